@@ -0,0 +1,1364 @@
+/****************************************************************************
+ *                                                                          *
+ *  Example of a simple ray tracing application using Vulkan API            *
+ *  Copyright (C) 2020 Artem Hlumov <artyom.altair@gmail.com>               *
+ *                                                                          *
+ *  This program is free software: you can redistribute it and/or modify    *
+ *  it under the terms of the GNU General Public License as published by    *
+ *  the Free Software Foundation, either version 3 of the License, or       *
+ *  (at your option) any later version.                                     *
+ *                                                                          *
+ *  This program is distributed in the hope that it will be useful,         *
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of          *
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           *
+ *  GNU General Public License for more details.                            *
+ *                                                                          *
+ *  You should have received a copy of the GNU General Public License       *
+ *  along with this program. If not, see <https://www.gnu.org/licenses/>.   *
+ *                                                                          *
+ ****************************************************************************
+ *                                                                          *
+ *    Benchmark of acceleration structures and ray traversal.               *
+ *                                                                          *
+ *    The benchmark generates procedural scenes of different sizes,         *
+ *    builds, compacts and refits acceleration structures of them and       *
+ *    traces coherent and incoherent rays against them. All timings are     *
+ *    GPU timestamps, results are written as CSV, one row per scene         *
+ *    and ray mode, so runs can be compared to catch regressions.           *
+ *                                                                          *
+ *    Like the example itself, the code is one large main() function        *
+ *    going step by step. Only the KHR ray tracing backend is used.         *
+ *                                                                          *
+ ****************************************************************************/
+
+#include <vulkan/vulkan.h>
+
+// Include GLM (linear algebra library).
+// Use radians instead of degrees to disable deprecated functions.
+#define GLM_FORCE_RADIANS
+#define GLM_FORCE_DEPTH_ZERO_TO_ONE
+#include <glm/glm.hpp>
+#include <glm/gtx/transform.hpp>
+
+#include <set>
+#include <array>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <functional>
+
+/**
+ * Benchmark name.
+ */
+constexpr const char* BENCHMARK_NAME = "VKBenchmarkRTX";
+/**
+ * Triangle counts of scene meshes swept by default.
+ */
+const std::vector< uint64_t > DEFAULT_TRIANGLE_COUNTS = { 1000, 10000, 100000, 1000000, 10000000, 50000000 };
+/**
+ * Instance counts of scenes swept by default.
+ */
+const std::vector< uint64_t > DEFAULT_INSTANCE_COUNTS = { 1, 10, 1000, 100000, 1000000 };
+/**
+ * Size of the traced image if not specified in the command line.
+ */
+constexpr uint32_t DEFAULT_TRACE_WIDTH = 1920;
+constexpr uint32_t DEFAULT_TRACE_HEIGHT = 1080;
+/**
+ * Amount of measured repetitions of every build and trace if not specified in the command line.
+ * Every measurement is preceded by one repetition that is not measured.
+ */
+constexpr uint32_t DEFAULT_REPEAT_COUNT = 5;
+/**
+ * Maximal amount of digits of a triangle or instance count in the command line.
+ */
+constexpr size_t MAX_COUNT_DIGITS = 18;
+/**
+ * Results file if not specified in the command line.
+ */
+constexpr const char* DEFAULT_OUTPUT_FILE = "benchmark.csv";
+/**
+ * Size of the staging buffer data is uploaded through.
+ * It is a multiple of both vertex and index sizes, so chunks never split an element.
+ */
+constexpr VkDeviceSize UPLOAD_CHUNK_SIZE = 48 * 1024 * 1024;
+/**
+ * Part of the device-local heap a scene may take, the rest is left to the driver and other applications.
+ * Scenes that do not fit are skipped.
+ */
+constexpr double MAX_HEAP_USAGE = 0.85;
+/**
+ * Part of a grid cell occupied by an instance.
+ */
+constexpr float INSTANCE_FILL_FACTOR = 0.5f;
+/**
+ * Rotation of instances applied between the TLAS build and refits, in radians.
+ */
+constexpr float INSTANCE_REFIT_ROTATION = 0.1f;
+/**
+ * Ray modes, they should match RAY_MODE_* constants of the ray generation shader.
+ */
+constexpr uint32_t BENCHMARK_RAY_MODE_PRIMARY = 0;
+constexpr uint32_t BENCHMARK_RAY_MODE_RANDOM = 1;
+
+/**
+ * Push constants of the ray generation shader, should match benchmark_launch_type of the shader.
+ */
+struct BenchmarkPushConstants
+{
+    /**
+     * One of BENCHMARK_RAY_MODE_* constants.
+     */
+    uint32_t rayMode;
+    /**
+     * Seed of random rays, different for every launch.
+     */
+    uint32_t seed;
+};
+
+/**
+ * Buffer with its own memory allocation.
+ * The benchmark creates few large resources and releases them after every scene,
+ * so each of them gets a dedicated allocation instead of a memory arena.
+ */
+struct BenchmarkBuffer
+{
+    /**
+     * Buffer handle.
+     */
+    VkBuffer buffer = VK_NULL_HANDLE;
+    /**
+     * Memory bound to the buffer.
+     */
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    /**
+     * Size of the allocated memory.
+     */
+    VkDeviceSize size = 0;
+    /**
+     * Device address of the buffer, zero if the buffer has no such usage.
+     */
+    VkDeviceAddress address = 0;
+    /**
+     * Pointer to the persistently mapped memory, null for device-local buffers.
+     */
+    void* mappedData = nullptr;
+    /**
+     * Whether the memory is device-local and counts into VRAM use.
+     */
+    bool deviceLocal = false;
+};
+
+/**
+ * KHR acceleration structure placed into its own buffer.
+ */
+struct BenchmarkAccelerationStructure
+{
+    /**
+     * Acceleration structure handle.
+     */
+    VkAccelerationStructureKHR handle = VK_NULL_HANDLE;
+    /**
+     * Buffer keeping the acceleration structure.
+     */
+    BenchmarkBuffer storage;
+    /**
+     * Device address instances refer to the acceleration structure by.
+     */
+    VkDeviceAddress address = 0;
+};
+
+/**
+ * Measurements of one scene traced with one ray mode, a row of the results file.
+ */
+struct BenchmarkResult
+{
+    /**
+     * Amount of triangles of the mesh and amount of its instances.
+     */
+    uint64_t triangleCount;
+    uint64_t instanceCount;
+    /**
+     * Name of the ray mode.
+     */
+    const char* rayMode;
+    /**
+     * Average times of a BLAS build and of the BLAS compaction copy.
+     */
+    double blasBuildMs;
+    double blasCompactMs;
+    /**
+     * Sizes of the BLAS before and after compaction.
+     */
+    VkDeviceSize blasSize;
+    VkDeviceSize compactedBlasSize;
+    /**
+     * Average times of a full TLAS build and of a TLAS refit.
+     */
+    double tlasBuildMs;
+    double tlasRefitMs;
+    /**
+     * Size of the TLAS.
+     */
+    VkDeviceSize tlasSize;
+    /**
+     * Device-local memory allocated while the BLAS was built and while rays were traced.
+     */
+    VkDeviceSize buildPeakVramBytes;
+    VkDeviceSize traceVramBytes;
+    /**
+     * Average time of one launch tracing one ray per pixel and the resulting throughput.
+     */
+    double traceMs;
+    double megaRaysPerSecond;
+};
+
+/**
+ * Parse a comma separated list of counts, for example "1000,1000000".
+ * Returns an empty list if the text is not such a list.
+ */
+std::vector< uint64_t > parseCountList(const std::string& text)
+{
+    std::vector< uint64_t > counts;
+    size_t position = 0;
+    while (position <= text.size()) {
+        const size_t end = std::min(text.find(',', position), text.size());
+        const std::string item = text.substr(position, end - position);
+        // Longer numbers do not fit into 64 bits, and no device has such amounts of primitives anyway.
+        if (item.empty() || item.size() > MAX_COUNT_DIGITS || item.find_first_not_of("0123456789") != std::string::npos) {
+            return {};
+        }
+        const uint64_t count = std::stoull(item);
+        if (count == 0) {
+            return {};
+        }
+        counts.push_back(count);
+        position = end + 1;
+    }
+    return counts;
+}
+
+/**
+ * Benchmark entry point.
+ */
+int main(int argc, char** argv)
+{
+    // ==========================================================================
+    //                 STEP 0: Parse command line arguments
+    // ==========================================================================
+    // All options are optional and have reasonable defaults.
+    //   --triangles <list>  Comma separated triangle counts of the mesh.
+    //   --instances <list>  Comma separated instance counts of the mesh.
+    //   --width <W>         Width of the traced image.
+    //   --height <H>        Height of the traced image.
+    //   --repeats <N>       Measured repetitions of every build and trace.
+    //   --output <file>     CSV file results are written into.
+    // ==========================================================================
+
+    std::vector< uint64_t > triangleCounts = DEFAULT_TRIANGLE_COUNTS;
+    std::vector< uint64_t > instanceCounts = DEFAULT_INSTANCE_COUNTS;
+    uint32_t traceWidth = DEFAULT_TRACE_WIDTH;
+    uint32_t traceHeight = DEFAULT_TRACE_HEIGHT;
+    uint32_t repeatCount = DEFAULT_REPEAT_COUNT;
+    std::string outputPath = DEFAULT_OUTPUT_FILE;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        if (arg == "--triangles" && i + 1 < argc) {
+            triangleCounts = parseCountList(argv[++i]);
+            if (triangleCounts.empty()) {
+                std::cerr << "Triangle counts should be a comma separated list of positive numbers!" << std::endl;
+                abort();
+            }
+        } else if (arg == "--instances" && i + 1 < argc) {
+            instanceCounts = parseCountList(argv[++i]);
+            if (instanceCounts.empty()) {
+                std::cerr << "Instance counts should be a comma separated list of positive numbers!" << std::endl;
+                abort();
+            }
+        } else if (arg == "--width" && i + 1 < argc) {
+            traceWidth = static_cast< uint32_t >(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--height" && i + 1 < argc) {
+            traceHeight = static_cast< uint32_t >(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--repeats" && i + 1 < argc) {
+            repeatCount = static_cast< uint32_t >(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--output" && i + 1 < argc) {
+            outputPath = argv[++i];
+        } else {
+            std::cerr << "Unknown or incomplete option: " << arg << std::endl;
+            abort();
+        }
+    }
+
+    // ==========================================================================
+    //                    STEP 1: Create a Vulkan instance
+    // ==========================================================================
+    // The benchmark renders nothing on the screen, so the instance needs no extensions.
+    // ==========================================================================
+
+    VkApplicationInfo vkAppInfo{};
+    vkAppInfo.sType = VK_STRUCTURE_TYPE_APPLICATION_INFO;
+    vkAppInfo.pApplicationName = BENCHMARK_NAME;
+    vkAppInfo.applicationVersion = VK_MAKE_VERSION(1, 0, 0);
+    vkAppInfo.pEngineName = BENCHMARK_NAME;
+    vkAppInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
+    // Buffer device addresses and SPIR-V 1.4 of the KHR ray tracing extensions are core in v1.2.
+    // Older loaders reject such instances, and do not even have vkEnumerateInstanceVersion().
+    uint32_t vkInstanceVersion = VK_API_VERSION_1_0;
+    const auto vkEnumerateInstanceVersionFunc = reinterpret_cast< PFN_vkEnumerateInstanceVersion >(vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+    if (vkEnumerateInstanceVersionFunc == nullptr || vkEnumerateInstanceVersionFunc(&vkInstanceVersion) != VK_SUCCESS || vkInstanceVersion < VK_API_VERSION_1_2) {
+        std::cerr << "The benchmark needs Vulkan 1.2, the loader supports only " << VK_VERSION_MAJOR(vkInstanceVersion) << "." << VK_VERSION_MINOR(vkInstanceVersion) << "!" << std::endl;
+        abort();
+    }
+    vkAppInfo.apiVersion = VK_API_VERSION_1_2;
+
+    VkInstanceCreateInfo vkCreateInfo{};
+    vkCreateInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
+    vkCreateInfo.pApplicationInfo = &vkAppInfo;
+
+#ifdef DEBUG_MODE
+
+    // Validation layers slow down builds and traces, use them only to debug the benchmark itself.
+    const std::vector< const char* > desiredValidationLayers = { "VK_LAYER_KHRONOS_validation" };
+    vkCreateInfo.enabledLayerCount = static_cast< uint32_t >(desiredValidationLayers.size());
+    vkCreateInfo.ppEnabledLayerNames = desiredValidationLayers.data();
+
+#endif
+
+    VkInstance vkInstance;
+    if (vkCreateInstance(&vkCreateInfo, nullptr, &vkInstance) != VK_SUCCESS) {
+        std::cerr << "Failed to create a Vulkan instance!" << std::endl;
+        abort();
+    }
+
+    // ==========================================================================
+    //                    STEP 2: Pick a physical device
+    // ==========================================================================
+    // The device should support KHR ray tracing pipelines and acceleration
+    // structures, and one of its queue families should run ray tracing
+    // and write timestamps.
+    // ==========================================================================
+
+    const std::vector< const char* > desiredDeviceExtensions = {
+        VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+        VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+        VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME
+    };
+
+    uint32_t vkDeviceCount = 0;
+    vkEnumeratePhysicalDevices(vkInstance, &vkDeviceCount, nullptr);
+    std::vector< VkPhysicalDevice > vkDevices(vkDeviceCount);
+    vkEnumeratePhysicalDevices(vkInstance, &vkDeviceCount, vkDevices.data());
+
+    VkPhysicalDevice vkPhysicalDevice = VK_NULL_HANDLE;
+    std::optional< uint32_t > queueFamilyIndex;
+    uint32_t timestampValidBits = 0;
+    for (auto device : vkDevices) {
+        VkPhysicalDeviceProperties vkDeviceProperties;
+        vkGetPhysicalDeviceProperties(device, &vkDeviceProperties);
+        if (vkDeviceProperties.apiVersion < VK_API_VERSION_1_2) {
+            continue;
+        }
+
+        // Check extensions.
+        uint32_t vkExtensionCount;
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &vkExtensionCount, nullptr);
+        std::vector< VkExtensionProperties > vkAvailableExtensions(vkExtensionCount);
+        vkEnumerateDeviceExtensionProperties(device, nullptr, &vkExtensionCount, vkAvailableExtensions.data());
+        std::set< std::string > requiredExtensions(desiredDeviceExtensions.begin(), desiredDeviceExtensions.end());
+        for (const auto& extension : vkAvailableExtensions) {
+            requiredExtensions.erase(extension.extensionName);
+        }
+        if (!requiredExtensions.empty()) {
+            continue;
+        }
+
+        // Check features, extensions alone may be exposed by drivers that do not implement them.
+        VkPhysicalDeviceBufferDeviceAddressFeatures vkBufferDeviceAddressFeatures{};
+        vkBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+        VkPhysicalDeviceAccelerationStructureFeaturesKHR vkAccelerationStructureFeatures{};
+        vkAccelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+        vkAccelerationStructureFeatures.pNext = &vkBufferDeviceAddressFeatures;
+        VkPhysicalDeviceRayTracingPipelineFeaturesKHR vkRayTracingPipelineFeatures{};
+        vkRayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+        vkRayTracingPipelineFeatures.pNext = &vkAccelerationStructureFeatures;
+        VkPhysicalDeviceFeatures2 vkDeviceFeatures2{};
+        vkDeviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+        vkDeviceFeatures2.pNext = &vkRayTracingPipelineFeatures;
+        vkGetPhysicalDeviceFeatures2(device, &vkDeviceFeatures2);
+        if (!vkRayTracingPipelineFeatures.rayTracingPipeline ||
+            !vkAccelerationStructureFeatures.accelerationStructure ||
+            !vkBufferDeviceAddressFeatures.bufferDeviceAddress) {
+            continue;
+        }
+
+        // Ray tracing runs on queues supporting compute, and every measurement is a pair of timestamps.
+        uint32_t vkQueueFamilyCount = 0;
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &vkQueueFamilyCount, nullptr);
+        std::vector< VkQueueFamilyProperties > vkQueueFamilies(vkQueueFamilyCount);
+        vkGetPhysicalDeviceQueueFamilyProperties(device, &vkQueueFamilyCount, vkQueueFamilies.data());
+        for (uint32_t i = 0; i < vkQueueFamilyCount; i++) {
+            if ((vkQueueFamilies[i].queueFlags & VK_QUEUE_COMPUTE_BIT) && vkQueueFamilies[i].timestampValidBits > 0) {
+                queueFamilyIndex = i;
+                timestampValidBits = vkQueueFamilies[i].timestampValidBits;
+                break;
+            }
+        }
+        if (queueFamilyIndex.has_value()) {
+            vkPhysicalDevice = device;
+            break;
+        }
+    }
+    if (vkPhysicalDevice == VK_NULL_HANDLE) {
+        std::cerr << "No physical devices with KHR ray tracing and timestamps available!" << std::endl;
+        abort();
+    }
+
+    // Query properties needed to size and lay out resources.
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
+    accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties{};
+    rayTracingPipelineProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
+    VkPhysicalDeviceMaintenance3Properties maintenance3Properties{};
+    maintenance3Properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MAINTENANCE_3_PROPERTIES;
+    maintenance3Properties.pNext = &rayTracingPipelineProperties;
+    VkPhysicalDeviceProperties2 deviceProps2{};
+    deviceProps2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    deviceProps2.pNext = &maintenance3Properties;
+    vkGetPhysicalDeviceProperties2(vkPhysicalDevice, &deviceProps2);
+    const std::string deviceName = deviceProps2.properties.deviceName;
+    std::cout << "Benchmarking " << deviceName << std::endl;
+
+    VkPhysicalDeviceMemoryProperties vkPhysicalDeviceMemoryProperties;
+    vkGetPhysicalDeviceMemoryProperties(vkPhysicalDevice, &vkPhysicalDeviceMemoryProperties);
+
+    // The largest device-local heap limits scenes the benchmark can build.
+    VkDeviceSize deviceLocalHeapSize = 0;
+    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryHeapCount; i++) {
+        if (vkPhysicalDeviceMemoryProperties.memoryHeaps[i].flags & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT) {
+            deviceLocalHeapSize = std::max(deviceLocalHeapSize, vkPhysicalDeviceMemoryProperties.memoryHeaps[i].size);
+        }
+    }
+
+    // ==========================================================================
+    //                   STEP 3: Create a logical device
+    // ==========================================================================
+    // One queue does everything: uploads, builds and traces run one after another,
+    // so measurements do not overlap.
+    // ==========================================================================
+
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueCreateInfo{};
+    queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+    queueCreateInfo.queueFamilyIndex = queueFamilyIndex.value();
+    queueCreateInfo.queueCount = 1;
+    queueCreateInfo.pQueuePriorities = &queuePriority;
+
+    VkPhysicalDeviceBufferDeviceAddressFeatures vkBufferDeviceAddressFeatures{};
+    vkBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    vkBufferDeviceAddressFeatures.bufferDeviceAddress = VK_TRUE;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR vkAccelerationStructureFeatures{};
+    vkAccelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    vkAccelerationStructureFeatures.pNext = &vkBufferDeviceAddressFeatures;
+    vkAccelerationStructureFeatures.accelerationStructure = VK_TRUE;
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR vkRayTracingPipelineFeatures{};
+    vkRayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+    vkRayTracingPipelineFeatures.pNext = &vkAccelerationStructureFeatures;
+    vkRayTracingPipelineFeatures.rayTracingPipeline = VK_TRUE;
+
+    VkDeviceCreateInfo vkDeviceCreateInfo{};
+    vkDeviceCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    vkDeviceCreateInfo.pNext = &vkRayTracingPipelineFeatures;
+    vkDeviceCreateInfo.queueCreateInfoCount = 1;
+    vkDeviceCreateInfo.pQueueCreateInfos = &queueCreateInfo;
+    vkDeviceCreateInfo.enabledExtensionCount = static_cast< uint32_t >(desiredDeviceExtensions.size());
+    vkDeviceCreateInfo.ppEnabledExtensionNames = desiredDeviceExtensions.data();
+    VkDevice vkDevice;
+    if (vkCreateDevice(vkPhysicalDevice, &vkDeviceCreateInfo, nullptr, &vkDevice) != VK_SUCCESS) {
+        std::cerr << "Failed to create a logical device!" << std::endl;
+        abort();
+    }
+    VkQueue vkQueue;
+    vkGetDeviceQueue(vkDevice, queueFamilyIndex.value(), 0, &vkQueue);
+
+    // Import extension functions, they are not exported by the loader.
+    PFN_vkGetBufferDeviceAddress vkGetBufferDeviceAddress = reinterpret_cast<PFN_vkGetBufferDeviceAddress>(vkGetDeviceProcAddr(vkDevice, "vkGetBufferDeviceAddress"));
+    PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkCreateAccelerationStructureKHR"));
+    PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkDestroyAccelerationStructureKHR"));
+    PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureBuildSizesKHR"));
+    PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureDeviceAddressKHR"));
+    PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdBuildAccelerationStructuresKHR"));
+    PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdCopyAccelerationStructureKHR"));
+    PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(vkDevice, "vkCreateRayTracingPipelinesKHR"));
+    PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetRayTracingShaderGroupHandlesKHR"));
+    PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdTraceRaysKHR"));
+
+    // ==========================================================================
+    //                STEP 4: Commands, timestamps and buffers
+    // ==========================================================================
+    // Every measurement is one submission waited by a fence, with timestamps
+    // written at its beginning and its end.
+    // ==========================================================================
+
+    VkCommandPoolCreateInfo vkPoolInfo{};
+    vkPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    vkPoolInfo.queueFamilyIndex = queueFamilyIndex.value();
+    VkCommandPool vkCommandPool;
+    if (vkCreateCommandPool(vkDevice, &vkPoolInfo, nullptr, &vkCommandPool) != VK_SUCCESS) {
+        std::cerr << "Failed to create a command pool!" << std::endl;
+        abort();
+    }
+    VkCommandBufferAllocateInfo vkCmdBufAllocateInfo{};
+    vkCmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    vkCmdBufAllocateInfo.commandPool = vkCommandPool;
+    vkCmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    vkCmdBufAllocateInfo.commandBufferCount = 1;
+    VkCommandBuffer vkCmdBuffer;
+    if (vkAllocateCommandBuffers(vkDevice, &vkCmdBufAllocateInfo, &vkCmdBuffer) != VK_SUCCESS) {
+        std::cerr << "Failed to allocate command buffers!" << std::endl;
+        abort();
+    }
+    VkFenceCreateInfo vkFenceInfo{};
+    vkFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    VkFence vkFence;
+    if (vkCreateFence(vkDevice, &vkFenceInfo, nullptr, &vkFence) != VK_SUCCESS) {
+        std::cerr << "Failed to create a fence!" << std::endl;
+        abort();
+    }
+
+    // Record commands by the given function, submit them and wait until the GPU executes them.
+    auto executeCommands = [&](const std::function< void(VkCommandBuffer) >& record) {
+        VkCommandBufferBeginInfo vkBeginInfo{};
+        vkBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        vkBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        if (vkBeginCommandBuffer(vkCmdBuffer, &vkBeginInfo) != VK_SUCCESS) {
+            std::cerr << "Failed to begin a command buffer!" << std::endl;
+            abort();
+        }
+        record(vkCmdBuffer);
+        if (vkEndCommandBuffer(vkCmdBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to end a command buffer!" << std::endl;
+            abort();
+        }
+        VkSubmitInfo vkSubmitInfo{};
+        vkSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        vkSubmitInfo.commandBufferCount = 1;
+        vkSubmitInfo.pCommandBuffers = &vkCmdBuffer;
+        if (vkQueueSubmit(vkQueue, 1, &vkSubmitInfo, vkFence) != VK_SUCCESS) {
+            std::cerr << "Failed to submit" << std::endl;
+            abort();
+        }
+        if (vkWaitForFences(vkDevice, 1, &vkFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            std::cerr << "Failed to wait for a fence!" << std::endl;
+            abort();
+        }
+        vkResetFences(vkDevice, 1, &vkFence);
+        vkResetCommandPool(vkDevice, vkCommandPool, 0);
+    };
+
+    // Create a query pool of two timestamps.
+    VkQueryPoolCreateInfo vkTimestampPoolInfo{};
+    vkTimestampPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    vkTimestampPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    vkTimestampPoolInfo.queryCount = 2;
+    VkQueryPool vkTimestampPool;
+    if (vkCreateQueryPool(vkDevice, &vkTimestampPoolInfo, nullptr, &vkTimestampPool) != VK_SUCCESS) {
+        std::cerr << "Failed to create a query pool!" << std::endl;
+        abort();
+    }
+
+    // Execute commands recorded by the given function and return their GPU time in milliseconds.
+    // The end timestamp waits for all commands, so the time covers their whole execution.
+    auto measureGpuMs = [&](const std::function< void(VkCommandBuffer) >& record) {
+        executeCommands([&](VkCommandBuffer cmd) {
+            vkCmdResetQueryPool(cmd, vkTimestampPool, 0, 2);
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, vkTimestampPool, 0);
+            record(cmd);
+            vkCmdWriteTimestamp(cmd, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, vkTimestampPool, 1);
+        });
+        std::array< uint64_t, 2 > timestamps{};
+        if (vkGetQueryPoolResults(vkDevice, vkTimestampPool, 0, 2, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+            std::cerr << "Failed to get timestamps!" << std::endl;
+            abort();
+        }
+        // Only timestampValidBits of a timestamp are meaningful, so the difference is masked.
+        const uint64_t mask = (timestampValidBits >= 64) ? ~0ull : ((1ull << timestampValidBits) - 1);
+        return static_cast< double >((timestamps[1] - timestamps[0]) & mask) * deviceProps2.properties.limits.timestampPeriod / 1e6;
+    };
+
+    // Measure the given commands once without recording the time, so caches and clocks warm up,
+    // and then the given amount of times. Returns the average time in milliseconds.
+    auto measureAverageGpuMs = [&](const std::function< void(VkCommandBuffer) >& record) {
+        measureGpuMs(record);
+        double sum = 0.0;
+        for (uint32_t i = 0; i < repeatCount; i++) {
+            sum += measureGpuMs(record);
+        }
+        return sum / repeatCount;
+    };
+
+    // Device-local memory allocated by the benchmark, the current amount and the peak.
+    VkDeviceSize allocatedVramBytes = 0;
+    VkDeviceSize peakVramBytes = 0;
+    auto trackVramAllocation = [&](VkDeviceSize size) {
+        allocatedVramBytes += size;
+        peakVramBytes = std::max(peakVramBytes, allocatedVramBytes);
+    };
+
+    // Find a memory type having the given properties.
+    auto findMemoryType = [&](uint32_t typeBits, VkMemoryPropertyFlags properties) {
+        for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
+            if ((typeBits & (1u << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & properties) == properties) {
+                return i;
+            }
+        }
+        std::cerr << "Failed to find a suitable memory type!" << std::endl;
+        abort();
+    };
+
+    // Create a buffer with its own memory. Host-visible buffers are mapped persistently.
+    auto createBuffer = [&](VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties) {
+        BenchmarkBuffer result;
+        VkBufferCreateInfo vkBufferInfo{};
+        vkBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkBufferInfo.size = size;
+        vkBufferInfo.usage = usage;
+        vkBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(vkDevice, &vkBufferInfo, nullptr, &result.buffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create a buffer!" << std::endl;
+            abort();
+        }
+        VkMemoryRequirements vkMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, result.buffer, &vkMemRequirements);
+
+        // Acceleration structure builds and shader binding tables are read by device addresses.
+        VkMemoryAllocateFlagsInfo vkAllocateFlagsInfo{};
+        vkAllocateFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+        vkAllocateFlagsInfo.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+        VkMemoryAllocateInfo vkAllocInfo{};
+        vkAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        vkAllocInfo.pNext = (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) ? &vkAllocateFlagsInfo : nullptr;
+        vkAllocInfo.allocationSize = vkMemRequirements.size;
+        vkAllocInfo.memoryTypeIndex = findMemoryType(vkMemRequirements.memoryTypeBits, properties);
+        if (vkAllocateMemory(vkDevice, &vkAllocInfo, nullptr, &result.memory) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate " << vkMemRequirements.size << " bytes of memory!" << std::endl;
+            abort();
+        }
+        vkBindBufferMemory(vkDevice, result.buffer, result.memory, 0);
+        result.size = vkMemRequirements.size;
+        if (usage & VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) {
+            VkBufferDeviceAddressInfo addressInfo{};
+            addressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+            addressInfo.buffer = result.buffer;
+            result.address = vkGetBufferDeviceAddress(vkDevice, &addressInfo);
+        }
+        if (properties & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            vkMapMemory(vkDevice, result.memory, 0, VK_WHOLE_SIZE, 0, &result.mappedData);
+        }
+        result.deviceLocal = (properties & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT) != 0;
+        if (result.deviceLocal) {
+            trackVramAllocation(result.size);
+        }
+        return result;
+    };
+
+    auto destroyBuffer = [&](BenchmarkBuffer& buffer) {
+        if (buffer.buffer == VK_NULL_HANDLE) {
+            return;
+        }
+        vkDestroyBuffer(vkDevice, buffer.buffer, nullptr);
+        vkFreeMemory(vkDevice, buffer.memory, nullptr);
+        if (buffer.deviceLocal) {
+            allocatedVramBytes -= buffer.size;
+        }
+        buffer = BenchmarkBuffer{};
+    };
+
+    // Generated scenes are uploaded into device-local memory through the staging buffer chunk by chunk,
+    // so even the largest meshes never exist in host memory as a whole.
+    // The given function fills a chunk: it gets the destination and the byte range of the chunk.
+    BenchmarkBuffer stagingBuffer = createBuffer(UPLOAD_CHUNK_SIZE, VK_BUFFER_USAGE_TRANSFER_SRC_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT);
+    auto uploadBuffer = [&](const BenchmarkBuffer& buffer, VkDeviceSize size, const std::function< void(uint8_t*, VkDeviceSize, VkDeviceSize) >& fill) {
+        for (VkDeviceSize offset = 0; offset < size; offset += UPLOAD_CHUNK_SIZE) {
+            const VkDeviceSize chunkSize = std::min(UPLOAD_CHUNK_SIZE, size - offset);
+            fill(static_cast< uint8_t* >(stagingBuffer.mappedData), offset, chunkSize);
+            executeCommands([&](VkCommandBuffer cmd) {
+                VkBufferCopy copyRegion{};
+                copyRegion.srcOffset = 0;
+                copyRegion.dstOffset = offset;
+                copyRegion.size = chunkSize;
+                vkCmdCopyBuffer(cmd, stagingBuffer.buffer, buffer.buffer, 1, &copyRegion);
+
+                // Fences do not make transfer writes visible to the device, so builds and traces
+                // of later submissions wait for the copy by a barrier.
+                VkMemoryBarrier vkUploadBarrier{};
+                vkUploadBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                vkUploadBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                vkUploadBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_SHADER_READ_BIT;
+                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &vkUploadBarrier, 0, nullptr, 0, nullptr);
+            });
+        }
+    };
+
+    // Create a KHR acceleration structure in a buffer of the given size.
+    auto createAccelerationStructure = [&](VkAccelerationStructureTypeKHR type, VkDeviceSize size) {
+        BenchmarkAccelerationStructure result;
+        result.storage = createBuffer(size, VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = result.storage.buffer;
+        createInfo.offset = 0;
+        createInfo.size = size;
+        createInfo.type = type;
+        if (vkCreateAccelerationStructureKHR(vkDevice, &createInfo, nullptr, &result.handle) != VK_SUCCESS) {
+            std::cerr << "Failed to create an acceleration structure!" << std::endl;
+            abort();
+        }
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo{};
+        addressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        addressInfo.accelerationStructure = result.handle;
+        result.address = vkGetAccelerationStructureDeviceAddressKHR(vkDevice, &addressInfo);
+        return result;
+    };
+
+    auto destroyAccelerationStructure = [&](BenchmarkAccelerationStructure& accelerationStructure) {
+        if (accelerationStructure.handle == VK_NULL_HANDLE) {
+            return;
+        }
+        vkDestroyAccelerationStructureKHR(vkDevice, accelerationStructure.handle, nullptr);
+        destroyBuffer(accelerationStructure.storage);
+        accelerationStructure = BenchmarkAccelerationStructure{};
+    };
+
+    // Barrier between acceleration structure builds, copies and traces.
+    VkMemoryBarrier vkAccelerationStructureBarrier{};
+    vkAccelerationStructureBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+    vkAccelerationStructureBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+    vkAccelerationStructureBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR;
+
+    // Usage of buffers read by acceleration structure builds.
+    const VkBufferUsageFlags buildInputBufferUsage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR |
+                                                     VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT |
+                                                     VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    // Scratch offsets should be aligned, so scratch buffers get some extra space.
+    const VkDeviceSize scratchAlignment = std::max< VkDeviceSize >(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+    auto alignUp = [](VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    };
+    auto createScratchBuffer = [&](VkDeviceSize size) {
+        return createBuffer(size + scratchAlignment, VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    };
+
+    // ==========================================================================
+    //                    STEP 5: Create a storage image
+    // ==========================================================================
+    // Rays write their hit distances into the image, so the traversal
+    // cannot be optimized away. Nobody reads the image.
+    // ==========================================================================
+
+    VkImageCreateInfo vkImageInfo{};
+    vkImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    vkImageInfo.imageType = VK_IMAGE_TYPE_2D;
+    vkImageInfo.format = VK_FORMAT_R32_SFLOAT;
+    vkImageInfo.extent = { traceWidth, traceHeight, 1 };
+    vkImageInfo.mipLevels = 1;
+    vkImageInfo.arrayLayers = 1;
+    vkImageInfo.samples = VK_SAMPLE_COUNT_1_BIT;
+    vkImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+    vkImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+    vkImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    vkImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+    VkImage vkStorageImage;
+    if (vkCreateImage(vkDevice, &vkImageInfo, nullptr, &vkStorageImage) != VK_SUCCESS) {
+        std::cerr << "Failed to create a storage image!" << std::endl;
+        abort();
+    }
+    VkMemoryRequirements vkImageMemRequirements;
+    vkGetImageMemoryRequirements(vkDevice, vkStorageImage, &vkImageMemRequirements);
+    VkMemoryAllocateInfo vkImageAllocInfo{};
+    vkImageAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    vkImageAllocInfo.allocationSize = vkImageMemRequirements.size;
+    vkImageAllocInfo.memoryTypeIndex = findMemoryType(vkImageMemRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    VkDeviceMemory vkStorageImageMemory;
+    if (vkAllocateMemory(vkDevice, &vkImageAllocInfo, nullptr, &vkStorageImageMemory) != VK_SUCCESS) {
+        std::cerr << "Failed to allocate storage image memory!" << std::endl;
+        abort();
+    }
+    vkBindImageMemory(vkDevice, vkStorageImage, vkStorageImageMemory, 0);
+    trackVramAllocation(vkImageMemRequirements.size);
+
+    VkImageViewCreateInfo vkImageViewInfo{};
+    vkImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    vkImageViewInfo.image = vkStorageImage;
+    vkImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    vkImageViewInfo.format = vkImageInfo.format;
+    vkImageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+    VkImageView vkStorageImageView;
+    if (vkCreateImageView(vkDevice, &vkImageViewInfo, nullptr, &vkStorageImageView) != VK_SUCCESS) {
+        std::cerr << "Failed to create a storage image view!" << std::endl;
+        abort();
+    }
+
+    // Shaders write the image in the general layout.
+    executeCommands([&](VkCommandBuffer cmd) {
+        VkImageMemoryBarrier vkLayoutBarrier{};
+        vkLayoutBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        vkLayoutBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        vkLayoutBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        vkLayoutBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkLayoutBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkLayoutBarrier.image = vkStorageImage;
+        vkLayoutBarrier.subresourceRange = vkImageViewInfo.subresourceRange;
+        vkLayoutBarrier.srcAccessMask = 0;
+        vkLayoutBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 0, nullptr, 0, nullptr, 1, &vkLayoutBarrier);
+    });
+
+    // ==========================================================================
+    //                    STEP 6: Create a pipeline
+    // ==========================================================================
+    // The pipeline has three shader groups: ray generation, miss and one
+    // triangle hit group. Shaders are compiled by CMake next to the benchmark.
+    // ==========================================================================
+
+    // Load a shader compiled for the KHR backend.
+    auto loadShader = [&](const std::string& name) {
+        const std::string path = name + ".khr.spv";
+        std::ifstream file(path, std::ios::binary | std::ios::ate);
+        if (!file.is_open()) {
+            std::cerr << "Failed to open " << path << "!" << std::endl;
+            abort();
+        }
+        std::vector< char > code(static_cast< size_t >(file.tellg()));
+        file.seekg(0);
+        file.read(code.data(), static_cast< std::streamsize >(code.size()));
+        VkShaderModuleCreateInfo vkShaderInfo{};
+        vkShaderInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        vkShaderInfo.codeSize = code.size();
+        vkShaderInfo.pCode = reinterpret_cast< const uint32_t* >(code.data());
+        VkShaderModule module;
+        if (vkCreateShaderModule(vkDevice, &vkShaderInfo, nullptr, &module) != VK_SUCCESS) {
+            std::cerr << "Failed to create a shader module of " << path << "!" << std::endl;
+            abort();
+        }
+        return module;
+    };
+    const std::array< VkShaderModule, 3 > vkShaderModules = { loadShader("bench.rgen"), loadShader("bench.rmiss"), loadShader("bench.rchit") };
+    const std::array< VkShaderStageFlagBits, 3 > vkShaderStages = { VK_SHADER_STAGE_RAYGEN_BIT_KHR, VK_SHADER_STAGE_MISS_BIT_KHR, VK_SHADER_STAGE_CLOSEST_HIT_BIT_KHR };
+    std::array< VkPipelineShaderStageCreateInfo, 3 > vkStageInfos{};
+    std::array< VkRayTracingShaderGroupCreateInfoKHR, 3 > vkGroupInfos{};
+    for (size_t i = 0; i < vkStageInfos.size(); i++) {
+        vkStageInfos[i].sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vkStageInfos[i].stage = vkShaderStages[i];
+        vkStageInfos[i].module = vkShaderModules[i];
+        vkStageInfos[i].pName = "main";
+        vkGroupInfos[i].sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
+        vkGroupInfos[i].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_KHR;
+        vkGroupInfos[i].generalShader = static_cast< uint32_t >(i);
+        vkGroupInfos[i].closestHitShader = VK_SHADER_UNUSED_KHR;
+        vkGroupInfos[i].anyHitShader = VK_SHADER_UNUSED_KHR;
+        vkGroupInfos[i].intersectionShader = VK_SHADER_UNUSED_KHR;
+    }
+    vkGroupInfos[2].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_KHR;
+    vkGroupInfos[2].generalShader = VK_SHADER_UNUSED_KHR;
+    vkGroupInfos[2].closestHitShader = 2;
+
+    // Descriptor set layout: the TLAS and the storage image.
+    std::array< VkDescriptorSetLayoutBinding, 2 > vkBindings{};
+    vkBindings[0].binding = 0;
+    vkBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+    vkBindings[0].descriptorCount = 1;
+    vkBindings[0].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    vkBindings[1].binding = 1;
+    vkBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkBindings[1].descriptorCount = 1;
+    vkBindings[1].stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    VkDescriptorSetLayoutCreateInfo vkLayoutInfo{};
+    vkLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    vkLayoutInfo.bindingCount = static_cast< uint32_t >(vkBindings.size());
+    vkLayoutInfo.pBindings = vkBindings.data();
+    VkDescriptorSetLayout vkDescriptorSetLayout;
+    if (vkCreateDescriptorSetLayout(vkDevice, &vkLayoutInfo, nullptr, &vkDescriptorSetLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a descriptor set layout!" << std::endl;
+        abort();
+    }
+
+    VkPushConstantRange vkPushConstantRange{};
+    vkPushConstantRange.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_KHR;
+    vkPushConstantRange.offset = 0;
+    vkPushConstantRange.size = sizeof(BenchmarkPushConstants);
+    VkPipelineLayoutCreateInfo vkPipelineLayoutInfo{};
+    vkPipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    vkPipelineLayoutInfo.setLayoutCount = 1;
+    vkPipelineLayoutInfo.pSetLayouts = &vkDescriptorSetLayout;
+    vkPipelineLayoutInfo.pushConstantRangeCount = 1;
+    vkPipelineLayoutInfo.pPushConstantRanges = &vkPushConstantRange;
+    VkPipelineLayout vkPipelineLayout;
+    if (vkCreatePipelineLayout(vkDevice, &vkPipelineLayoutInfo, nullptr, &vkPipelineLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a pipeline layout!" << std::endl;
+        abort();
+    }
+
+    VkRayTracingPipelineCreateInfoKHR vkPipelineInfo{};
+    vkPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+    vkPipelineInfo.stageCount = static_cast< uint32_t >(vkStageInfos.size());
+    vkPipelineInfo.pStages = vkStageInfos.data();
+    vkPipelineInfo.groupCount = static_cast< uint32_t >(vkGroupInfos.size());
+    vkPipelineInfo.pGroups = vkGroupInfos.data();
+    vkPipelineInfo.maxPipelineRayRecursionDepth = 1;
+    vkPipelineInfo.layout = vkPipelineLayout;
+    VkPipeline vkPipeline;
+    if (vkCreateRayTracingPipelinesKHR(vkDevice, VK_NULL_HANDLE, VK_NULL_HANDLE, 1, &vkPipelineInfo, nullptr, &vkPipeline) != VK_SUCCESS) {
+        std::cerr << "Failed to create a pipeline!" << std::endl;
+        abort();
+    }
+
+    // Shader binding table: one record per group, each region starts at the base alignment.
+    const uint32_t handleSize = rayTracingPipelineProperties.shaderGroupHandleSize;
+    const VkDeviceSize sbtStride = alignUp(handleSize, rayTracingPipelineProperties.shaderGroupHandleAlignment);
+    const VkDeviceSize sbtRegionSize = alignUp(sbtStride, rayTracingPipelineProperties.shaderGroupBaseAlignment);
+    std::vector< uint8_t > shaderHandles(handleSize * vkGroupInfos.size());
+    if (vkGetRayTracingShaderGroupHandlesKHR(vkDevice, vkPipeline, 0, static_cast< uint32_t >(vkGroupInfos.size()), shaderHandles.size(), shaderHandles.data()) != VK_SUCCESS) {
+        std::cerr << "Failed to get shader group handles!" << std::endl;
+        abort();
+    }
+    BenchmarkBuffer sbtBuffer = createBuffer(sbtRegionSize * vkGroupInfos.size() + rayTracingPipelineProperties.shaderGroupBaseAlignment,
+        VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+    // The buffer address may be less aligned than the table needs, so the table starts at an aligned offset.
+    const VkDeviceAddress sbtAddress = alignUp(sbtBuffer.address, rayTracingPipelineProperties.shaderGroupBaseAlignment);
+    const VkDeviceSize sbtOffset = sbtAddress - sbtBuffer.address;
+    uploadBuffer(sbtBuffer, sbtOffset + sbtRegionSize * vkGroupInfos.size(), [&](uint8_t* data, VkDeviceSize, VkDeviceSize size) {
+        memset(data, 0, static_cast< size_t >(size));
+        for (size_t i = 0; i < vkGroupInfos.size(); i++) {
+            memcpy(data + sbtOffset + i * sbtRegionSize, shaderHandles.data() + i * handleSize, handleSize);
+        }
+    });
+    const VkStridedDeviceAddressRegionKHR raygenRegion{ sbtAddress, sbtStride, sbtStride };
+    const VkStridedDeviceAddressRegionKHR missRegion{ sbtAddress + sbtRegionSize, sbtStride, sbtStride };
+    const VkStridedDeviceAddressRegionKHR hitRegion{ sbtAddress + 2 * sbtRegionSize, sbtStride, sbtStride };
+    const VkStridedDeviceAddressRegionKHR callableRegion{};
+
+    // One descriptor set, the TLAS binding is rewritten for every scene.
+    std::array< VkDescriptorPoolSize, 2 > vkPoolSizes{};
+    vkPoolSizes[0] = { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR, 1 };
+    vkPoolSizes[1] = { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 };
+    VkDescriptorPoolCreateInfo vkDescriptorPoolInfo{};
+    vkDescriptorPoolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    vkDescriptorPoolInfo.maxSets = 1;
+    vkDescriptorPoolInfo.poolSizeCount = static_cast< uint32_t >(vkPoolSizes.size());
+    vkDescriptorPoolInfo.pPoolSizes = vkPoolSizes.data();
+    VkDescriptorPool vkDescriptorPool;
+    if (vkCreateDescriptorPool(vkDevice, &vkDescriptorPoolInfo, nullptr, &vkDescriptorPool) != VK_SUCCESS) {
+        std::cerr << "Failed to create a descriptor pool!" << std::endl;
+        abort();
+    }
+    VkDescriptorSetAllocateInfo vkDescriptorSetInfo{};
+    vkDescriptorSetInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    vkDescriptorSetInfo.descriptorPool = vkDescriptorPool;
+    vkDescriptorSetInfo.descriptorSetCount = 1;
+    vkDescriptorSetInfo.pSetLayouts = &vkDescriptorSetLayout;
+    VkDescriptorSet vkDescriptorSet;
+    if (vkAllocateDescriptorSets(vkDevice, &vkDescriptorSetInfo, &vkDescriptorSet) != VK_SUCCESS) {
+        std::cerr << "Failed to allocate a descriptor set!" << std::endl;
+        abort();
+    }
+    VkDescriptorImageInfo vkDescriptorImageInfo{};
+    vkDescriptorImageInfo.imageView = vkStorageImageView;
+    vkDescriptorImageInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    VkWriteDescriptorSet vkImageWrite{};
+    vkImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    vkImageWrite.dstSet = vkDescriptorSet;
+    vkImageWrite.dstBinding = 1;
+    vkImageWrite.descriptorCount = 1;
+    vkImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkImageWrite.pImageInfo = &vkDescriptorImageInfo;
+    vkUpdateDescriptorSets(vkDevice, 1, &vkImageWrite, 0, nullptr);
+
+    // Memory taken by the image and the table, it stays allocated during the whole run.
+    const VkDeviceSize baseVramBytes = allocatedVramBytes;
+
+    // ==========================================================================
+    //                    STEP 7: Run the benchmark
+    // ==========================================================================
+    // Every triangle count gets a mesh: a displaced grid filling the unit square.
+    // Its BLAS is built, compacted and then instanced in TLASes of every
+    // instance count. Instances are placed on a cubic grid filling the unit cube,
+    // so all scenes have the same size and the primary camera sees all of them.
+    // ==========================================================================
+
+    std::ofstream outputFile(outputPath, std::ios::trunc);
+    if (!outputFile.is_open()) {
+        std::cerr << "Failed to open " << outputPath << "!" << std::endl;
+        abort();
+    }
+    outputFile << "device,triangles,instances,rays,blas_build_ms,blas_compact_ms,blas_bytes,blas_compacted_bytes,compaction_ratio,"
+                  "tlas_build_ms,tlas_refit_ms,tlas_bytes,build_peak_vram_bytes,trace_vram_bytes,trace_ms,mrays_per_s\n";
+    auto writeResult = [&](const BenchmarkResult& result) {
+        outputFile << "\"" << deviceName << "\"," << result.triangleCount << "," << result.instanceCount << "," << result.rayMode << ","
+                   << result.blasBuildMs << "," << result.blasCompactMs << "," << result.blasSize << "," << result.compactedBlasSize << ","
+                   << static_cast< double >(result.compactedBlasSize) / result.blasSize << ","
+                   << result.tlasBuildMs << "," << result.tlasRefitMs << "," << result.tlasSize << ","
+                   << result.buildPeakVramBytes << "," << result.traceVramBytes << ","
+                   << result.traceMs << "," << result.megaRaysPerSecond << "\n";
+        outputFile.flush();
+        std::cout << "  " << result.instanceCount << " instances, " << result.rayMode << " rays: "
+                  << "TLAS build " << result.tlasBuildMs << " ms, refit " << result.tlasRefitMs << " ms, "
+                  << result.megaRaysPerSecond << " Mrays/s" << std::endl;
+    };
+
+    // Scenes larger than this are skipped.
+    const VkDeviceSize maxSceneBytes = static_cast< VkDeviceSize >(deviceLocalHeapSize * MAX_HEAP_USAGE);
+    const VkDeviceSize maxAllocationSize = maintenance3Properties.maxMemoryAllocationSize;
+
+    for (uint64_t requestedTriangleCount : triangleCounts) {
+        // ----------------------
+        // 1: Generate the mesh
+        // ----------------------
+
+        // The grid has two triangles per cell and is close to square,
+        // so the real triangle count may be slightly above the requested one.
+        const uint64_t cellCount = (requestedTriangleCount + 1) / 2;
+        const uint64_t gridWidth = std::max< uint64_t >(1, static_cast< uint64_t >(std::sqrt(static_cast< double >(cellCount))));
+        const uint64_t gridHeight = (cellCount + gridWidth - 1) / gridWidth;
+        const uint64_t triangleCount = gridWidth * gridHeight * 2;
+        const uint64_t vertexCount = (gridWidth + 1) * (gridHeight + 1);
+        const VkDeviceSize vertexBufferSize = vertexCount * sizeof(glm::vec3);
+        const VkDeviceSize indexBufferSize = triangleCount * 3 * sizeof(uint32_t);
+        if (triangleCount > accelerationStructureProperties.maxPrimitiveCount || vertexCount > UINT32_MAX) {
+            std::cout << "Skipping " << triangleCount << " triangles: more than a BLAS may have" << std::endl;
+            continue;
+        }
+
+        // Describe the geometry, addresses are filled in once buffers are created.
+        VkAccelerationStructureGeometryKHR blasGeometry{};
+        blasGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        blasGeometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+        blasGeometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+        blasGeometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        blasGeometry.geometry.triangles.vertexStride = sizeof(glm::vec3);
+        blasGeometry.geometry.triangles.maxVertex = static_cast< uint32_t >(vertexCount - 1);
+        blasGeometry.geometry.triangles.indexType = VK_INDEX_TYPE_UINT32;
+        blasGeometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+        VkAccelerationStructureBuildGeometryInfoKHR blasBuildInfo{};
+        blasBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        blasBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        blasBuildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_KHR;
+        blasBuildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        blasBuildInfo.geometryCount = 1;
+        blasBuildInfo.pGeometries = &blasGeometry;
+        const uint32_t primitiveCount = static_cast< uint32_t >(triangleCount);
+        VkAccelerationStructureBuildSizesInfoKHR blasSizes{};
+        blasSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        vkGetAccelerationStructureBuildSizesKHR(vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &blasBuildInfo, &primitiveCount, &blasSizes);
+
+        // Everything the build needs should fit into device-local memory at once.
+        const VkDeviceSize blasBuildBytes = vertexBufferSize + indexBufferSize + blasSizes.accelerationStructureSize + blasSizes.buildScratchSize;
+        const VkDeviceSize largestBlasBuffer = std::max({ vertexBufferSize, indexBufferSize, blasSizes.accelerationStructureSize, blasSizes.buildScratchSize });
+        if (baseVramBytes + blasBuildBytes > maxSceneBytes || largestBlasBuffer > maxAllocationSize) {
+            std::cout << "Skipping " << triangleCount << " triangles: " << blasBuildBytes << " bytes do not fit into device memory" << std::endl;
+            continue;
+        }
+        std::cout << "Mesh of " << triangleCount << " triangles" << std::endl;
+        peakVramBytes = allocatedVramBytes;
+
+        // Vertices form a grid over the unit square, the surface is displaced by waves,
+        // so triangles are not coplanar and bounding boxes of the BLAS overlap like in real meshes.
+        BenchmarkBuffer vertexBuffer = createBuffer(vertexBufferSize, buildInputBufferUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(vertexBuffer, vertexBufferSize, [&](uint8_t* data, VkDeviceSize offset, VkDeviceSize size) {
+            glm::vec3* vertices = reinterpret_cast< glm::vec3* >(data);
+            const uint64_t first = offset / sizeof(glm::vec3);
+            const uint64_t count = size / sizeof(glm::vec3);
+            for (uint64_t i = 0; i < count; i++) {
+                const uint64_t vertex = first + i;
+                const float u = static_cast< float >(vertex % (gridWidth + 1)) / gridWidth;
+                const float v = static_cast< float >(vertex / (gridWidth + 1)) / gridHeight;
+                const float height = 0.05f * std::sin(u * 25.0f) * std::cos(v * 25.0f);
+                vertices[i] = glm::vec3(u - 0.5f, v - 0.5f, height);
+            }
+        });
+
+        // Each grid cell is split into two triangles.
+        BenchmarkBuffer indexBuffer = createBuffer(indexBufferSize, buildInputBufferUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        uploadBuffer(indexBuffer, indexBufferSize, [&](uint8_t* data, VkDeviceSize offset, VkDeviceSize size) {
+            uint32_t* indices = reinterpret_cast< uint32_t* >(data);
+            const uint64_t first = offset / sizeof(uint32_t);
+            const uint64_t count = size / sizeof(uint32_t);
+            for (uint64_t i = 0; i < count; i++) {
+                const uint64_t index = first + i;
+                const uint64_t triangle = index / 3;
+                const uint64_t cell = triangle / 2;
+                const uint64_t x = cell % gridWidth;
+                const uint64_t y = cell / gridWidth;
+                const uint32_t v00 = static_cast< uint32_t >(y * (gridWidth + 1) + x);
+                const uint32_t v10 = v00 + 1;
+                const uint32_t v01 = v00 + static_cast< uint32_t >(gridWidth + 1);
+                const uint32_t v11 = v01 + 1;
+                const std::array< uint32_t, 6 > cellIndices = { v00, v10, v11, v00, v11, v01 };
+                indices[i] = cellIndices[(triangle % 2) * 3 + index % 3];
+            }
+        });
+        blasGeometry.geometry.triangles.vertexData.deviceAddress = vertexBuffer.address;
+        blasGeometry.geometry.triangles.indexData.deviceAddress = indexBuffer.address;
+
+        // -----------------------------
+        // 2: Build and compact the BLAS
+        // -----------------------------
+
+        BenchmarkAccelerationStructure blas = createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, blasSizes.accelerationStructureSize);
+        BenchmarkBuffer blasScratchBuffer = createScratchBuffer(blasSizes.buildScratchSize);
+        blasBuildInfo.dstAccelerationStructure = blas.handle;
+        blasBuildInfo.scratchData.deviceAddress = alignUp(blasScratchBuffer.address, scratchAlignment);
+        VkAccelerationStructureBuildRangeInfoKHR blasBuildRange{};
+        blasBuildRange.primitiveCount = primitiveCount;
+        const VkAccelerationStructureBuildRangeInfoKHR* blasBuildRanges = &blasBuildRange;
+
+        // Every repetition rebuilds the BLAS from scratch.
+        const double blasBuildMs = measureAverageGpuMs([&](VkCommandBuffer cmd) {
+            vkCmdBuildAccelerationStructuresKHR(cmd, 1, &blasBuildInfo, &blasBuildRanges);
+        });
+
+        // Query the compacted size of the last build.
+        // The barrier makes results of the build in the previous submission visible to the query.
+        VkQueryPoolCreateInfo vkCompactedSizeQueryPoolInfo{};
+        vkCompactedSizeQueryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        vkCompactedSizeQueryPoolInfo.queryType = VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR;
+        vkCompactedSizeQueryPoolInfo.queryCount = 1;
+        VkQueryPool vkCompactedSizeQueryPool;
+        if (vkCreateQueryPool(vkDevice, &vkCompactedSizeQueryPoolInfo, nullptr, &vkCompactedSizeQueryPool) != VK_SUCCESS) {
+            std::cerr << "Failed to create a query pool!" << std::endl;
+            abort();
+        }
+        executeCommands([&](VkCommandBuffer cmd) {
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &vkAccelerationStructureBarrier, 0, nullptr, 0, nullptr);
+            vkCmdResetQueryPool(cmd, vkCompactedSizeQueryPool, 0, 1);
+            vkCmdWriteAccelerationStructuresPropertiesKHR(cmd, 1, &blas.handle, VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR, vkCompactedSizeQueryPool, 0);
+        });
+        VkDeviceSize compactedSize = 0;
+        if (vkGetQueryPoolResults(vkDevice, vkCompactedSizeQueryPool, 0, 1, sizeof(compactedSize), &compactedSize, sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+            std::cerr << "Failed to get the compacted BLAS size!" << std::endl;
+            abort();
+        }
+        vkDestroyQueryPool(vkDevice, vkCompactedSizeQueryPool, nullptr);
+
+        // Compact the BLAS. Scenes are static, so the compacted BLAS is the one instances refer to.
+        BenchmarkAccelerationStructure compactedBlas = createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactedSize);
+        const double blasCompactMs = measureGpuMs([&](VkCommandBuffer cmd) {
+            vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &vkAccelerationStructureBarrier, 0, nullptr, 0, nullptr);
+            VkCopyAccelerationStructureInfoKHR copyInfo{};
+            copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+            copyInfo.src = blas.handle;
+            copyInfo.dst = compactedBlas.handle;
+            copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+            vkCmdCopyAccelerationStructureKHR(cmd, &copyInfo);
+        });
+        const VkDeviceSize buildPeakVramBytes = peakVramBytes;
+        // Sizes of acceleration structures themselves, buffers keeping them are rounded up
+        // to the memory alignment and are counted only as VRAM use.
+        const VkDeviceSize blasSize = blasSizes.accelerationStructureSize;
+        const VkDeviceSize compactedBlasSize = compactedSize;
+        std::cout << "  BLAS build " << blasBuildMs << " ms, compacted from " << blasSize << " to " << compactedBlasSize << " bytes" << std::endl;
+
+        // Geometry and the original BLAS are not needed anymore, instanced scenes get more memory.
+        destroyAccelerationStructure(blas);
+        destroyBuffer(blasScratchBuffer);
+        destroyBuffer(indexBuffer);
+        destroyBuffer(vertexBuffer);
+
+        for (uint64_t instanceCount : instanceCounts) {
+            // ------------------------------
+            // 3: Build and refit the TLAS
+            // ------------------------------
+
+            if (instanceCount > accelerationStructureProperties.maxInstanceCount) {
+                std::cout << "  Skipping " << instanceCount << " instances: more than a TLAS may have" << std::endl;
+                continue;
+            }
+            const VkDeviceSize instanceBufferSize = instanceCount * sizeof(VkAccelerationStructureInstanceKHR);
+
+            // Describe the TLAS, the instance address is filled in for every build.
+            VkAccelerationStructureGeometryKHR tlasGeometry{};
+            tlasGeometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+            tlasGeometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+            tlasGeometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+            tlasGeometry.geometry.instances.arrayOfPointers = VK_FALSE;
+            VkAccelerationStructureBuildGeometryInfoKHR tlasBuildInfo{};
+            tlasBuildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+            tlasBuildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+            tlasBuildInfo.flags = VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_KHR | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_KHR;
+            tlasBuildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+            tlasBuildInfo.geometryCount = 1;
+            tlasBuildInfo.pGeometries = &tlasGeometry;
+            const uint32_t tlasPrimitiveCount = static_cast< uint32_t >(instanceCount);
+            VkAccelerationStructureBuildSizesInfoKHR tlasSizes{};
+            tlasSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+            vkGetAccelerationStructureBuildSizesKHR(vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &tlasBuildInfo, &tlasPrimitiveCount, &tlasSizes);
+            const VkDeviceSize tlasScratchSize = std::max(tlasSizes.buildScratchSize, tlasSizes.updateScratchSize);
+            const VkDeviceSize tlasBytes = 2 * instanceBufferSize + tlasSizes.accelerationStructureSize + tlasScratchSize;
+            if (allocatedVramBytes + tlasBytes > maxSceneBytes || std::max(tlasSizes.accelerationStructureSize, tlasScratchSize) > maxAllocationSize) {
+                std::cout << "  Skipping " << instanceCount << " instances: " << tlasBytes << " bytes do not fit into device memory" << std::endl;
+                continue;
+            }
+
+            // Instances of the compacted BLAS on a cubic grid.
+            // The TLAS is built from the first buffer and refitted from the second one,
+            // where every instance is rotated a bit, like animated instances move between frames.
+            const uint64_t instanceGridSize = static_cast< uint64_t >(std::ceil(std::cbrt(static_cast< double >(instanceCount)) - 1e-6));
+            const float instanceScale = 1.0f / instanceGridSize;
+            auto fillInstances = [&](float rotation) {
+                return [&, rotation](uint8_t* data, VkDeviceSize offset, VkDeviceSize size) {
+                    VkAccelerationStructureInstanceKHR* instances = reinterpret_cast< VkAccelerationStructureInstanceKHR* >(data);
+                    const uint64_t first = offset / sizeof(VkAccelerationStructureInstanceKHR);
+                    const uint64_t count = size / sizeof(VkAccelerationStructureInstanceKHR);
+                    for (uint64_t i = 0; i < count; i++) {
+                        const uint64_t instance = first + i;
+                        const glm::vec3 cell(instance % instanceGridSize, (instance / instanceGridSize) % instanceGridSize, instance / (instanceGridSize * instanceGridSize));
+                        const glm::vec3 position = (cell + glm::vec3(0.5f)) * instanceScale - glm::vec3(0.5f);
+                        const glm::mat4 model = glm::translate(position) *
+                                                glm::rotate(rotation + instance * 0.7f, glm::vec3(0.0f, 0.0f, 1.0f)) *
+                                                glm::scale(glm::vec3(instanceScale * INSTANCE_FILL_FACTOR));
+                        // Transformation is a row-major 3x4 matrix, while GLM stores matrices column by column.
+                        VkAccelerationStructureInstanceKHR& geometryInstance = instances[i];
+                        for (int row = 0; row < 3; row++) {
+                            for (int column = 0; column < 4; column++) {
+                                geometryInstance.transform.matrix[row][column] = model[column][row];
+                            }
+                        }
+                        geometryInstance.instanceCustomIndex = 0;
+                        geometryInstance.mask = 0xff;
+                        geometryInstance.instanceShaderBindingTableRecordOffset = 0;
+                        geometryInstance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_FACING_CULL_DISABLE_BIT_KHR;
+                        geometryInstance.accelerationStructureReference = compactedBlas.address;
+                    }
+                };
+            };
+            std::array< BenchmarkBuffer, 2 > instanceBuffers;
+            for (size_t i = 0; i < instanceBuffers.size(); i++) {
+                instanceBuffers[i] = createBuffer(instanceBufferSize, buildInputBufferUsage, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+                uploadBuffer(instanceBuffers[i], instanceBufferSize, fillInstances(i * INSTANCE_REFIT_ROTATION));
+            }
+
+            BenchmarkAccelerationStructure tlas = createAccelerationStructure(VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, tlasSizes.accelerationStructureSize);
+            BenchmarkBuffer tlasScratchBuffer = createScratchBuffer(tlasScratchSize);
+            tlasBuildInfo.dstAccelerationStructure = tlas.handle;
+            tlasBuildInfo.scratchData.deviceAddress = alignUp(tlasScratchBuffer.address, scratchAlignment);
+            VkAccelerationStructureBuildRangeInfoKHR tlasBuildRange{};
+            tlasBuildRange.primitiveCount = tlasPrimitiveCount;
+            const VkAccelerationStructureBuildRangeInfoKHR* tlasBuildRanges = &tlasBuildRange;
+
+            // The BLAS is read by the TLAS build, so the compaction copy should be finished.
+            tlasGeometry.geometry.instances.data.deviceAddress = instanceBuffers[0].address;
+            const double tlasBuildMs = measureAverageGpuMs([&](VkCommandBuffer cmd) {
+                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &vkAccelerationStructureBarrier, 0, nullptr, 0, nullptr);
+                vkCmdBuildAccelerationStructuresKHR(cmd, 1, &tlasBuildInfo, &tlasBuildRanges);
+            });
+
+            // Refits update the TLAS in place, alternating between both instance buffers.
+            tlasBuildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR;
+            tlasBuildInfo.srcAccelerationStructure = tlas.handle;
+            size_t refitIndex = 0;
+            const double tlasRefitMs = measureAverageGpuMs([&](VkCommandBuffer cmd) {
+                tlasGeometry.geometry.instances.data.deviceAddress = instanceBuffers[++refitIndex % 2].address;
+                vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR, 0, 1, &vkAccelerationStructureBarrier, 0, nullptr, 0, nullptr);
+                vkCmdBuildAccelerationStructuresKHR(cmd, 1, &tlasBuildInfo, &tlasBuildRanges);
+            });
+
+            // ----------------
+            // 4: Trace rays
+            // ----------------
+
+            VkWriteDescriptorSetAccelerationStructureKHR vkDescriptorAccelerationStructureInfo{};
+            vkDescriptorAccelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+            vkDescriptorAccelerationStructureInfo.accelerationStructureCount = 1;
+            vkDescriptorAccelerationStructureInfo.pAccelerationStructures = &tlas.handle;
+            VkWriteDescriptorSet vkAccelerationStructureWrite{};
+            vkAccelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            vkAccelerationStructureWrite.pNext = &vkDescriptorAccelerationStructureInfo;
+            vkAccelerationStructureWrite.dstSet = vkDescriptorSet;
+            vkAccelerationStructureWrite.dstBinding = 0;
+            vkAccelerationStructureWrite.descriptorCount = 1;
+            vkAccelerationStructureWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR;
+            vkUpdateDescriptorSets(vkDevice, 1, &vkAccelerationStructureWrite, 0, nullptr);
+
+            // Refit scratch memory is not needed by traces.
+            destroyBuffer(tlasScratchBuffer);
+            const VkDeviceSize traceVramBytes = allocatedVramBytes;
+
+            // One launch traces one ray per pixel. Launches of a repetition are
+            // separated by barriers, since all of them write the same image.
+            const std::array< std::pair< uint32_t, const char* >, 2 > rayModes = { { { BENCHMARK_RAY_MODE_PRIMARY, "primary" }, { BENCHMARK_RAY_MODE_RANDOM, "random" } } };
+            for (const auto& rayMode : rayModes) {
+                uint32_t seed = 0;
+                const double traceMs = measureAverageGpuMs([&](VkCommandBuffer cmd) {
+                    VkMemoryBarrier vkTraceBarrier{};
+                    vkTraceBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                    vkTraceBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_KHR | VK_ACCESS_SHADER_WRITE_BIT;
+                    vkTraceBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_KHR | VK_ACCESS_SHADER_WRITE_BIT;
+                    vkCmdPipelineBarrier(cmd, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_KHR | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_KHR, 0, 1, &vkTraceBarrier, 0, nullptr, 0, nullptr);
+                    vkCmdBindPipeline(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, vkPipeline);
+                    vkCmdBindDescriptorSets(cmd, VK_PIPELINE_BIND_POINT_RAY_TRACING_KHR, vkPipelineLayout, 0, 1, &vkDescriptorSet, 0, nullptr);
+                    BenchmarkPushConstants pushConstants{};
+                    pushConstants.rayMode = rayMode.first;
+                    pushConstants.seed = seed++;
+                    vkCmdPushConstants(cmd, vkPipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_KHR, 0, sizeof(pushConstants), &pushConstants);
+                    vkCmdTraceRaysKHR(cmd, &raygenRegion, &missRegion, &hitRegion, &callableRegion, traceWidth, traceHeight, 1);
+                });
+
+                BenchmarkResult result{};
+                result.triangleCount = triangleCount;
+                result.instanceCount = instanceCount;
+                result.rayMode = rayMode.second;
+                result.blasBuildMs = blasBuildMs;
+                result.blasCompactMs = blasCompactMs;
+                result.blasSize = blasSize;
+                result.compactedBlasSize = compactedBlasSize;
+                result.tlasBuildMs = tlasBuildMs;
+                result.tlasRefitMs = tlasRefitMs;
+                result.tlasSize = tlasSizes.accelerationStructureSize;
+                result.buildPeakVramBytes = buildPeakVramBytes;
+                result.traceVramBytes = traceVramBytes;
+                result.traceMs = traceMs;
+                result.megaRaysPerSecond = traceMs > 0.0 ? static_cast< double >(traceWidth) * traceHeight / (traceMs * 1e3) : 0.0;
+                writeResult(result);
+            }
+
+            destroyAccelerationStructure(tlas);
+            for (BenchmarkBuffer& instanceBuffer : instanceBuffers) {
+                destroyBuffer(instanceBuffer);
+            }
+        }
+        destroyAccelerationStructure(compactedBlas);
+    }
+    outputFile.close();
+    std::cout << "Results are written into " << outputPath << std::endl;
+
+    // ==========================================================================
+    //                     STEP 8: Deinitialization
+    // ==========================================================================
+
+    vkDeviceWaitIdle(vkDevice);
+    vkDestroyDescriptorPool(vkDevice, vkDescriptorPool, nullptr);
+    destroyBuffer(sbtBuffer);
+    vkDestroyPipeline(vkDevice, vkPipeline, nullptr);
+    vkDestroyPipelineLayout(vkDevice, vkPipelineLayout, nullptr);
+    vkDestroyDescriptorSetLayout(vkDevice, vkDescriptorSetLayout, nullptr);
+    for (VkShaderModule module : vkShaderModules) {
+        vkDestroyShaderModule(vkDevice, module, nullptr);
+    }
+    vkDestroyImageView(vkDevice, vkStorageImageView, nullptr);
+    vkDestroyImage(vkDevice, vkStorageImage, nullptr);
+    vkFreeMemory(vkDevice, vkStorageImageMemory, nullptr);
+    destroyBuffer(stagingBuffer);
+    vkDestroyQueryPool(vkDevice, vkTimestampPool, nullptr);
+    vkDestroyFence(vkDevice, vkFence, nullptr);
+    vkDestroyCommandPool(vkDevice, vkCommandPool, nullptr);
+    vkDestroyDevice(vkDevice, nullptr);
+    vkDestroyInstance(vkInstance, nullptr);
+    return 0;
+}
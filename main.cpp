@@ -32,6 +32,18 @@
  *                                                                          *
  ****************************************************************************/
 
+// Include platform memory mapping API.
+// Windows headers go first and without min/max macros, so they do not clash with GLFW and std::min.
+#ifdef _WIN32
+#define NOMINMAX
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 // Include GLFW (window SDK).
 // Switch on support of Vulkan
 #define GLFW_INCLUDE_VULKAN
@@ -46,31 +58,1525 @@
 #include <glm/glm.hpp>
 #include <glm/gtx/transform.hpp>
 
-#include <set>
-#include <array>
-#include <string>
-#include <vector>
-#include <cstring>
-#include <fstream>
-#include <iostream>
-#include <optional>
+#include <set>
+#include <map>
+#include <array>
+#include <deque>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstddef>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <functional>
+#include <condition_variable>
+
+// File modification times for hot shader reload.
+#include <sys/stat.h>
+
+// Shader compiler and the directory of shader sources used by hot shader reload.
+// CMake provides paths of the build machine, by default glslc is taken from PATH
+// and sources are looked up in the working directory.
+#ifndef SHADER_COMPILER
+#define SHADER_COMPILER "glslc"
+#endif
+#ifndef SHADER_SOURCE_DIR
+#define SHADER_SOURCE_DIR "."
+#endif
+
+/**
+ * Window width.
+ */
+constexpr int WINDOW_WIDTH = 800;
+/**
+ * Window height.
+ */
+constexpr int WINDOW_HEIGHT = 800;
+/**
+ * Application name.
+ */
+constexpr const char* APPLICATION_NAME = "VKExampleRTX";
+/**
+ * Maximal amount of frames processed at the same time.
+ */
+constexpr int MAX_FRAMES_IN_FLIGHT = 5;
+/**
+ * Size of one segment of the staging ring used to upload data into device-local memory.
+ * Uploads larger than this are split into segment-sized chunks.
+ */
+constexpr VkDeviceSize STAGING_RING_SEGMENT_SIZE = 4 * 1024 * 1024;
+/**
+ * Amount of segments in the staging ring.
+ * The CPU fills one segment while the GPU copies from the others.
+ */
+constexpr size_t STAGING_RING_SEGMENT_COUNT = 4;
+/**
+ * Magic number in the beginning of a mesh file ("VKMS").
+ */
+constexpr uint32_t MESH_FILE_MAGIC = 0x534D4B56;
+/**
+ * Latest supported version of the mesh file format.
+ * Version 1 files have no vertex attributes, version 2 files have them after indices.
+ */
+constexpr uint32_t MESH_FILE_VERSION = 2;
+/**
+ * Amount of instances in the TLAS if not specified in the command line.
+ */
+constexpr uint32_t DEFAULT_INSTANCE_COUNT = 1;
+/**
+ * Rotation speed of instances in radians per second.
+ */
+constexpr float INSTANCE_ROTATION_SPEED = 1.0f;
+/**
+ * Part of a grid cell occupied by an instance.
+ */
+constexpr float INSTANCE_FILL_FACTOR = 0.5f;
+
+/**
+ * Header of a binary mesh file.
+ * The header is followed by vertexCount positions (3 x float each)
+ * and then by indexCount indices (indexSize bytes each).
+ * Version 2 files end with vertexCount VertexAttributes.
+ * All values are little endian.
+ */
+struct MeshFileHeader
+{
+    /**
+     * Should be equal to MESH_FILE_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * Should be in the range from 1 to MESH_FILE_VERSION.
+     */
+    uint32_t version;
+    /**
+     * Amount of vertices in the mesh.
+     */
+    uint32_t vertexCount;
+    /**
+     * Amount of indices in the mesh. Each triplet of indices represents one triangle.
+     */
+    uint32_t indexCount;
+    /**
+     * Size of one index in bytes: 2 for 16-bit indices or 4 for 32-bit indices.
+     */
+    uint32_t indexSize;
+};
+
+/**
+ * Shading attributes of a vertex, stored in version 2 mesh files.
+ * Positions stay in their own buffer read by BLAS builds, while closest hit shaders
+ * fetch these 8 bytes per vertex, so shading does not spend much bandwidth on attributes.
+ */
+struct VertexAttributes
+{
+    /**
+     * Normal in octahedral encoding, two snorm16 values.
+     */
+    int16_t normal[2];
+    /**
+     * Texture coordinates, two half floats.
+     */
+    uint16_t uv[2];
+};
+
+/**
+ * Camera rotation in radians per pixel of mouse movement.
+ */
+constexpr float CAMERA_ROTATION_SPEED = 0.005f;
+/**
+ * Factor the camera distance is multiplied by per scroll step.
+ */
+constexpr float CAMERA_ZOOM_SPEED = 0.9f;
+/**
+ * Minimal distance from the camera to the target.
+ */
+constexpr float CAMERA_MIN_DISTANCE = 0.5f;
+/**
+ * Maximal distance from the camera to the target.
+ */
+constexpr float CAMERA_MAX_DISTANCE = 8.0f;
+/**
+ * Maximal vertical angle of the camera, slightly less than 90 degrees to keep the up vector valid.
+ */
+constexpr float CAMERA_MAX_PITCH = 1.55f;
+/**
+ * Interval in seconds between profiler reports printed to the console.
+ */
+constexpr double PROFILER_REPORT_INTERVAL = 1.0;
+/**
+ * Amount of measured frames rendered in headless mode by default.
+ */
+constexpr uint32_t DEFAULT_BENCHMARK_FRAME_COUNT = 1000;
+/**
+ * Amount of first frames excluded from headless statistics.
+ * They include the acceleration structure build and driver warm up.
+ */
+constexpr uint32_t BENCHMARK_WARMUP_FRAMES = 16;
+/**
+ * Animation time step in seconds between frames in headless mode.
+ * A fixed step makes every run render exactly the same sequence of frames.
+ */
+constexpr double BENCHMARK_FRAME_TIME_STEP = 1.0 / 60.0;
+/**
+ * Minimal scale of the internal resolution in dynamic resolution mode.
+ */
+constexpr float DYNAMIC_RESOLUTION_MIN_SCALE = 0.5f;
+/**
+ * Step the internal resolution scale changes by.
+ */
+constexpr float DYNAMIC_RESOLUTION_SCALE_STEP = 0.1f;
+/**
+ * Amount of frames averaged before the internal resolution is adjusted.
+ * Averaging many frames prevents the resolution from oscillating.
+ */
+constexpr uint32_t DYNAMIC_RESOLUTION_ADJUST_FRAMES = 30;
+/**
+ * Part of the frame time budget the average frame time should fall below
+ * before the internal resolution is raised again.
+ */
+constexpr double DYNAMIC_RESOLUTION_HEADROOM = 0.8;
+/**
+ * Maximal amount of samples traced by one ray generation shader invocation.
+ */
+constexpr uint32_t MAX_SAMPLES_PER_PIXEL = 64;
+/**
+ * Maximal width and height of the rendered image in pixels.
+ * Ray tracing capable GPUs support 2D images of this size.
+ */
+constexpr uint32_t MAX_RENDER_EXTENT = 16384;
+/**
+ * Amount of a-trous wavelet iterations of the denoiser.
+ * Each iteration doubles the distance between filter taps, so three iterations
+ * cover a 29x29 pixel footprint with only 25 taps per pixel and iteration.
+ */
+constexpr uint32_t DENOISER_ATROUS_ITERATIONS = 3;
+/**
+ * Edge length of a denoiser workgroup in pixels, should match local_size of denoise.comp.
+ */
+constexpr uint32_t DENOISER_WORKGROUP_SIZE = 8;
+/**
+ * Denoiser passes, they should match DENOISER_PASS_* constants of denoise.comp.
+ */
+constexpr uint32_t DENOISER_PASS_TEMPORAL = 0;
+constexpr uint32_t DENOISER_PASS_ATROUS = 1;
+/**
+ * Format of images rays are traced into.
+ * Half floats keep the precision accumulation and denoising need for values above 1,
+ * with half the bandwidth of 32-bit floats.
+ */
+constexpr VkFormat RADIANCE_IMAGE_FORMAT = VK_FORMAT_R16G16B16A16_SFLOAT;
+/**
+ * Format of display images the tone mapping pass writes when it cannot write swap chain images.
+ * Storage support of the format is required by the specification, unlike BGRA formats of swap chains,
+ * and blits into the swap chain convert it into the swap chain format.
+ */
+constexpr VkFormat DISPLAY_IMAGE_FORMAT = VK_FORMAT_R8G8B8A8_UNORM;
+/**
+ * Edge length of a tone mapping workgroup in pixels, should match local_size of tonemap.comp.
+ */
+constexpr uint32_t TONEMAP_WORKGROUP_SIZE = 8;
+/**
+ * Exposure radiance is scaled by before tone mapping.
+ */
+constexpr float TONEMAP_EXPOSURE = 1.0f;
+/**
+ * Interval between checks of shader sources for changes in hot reload mode.
+ */
+constexpr uint32_t HOT_RELOAD_POLL_INTERVAL_MS = 500;
+/**
+ * File the pipeline cache is stored in between application runs.
+ */
+constexpr const char* PIPELINE_CACHE_FILE_NAME = "pipeline.cache";
+/**
+ * Magic number in the beginning of a pipeline cache file ("VKPC").
+ */
+constexpr uint32_t PIPELINE_CACHE_FILE_MAGIC = 0x43504B56;
+
+/**
+ * Header of a pipeline cache file.
+ * The cache data is only valid for the same device and driver,
+ * so they are stored together with the data and checked on load.
+ * The header is followed by dataSize bytes of vkGetPipelineCacheData() output.
+ */
+struct PipelineCacheFileHeader
+{
+    /**
+     * Should be equal to PIPELINE_CACHE_FILE_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * Vendor of the device the cache was created on.
+     */
+    uint32_t vendorID;
+    /**
+     * Device the cache was created on.
+     */
+    uint32_t deviceID;
+    /**
+     * Version of the driver the cache was created with.
+     */
+    uint32_t driverVersion;
+    /**
+     * Pipeline cache UUID reported by the driver.
+     */
+    uint8_t pipelineCacheUUID[VK_UUID_SIZE];
+    /**
+     * Size of the cache data following the header.
+     */
+    uint64_t dataSize;
+};
+
+/**
+ * Magic number in the beginning of an asset archive ("VKPA").
+ */
+constexpr uint32_t ASSET_ARCHIVE_MAGIC = 0x41504B56;
+/**
+ * Version of asset archives written by the application.
+ */
+constexpr uint32_t ASSET_ARCHIVE_VERSION = 1;
+/**
+ * Alignment of asset data in an archive.
+ * Mapped SPIR-V words and mesh data can be used in place only if they are aligned.
+ */
+constexpr uint64_t ASSET_ARCHIVE_ALIGNMENT = 16;
+/**
+ * Size of the asset name field in an archive entry, including the terminating zero.
+ */
+constexpr size_t ASSET_ARCHIVE_NAME_SIZE = 64;
+
+/**
+ * Header of an asset archive.
+ * The header is followed by entryCount AssetArchiveEntry structures
+ * and then by data of the assets, each one starts at ASSET_ARCHIVE_ALIGNMENT.
+ * All values are little endian.
+ */
+struct AssetArchiveHeader
+{
+    /**
+     * Should be equal to ASSET_ARCHIVE_MAGIC.
+     */
+    uint32_t magic;
+    /**
+     * Should be equal to ASSET_ARCHIVE_VERSION.
+     */
+    uint32_t version;
+    /**
+     * Amount of assets in the archive.
+     */
+    uint32_t entryCount;
+    /**
+     * Unused, keeps entries aligned.
+     */
+    uint32_t reserved;
+};
+
+/**
+ * Index entry of an asset archive.
+ */
+struct AssetArchiveEntry
+{
+    /**
+     * Name the asset is looked up by: the file name the asset has been packed from.
+     */
+    char name[ASSET_ARCHIVE_NAME_SIZE];
+    /**
+     * Offset of the asset data from the beginning of the archive.
+     */
+    uint64_t offset;
+    /**
+     * Size of the asset data in bytes.
+     */
+    uint64_t size;
+};
+
+/**
+ * Read-only memory mapping of a whole file.
+ * Pages are loaded by the OS on the first access, so data goes from the page cache
+ * straight to its consumer instead of being read into an intermediate heap buffer.
+ */
+struct MappedFile
+{
+    /**
+     * Beginning of the mapped file or nullptr if no file is mapped.
+     */
+    const uint8_t* data = nullptr;
+    /**
+     * Size of the mapped file in bytes.
+     */
+    size_t size = 0;
+#ifdef _WIN32
+    /**
+     * File mapping object the view is created from.
+     */
+    HANDLE mapping = nullptr;
+#endif
+
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile()
+    {
+        close();
+    }
+
+    /**
+     * Map a file.
+     * @param path Path to the file.
+     * @return False if the file cannot be opened or is empty.
+     */
+    bool open(const std::string& path)
+    {
+        close();
+#ifdef _WIN32
+        // The file handle may be closed right away, the mapping keeps the file open.
+        HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            CloseHandle(file);
+            return false;
+        }
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        CloseHandle(file);
+        if (mapping == nullptr) {
+            return false;
+        }
+        data = static_cast< const uint8_t* >(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+        if (data == nullptr) {
+            CloseHandle(mapping);
+            mapping = nullptr;
+            return false;
+        }
+        size = static_cast< size_t >(fileSize.QuadPart);
+#else
+        // The descriptor may be closed right away, the mapping keeps the file open.
+        const int file = ::open(path.c_str(), O_RDONLY);
+        if (file < 0) {
+            return false;
+        }
+        struct stat fileStat;
+        if (fstat(file, &fileStat) != 0 || fileStat.st_size == 0) {
+            ::close(file);
+            return false;
+        }
+        void* mapped = mmap(nullptr, static_cast< size_t >(fileStat.st_size), PROT_READ, MAP_PRIVATE, file, 0);
+        ::close(file);
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        // Assets are consumed front to back, so let the OS read ahead.
+        madvise(mapped, static_cast< size_t >(fileStat.st_size), MADV_SEQUENTIAL);
+        data = static_cast< const uint8_t* >(mapped);
+        size = static_cast< size_t >(fileStat.st_size);
+#endif
+        return true;
+    }
+
+    /**
+     * Unmap the file if it is mapped.
+     */
+    void close()
+    {
+        if (data == nullptr) {
+            return;
+        }
+#ifdef _WIN32
+        UnmapViewOfFile(data);
+        CloseHandle(mapping);
+        mapping = nullptr;
+#else
+        munmap(const_cast< uint8_t* >(data), size);
+#endif
+        data = nullptr;
+        size = 0;
+    }
+};
+
+/**
+ * Read-only bytes of an asset inside a mapped file.
+ */
+struct AssetView
+{
+    /**
+     * Beginning of the asset or nullptr if the asset is not found.
+     */
+    const uint8_t* data = nullptr;
+    /**
+     * Size of the asset in bytes.
+     */
+    size_t size = 0;
+};
+
+/**
+ * Reader of assets: shader binaries and meshes.
+ * Assets are looked up in the asset archive first, so a single mapping serves
+ * all of them. Assets missing in the archive are mapped from files with the same name.
+ * Views stay valid until the reader is closed.
+ */
+struct AssetReader
+{
+    /**
+     * Mapped asset archive, it is not mapped if no archive is used.
+     */
+    MappedFile archive;
+    /**
+     * Assets of the archive by their names.
+     */
+    std::map< std::string, AssetView > archiveAssets;
+    /**
+     * Files mapped for assets that the archive does not have.
+     */
+    std::vector< std::unique_ptr< MappedFile > > files;
+
+    /**
+     * Map an asset archive and read its index.
+     * @param path Path to the archive.
+     * @return False if the archive cannot be mapped or is malformed.
+     */
+    bool openArchive(const std::string& path)
+    {
+        if (!archive.open(path)) {
+            return false;
+        }
+        AssetArchiveHeader header;
+        if (archive.size < sizeof(header)) {
+            archive.close();
+            return false;
+        }
+        memcpy(&header, archive.data, sizeof(header));
+        const uint64_t indexEnd = sizeof(header) + static_cast< uint64_t >(header.entryCount) * sizeof(AssetArchiveEntry);
+        if (header.magic != ASSET_ARCHIVE_MAGIC || header.version != ASSET_ARCHIVE_VERSION || indexEnd > archive.size) {
+            archive.close();
+            return false;
+        }
+        for (uint32_t i = 0; i < header.entryCount; i++) {
+            AssetArchiveEntry entry;
+            memcpy(&entry, archive.data + sizeof(header) + i * sizeof(entry), sizeof(entry));
+            entry.name[ASSET_ARCHIVE_NAME_SIZE - 1] = 0;
+            // Offsets past the end of the file are rejected first, so the size check does not wrap around.
+            if (entry.offset < indexEnd || entry.offset % ASSET_ARCHIVE_ALIGNMENT != 0 ||
+                entry.offset > archive.size || entry.size > archive.size - entry.offset) {
+                archiveAssets.clear();
+                archive.close();
+                return false;
+            }
+            // Shader binaries are passed to the driver as 32-bit words, so they should consist of whole words.
+            // A name should appear once, otherwise one of the entries would silently shadow the other.
+            const std::string name = entry.name;
+            const bool isShader = name.size() >= 4 && name.compare(name.size() - 4, 4, ".spv") == 0;
+            if ((isShader && entry.size % sizeof(uint32_t) != 0) || archiveAssets.count(name) != 0) {
+                archiveAssets.clear();
+                archive.close();
+                return false;
+            }
+            AssetView view;
+            view.data = archive.data + entry.offset;
+            view.size = static_cast< size_t >(entry.size);
+            archiveAssets[name] = view;
+        }
+        return true;
+    }
+
+    /**
+     * Find an asset.
+     * @param name Name of the asset, which is also the path to its file.
+     * @return View of the asset, its data is nullptr if the asset is not found.
+     */
+    AssetView find(const std::string& name)
+    {
+        const auto asset = archiveAssets.find(name);
+        if (asset != archiveAssets.end()) {
+            return asset->second;
+        }
+        auto file = std::make_unique< MappedFile >();
+        if (!file->open(name)) {
+            return AssetView();
+        }
+        AssetView view;
+        view.data = file->data;
+        view.size = file->size;
+        files.push_back(std::move(file));
+        return view;
+    }
+
+    /**
+     * Unmap the archive and all files, views become invalid.
+     */
+    void close()
+    {
+        files.clear();
+        archiveAssets.clear();
+        archive.close();
+    }
+};
+
+/**
+ * Pack files into an asset archive.
+ * Files are mapped one by one and written behind the index, each one aligned to ASSET_ARCHIVE_ALIGNMENT.
+ * @param path Path to the archive.
+ * @param names Paths to the files, the same strings are names of assets in the archive.
+ * @return False if a file cannot be read or the archive cannot be written.
+ */
+bool writeAssetArchive(const std::string& path, const std::vector< std::string >& names)
+{
+    // Lay out the index.
+    std::vector< AssetArchiveEntry > entries(names.size());
+    std::vector< std::unique_ptr< MappedFile > > files;
+    uint64_t offset = sizeof(AssetArchiveHeader) + entries.size() * sizeof(AssetArchiveEntry);
+    for (size_t i = 0; i < names.size(); i++) {
+        if (names[i].size() >= ASSET_ARCHIVE_NAME_SIZE) {
+            std::cerr << "Asset name is too long: " << names[i] << std::endl;
+            return false;
+        }
+        files.push_back(std::make_unique< MappedFile >());
+        if (!files.back()->open(names[i])) {
+            std::cerr << "Asset file " << names[i] << " not found!" << std::endl;
+            return false;
+        }
+        offset = (offset + ASSET_ARCHIVE_ALIGNMENT - 1) / ASSET_ARCHIVE_ALIGNMENT * ASSET_ARCHIVE_ALIGNMENT;
+        memset(&entries[i], 0, sizeof(entries[i]));
+        memcpy(entries[i].name, names[i].data(), names[i].size());
+        entries[i].offset = offset;
+        entries[i].size = files.back()->size;
+        offset += entries[i].size;
+    }
+
+    // Write the header, the index and the data with padding in between.
+    std::ofstream archiveFile(path, std::ios::binary);
+    if (!archiveFile.is_open()) {
+        return false;
+    }
+    AssetArchiveHeader header{};
+    header.magic = ASSET_ARCHIVE_MAGIC;
+    header.version = ASSET_ARCHIVE_VERSION;
+    header.entryCount = static_cast< uint32_t >(entries.size());
+    archiveFile.write(reinterpret_cast< const char* >(&header), sizeof(header));
+    archiveFile.write(reinterpret_cast< const char* >(entries.data()), entries.size() * sizeof(AssetArchiveEntry));
+    const char padding[ASSET_ARCHIVE_ALIGNMENT] = {};
+    for (size_t i = 0; i < entries.size(); i++) {
+        archiveFile.write(padding, static_cast< std::streamsize >(entries[i].offset - static_cast< uint64_t >(archiveFile.tellp())));
+        archiveFile.write(reinterpret_cast< const char* >(files[i]->data), static_cast< std::streamsize >(files[i]->size));
+    }
+    return static_cast< bool >(archiveFile);
+}
+
+/**
+ * Size of one memory block allocated by the memory arena.
+ * Resources bigger than that get a block of their own size.
+ */
+constexpr VkDeviceSize MEMORY_ARENA_BLOCK_SIZE = 64 * 1024 * 1024;
+
+/**
+ * Large block of device memory that the memory arena sub-allocates resources from.
+ */
+struct MemoryBlock
+{
+    /**
+     * Vulkan memory object of the block.
+     */
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    /**
+     * Size of the block in bytes.
+     */
+    VkDeviceSize size = 0;
+    /**
+     * Pointer to the mapped block if the memory is host visible, nullptr otherwise.
+     */
+    uint8_t* mappedData = nullptr;
+    /**
+     * Free ranges of the block (offset -> size). Adjacent ranges are always merged.
+     */
+    std::map< VkDeviceSize, VkDeviceSize > freeRanges;
+    /**
+     * Amount of bytes occupied by allocations including alignment padding.
+     */
+    VkDeviceSize usedBytes = 0;
+    /**
+     * Amount of live allocations in the block.
+     */
+    uint32_t allocationCount = 0;
+};
+
+/**
+ * Piece of device memory sub-allocated by the memory arena.
+ */
+struct MemoryAllocation
+{
+    /**
+     * Memory object that should be passed to vkBind*Memory() calls.
+     */
+    VkDeviceMemory memory = VK_NULL_HANDLE;
+    /**
+     * Offset of the allocation within the memory object.
+     */
+    VkDeviceSize offset = 0;
+    /**
+     * Requested size of the allocation.
+     */
+    VkDeviceSize size = 0;
+    /**
+     * Pointer to the mapped allocation if the memory is host visible, nullptr otherwise.
+     */
+    void* mappedData = nullptr;
+    /**
+     * Block the allocation belongs to.
+     */
+    MemoryBlock* block = nullptr;
+    /**
+     * Index of the pool the block belongs to.
+     */
+    uint32_t poolIndex = 0;
+    /**
+     * Range reserved in the block including alignment padding.
+     */
+    VkDeviceSize rangeOffset = 0;
+    VkDeviceSize rangeSize = 0;
+};
+
+/**
+ * Memory usage statistics of the memory arena.
+ */
+struct MemoryArenaStatistics
+{
+    /**
+     * Amount of VkDeviceMemory objects allocated by the arena.
+     */
+    uint32_t blockCount = 0;
+    /**
+     * Amount of live sub-allocations.
+     */
+    uint32_t allocationCount = 0;
+    /**
+     * Total size of all blocks.
+     */
+    VkDeviceSize reservedBytes = 0;
+    /**
+     * Amount of bytes occupied by sub-allocations including alignment padding.
+     */
+    VkDeviceSize usedBytes = 0;
+    /**
+     * Size of the largest free range, i.e. the largest allocation that fits without a new block.
+     */
+    VkDeviceSize largestFreeRange = 0;
+    /**
+     * Amount of separate free ranges.
+     */
+    uint32_t freeRangeCount = 0;
+    /**
+     * Fragmentation of the free memory in [0, 1]: 0 means that all free memory is one contiguous range.
+     */
+    float fragmentation = 0.0f;
+};
+
+/**
+ * Memory arena sub-allocates resources from large VkDeviceMemory blocks,
+ * so the application performs only a few vkAllocateMemory() calls and stays
+ * far below maxMemoryAllocationCount.
+ * There is a separate pool of blocks per memory type and per resource kind:
+ * linear resources (buffers and acceleration structures) and optimal tiling
+ * images never share a block, so bufferImageGranularity does not have to be
+ * taken into account. Host-visible blocks are persistently mapped.
+ */
+struct MemoryArena
+{
+    /**
+     * Logical device the memory is allocated from.
+     */
+    VkDevice device = VK_NULL_HANDLE;
+    /**
+     * Memory properties of the physical device.
+     */
+    VkPhysicalDeviceMemoryProperties memoryProperties{};
+    /**
+     * Maximal amount of VkDeviceMemory objects allowed by the device.
+     */
+    uint32_t maxAllocationCount = 0;
+    /**
+     * Flags all memory blocks are allocated with.
+     * The KHR ray tracing backend needs device addresses of buffers.
+     */
+    VkMemoryAllocateFlags allocateFlags = 0;
+    /**
+     * Amount of physical devices of the logical device.
+     * Memory of multi-instance heaps cannot be mapped, so device groups keep
+     * host-visible resources in other heaps, which all GPUs of the group share.
+     */
+    uint32_t deviceCount = 1;
+    /**
+     * Blocks of each pool. Pool index is memoryTypeIndex * 2 + (isImage ? 1 : 0).
+     */
+    std::array< std::vector< std::unique_ptr< MemoryBlock > >, VK_MAX_MEMORY_TYPES * 2 > pools;
+
+    /**
+     * Sub-allocate memory for a resource.
+     * @param requirements Memory requirements of the resource.
+     * @param flags Memory properties the memory type should have.
+     * @param isImage True for optimal tiling images, false for buffers and acceleration structures.
+     * @param preferredFlags Additional memory properties that are used if some memory type has them.
+     * @return Allocation the resource should be bound to.
+     */
+    MemoryAllocation allocate(const VkMemoryRequirements& requirements, VkMemoryPropertyFlags flags, bool isImage, VkMemoryPropertyFlags preferredFlags = 0)
+    {
+        // Find a memory type that is allowed for the resource and has all requested properties.
+        // Try preferred properties first and fall back to the required ones.
+        uint32_t memoryTypeIndex = UINT32_MAX;
+        for (VkMemoryPropertyFlags wantedFlags : { flags | preferredFlags, flags }) {
+            for (uint32_t i = 0; i < memoryProperties.memoryTypeCount && memoryTypeIndex == UINT32_MAX; i++) {
+                const bool multiInstance = deviceCount > 1 && (memoryProperties.memoryHeaps[memoryProperties.memoryTypes[i].heapIndex].flags & VK_MEMORY_HEAP_MULTI_INSTANCE_BIT);
+                if (multiInstance && (flags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
+                    continue;
+                }
+                if ((requirements.memoryTypeBits & (1 << i)) && (memoryProperties.memoryTypes[i].propertyFlags & wantedFlags) == wantedFlags) {
+                    memoryTypeIndex = i;
+                }
+            }
+        }
+        if (memoryTypeIndex == UINT32_MAX) {
+            std::cerr << "No suitable memory type!" << std::endl;
+            abort();
+        }
+        const uint32_t poolIndex = memoryTypeIndex * 2 + (isImage ? 1 : 0);
+        auto& pool = pools[poolIndex];
+        const VkDeviceSize alignment = std::max< VkDeviceSize >(requirements.alignment, 1);
+
+        // Take the first free range of an existing block the resource fits into.
+        for (auto& block : pool) {
+            for (auto range = block->freeRanges.begin(); range != block->freeRanges.end(); ++range) {
+                const VkDeviceSize alignedOffset = (range->first + alignment - 1) / alignment * alignment;
+                if (alignedOffset + requirements.size <= range->first + range->second) {
+                    return takeRange(*block, poolIndex, range, alignedOffset, requirements.size);
+                }
+            }
+        }
+
+        // There is no free space, so allocate a new block.
+        if (getStatistics().blockCount >= maxAllocationCount) {
+            std::cerr << "Too many memory allocations!" << std::endl;
+            abort();
+        }
+        auto block = std::make_unique< MemoryBlock >();
+        block->size = std::max(MEMORY_ARENA_BLOCK_SIZE, requirements.size);
+        VkMemoryAllocateInfo vkAllocInfo{};
+        vkAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+        vkAllocInfo.allocationSize = block->size;
+        vkAllocInfo.memoryTypeIndex = memoryTypeIndex;
+        VkMemoryAllocateFlagsInfo vkAllocFlagsInfo{};
+        vkAllocFlagsInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+        vkAllocFlagsInfo.flags = allocateFlags;
+        if (allocateFlags != 0) {
+            vkAllocInfo.pNext = &vkAllocFlagsInfo;
+        }
+        if (vkAllocateMemory(device, &vkAllocInfo, nullptr, &block->memory) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate a memory block!" << std::endl;
+            abort();
+        }
+        // Keep host-visible memory mapped for the whole lifetime of the block.
+        if (memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) {
+            void* data;
+            if (vkMapMemory(device, block->memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+                std::cerr << "Failed to map a memory block!" << std::endl;
+                abort();
+            }
+            block->mappedData = static_cast< uint8_t* >(data);
+        }
+        block->freeRanges[0] = block->size;
+        pool.push_back(std::move(block));
+        auto& newBlock = *pool.back();
+        return takeRange(newBlock, poolIndex, newBlock.freeRanges.begin(), 0, requirements.size);
+    }
+
+    /**
+     * Return memory of a destroyed resource to the arena.
+     * The resource should not be used by the GPU anymore.
+     * @param allocation Allocation returned by allocate().
+     */
+    void free(MemoryAllocation& allocation)
+    {
+        MemoryBlock& block = *allocation.block;
+
+        // Return the range and merge it with adjacent free ranges.
+        auto range = block.freeRanges.emplace(allocation.rangeOffset, allocation.rangeSize).first;
+        auto next = std::next(range);
+        if (next != block.freeRanges.end() && range->first + range->second == next->first) {
+            range->second += next->second;
+            block.freeRanges.erase(next);
+        }
+        if (range != block.freeRanges.begin()) {
+            auto prev = std::prev(range);
+            if (prev->first + prev->second == range->first) {
+                prev->second += range->second;
+                block.freeRanges.erase(range);
+            }
+        }
+        block.usedBytes -= allocation.rangeSize;
+        block.allocationCount--;
+
+        // Give empty blocks back to the driver, but keep the last one of the pool for future allocations.
+        auto& pool = pools[allocation.poolIndex];
+        if (block.allocationCount == 0 && pool.size() > 1) {
+            if (block.mappedData != nullptr) {
+                vkUnmapMemory(device, block.memory);
+            }
+            vkFreeMemory(device, block.memory, nullptr);
+            for (auto it = pool.begin(); it != pool.end(); ++it) {
+                if (it->get() == &block) {
+                    pool.erase(it);
+                    break;
+                }
+            }
+        }
+        allocation = MemoryAllocation{};
+    }
+
+    /**
+     * Collect memory usage statistics of all pools.
+     * @return Statistics.
+     */
+    MemoryArenaStatistics getStatistics() const
+    {
+        MemoryArenaStatistics stats;
+        VkDeviceSize freeBytes = 0;
+        for (const auto& pool : pools) {
+            for (const auto& block : pool) {
+                stats.blockCount++;
+                stats.allocationCount += block->allocationCount;
+                stats.reservedBytes += block->size;
+                stats.usedBytes += block->usedBytes;
+                for (const auto& range : block->freeRanges) {
+                    stats.freeRangeCount++;
+                    stats.largestFreeRange = std::max(stats.largestFreeRange, range.second);
+                    freeBytes += range.second;
+                }
+            }
+        }
+        if (freeBytes > 0) {
+            stats.fragmentation = 1.0f - static_cast< float >(stats.largestFreeRange) / freeBytes;
+        }
+        return stats;
+    }
+
+    /**
+     * Print memory usage statistics to stdout.
+     */
+    void printStatistics() const
+    {
+        const MemoryArenaStatistics stats = getStatistics();
+        std::cout << "Memory arena: " << stats.allocationCount << " allocations in " << stats.blockCount << " blocks, "
+                  << stats.usedBytes / 1024 << " KB in use of " << stats.reservedBytes / 1024 << " KB reserved, "
+                  << stats.freeRangeCount << " free ranges, fragmentation " << stats.fragmentation * 100.0f << "%" << std::endl;
+    }
+
+    /**
+     * Free all memory blocks. All resources should be destroyed before.
+     */
+    void destroy()
+    {
+        for (auto& pool : pools) {
+            for (auto& block : pool) {
+                if (block->mappedData != nullptr) {
+                    vkUnmapMemory(device, block->memory);
+                }
+                vkFreeMemory(device, block->memory, nullptr);
+            }
+            pool.clear();
+        }
+    }
+
+private:
+
+    /**
+     * Reserve a part of a free range for an allocation.
+     * @param block Block that contains the range.
+     * @param poolIndex Index of the pool the block belongs to.
+     * @param range Free range to take the memory from.
+     * @param alignedOffset Offset of the allocation inside the range aligned as required.
+     * @param size Size of the allocation.
+     * @return Allocation.
+     */
+    MemoryAllocation takeRange(MemoryBlock& block, uint32_t poolIndex, std::map< VkDeviceSize, VkDeviceSize >::iterator range, VkDeviceSize alignedOffset, VkDeviceSize size)
+    {
+        // The alignment padding in front of the allocation stays a part of it,
+        // so we do not produce tiny free ranges that can never be used.
+        MemoryAllocation allocation;
+        allocation.memory = block.memory;
+        allocation.offset = alignedOffset;
+        allocation.size = size;
+        allocation.mappedData = (block.mappedData != nullptr) ? block.mappedData + alignedOffset : nullptr;
+        allocation.block = &block;
+        allocation.poolIndex = poolIndex;
+        allocation.rangeOffset = range->first;
+        allocation.rangeSize = alignedOffset + size - range->first;
+
+        // Return the tail of the range back to the free list.
+        const VkDeviceSize rangeEnd = range->first + range->second;
+        block.freeRanges.erase(range);
+        if (alignedOffset + size < rangeEnd) {
+            block.freeRanges[alignedOffset + size] = rangeEnd - (alignedOffset + size);
+        }
+        block.usedBytes += allocation.rangeSize;
+        block.allocationCount++;
+        return allocation;
+    }
+};
+
+/**
+ * Maximal size of the scratch pool used to build BLASes in one batch.
+ * If the batch needs more scratch memory, it is split into several groups
+ * separated by barriers, so the groups reuse the same pool.
+ */
+constexpr VkDeviceSize BLAS_SCRATCH_POOL_BUDGET = 32 * 1024 * 1024;
+
+/**
+ * Acceleration structure created by one of the ray tracing backends.
+ * VK_NV_ray_tracing binds memory to acceleration structures directly,
+ * while VK_KHR_acceleration_structure places them into buffers.
+ */
+struct AccelerationStructure
+{
+    /**
+     * Handle of the NV backend.
+     */
+    VkAccelerationStructureNV nv = VK_NULL_HANDLE;
+    /**
+     * Handle of the KHR backend.
+     */
+    VkAccelerationStructureKHR khr = VK_NULL_HANDLE;
+    /**
+     * Buffer the acceleration structure is placed in, only used by the KHR backend.
+     */
+    VkBuffer buffer = VK_NULL_HANDLE;
+    /**
+     * Memory of the acceleration structure or its buffer.
+     */
+    MemoryAllocation memory;
+    /**
+     * Value TLAS instances use to refer to a BLAS: a handle for NV, a device address for KHR.
+     */
+    uint64_t reference = 0;
+    /**
+     * Size of the scratch memory needed to build the acceleration structure.
+     */
+    VkDeviceSize buildScratchSize = 0;
+    /**
+     * Size of the scratch memory needed to update the acceleration structure.
+     */
+    VkDeviceSize updateScratchSize = 0;
+    /**
+     * Alignment of the scratch memory offset.
+     */
+    VkDeviceSize scratchAlignment = 1;
+};
+
+/**
+ * Geometry and acceleration structure of one mesh.
+ */
+struct Mesh
+{
+    /**
+     * Amount of vertices in the vertex buffer.
+     */
+    uint32_t vertexCount;
+    /**
+     * Amount of indices in the index buffer.
+     */
+    uint32_t indexCount;
+    /**
+     * Type of indices in the index buffer.
+     */
+    VkIndexType indexType;
+    /**
+     * Device-local buffer of vertex positions.
+     */
+    VkBuffer vertexBuffer;
+    /**
+     * Memory of the vertex buffer.
+     */
+    MemoryAllocation vertexBufferMemory;
+    /**
+     * Device-local buffer of indices.
+     */
+    VkBuffer indexBuffer;
+    /**
+     * Memory of the index buffer.
+     */
+    MemoryAllocation indexBufferMemory;
+    /**
+     * Device-local buffer of vertex attributes, null if the mesh file has none.
+     */
+    VkBuffer attributeBuffer;
+    /**
+     * Memory of the attribute buffer.
+     */
+    MemoryAllocation attributeBufferMemory;
+    /**
+     * Geometry description the BLAS is built from by the NV backend.
+     */
+    VkGeometryNV geometry;
+    /**
+     * Geometry description the BLAS is built from by the KHR backend.
+     */
+    VkAccelerationStructureGeometryKHR geometryKhr;
+    /**
+     * Bottom level acceleration structure of the mesh.
+     */
+    AccelerationStructure blas;
+    /**
+     * Offset of the BLAS build scratch memory inside the scratch pool.
+     */
+    VkDeviceSize scratchOffset;
+};
+
+/**
+ * Description of a mesh for closest hit shaders, which fetch mesh data by themselves.
+ * The layout matches the std430 mesh info block of main.rchit.
+ */
+struct MeshShaderInfo
+{
+    /**
+     * Size of one index in bytes, 2 or 4.
+     */
+    uint32_t indexSize;
+    /**
+     * Whether the mesh has vertex attributes. Shaders use face normals otherwise.
+     */
+    uint32_t hasAttributes;
+};
+
+/**
+ * Maximal amount of worker threads recording command buffers.
+ */
+constexpr uint32_t MAX_RECORDING_THREADS = 4;
+
+/**
+ * Maximal amount of GPUs of a device group tracing one frame together.
+ */
+constexpr uint32_t MAX_DEVICE_GROUP_SIZE = 4;
+
+/**
+ * Weight of the latest measurement in the running average of the time
+ * a GPU of a device group needs to trace one row of its band.
+ */
+constexpr double DEVICE_BAND_COST_SMOOTHING = 0.1;
+
+/**
+ * Minimal change of a band in rows that makes GPUs of a device group take new bands,
+ * so bands do not move every frame by a few rows.
+ */
+constexpr uint32_t DEVICE_BAND_MIN_ROW_CHANGE = 8;
+
+/**
+ * Minimal share of the frame every GPU of a device group keeps tracing,
+ * so its time is still measured after a slow frame.
+ */
+constexpr double DEVICE_BAND_MIN_SHARE = 0.05;
+
+/**
+ * Simple job system executing jobs on a fixed set of worker threads.
+ * Each job gets the index of the worker running it, so jobs can use
+ * per-thread resources such as command pools without any locking.
+ */
+struct JobSystem
+{
+    /**
+     * Job to execute. The argument is the index of the worker thread.
+     */
+    using Job = std::function< void(uint32_t) >;
+
+    /**
+     * Worker threads.
+     */
+    std::vector< std::thread > workers;
+    /**
+     * Jobs waiting for a free worker.
+     */
+    std::deque< Job > jobs;
+    /**
+     * Amount of submitted jobs that are not finished yet.
+     */
+    size_t pendingJobCount = 0;
+    /**
+     * Set when workers should exit.
+     */
+    bool stopping = false;
+    /**
+     * Protects the job queue and the counters.
+     */
+    std::mutex mutex;
+    /**
+     * Wakes up workers when a job is submitted.
+     */
+    std::condition_variable jobSubmitted;
+    /**
+     * Wakes up wait() when all jobs are finished.
+     */
+    std::condition_variable jobsFinished;
+
+    /**
+     * Start worker threads.
+     * @param workerCount Amount of worker threads.
+     */
+    void start(uint32_t workerCount)
+    {
+        for (uint32_t i = 0; i < workerCount; i++) {
+            workers.emplace_back([this, i]() { run(i); });
+        }
+    }
+
+    /**
+     * Put a job into the queue. It is executed by the first free worker.
+     * @param job Job to execute.
+     */
+    void submit(Job job)
+    {
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            jobs.push_back(std::move(job));
+            pendingJobCount++;
+        }
+        jobSubmitted.notify_one();
+    }
+
+    /**
+     * Block the calling thread until all submitted jobs are finished.
+     */
+    void wait()
+    {
+        std::unique_lock< std::mutex > lock(mutex);
+        jobsFinished.wait(lock, [this]() { return pendingJobCount == 0; });
+    }
+
+    /**
+     * Finish remaining jobs and join all worker threads.
+     */
+    void stop()
+    {
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            stopping = true;
+        }
+        jobSubmitted.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        workers.clear();
+    }
+
+private:
+
+    /**
+     * Main function of a worker thread.
+     * @param workerIndex Index of the worker.
+     */
+    void run(uint32_t workerIndex)
+    {
+        while (true) {
+            // Take the next job or exit if there are no more jobs and we are stopping.
+            Job job;
+            {
+                std::unique_lock< std::mutex > lock(mutex);
+                jobSubmitted.wait(lock, [this]() { return stopping || !jobs.empty(); });
+                if (jobs.empty()) {
+                    return;
+                }
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+
+            job(workerIndex);
+
+            // Notify waiting threads if this was the last job.
+            std::lock_guard< std::mutex > lock(mutex);
+            if (--pendingJobCount == 0) {
+                jobsFinished.notify_all();
+            }
+        }
+    }
+};
+
+/**
+ * Frame read back into host memory.
+ * Pixels are tightly packed rows of the display image, 4 bytes per pixel.
+ */
+struct ReadbackFrame
+{
+    /**
+     * Readback buffer holding the frame, which is the index of the frame in flight.
+     */
+    size_t slot;
+    /**
+     * Number of the frame since the start.
+     */
+    uint64_t frameIndex;
+    /**
+     * Size of the image in pixels.
+     */
+    uint32_t width;
+    uint32_t height;
+    /**
+     * Pixels in the mapped memory of the readback buffer.
+     */
+    const uint8_t* pixels;
+};
+
+/**
+ * Encoder thread consuming frames read back from the GPU.
+ * Readback buffers form a ring with one buffer per frame in flight. Once the fence of a frame
+ * is signaled its buffer is pushed to the encoder, which reads pixels right from mapped memory
+ * and releases the buffer when it is done. The GPU does not write a buffer again until it is released,
+ * so the encoder never copies frames and the GPU keeps tracing next frames meanwhile.
+ */
+struct ReadbackEncoder
+{
+    /**
+     * Function called on the encoder thread for every frame.
+     * Pixels are valid only until it returns.
+     */
+    using Consumer = std::function< void(const ReadbackFrame&) >;
+
+    /**
+     * Encoder thread.
+     */
+    std::thread thread;
+    /**
+     * Consumer of frames.
+     */
+    Consumer consumer;
+    /**
+     * Frames waiting for the encoder.
+     */
+    std::deque< ReadbackFrame > frames;
+    /**
+     * Buffers pushed to the encoder and not released yet.
+     */
+    std::array< bool, MAX_FRAMES_IN_FLIGHT > busy{};
+    /**
+     * Set when the thread should exit.
+     */
+    bool stopping = false;
+    /**
+     * Protects the queue and the flags.
+     */
+    std::mutex mutex;
+    /**
+     * Wakes up the encoder when a frame is pushed.
+     */
+    std::condition_variable framePushed;
+    /**
+     * Wakes up threads waiting for buffers to be released.
+     */
+    std::condition_variable frameReleased;
+
+    /**
+     * Start the encoder thread.
+     * @param frameConsumer Function called for every frame.
+     */
+    void start(Consumer frameConsumer)
+    {
+        consumer = std::move(frameConsumer);
+        thread = std::thread([this]() { run(); });
+    }
+
+    /**
+     * Hand a frame over to the encoder. Its buffer stays busy until the encoder releases it.
+     * @param frame Frame whose readback copy is finished.
+     */
+    void push(const ReadbackFrame& frame)
+    {
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            busy[frame.slot] = true;
+            frames.push_back(frame);
+        }
+        framePushed.notify_one();
+    }
+
+    /**
+     * Block the calling thread until the encoder releases the buffer.
+     * @param slot Index of the buffer.
+     */
+    void waitForSlot(size_t slot)
+    {
+        std::unique_lock< std::mutex > lock(mutex);
+        frameReleased.wait(lock, [this, slot]() { return !busy[slot]; });
+    }
+
+    /**
+     * Block the calling thread until all pushed frames are consumed.
+     */
+    void waitIdle()
+    {
+        std::unique_lock< std::mutex > lock(mutex);
+        frameReleased.wait(lock, [this]() { return std::none_of(busy.begin(), busy.end(), [](bool b) { return b; }); });
+    }
+
+    /**
+     * Consume remaining frames and join the encoder thread.
+     */
+    void stop()
+    {
+        if (!thread.joinable()) {
+            return;
+        }
+        {
+            std::lock_guard< std::mutex > lock(mutex);
+            stopping = true;
+        }
+        framePushed.notify_all();
+        thread.join();
+    }
+
+private:
+
+    /**
+     * Main function of the encoder thread.
+     */
+    void run()
+    {
+        while (true) {
+            // Take the next frame or exit if there are no more frames and we are stopping.
+            ReadbackFrame frame;
+            {
+                std::unique_lock< std::mutex > lock(mutex);
+                framePushed.wait(lock, [this]() { return stopping || !frames.empty(); });
+                if (frames.empty()) {
+                    return;
+                }
+                frame = frames.front();
+                frames.pop_front();
+            }
+
+            consumer(frame);
+
+            // Give the buffer back to the GPU.
+            {
+                std::lock_guard< std::mutex > lock(mutex);
+                busy[frame.slot] = false;
+            }
+            frameReleased.notify_all();
+        }
+    }
+};
+
+/**
+ * Shading model coloring the surface by barycentric coordinates of the hit, tinted by the base color.
+ */
+constexpr uint32_t MATERIAL_MODEL_GRADIENT = 0;
+/**
+ * Shading model of a solid base color darkened with the hit distance.
+ */
+constexpr uint32_t MATERIAL_MODEL_SOLID = 1;
+/**
+ * Shading model drawing triangle edges over the base color.
+ */
+constexpr uint32_t MATERIAL_MODEL_WIREFRAME = 2;
+/**
+ * Amount of shading models. Each model has its own hit group with the closest hit
+ * shader specialized for it, so shaders do not branch on the material type.
+ */
+constexpr uint32_t NUM_MATERIAL_MODELS = 3;
+
+/**
+ * Material parameters stored inline after the handle of a hit record in the shader binding table.
+ * The layout matches the std430 shader record block of main.rchit.
+ */
+struct MaterialRecord
+{
+    /**
+     * Base color of the surface.
+     */
+    glm::vec4 baseColor;
+    /**
+     * Color of triangle edges, used by the wireframe model.
+     */
+    glm::vec4 edgeColor;
+    /**
+     * Width of triangle edges in barycentric units, used by the wireframe model.
+     */
+    float edgeWidth;
+};
 
 /**
- * Window width.
+ * Material of an instance: the hit group of its shading model and the data of its hit record.
  */
-constexpr int WINDOW_WIDTH = 800;
+struct Material
+{
+    /**
+     * Shading model, one of MATERIAL_MODEL_* constants.
+     */
+    uint32_t model;
+    /**
+     * Parameters of the material.
+     */
+    MaterialRecord record;
+};
+
 /**
- * Window height.
+ * Materials of the scene. Instances use them one by one.
+ * Several materials may share a shading model, they differ only by the record data.
  */
-constexpr int WINDOW_HEIGHT = 800;
+const std::array< Material, 4 > MATERIALS = {{
+    { MATERIAL_MODEL_GRADIENT, { glm::vec4(1.0f), glm::vec4(0.0f), 0.0f } },
+    { MATERIAL_MODEL_SOLID, { glm::vec4(0.9f, 0.5f, 0.2f, 1.0f), glm::vec4(0.0f), 0.0f } },
+    { MATERIAL_MODEL_WIREFRAME, { glm::vec4(0.1f, 0.1f, 0.1f, 1.0f), glm::vec4(0.2f, 0.8f, 1.0f, 1.0f), 0.03f } },
+    { MATERIAL_MODEL_GRADIENT, { glm::vec4(0.6f, 0.8f, 1.0f, 1.0f), glm::vec4(0.0f), 0.0f } }
+}};
+
 /**
- * Application name.
+ * Rectangle of the image traced by one vkCmdTraceRaysNV() call.
  */
-constexpr const char* APPLICATION_NAME = "VKExampleRTX";
+struct TraceTile
+{
+    /**
+     * Position of the top left pixel of the tile.
+     */
+    VkOffset2D offset;
+    /**
+     * Size of the tile, smaller than the tile size at the right and bottom edges.
+     */
+    VkExtent2D extent;
+    /**
+     * Morton code of the tile position in the grid of tiles.
+     */
+    uint32_t mortonCode;
+    /**
+     * Index of the GPU of the device group tracing the tile, it is always 0 for a single GPU.
+     */
+    uint32_t deviceIndex;
+};
+
 /**
- * Maximal amount of frames processed at the same time.
+ * Interleave bits of two coordinates into a Morton code.
+ * Sorting by the code walks over the grid along the Z-order curve,
+ * so consecutive elements stay close to each other.
+ * @param x Horizontal coordinate.
+ * @param y Vertical coordinate.
+ * @return Morton code of the point.
  */
-constexpr int MAX_FRAMES_IN_FLIGHT = 5;
+uint32_t mortonCode(uint16_t x, uint16_t y)
+{
+    // Spread bits of a 16 bit value so there is a zero bit between each two of them.
+    auto spreadBits = [](uint32_t v) {
+        v = (v | (v << 8)) & 0x00FF00FF;
+        v = (v | (v << 4)) & 0x0F0F0F0F;
+        v = (v | (v << 2)) & 0x33333333;
+        v = (v | (v << 1)) & 0x55555555;
+        return v;
+    };
+    return spreadBits(x) | (spreadBits(y) << 1);
+}
 
 /**
  * Callback function that will be called each time a validation level produces a message.
@@ -100,25 +1606,275 @@ VKAPI_ATTR VkBool32 VKAPI_CALL messageCallback
 
 /**
  * Main function.
+ * @param argc Amount of command line arguments.
+ * @param argv Command line arguments.
  * @return Return code of the application.
  */
-int main()
+int main(int argc, char** argv)
 {
+    // ==========================================================================
+    //                 STEP 0: Parse command line arguments
+    // ==========================================================================
+    // The application can be configured via command line. All options are
+    // optional and have reasonable defaults.
+    //   --mesh <file>   Load a binary mesh file (see MeshFileHeader) instead
+    //                   of the built-in cube. May be given several times.
+    //   --instances <N> Amount of animated mesh instances in the TLAS.
+    //   --compact-blas  Compact BLASes after the build to save memory.
+    //   --profile-csv <file> Write GPU timings of each frame into a CSV file.
+    //   --headless      Render offscreen without a window and a swap chain.
+    //   --frames <N>    Amount of measured frames in headless mode.
+    //   --width <W>     Width of the rendered image.
+    //   --height <H>    Height of the rendered image.
+    //   --dynamic-resolution <ms> Lower the internal resolution when frames take
+    //                   longer than the given budget in milliseconds.
+    //   --present-mode <immediate|mailbox|fifo> Present mode of the swap chain.
+    //   --frames-in-flight <N> Amount of frames the CPU may prepare ahead of the GPU.
+    //   --low-latency   Sample input only after the previous frame is finished.
+    //   --accumulate    Accumulate jittered samples while the camera does not move.
+    //   --samples <K>   Amount of samples traced per pixel by one shader invocation.
+    //   --tile-size <N> Trace the image in tiles of NxN pixels, one trace call per tile.
+    //   --tiles-per-submit <M> Split tiles of a frame into several queue submissions.
+    //   --ray-tracing-backend <auto|nv|khr> Ray tracing extensions to use.
+    //   --denoise       Denoise the traced image with temporal and a-trous compute passes.
+    //   --readback <file> Read every frame back into host memory and write raw pixels into a file.
+    //   --multi-gpu     Trace bands of the frame on all GPUs of a device group.
+    // ==========================================================================
+
+    // Moment the application started, used to measure the time to the first frame.
+    const auto applicationStartTime = std::chrono::steady_clock::now();
+    // Paths to mesh files. No files means the built-in cube.
+    std::vector< std::string > meshFilePaths;
+    // Asset archive shaders and meshes are loaded from. Empty means loose files only.
+    std::string assetArchivePath;
+    // Asset archive to pack shaders and meshes into, the application exits after that.
+    std::string packAssetArchivePath;
+    // Amount of instances placed into the TLAS.
+    uint32_t instanceCount = DEFAULT_INSTANCE_COUNT;
+    // Whether BLASes should be compacted after the build.
+    bool compactBlas = false;
+    // Path to a CSV file for profiler output. Empty string means no CSV output.
+    std::string profileCsvPath;
+    // Whether the application renders offscreen for a fixed amount of frames.
+    bool headless = false;
+    // Amount of frames measured in headless mode.
+    uint32_t benchmarkFrameCount = DEFAULT_BENCHMARK_FRAME_COUNT;
+    // Resolution of the window or the offscreen image.
+    uint32_t renderWidth = WINDOW_WIDTH;
+    uint32_t renderHeight = WINDOW_HEIGHT;
+    // Frame time budget for dynamic resolution. Zero means the resolution is fixed.
+    double frameTimeBudgetMs = 0.0;
+    // Present mode requested in the command line. Mailbox is preferable by default.
+    VkPresentModeKHR requestedPresentMode = VK_PRESENT_MODE_MAILBOX_KHR;
+    bool presentModeRequested = false;
+    // Amount of frames in flight actually used, may be lower than MAX_FRAMES_IN_FLIGHT.
+    uint32_t framesInFlight = MAX_FRAMES_IN_FLIGHT;
+    // Whether input is sampled only after the GPU finishes the previous frame.
+    bool lowLatency = false;
+    // Whether samples of consecutive frames are accumulated while the camera is static.
+    bool accumulate = false;
+    // Amount of samples per pixel, baked into the ray generation shader at pipeline creation.
+    uint32_t samplesPerPixel = 1;
+    // Edge length of trace tiles in pixels. Zero means the image is traced as one tile.
+    uint32_t traceTileSize = 0;
+    // Amount of tiles per queue submission. Zero means all tiles of a frame are submitted together.
+    uint32_t tilesPerSubmit = 0;
+    // Ray tracing backends the device may be selected for. Both are allowed by default.
+    bool allowNvRayTracing = true;
+    bool allowKhrRayTracing = true;
+    // Whether the traced image is denoised by compute passes before it is presented.
+    bool denoise = false;
+    // Whether ray tracing shaders are recompiled and the pipeline is recreated when their sources change.
+    bool hotReload = false;
+    // File frames read back from the GPU are written into. Empty string means no readback.
+    std::string readbackPath;
+    // Whether bands of the frame are traced on all GPUs of the device group of the selected GPU.
+    bool multiGpu = false;
+
+    // Parse a non-negative integer value of the command line option at argv[i] and skip the value.
+    // Anything but decimal digits or a value that does not fit into 32 bits is rejected.
+    auto parseUnsigned = [&](int& i) {
+        const char* option = argv[i];
+        const char* text = argv[++i];
+        char* end = nullptr;
+        const unsigned long long value = std::strtoull(text, &end, 10);
+        if (text[0] < '0' || text[0] > '9' || *end != '\0' || value > UINT32_MAX) {
+            std::cerr << "Invalid value of " << option << ": " << text << std::endl;
+            abort();
+        }
+        return static_cast< uint32_t >(value);
+    };
+
+    // Parse a finite floating point value of the command line option at argv[i] and skip the value.
+    auto parseDouble = [&](int& i) {
+        const char* option = argv[i];
+        const char* text = argv[++i];
+        char* end = nullptr;
+        const double value = std::strtod(text, &end);
+        if (end == text || *end != '\0' || !std::isfinite(value)) {
+            std::cerr << "Invalid value of " << option << ": " << text << std::endl;
+            abort();
+        }
+        return value;
+    };
+
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--mesh") == 0 && i + 1 < argc) {
+            meshFilePaths.push_back(argv[++i]);
+        } else if (std::strcmp(argv[i], "--assets") == 0 && i + 1 < argc) {
+            assetArchivePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--pack-assets") == 0 && i + 1 < argc) {
+            packAssetArchivePath = argv[++i];
+        } else if (std::strcmp(argv[i], "--compact-blas") == 0) {
+            compactBlas = true;
+        } else if (std::strcmp(argv[i], "--profile-csv") == 0 && i + 1 < argc) {
+            profileCsvPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--headless") == 0) {
+            headless = true;
+        } else if (std::strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+            benchmarkFrameCount = parseUnsigned(i);
+            if (benchmarkFrameCount == 0) {
+                std::cerr << "Amount of frames should be positive!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--width") == 0 && i + 1 < argc) {
+            renderWidth = parseUnsigned(i);
+            if (renderWidth == 0 || renderWidth > MAX_RENDER_EXTENT) {
+                std::cerr << "Width should be between 1 and " << MAX_RENDER_EXTENT << "!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--height") == 0 && i + 1 < argc) {
+            renderHeight = parseUnsigned(i);
+            if (renderHeight == 0 || renderHeight > MAX_RENDER_EXTENT) {
+                std::cerr << "Height should be between 1 and " << MAX_RENDER_EXTENT << "!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--dynamic-resolution") == 0 && i + 1 < argc) {
+            frameTimeBudgetMs = parseDouble(i);
+            if (frameTimeBudgetMs <= 0.0) {
+                std::cerr << "Frame time budget should be positive!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--present-mode") == 0 && i + 1 < argc) {
+            const std::map< std::string, VkPresentModeKHR > presentModes = {
+                { "immediate", VK_PRESENT_MODE_IMMEDIATE_KHR },
+                { "mailbox", VK_PRESENT_MODE_MAILBOX_KHR },
+                { "fifo", VK_PRESENT_MODE_FIFO_KHR }
+            };
+            const auto mode = presentModes.find(argv[++i]);
+            if (mode == presentModes.end()) {
+                std::cerr << "Unknown present mode: " << argv[i] << std::endl;
+                abort();
+            }
+            requestedPresentMode = mode->second;
+            presentModeRequested = true;
+        } else if (std::strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc) {
+            framesInFlight = parseUnsigned(i);
+            if (framesInFlight == 0 || framesInFlight > MAX_FRAMES_IN_FLIGHT) {
+                std::cerr << "Amount of frames in flight should be between 1 and " << MAX_FRAMES_IN_FLIGHT << "!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--low-latency") == 0) {
+            lowLatency = true;
+        } else if (std::strcmp(argv[i], "--accumulate") == 0) {
+            accumulate = true;
+        } else if (std::strcmp(argv[i], "--denoise") == 0) {
+            denoise = true;
+        } else if (std::strcmp(argv[i], "--hot-reload") == 0) {
+            hotReload = true;
+        } else if (std::strcmp(argv[i], "--readback") == 0 && i + 1 < argc) {
+            readbackPath = argv[++i];
+        } else if (std::strcmp(argv[i], "--multi-gpu") == 0) {
+            multiGpu = true;
+        } else if (std::strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samplesPerPixel = parseUnsigned(i);
+            if (samplesPerPixel == 0 || samplesPerPixel > MAX_SAMPLES_PER_PIXEL) {
+                std::cerr << "Amount of samples should be between 1 and " << MAX_SAMPLES_PER_PIXEL << "!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--tile-size") == 0 && i + 1 < argc) {
+            traceTileSize = parseUnsigned(i);
+            if (traceTileSize > MAX_RENDER_EXTENT) {
+                std::cerr << "Tile size should not exceed " << MAX_RENDER_EXTENT << "!" << std::endl;
+                abort();
+            }
+        } else if (std::strcmp(argv[i], "--tiles-per-submit") == 0 && i + 1 < argc) {
+            tilesPerSubmit = parseUnsigned(i);
+        } else if (std::strcmp(argv[i], "--ray-tracing-backend") == 0 && i + 1 < argc) {
+            const std::string backend = argv[++i];
+            if (backend != "auto" && backend != "nv" && backend != "khr") {
+                std::cerr << "Unknown ray tracing backend: " << backend << std::endl;
+                abort();
+            }
+            allowNvRayTracing = backend != "khr";
+            allowKhrRayTracing = backend != "nv";
+        } else if (std::strcmp(argv[i], "--instances") == 0 && i + 1 < argc) {
+            instanceCount = parseUnsigned(i);
+            if (instanceCount == 0) {
+                std::cerr << "Amount of instances should be positive!" << std::endl;
+                abort();
+            }
+        } else {
+            std::cerr << "Unknown command line argument: " << argv[i] << std::endl;
+            abort();
+        }
+    }
+    // Both modes reuse samples of previous frames, the denoiser replaces accumulation for moving cameras.
+    if (denoise && accumulate) {
+        std::cerr << "Denoising cannot be combined with accumulation!" << std::endl;
+        abort();
+    }
+    // The denoiser reads G-buffers of neighbour pixels, which other GPUs may have traced,
+    // and compaction reads sizes from queries written by every GPU of the group.
+    if (multiGpu && (denoise || compactBlas)) {
+        std::cerr << "Multi-GPU tracing cannot be combined with denoising and BLAS compaction!" << std::endl;
+        abort();
+    }
+
+    // Pack shader binaries of both backends and the given meshes into an asset archive.
+    // This is a build step, so nothing else is done.
+    if (!packAssetArchivePath.empty()) {
+        std::vector< std::string > assetNames;
+        for (const char* shaderName : { "main.rgen", "main.rmiss", "shadow.rmiss", "main.rchit", "denoise.comp", "tonemap.comp" }) {
+            for (const char* suffix : { ".spv", ".khr.spv" }) {
+                assetNames.push_back(std::string(shaderName) + suffix);
+            }
+        }
+        // A mesh given several times is packed once, archives with repeated names are rejected.
+        for (const std::string& meshFilePath : meshFilePaths) {
+            if (std::find(assetNames.begin(), assetNames.end(), meshFilePath) == assetNames.end()) {
+                assetNames.push_back(meshFilePath);
+            }
+        }
+        if (!writeAssetArchive(packAssetArchivePath, assetNames)) {
+            std::cerr << "Failed to write the asset archive!" << std::endl;
+            abort();
+        }
+        std::cout << "Packed " << assetNames.size() << " assets into " << packAssetArchivePath << std::endl;
+        return 0;
+    }
+
     // ==========================================================================
     //                 STEP 1: Create a Window using GLFW
     // ==========================================================================
     // GLFW abstracts native calls to create a window and allows us to write
     // cross-platform applications.
+    // Headless mode does not touch GLFW at all, so it runs on machines
+    // without a display.
     // ==========================================================================
 
-    // Initialize GLFW context.
-    glfwInit();
-    // Do not create an OpenGL context - we use Vulkan.
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    // Make the window not resizable.
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    // Create a window instance.
-    GLFWwindow* glfwWindow = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, APPLICATION_NAME, nullptr, nullptr);
+    GLFWwindow* glfwWindow = nullptr;
+    if (!headless) {
+        // Initialize GLFW context.
+        glfwInit();
+        // Do not create an OpenGL context - we use Vulkan.
+        glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+        // Make the window resizable, the swap chain is recreated when its size changes.
+        // Frame readback writes raw frames of one size, so the window keeps its size then.
+        glfwWindowHint(GLFW_RESIZABLE, readbackPath.empty() ? GLFW_TRUE : GLFW_FALSE);
+        // Create a window instance.
+        glfwWindow = glfwCreateWindow(renderWidth, renderHeight, APPLICATION_NAME, nullptr, nullptr);
+    }
 
     // ==========================================================================
     //                   STEP 2: Select Vulkan extensions
@@ -130,9 +1886,12 @@ int main()
     // ==========================================================================
 
     // Take a minimal set of Vulkan extensions required by GLWF.
+    // Headless mode does not present images, so it needs no surface extensions.
     uint32_t glfwExtensionCount = 0;
-    const char** glfwExtensions;
-    glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    const char** glfwExtensions = nullptr;
+    if (!headless) {
+        glfwExtensions = glfwGetRequiredInstanceExtensions(&glfwExtensionCount);
+    }
 
     // Fetch list of available Vulkan extensions.
     uint32_t vkNumAvailableExtensions = 0;
@@ -231,8 +1990,28 @@ int main()
     // Information about your 3D engine (if applicable).
     vkAppInfo.pEngineName = APPLICATION_NAME;
     vkAppInfo.engineVersion = VK_MAKE_VERSION(1, 0, 0);
-    // Use v1.0 that is likely supported by the most of drivers.
-    vkAppInfo.apiVersion = VK_API_VERSION_1_0;
+    // Use v1.2 if the loader supports it, buffer device addresses and SPIR-V 1.4 needed by
+    // the KHR ray tracing backend are core there. Older loaders do not even have
+    // vkEnumerateInstanceVersion() and reject instances of higher versions,
+    // so a lower version is requested and only the NV backend is left.
+    uint32_t vkInstanceVersion = VK_API_VERSION_1_0;
+    const auto vkEnumerateInstanceVersionFunc = reinterpret_cast< PFN_vkEnumerateInstanceVersion >(vkGetInstanceProcAddr(nullptr, "vkEnumerateInstanceVersion"));
+    if (vkEnumerateInstanceVersionFunc != nullptr && vkEnumerateInstanceVersionFunc(&vkInstanceVersion) != VK_SUCCESS) {
+        vkInstanceVersion = VK_API_VERSION_1_0;
+    }
+    vkAppInfo.apiVersion = std::min< uint32_t >(VK_API_VERSION_1_2, VK_MAKE_VERSION(VK_VERSION_MAJOR(vkInstanceVersion), VK_VERSION_MINOR(vkInstanceVersion), 0));
+    if (vkAppInfo.apiVersion < VK_API_VERSION_1_2) {
+        if (!allowNvRayTracing) {
+            std::cerr << "The KHR ray tracing backend needs Vulkan 1.2, the loader supports only " << VK_VERSION_MAJOR(vkInstanceVersion) << "." << VK_VERSION_MINOR(vkInstanceVersion) << "!" << std::endl;
+            abort();
+        }
+        allowKhrRayTracing = false;
+    }
+    // Device groups are core since v1.1.
+    if (multiGpu && vkAppInfo.apiVersion < VK_API_VERSION_1_1) {
+        std::cerr << "Multi-GPU tracing needs Vulkan 1.1!" << std::endl;
+        abort();
+    }
 
     // Fill in an instance create structure.
     VkInstanceCreateInfo vkCreateInfo {};
@@ -276,8 +2055,9 @@ int main()
     // a surface, GLFW provides us a way to do this platform-agnostic.
     // ==========================================================================
 
-    VkSurfaceKHR vkSurface;
-    if (glfwCreateWindowSurface(vkInstance, glfwWindow, nullptr, &vkSurface) != VK_SUCCESS) {
+    // Headless mode has no window and therefore no surface.
+    VkSurfaceKHR vkSurface = VK_NULL_HANDLE;
+    if (!headless && glfwCreateWindowSurface(vkInstance, glfwWindow, nullptr, &vkSurface) != VK_SUCCESS) {
         std::cerr << "Failed to create a surface!" << std::endl;
         abort();
     }
@@ -333,6 +2113,12 @@ int main()
         std::optional< uint32_t > graphicsFamily;
         // Present queue tranfers images to the surface.
         std::optional< uint32_t > presentFamily;
+        // Transfer queue uploads data into device-local memory.
+        // If there is no dedicated transfer family, the graphics family is used.
+        std::optional< uint32_t > transferFamily;
+        // Compute queue builds acceleration structures asynchronously to rendering.
+        // If there is no dedicated compute family, the graphics family is used.
+        std::optional< uint32_t > computeFamily;
     };
     QueueFamilyIndices queueFamilyIndices;
     // Here we take information about a swap chain.
@@ -341,19 +2127,36 @@ int main()
         std::vector< VkSurfaceFormatKHR > formats;
         std::vector< VkPresentModeKHR > presentModes;
     };
-    SwapChainSupportDetails swapChainSupportDetails;
+    SwapChainSupportDetails swapChainSupportDetails{};
     // --------------------------------------------------------------------------
 
     // Desired extensions that should be supported by the graphical card.
-    const std::vector< const char* > desiredDeviceExtensions = {
-        // Swap chain extension is needed for drawing.
-        // Any graphical card that aims to draw into a framebuffer
-        // should support this extension.
-        VK_KHR_SWAPCHAIN_EXTENSION_NAME,
-        // Ray tracing extensions.
-        VK_NV_RAY_TRACING_EXTENSION_NAME,
+    std::vector< const char* > desiredDeviceExtensions = {
         VK_KHR_GET_MEMORY_REQUIREMENTS_2_EXTENSION_NAME
     };
+    // Swap chain extension is needed for drawing.
+    // Any graphical card that aims to draw into a framebuffer
+    // should support this extension.
+    // Headless mode does not present images and can run without it.
+    if (!headless) {
+        desiredDeviceExtensions.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+    }
+    // Ray tracing is available through one of two extension sets.
+    // VK_NV_ray_tracing is supported by NVIDIA drivers only, while the KHR extensions
+    // are implemented by all vendors and need Vulkan 1.2 for buffer device addresses.
+    // The device gets the KHR set if it supports it, the NV set otherwise.
+    // Descriptor indexing is core in Vulkan 1.2, but the NV backend may run on older versions.
+    const std::vector< const char* > nvRayTracingExtensions = {
+        VK_NV_RAY_TRACING_EXTENSION_NAME,
+        VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME
+    };
+    const std::vector< const char* > khrRayTracingExtensions = {
+        VK_KHR_ACCELERATION_STRUCTURE_EXTENSION_NAME,
+        VK_KHR_RAY_TRACING_PIPELINE_EXTENSION_NAME,
+        VK_KHR_DEFERRED_HOST_OPERATIONS_EXTENSION_NAME
+    };
+    // Whether the selected device uses the KHR ray tracing backend.
+    bool useKhrRayTracing = false;
 
     // Get a list of available physical devices.
     uint32_t vkDeviceCount = 0;
@@ -388,11 +2191,59 @@ int main()
         // ---------------------------------------------------
 
         // Get list of extensions and compare it to desired one.
-        std::set< std::string > requiredExtensions(desiredDeviceExtensions.begin(), desiredDeviceExtensions.end());
-        for (const auto& extension : vkAvailableExtensions) {
-            requiredExtensions.erase(extension.extensionName);
+        auto extensionsAvailable = [&](const std::vector< const char* >& extensions) {
+            std::set< std::string > requiredExtensions(extensions.begin(), extensions.end());
+            for (const auto& extension : vkAvailableExtensions) {
+                requiredExtensions.erase(extension.extensionName);
+            }
+            return requiredExtensions.empty();
+        };
+
+        // The KHR backend needs its features as well, extensions alone may be exposed
+        // by drivers that do not implement ray tracing pipelines.
+        bool khrRayTracingAvailable = allowKhrRayTracing &&
+                                      vkDeviceProperties.apiVersion >= VK_API_VERSION_1_2 &&
+                                      extensionsAvailable(khrRayTracingExtensions);
+        if (khrRayTracingAvailable) {
+            VkPhysicalDeviceBufferDeviceAddressFeatures vkBufferDeviceAddressFeatures{};
+            vkBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+            VkPhysicalDeviceAccelerationStructureFeaturesKHR vkAccelerationStructureFeatures{};
+            vkAccelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+            vkAccelerationStructureFeatures.pNext = &vkBufferDeviceAddressFeatures;
+            VkPhysicalDeviceRayTracingPipelineFeaturesKHR vkRayTracingPipelineFeatures{};
+            vkRayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+            vkRayTracingPipelineFeatures.pNext = &vkAccelerationStructureFeatures;
+            VkPhysicalDeviceFeatures2 vkDeviceFeatures2{};
+            vkDeviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            vkDeviceFeatures2.pNext = &vkRayTracingPipelineFeatures;
+            vkGetPhysicalDeviceFeatures2(device, &vkDeviceFeatures2);
+            khrRayTracingAvailable = vkRayTracingPipelineFeatures.rayTracingPipeline &&
+                                     vkAccelerationStructureFeatures.accelerationStructure &&
+                                     vkBufferDeviceAddressFeatures.bufferDeviceAddress;
+        }
+        bool nvRayTracingAvailable = allowNvRayTracing && extensionsAvailable(nvRayTracingExtensions);
+
+        bool allExtensionsAvailable = extensionsAvailable(desiredDeviceExtensions) &&
+                                      (khrRayTracingAvailable || nvRayTracingAvailable);
+
+        // Closest hit shaders fetch mesh data from arrays of storage buffers indexed by the hit instance,
+        // which needs runtime descriptor arrays and non-uniform indexing of storage buffers.
+        bool descriptorIndexingOk = false;
+        if (allExtensionsAvailable) {
+            VkPhysicalDeviceDescriptorIndexingFeatures vkDescriptorIndexingFeatures{};
+            vkDescriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+            VkPhysicalDeviceFeatures2 vkDeviceFeatures2{};
+            vkDeviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            vkDeviceFeatures2.pNext = &vkDescriptorIndexingFeatures;
+            vkGetPhysicalDeviceFeatures2(device, &vkDeviceFeatures2);
+            descriptorIndexingOk = vkDescriptorIndexingFeatures.runtimeDescriptorArray &&
+                                   vkDescriptorIndexingFeatures.shaderStorageBufferArrayNonUniformIndexing;
+        }
+        // The denoiser selects its ping-pong images from arrays by the frame parity.
+        // Its shader is loaded only with denoising, the ray generation shader indexes G-buffers by constants.
+        if (denoise && !vkDeviceFeatures.shaderStorageImageArrayDynamicIndexing) {
+            descriptorIndexingOk = false;
         }
-        bool allExtensionsAvailable = requiredExtensions.empty();
 
         // ----------------------------------------------------------
         // TEST 2: Check if all required queue families are supported
@@ -419,10 +2270,38 @@ int main()
             // Note that graphicsFamily and presentFamily may refer to the same queue family
             // for some video cards and we should be ready to this.
             VkBool32 vkPresentSupport = false;
-            vkGetPhysicalDeviceSurfaceSupportKHR(device, i, vkSurface, &vkPresentSupport);
+            if (!headless) {
+                vkGetPhysicalDeviceSurfaceSupportKHR(device, i, vkSurface, &vkPresentSupport);
+            }
             if (vkPresentSupport) {
                 currentDeviceQueueFamilyIndices.presentFamily = i;
             }
+
+            // Check if this is a dedicated transfer family.
+            // Such families do not support graphics and compute and are usually backed
+            // by DMA engines that copy data in parallel with rendering.
+            if ((queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT) && !(queueFamily.queueFlags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT))) {
+                currentDeviceQueueFamilyIndices.transferFamily = i;
+            }
+
+            // Check if this is an async compute family.
+            // Such families do not support graphics, so their work runs in parallel with rendering.
+            if ((queueFamily.queueFlags & VK_QUEUE_COMPUTE_BIT) && !(queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT)) {
+                currentDeviceQueueFamilyIndices.computeFamily = i;
+            }
+        }
+        // Graphics queues always support transfer operations, so use it as a fallback.
+        if (!currentDeviceQueueFamilyIndices.transferFamily.has_value()) {
+            currentDeviceQueueFamilyIndices.transferFamily = currentDeviceQueueFamilyIndices.graphicsFamily;
+        }
+        // Graphics queues always support compute operations as well.
+        if (!currentDeviceQueueFamilyIndices.computeFamily.has_value()) {
+            currentDeviceQueueFamilyIndices.computeFamily = currentDeviceQueueFamilyIndices.graphicsFamily;
+        }
+        // Headless mode presents nothing, let the graphics family stand in
+        // for the present one so the rest of queue setup stays the same.
+        if (headless) {
+            currentDeviceQueueFamilyIndices.presentFamily = currentDeviceQueueFamilyIndices.graphicsFamily;
         }
         bool queuesOk = currentDeviceQueueFamilyIndices.graphicsFamily.has_value() &&
                         currentDeviceQueueFamilyIndices.presentFamily.has_value();
@@ -436,7 +2315,8 @@ int main()
         // We should do this only in case the device supports swap buffer.
         // To avoid extra flags and more complex logic, just make sure that all
         // desired extensions have been found.
-        if (allExtensionsAvailable) {
+        // Headless mode has no surface and needs no swap chain.
+        if (allExtensionsAvailable && !headless) {
             // Get surface capabilities.
             vkGetPhysicalDeviceSurfaceCapabilitiesKHR(device, vkSurface, &currenDeviceSwapChainDetails.capabilities);
             // Get supported formats.
@@ -454,16 +2334,18 @@ int main()
                 vkGetPhysicalDeviceSurfacePresentModesKHR(device, vkSurface, &vkPhysicalDevicePresentModeCount, currenDeviceSwapChainDetails.presentModes.data());
             }
         }
-        bool swapChainOk = !currenDeviceSwapChainDetails.formats.empty() &&
-                           !currenDeviceSwapChainDetails.presentModes.empty();
+        bool swapChainOk = headless ||
+                           (!currenDeviceSwapChainDetails.formats.empty() &&
+                            !currenDeviceSwapChainDetails.presentModes.empty());
 
         // ------------------------------------------------------------------------------------
 
         // Select the first suitable device.
-        if (allExtensionsAvailable && queuesOk && swapChainOk) {
+        if (allExtensionsAvailable && descriptorIndexingOk && queuesOk && swapChainOk) {
             vkPhysicalDevice = device;
             queueFamilyIndices = currentDeviceQueueFamilyIndices;
             swapChainSupportDetails = currenDeviceSwapChainDetails;
+            useKhrRayTracing = khrRayTracingAvailable;
             break;
         }
     }
@@ -474,18 +2356,100 @@ int main()
         abort();
     }
 
+    // Multi-GPU mode uses all GPUs of the device group the selected device belongs to.
+    // GPUs of one group are identical cards linked by the driver, so the checks above hold for all of them.
+    // The selected device goes first: device index 0 composites and presents frames.
+    std::vector< VkPhysicalDevice > vkGroupPhysicalDevices{ vkPhysicalDevice };
+    if (multiGpu) {
+        uint32_t vkGroupCount = 0;
+        vkEnumeratePhysicalDeviceGroups(vkInstance, &vkGroupCount, nullptr);
+        std::vector< VkPhysicalDeviceGroupProperties > vkGroups(vkGroupCount);
+        for (auto& group : vkGroups) {
+            group.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_GROUP_PROPERTIES;
+        }
+        vkEnumeratePhysicalDeviceGroups(vkInstance, &vkGroupCount, vkGroups.data());
+        for (const auto& group : vkGroups) {
+            const VkPhysicalDevice* groupEnd = group.physicalDevices + group.physicalDeviceCount;
+            if (std::find(group.physicalDevices, groupEnd, vkPhysicalDevice) == groupEnd) {
+                continue;
+            }
+            for (uint32_t i = 0; i < group.physicalDeviceCount && vkGroupPhysicalDevices.size() < MAX_DEVICE_GROUP_SIZE; i++) {
+                if (group.physicalDevices[i] != vkPhysicalDevice) {
+                    vkGroupPhysicalDevices.push_back(group.physicalDevices[i]);
+                }
+            }
+        }
+
+        // Buffers of the KHR backend are read by device addresses, which should be the same on all GPUs.
+        if (useKhrRayTracing && vkGroupPhysicalDevices.size() > 1) {
+            VkPhysicalDeviceBufferDeviceAddressFeatures vkBufferDeviceAddressFeatures{};
+            vkBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+            VkPhysicalDeviceFeatures2 vkDeviceFeatures2{};
+            vkDeviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+            vkDeviceFeatures2.pNext = &vkBufferDeviceAddressFeatures;
+            vkGetPhysicalDeviceFeatures2(vkPhysicalDevice, &vkDeviceFeatures2);
+            if (!vkBufferDeviceAddressFeatures.bufferDeviceAddressMultiDevice) {
+                std::cout << "Device addresses are not supported for device groups" << std::endl;
+                vkGroupPhysicalDevices.resize(1);
+            }
+        }
+        multiGpu = vkGroupPhysicalDevices.size() > 1;
+        if (multiGpu) {
+            std::cout << "Tracing on " << vkGroupPhysicalDevices.size() << " GPUs of a device group" << std::endl;
+        } else {
+            std::cout << "No device group with several GPUs, tracing on one GPU" << std::endl;
+        }
+    }
+    const uint32_t deviceGroupSize = static_cast< uint32_t >(vkGroupPhysicalDevices.size());
+    // Device mask of all GPUs, commands recorded under it run on every GPU of the group.
+    const uint32_t deviceGroupMask = (1u << deviceGroupSize) - 1;
+
+    // Enable extensions of the selected ray tracing backend.
+    const auto& rayTracingExtensions = useKhrRayTracing ? khrRayTracingExtensions : nvRayTracingExtensions;
+    desiredDeviceExtensions.insert(desiredDeviceExtensions.end(), rayTracingExtensions.begin(), rayTracingExtensions.end());
+    std::cout << "Ray tracing backend: " << (useKhrRayTracing ? "VK_KHR_ray_tracing_pipeline" : "VK_NV_ray_tracing") << std::endl;
+
     // Request physical device memory properties that will be used to find a suitable memory type.
     VkPhysicalDeviceMemoryProperties vkPhysicalDeviceMemoryProperties;
     vkGetPhysicalDeviceMemoryProperties(vkPhysicalDevice, &vkPhysicalDeviceMemoryProperties);
 
     // Query the ray tracing properties of the current implementation, we will need them later on.
+    // Each backend reports them in its own structure.
     VkPhysicalDeviceRayTracingPropertiesNV rayTracingProperties{};
     rayTracingProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PROPERTIES_NV;
+    VkPhysicalDeviceAccelerationStructurePropertiesKHR accelerationStructureProperties{};
+    accelerationStructureProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_PROPERTIES_KHR;
+    VkPhysicalDeviceRayTracingPipelinePropertiesKHR rayTracingPipelineProperties{};
+    rayTracingPipelineProperties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_PROPERTIES_KHR;
+    rayTracingPipelineProperties.pNext = &accelerationStructureProperties;
     VkPhysicalDeviceProperties2 deviceProps2{};
     deviceProps2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
-    deviceProps2.pNext = &rayTracingProperties;
+    if (useKhrRayTracing) {
+        deviceProps2.pNext = &rayTracingPipelineProperties;
+    } else {
+        deviceProps2.pNext = &rayTracingProperties;
+    }
     vkGetPhysicalDeviceProperties2(vkPhysicalDevice, &deviceProps2);
 
+    // Shader binding table layout is the same for both backends.
+    const uint32_t shaderGroupHandleSize = useKhrRayTracing ? rayTracingPipelineProperties.shaderGroupHandleSize
+                                                            : rayTracingProperties.shaderGroupHandleSize;
+    const uint32_t shaderGroupBaseAlignment = useKhrRayTracing ? rayTracingPipelineProperties.shaderGroupBaseAlignment
+                                                               : rayTracingProperties.shaderGroupBaseAlignment;
+    // Strides of records should be multiples of the handle alignment.
+    // The NV backend has no such property and requires multiples of the handle size.
+    const uint32_t shaderGroupHandleAlignment = useKhrRayTracing ? rayTracingPipelineProperties.shaderGroupHandleAlignment
+                                                                 : rayTracingProperties.shaderGroupHandleSize;
+
+    // Closest hit shaders trace shadow rays, which needs the recursion depth of 2.
+    // Implementations are only required to support 1, shadows are disabled on such devices.
+    const uint32_t maxRayRecursionDepth = useKhrRayTracing ? rayTracingPipelineProperties.maxRayRecursionDepth
+                                                           : rayTracingProperties.maxRecursionDepth;
+    const bool castShadows = maxRayRecursionDepth >= 2;
+    if (!castShadows) {
+        std::cout << "Ray recursion is not supported, shadows are disabled" << std::endl;
+    }
+
     // ==========================================================================
     //                   STEP 9: Create a logical device
     // ==========================================================================
@@ -496,14 +2460,16 @@ int main()
     // Logical device of a video card.
     VkDevice vkDevice;
 
-    // As it was mentioned above, we might have two queue families referring
-    // to the same index which means there is only one family that is suitable
-    // for both needs.
+    // As it was mentioned above, we might have several queue families referring
+    // to the same index which means there is one family that is suitable
+    // for several needs.
     // Use std::set to filter out duplicates as we should mention each queue
     // only once during logical device creation.
     std::set< uint32_t > uniqueQueueFamilies = {
         queueFamilyIndices.graphicsFamily.value(),
-        queueFamilyIndices.presentFamily.value()
+        queueFamilyIndices.presentFamily.value(),
+        queueFamilyIndices.transferFamily.value(),
+        queueFamilyIndices.computeFamily.value()
     };
 
     // Go through all remaining queues and make a creation info structure.
@@ -526,6 +2492,41 @@ int main()
     // If you specify something that is not supported - device
     // creation will fail, so you should check beforehand.
     VkPhysicalDeviceFeatures vkDeviceFeatures {};
+    vkDeviceFeatures.shaderStorageImageArrayDynamicIndexing = denoise ? VK_TRUE : VK_FALSE;
+
+    // The KHR ray tracing backend additionally needs its features to be enabled.
+    // They are passed in a chain of feature structures.
+    VkPhysicalDeviceBufferDeviceAddressFeatures vkBufferDeviceAddressFeatures{};
+    vkBufferDeviceAddressFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_BUFFER_DEVICE_ADDRESS_FEATURES;
+    vkBufferDeviceAddressFeatures.bufferDeviceAddress = VK_TRUE;
+    VkPhysicalDeviceAccelerationStructureFeaturesKHR vkAccelerationStructureFeatures{};
+    vkAccelerationStructureFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ACCELERATION_STRUCTURE_FEATURES_KHR;
+    vkAccelerationStructureFeatures.pNext = &vkBufferDeviceAddressFeatures;
+    vkAccelerationStructureFeatures.accelerationStructure = VK_TRUE;
+    VkPhysicalDeviceRayTracingPipelineFeaturesKHR vkRayTracingPipelineFeatures{};
+    vkRayTracingPipelineFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_RAY_TRACING_PIPELINE_FEATURES_KHR;
+    vkRayTracingPipelineFeatures.pNext = &vkAccelerationStructureFeatures;
+    vkRayTracingPipelineFeatures.rayTracingPipeline = VK_TRUE;
+
+    // Descriptor indexing is needed by both backends.
+    VkPhysicalDeviceDescriptorIndexingFeatures vkDescriptorIndexingFeatures{};
+    vkDescriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES;
+    vkDescriptorIndexingFeatures.runtimeDescriptorArray = VK_TRUE;
+    vkDescriptorIndexingFeatures.shaderStorageBufferArrayNonUniformIndexing = VK_TRUE;
+    if (useKhrRayTracing) {
+        vkDescriptorIndexingFeatures.pNext = &vkRayTracingPipelineFeatures;
+    }
+    vkBufferDeviceAddressFeatures.bufferDeviceAddressMultiDevice = multiGpu ? VK_TRUE : VK_FALSE;
+
+    // Multi-GPU mode creates one logical device for all GPUs of the group.
+    // Commands run on every GPU unless a device mask says otherwise and device-local
+    // memory is allocated on every GPU, so each of them builds and keeps its own copy of
+    // acceleration structures and images.
+    VkDeviceGroupDeviceCreateInfo vkDeviceGroupInfo{};
+    vkDeviceGroupInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_DEVICE_CREATE_INFO;
+    vkDeviceGroupInfo.pNext = &vkDescriptorIndexingFeatures;
+    vkDeviceGroupInfo.physicalDeviceCount = deviceGroupSize;
+    vkDeviceGroupInfo.pPhysicalDevices = vkGroupPhysicalDevices.data();
 
     // Logical device creation info.
     VkDeviceCreateInfo vkDeviceCreateInfo {};
@@ -533,6 +2534,7 @@ int main()
     vkDeviceCreateInfo.queueCreateInfoCount = queueCreateInfos.size();
     vkDeviceCreateInfo.pQueueCreateInfos = queueCreateInfos.data();
     vkDeviceCreateInfo.pEnabledFeatures = &vkDeviceFeatures;
+    vkDeviceCreateInfo.pNext = multiGpu ? static_cast< const void* >(&vkDeviceGroupInfo) : &vkDescriptorIndexingFeatures;
     // Specify which extensions we want to enable.
     vkDeviceCreateInfo.enabledExtensionCount = static_cast< uint32_t >(desiredDeviceExtensions.size());
     vkDeviceCreateInfo.ppEnabledExtensionNames = desiredDeviceExtensions.data();
@@ -555,63 +2557,154 @@ int main()
         abort();
     }
 
+    // Create a memory arena.
+    // All resources of the application are sub-allocated from large memory blocks,
+    // so we do not call vkAllocateMemory() per resource.
+    MemoryArena memoryArena;
+    memoryArena.device = vkDevice;
+    memoryArena.memoryProperties = vkPhysicalDeviceMemoryProperties;
+    memoryArena.maxAllocationCount = deviceProps2.properties.limits.maxMemoryAllocationCount;
+    memoryArena.deviceCount = deviceGroupSize;
+    // Acceleration structure builds of the KHR backend read all their inputs by device addresses.
+    if (useKhrRayTracing) {
+        memoryArena.allocateFlags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+    }
+
     // ==========================================================================
     //                   STEP 10: Select surface configuration
     // ==========================================================================
     // We should select surface format, present mode and extent (size) from
     // the proposed values. They will be used in furhter calls.
+    // Headless mode has no surface, so it takes the preferable format
+    // and the resolution requested in the command line.
     // ==========================================================================
 
     // Select a color format.
-    VkSurfaceFormatKHR vkSelectedFormat = swapChainSupportDetails.formats[0];
-    for (const auto& availableFormat : swapChainSupportDetails.formats) {
-        if (availableFormat.format == VK_FORMAT_B8G8R8A8_UNORM && availableFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
-            vkSelectedFormat = availableFormat;
-            break;
+    // The tone mapping pass encodes sRGB by itself, so UNORM formats in the sRGB color space are preferred.
+    // RGBA8 goes first: the pass can write it directly, since the format qualifier of its output is rgba8.
+    VkSurfaceFormatKHR vkSelectedFormat = { VK_FORMAT_B8G8R8A8_UNORM, VK_COLOR_SPACE_SRGB_NONLINEAR_KHR };
+    if (!headless) {
+        vkSelectedFormat = swapChainSupportDetails.formats[0];
+        bool preferredFormatFound = false;
+        for (VkFormat preferredFormat : { VK_FORMAT_R8G8B8A8_UNORM, VK_FORMAT_B8G8R8A8_UNORM }) {
+            for (const auto& availableFormat : swapChainSupportDetails.formats) {
+                if (availableFormat.format == preferredFormat && availableFormat.colorSpace == VK_COLOR_SPACE_SRGB_NONLINEAR_KHR) {
+                    vkSelectedFormat = availableFormat;
+                    preferredFormatFound = true;
+                    break;
+                }
+            }
+            if (preferredFormatFound) {
+                break;
+            }
         }
     }
+    // Writes into sRGB formats are encoded by the hardware, so the pass should not encode them once more.
+    const bool swapChainSrgb = !headless &&
+                               (vkSelectedFormat.format == VK_FORMAT_R8G8B8A8_SRGB ||
+                                vkSelectedFormat.format == VK_FORMAT_B8G8R8A8_SRGB ||
+                                vkSelectedFormat.format == VK_FORMAT_A8B8G8R8_SRGB_PACK32);
+
+    // Rays are traced into a float radiance image, and a tone mapping pass converts it
+    // into display colors. Check if the pass can write swap chain images directly:
+    // the surface should allow storage usage of its images, the format should be RGBA8
+    // matching the format qualifier of the pass and it should support storage images.
+    // Otherwise the pass writes a separate display image which is blitted into the swap chain every frame.
+    // Dynamic resolution traces a part of the radiance image and the tone mapping pass
+    // scales it up to the whole output image. Headless mode has nothing to scale into.
+    // Readback copies the display image into host memory, so it always needs one.
+    VkFormatProperties vkSelectedFormatProperties;
+    vkGetPhysicalDeviceFormatProperties(vkPhysicalDevice, vkSelectedFormat.format, &vkSelectedFormatProperties);
+    if (frameTimeBudgetMs > 0.0 && headless) {
+        std::cout << "Dynamic resolution is not used in headless mode" << std::endl;
+        frameTimeBudgetMs = 0.0;
+    }
+    const bool dynamicResolution = frameTimeBudgetMs > 0.0;
+    const bool readback = !readbackPath.empty();
+    const bool tonemapIntoSwapChain = !headless && !readback && vkSelectedFormat.format == VK_FORMAT_R8G8B8A8_UNORM &&
+                                      (swapChainSupportDetails.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_STORAGE_BIT) &&
+                                      (vkSelectedFormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_STORAGE_IMAGE_BIT);
+    if (!headless) {
+        std::cout << (tonemapIntoSwapChain ? "Tone mapping directly into swap chain images" : "Tone mapping into a display image blitted into the swap chain") << std::endl;
+    }
+    // Readback frames are written into the file as they are in the display image, which is then blitted
+    // into the swap chain. An sRGB swap chain would encode colors once more, so the display image would have to
+    // keep linear colors, which are not what readback consumers expect.
+    if (readback && swapChainSrgb) {
+        std::cerr << "Frame readback needs a UNORM swap chain format, the surface offers only " << vkSelectedFormat.format << "!" << std::endl;
+        abort();
+    }
+    // The display image is blitted into swap chain images, so their format should be a blit destination.
+    if (!headless && !tonemapIntoSwapChain && !(vkSelectedFormatProperties.optimalTilingFeatures & VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
+        std::cerr << "The swap chain format supports neither storage images nor blits into it!" << std::endl;
+        abort();
+    }
 
     // Select a present mode.
-    VkPresentModeKHR vkSelectedPresendMode = swapChainSupportDetails.presentModes[0];
+    // Take the requested mode (mailbox by default) if the surface supports it.
+    // FIFO is always supported, so it is the fallback and a natural value for headless mode where it is unused.
+    // - VK_PRESENT_MODE_IMMEDIATE_KHR - The lowest latency, but the image may tear.
+    // - VK_PRESENT_MODE_MAILBOX_KHR - Does not block and does not tear, the newest frame replaces a queued one.
+    // - VK_PRESENT_MODE_FIFO_KHR - VSync, the application waits for the display.
+    VkPresentModeKHR vkSelectedPresendMode = VK_PRESENT_MODE_FIFO_KHR;
     for (const auto& availablePresentMode : swapChainSupportDetails.presentModes) {
-        // Preferrable mode. If we find it, break the cycle immediately.
-        if (availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR) {
+        if (availablePresentMode == requestedPresentMode) {
             vkSelectedPresendMode = availablePresentMode;
             break;
         }
-        // Fallback mode. If we find it, store to vkSelectedPresendMode,
-        // but try to find something better.
-        if (availablePresentMode == VK_PRESENT_MODE_FIFO_KHR) {
-            vkSelectedPresendMode = availablePresentMode;
-        }
+    }
+    if (presentModeRequested && !headless && vkSelectedPresendMode != requestedPresentMode) {
+        std::cout << "Requested present mode is not supported, FIFO is used instead" << std::endl;
     }
 
     // Select a swap chain images resolution.
-    VkExtent2D vkSelectedExtent;
-    if (swapChainSupportDetails.capabilities.currentExtent.width != UINT32_MAX) {
-        vkSelectedExtent = swapChainSupportDetails.capabilities.currentExtent;
-    } else {
-        // Some window managers do not allow to use resolution different from
-        // the resolution of the window. In such cases Vulkan will report
-        // UINT32_MAX as currentExtent.width and currentExtent.height.
-        vkSelectedExtent = { WINDOW_WIDTH, WINDOW_HEIGHT };
-        // Make sure the value is between minImageExtent.width and maxImageExtent.width.
-        vkSelectedExtent.width = std::max(
-                    swapChainSupportDetails.capabilities.minImageExtent.width,
-                    std::min(
-                        swapChainSupportDetails.capabilities.maxImageExtent.width,
-                        vkSelectedExtent.width
-                        )
-                    );
-        // Make sure the value is between minImageExtent.height and maxImageExtent.height.
-        vkSelectedExtent.height = std::max(
-                    swapChainSupportDetails.capabilities.minImageExtent.height,
-                    std::min(
-                        swapChainSupportDetails.capabilities.maxImageExtent.height,
-                        vkSelectedExtent.height
-                        )
-                    );
-    }
+    // The window may be resized, so the resolution is selected again
+    // with fresh surface capabilities every time the swap chain is recreated.
+    VkExtent2D vkSelectedExtent{};
+    auto selectExtent = [&]() {
+        if (headless) {
+            vkSelectedExtent = { renderWidth, renderHeight };
+            return;
+        }
+        vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vkPhysicalDevice, vkSurface, &swapChainSupportDetails.capabilities);
+        if (swapChainSupportDetails.capabilities.currentExtent.width != UINT32_MAX) {
+            vkSelectedExtent = swapChainSupportDetails.capabilities.currentExtent;
+        } else {
+            // Some window managers do not allow to use resolution different from
+            // the resolution of the window. In such cases Vulkan will report
+            // UINT32_MAX as currentExtent.width and currentExtent.height.
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(glfwWindow, &framebufferWidth, &framebufferHeight);
+            vkSelectedExtent = { static_cast< uint32_t >(framebufferWidth), static_cast< uint32_t >(framebufferHeight) };
+            // Make sure the value is between minImageExtent.width and maxImageExtent.width.
+            vkSelectedExtent.width = std::max(
+                        swapChainSupportDetails.capabilities.minImageExtent.width,
+                        std::min(
+                            swapChainSupportDetails.capabilities.maxImageExtent.width,
+                            vkSelectedExtent.width
+                            )
+                        );
+            // Make sure the value is between minImageExtent.height and maxImageExtent.height.
+            vkSelectedExtent.height = std::max(
+                        swapChainSupportDetails.capabilities.minImageExtent.height,
+                        std::min(
+                            swapChainSupportDetails.capabilities.maxImageExtent.height,
+                            vkSelectedExtent.height
+                            )
+                        );
+        }
+    };
+    selectExtent();
+
+    // Select a resolution rays are traced at.
+    // It matches the swap chain resolution unless dynamic resolution scales it down.
+    float renderScale = 1.0f;
+    VkExtent2D vkRenderExtent{};
+    auto updateRenderExtent = [&]() {
+        vkRenderExtent.width = std::max(1u, static_cast< uint32_t >(vkSelectedExtent.width * renderScale));
+        vkRenderExtent.height = std::max(1u, static_cast< uint32_t >(vkSelectedExtent.height * renderScale));
+    };
+    updateRenderExtent();
 
     // ==========================================================================
     //                     STEP 11: Create a swap chain
@@ -622,59 +2715,75 @@ int main()
     // than they are displayed, it should wait.
     // ==========================================================================
 
-    // First of all we should select a size of the swap chain.
-    // It is recommended to use minValue + 1 but we also have to make sure
-    // it does not exceed maxValue.
-    // If maxValue is zero, it means there is no upper bound.
-    uint32_t imageCount = swapChainSupportDetails.capabilities.minImageCount + 1;
-    if (swapChainSupportDetails.capabilities.maxImageCount > 0 && imageCount > swapChainSupportDetails.capabilities.maxImageCount) {
-        imageCount = swapChainSupportDetails.capabilities.maxImageCount;
-    }
-
-    // Fill in swap chain create info using selected surface configuration.
-    VkSwapchainCreateInfoKHR vkSwapChainCreateInfo{};
-    vkSwapChainCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
-    vkSwapChainCreateInfo.surface = vkSurface;
-    vkSwapChainCreateInfo.minImageCount = imageCount;
-    vkSwapChainCreateInfo.imageFormat = vkSelectedFormat.format;
-    vkSwapChainCreateInfo.imageColorSpace = vkSelectedFormat.colorSpace;
-    vkSwapChainCreateInfo.imageExtent = vkSelectedExtent;
-    vkSwapChainCreateInfo.imageArrayLayers = 1;
-    vkSwapChainCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
-    // We have two options for queue synchronization:
-    // - VK_SHARING_MODE_EXCLUSIVE - An image ownership should be explicitly transferred
-    //                               before using it in a differen queue. Best performance option.
-    // - VK_SHARING_MODE_CONCURRENT - Images can be used in different queues without
-    //                                explicit ownership transfer. Less performant, but simpler in implementation.
-    // If we have only one queue family - we should use VK_SHARING_MODE_EXCLUSIVE as we do not need
-    // to do any synchrnoization and can use the faster option for free.
-    // If we have two queue families - we will use VK_SHARING_MODE_CONCURRENT mode to avoid
-    // additional complexity of ownership transferring.
-    uint32_t familyIndices[] = {
-        queueFamilyIndices.graphicsFamily.value(),
-        queueFamilyIndices.presentFamily.value()
+    // The swap chain is created again every time the window is resized.
+    // Headless mode renders only into storage images and has no swap chain.
+    VkSwapchainKHR vkSwapChain = VK_NULL_HANDLE;
+    auto createSwapChain = [&]() {
+        // First of all we should select a size of the swap chain.
+        // It is recommended to use minValue + 1 but we also have to make sure
+        // it does not exceed maxValue.
+        // If maxValue is zero, it means there is no upper bound.
+        uint32_t imageCount = swapChainSupportDetails.capabilities.minImageCount + 1;
+        if (swapChainSupportDetails.capabilities.maxImageCount > 0 && imageCount > swapChainSupportDetails.capabilities.maxImageCount) {
+            imageCount = swapChainSupportDetails.capabilities.maxImageCount;
+        }
+
+        // Fill in swap chain create info using selected surface configuration.
+        VkSwapchainCreateInfoKHR vkSwapChainCreateInfo{};
+        vkSwapChainCreateInfo.sType = VK_STRUCTURE_TYPE_SWAPCHAIN_CREATE_INFO_KHR;
+        vkSwapChainCreateInfo.surface = vkSurface;
+        vkSwapChainCreateInfo.minImageCount = imageCount;
+        vkSwapChainCreateInfo.imageFormat = vkSelectedFormat.format;
+        vkSwapChainCreateInfo.imageColorSpace = vkSelectedFormat.colorSpace;
+        vkSwapChainCreateInfo.imageExtent = vkSelectedExtent;
+        vkSwapChainCreateInfo.imageArrayLayers = 1;
+        // Images are either written by the tone mapping shader or receive a copy of the display image.
+        vkSwapChainCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | (tonemapIntoSwapChain ? VK_IMAGE_USAGE_STORAGE_BIT : VK_IMAGE_USAGE_TRANSFER_DST_BIT);
+        // We have two options for queue synchronization:
+        // - VK_SHARING_MODE_EXCLUSIVE - An image ownership should be explicitly transferred
+        //                               before using it in a differen queue. Best performance option.
+        // - VK_SHARING_MODE_CONCURRENT - Images can be used in different queues without
+        //                                explicit ownership transfer. Less performant, but simpler in implementation.
+        // If we have only one queue family - we should use VK_SHARING_MODE_EXCLUSIVE as we do not need
+        // to do any synchrnoization and can use the faster option for free.
+        // If we have two queue families - we will use VK_SHARING_MODE_CONCURRENT mode to avoid
+        // additional complexity of ownership transferring.
+        uint32_t familyIndices[] = {
+            queueFamilyIndices.graphicsFamily.value(),
+            queueFamilyIndices.presentFamily.value()
+        };
+        if (familyIndices[0] != familyIndices[1]) {
+            vkSwapChainCreateInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
+            vkSwapChainCreateInfo.queueFamilyIndexCount = 2;
+            vkSwapChainCreateInfo.pQueueFamilyIndices = familyIndices;
+        } else {
+            vkSwapChainCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
+            vkSwapChainCreateInfo.queueFamilyIndexCount = 0;
+            vkSwapChainCreateInfo.pQueueFamilyIndices = nullptr;
+        }
+        vkSwapChainCreateInfo.preTransform = swapChainSupportDetails.capabilities.currentTransform;
+        vkSwapChainCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
+        vkSwapChainCreateInfo.presentMode = vkSelectedPresendMode;
+        vkSwapChainCreateInfo.clipped = VK_TRUE;
+        // This option is only required if we recreate a swap chain.
+        // The driver may reuse resources of the old swap chain.
+        vkSwapChainCreateInfo.oldSwapchain = vkSwapChain;
+
+        // Create a swap chain.
+        VkSwapchainKHR vkNewSwapChain;
+        if (vkCreateSwapchainKHR(vkDevice, &vkSwapChainCreateInfo, nullptr, &vkNewSwapChain) != VK_SUCCESS) {
+            std::cerr << "Failed to create a swap chain!" << std::endl;
+            abort();
+        }
+
+        // The old swap chain is retired and can be destroyed.
+        if (vkSwapChain != VK_NULL_HANDLE) {
+            vkDestroySwapchainKHR(vkDevice, vkSwapChain, nullptr);
+        }
+        vkSwapChain = vkNewSwapChain;
     };
-    if (familyIndices[0] != familyIndices[1]) {
-        vkSwapChainCreateInfo.imageSharingMode = VK_SHARING_MODE_CONCURRENT;
-        vkSwapChainCreateInfo.queueFamilyIndexCount = 2;
-        vkSwapChainCreateInfo.pQueueFamilyIndices = familyIndices;
-    } else {
-        vkSwapChainCreateInfo.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
-        vkSwapChainCreateInfo.queueFamilyIndexCount = 0;
-        vkSwapChainCreateInfo.pQueueFamilyIndices = nullptr;
-    }
-    vkSwapChainCreateInfo.preTransform = swapChainSupportDetails.capabilities.currentTransform;
-    vkSwapChainCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
-    vkSwapChainCreateInfo.presentMode = vkSelectedPresendMode;
-    vkSwapChainCreateInfo.clipped = VK_TRUE;
-    // This option is only required if we recreate a swap chain.
-    vkSwapChainCreateInfo.oldSwapchain = VK_NULL_HANDLE;
-
-    // Create a swap chain.
-    VkSwapchainKHR vkSwapChain;
-    if (vkCreateSwapchainKHR(vkDevice, &vkSwapChainCreateInfo, nullptr, &vkSwapChain) != VK_SUCCESS) {
-        std::cerr << "Failed to create a swap chain!" << std::endl;
-        abort();
+    if (!headless) {
+        createSwapChain();
     }
 
     // ==========================================================================
@@ -685,147 +2794,518 @@ int main()
     // we should create image views.
     // ==========================================================================
 
-    // Fetch Vulkan images associated to the swap chain.
+    // Images and views are fetched again every time the swap chain is recreated.
+    // There are no images in headless mode.
     std::vector< VkImage > vkSwapChainImages;
-    uint32_t vkSwapChainImageCount;
-    vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &vkSwapChainImageCount, nullptr);
-    vkSwapChainImages.resize(vkSwapChainImageCount);
-    vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &vkSwapChainImageCount, vkSwapChainImages.data());
-
-    // Create image views for each image.
     std::vector< VkImageView > vkSwapChainImageViews;
-    vkSwapChainImageViews.resize(vkSwapChainImageCount);
-    for (size_t i = 0; i < vkSwapChainImageCount; i++) {
-        // Image view create info.
-        VkImageViewCreateInfo createInfo{};
-        createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-        createInfo.image = vkSwapChainImages[i];
-        createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-        createInfo.format = vkSelectedFormat.format;
-        createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
-        createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-        createInfo.subresourceRange.baseMipLevel = 0;
-        createInfo.subresourceRange.levelCount = 1;
-        createInfo.subresourceRange.baseArrayLayer = 0;
-        createInfo.subresourceRange.layerCount = 1;
-        // Create an image view.
-        if (vkCreateImageView(vkDevice, &createInfo, nullptr, &vkSwapChainImageViews[i]) != VK_SUCCESS) {
-            std::cerr << "Failed to create an image view #" << i << "!" << std::endl;
-            abort();
+    auto createSwapChainImageViews = [&]() {
+        // Fetch Vulkan images associated to the swap chain.
+        uint32_t vkSwapChainImageCount = 0;
+        vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &vkSwapChainImageCount, nullptr);
+        vkSwapChainImages.resize(vkSwapChainImageCount);
+        vkGetSwapchainImagesKHR(vkDevice, vkSwapChain, &vkSwapChainImageCount, vkSwapChainImages.data());
+
+        // Create image views for each image.
+        vkSwapChainImageViews.resize(vkSwapChainImageCount);
+        for (size_t i = 0; i < vkSwapChainImageCount; i++) {
+            // Image view create info.
+            VkImageViewCreateInfo createInfo{};
+            createInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            createInfo.image = vkSwapChainImages[i];
+            createInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            createInfo.format = vkSelectedFormat.format;
+            createInfo.components.r = VK_COMPONENT_SWIZZLE_IDENTITY;
+            createInfo.components.g = VK_COMPONENT_SWIZZLE_IDENTITY;
+            createInfo.components.b = VK_COMPONENT_SWIZZLE_IDENTITY;
+            createInfo.components.a = VK_COMPONENT_SWIZZLE_IDENTITY;
+            createInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            createInfo.subresourceRange.baseMipLevel = 0;
+            createInfo.subresourceRange.levelCount = 1;
+            createInfo.subresourceRange.baseArrayLayer = 0;
+            createInfo.subresourceRange.layerCount = 1;
+            // Create an image view.
+            if (vkCreateImageView(vkDevice, &createInfo, nullptr, &vkSwapChainImageViews[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create an image view #" << i << "!" << std::endl;
+                abort();
+            }
         }
+    };
+    // Images belong to the swap chain, only views should be destroyed.
+    auto destroySwapChainImageViews = [&]() {
+        for (auto imageView : vkSwapChainImageViews) {
+            vkDestroyImageView(vkDevice, imageView, nullptr);
+        }
+        vkSwapChainImageViews.clear();
+        vkSwapChainImages.clear();
+    };
+    if (!headless) {
+        createSwapChainImageViews();
     }
 
     // ==========================================================================
-    //                    STEP 13: Create a vertex buffer
+    //               STEP 13: Create a vertex and an index buffer
     // ==========================================================================
-    // Vertex buffer contains vertices of our model and will be used to construct
+    // Vertex buffer contains vertices of our model and index buffer describes
+    // triangles referring to these vertices. Both will be used to construct
     // acceleration structures for ray tracing.
+    // Indexed geometry does not duplicate vertices shared by several triangles,
+    // so it takes less memory and less bandwidth during the BLAS build.
+    // The mesh is streamed from a file chunk by chunk through a staging ring
+    // directly into device-local buffers, so we never keep the whole mesh
+    // in the host memory.
     // ==========================================================================
 
-    // Create a cube specifying its vertices.
-    // Each triplet of vertices represent one triangle.
-    // We do not use index buffer, so some vertices are duplicated.
-    std::vector< glm::vec3 > vertices
-    {
-        { -0.5f, -0.5f, -0.5f },
-        { -0.5f,  0.5f, -0.5f },
-        {  0.5f, -0.5f, -0.5f },
-        {  0.5f,  0.5f, -0.5f },
-        {  0.5f, -0.5f, -0.5f },
-        { -0.5f,  0.5f, -0.5f },
-
-        { -0.5f, -0.5f, -0.5f },
-        { -0.5f, -0.5f,  0.5f },
-        { -0.5f,  0.5f, -0.5f },
-        { -0.5f,  0.5f,  0.5f },
-        { -0.5f,  0.5f, -0.5f },
-        { -0.5f, -0.5f,  0.5f },
-
-        {  0.5f, -0.5f,  0.5f },
-        {  0.5f, -0.5f, -0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        {  0.5f,  0.5f, -0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        {  0.5f, -0.5f, -0.5f },
-
-        { -0.5f,  0.5f,  0.5f },
-        { -0.5f, -0.5f,  0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        {  0.5f, -0.5f,  0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        { -0.5f, -0.5f,  0.5f },
-
-        {  0.5f,  0.5f, -0.5f },
-        { -0.5f,  0.5f, -0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        { -0.5f,  0.5f,  0.5f },
-        {  0.5f,  0.5f,  0.5f },
-        { -0.5f,  0.5f, -0.5f },
-
-        { -0.5f, -0.5f,  0.5f },
-        { -0.5f, -0.5f, -0.5f },
-        {  0.5f, -0.5f, -0.5f },
-        { -0.5f, -0.5f,  0.5f },
-        {  0.5f, -0.5f, -0.5f },
-        {  0.5f, -0.5f,  0.5f },
-    };
-
-    // Calculate buffer size.
-    VkDeviceSize vertexBufferSize = sizeof(vertices[0]) * vertices.size();
+    // -------------------------
+    // 1: Create a staging ring
+    // -------------------------
+
+    // Device-local memory is the fastest memory for the GPU, but usually it is not
+    // visible to the host, so we cannot write it directly. Instead all uploads go
+    // through a staging ring: a persistently mapped host-visible buffer split into
+    // several segments. Each segment has its own command buffer and fence, so the CPU
+    // fills the next segment while the transfer queue still copies the previous ones.
+    // Large uploads are split into segment-sized chunks and pipelined this way.
+
+    // Pick a transfer queue.
+    VkQueue vkTransferQueue;
+    vkGetDeviceQueue(vkDevice, queueFamilyIndices.transferFamily.value(), 0, &vkTransferQueue);
+
+    // Buffers filled by the transfer queue are used by the graphics and compute queues afterwards.
+    // Similarly to the swap chain, we use concurrent sharing mode if these are different
+    // queue families to avoid additional complexity of ownership transferring.
+    std::set< uint32_t > uploadQueueFamilySet = {
+        queueFamilyIndices.graphicsFamily.value(),
+        queueFamilyIndices.transferFamily.value(),
+        queueFamilyIndices.computeFamily.value()
+    };
+    std::vector< uint32_t > uploadQueueFamilies(uploadQueueFamilySet.begin(), uploadQueueFamilySet.end());
+    const VkSharingMode uploadSharingMode = (uploadQueueFamilies.size() > 1) ? VK_SHARING_MODE_CONCURRENT : VK_SHARING_MODE_EXCLUSIVE;
+
+    // Acceleration structure builds of the KHR backend read vertices, indices and instances
+    // by device addresses, so such buffers need additional usage flags.
+    const VkBufferUsageFlags buildInputBufferUsage = useKhrRayTracing ?
+        (VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_BUILD_INPUT_READ_ONLY_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) : 0;
+
+    // Describe a staging ring buffer.
+    VkBufferCreateInfo vkStagingRingBufferInfo{};
+    vkStagingRingBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vkStagingRingBufferInfo.size = STAGING_RING_SEGMENT_SIZE * STAGING_RING_SEGMENT_COUNT;
+    vkStagingRingBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+    vkStagingRingBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    // Create a staging ring buffer.
+    VkBuffer vkStagingRingBuffer;
+    if (vkCreateBuffer(vkDevice, &vkStagingRingBufferInfo, nullptr, &vkStagingRingBuffer) != VK_SUCCESS) {
+        std::cerr << "Failed to create a staging buffer!" << std::endl;
+        abort();
+    }
 
-    // Describe a buffer.
-    VkBufferCreateInfo vkVertexBufferInfo{};
-    vkVertexBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vkVertexBufferInfo.size = vertexBufferSize;
-    vkVertexBufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-    vkVertexBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // Retrieve memory requirements for the staging ring buffer.
+    VkMemoryRequirements vkStagingRingBufferMemRequirements;
+    vkGetBufferMemoryRequirements(vkDevice, vkStagingRingBuffer, &vkStagingRingBufferMemRequirements);
 
-    // Create a buffer.
-    VkBuffer vkVertexBuffer;
-    if (vkCreateBuffer(vkDevice, &vkVertexBufferInfo, nullptr, &vkVertexBuffer) != VK_SUCCESS) {
-        std::cerr << "Failed to create a vertex buffer!" << std::endl;
+    // Allocate memory for the staging ring buffer.
+    // Host-visible blocks of the memory arena are persistently mapped,
+    // so the ring stays mapped until the application exits.
+    MemoryAllocation vkStagingRingBufferMemory = memoryArena.allocate(vkStagingRingBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+
+    // Bind the buffer to the allocated memory.
+    vkBindBufferMemory(vkDevice, vkStagingRingBuffer, vkStagingRingBufferMemory.memory, vkStagingRingBufferMemory.offset);
+    void* stagingRingData = vkStagingRingBufferMemory.mappedData;
+
+    // Create a command pool for transfer commands.
+    // Command buffers are re-recorded each time their segment is reused.
+    VkCommandPoolCreateInfo vkStagingRingPoolInfo{};
+    vkStagingRingPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    vkStagingRingPoolInfo.queueFamilyIndex = queueFamilyIndices.transferFamily.value();
+    vkStagingRingPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT | VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    VkCommandPool vkStagingRingCommandPool;
+    if (vkCreateCommandPool(vkDevice, &vkStagingRingPoolInfo, nullptr, &vkStagingRingCommandPool) != VK_SUCCESS) {
+        std::cerr << "Failed to create a command pool!" << std::endl;
+        abort();
+    }
+
+    // Create one command buffer per segment.
+    std::array< VkCommandBuffer, STAGING_RING_SEGMENT_COUNT > vkStagingRingCmdBuffers;
+    VkCommandBufferAllocateInfo vkStagingRingCmdBufAllocateInfo{};
+    vkStagingRingCmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    vkStagingRingCmdBufAllocateInfo.commandPool = vkStagingRingCommandPool;
+    vkStagingRingCmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    vkStagingRingCmdBufAllocateInfo.commandBufferCount = static_cast< uint32_t >(vkStagingRingCmdBuffers.size());
+    if (vkAllocateCommandBuffers(vkDevice, &vkStagingRingCmdBufAllocateInfo, vkStagingRingCmdBuffers.data()) != VK_SUCCESS) {
+        std::cerr << "Failed to allocate command buffers!" << std::endl;
         abort();
     }
 
-    // Retrieve memory requirements for the vertex buffer.
-    VkMemoryRequirements vkVertexBufferMemRequirements;
-    vkGetBufferMemoryRequirements(vkDevice, vkVertexBuffer, &vkVertexBufferMemRequirements);
+    // Create one fence per segment.
+    // Fences are created signaled, so the first use of each segment does not wait.
+    std::array< VkFence, STAGING_RING_SEGMENT_COUNT > vkStagingRingFences;
+    VkFenceCreateInfo vkStagingRingFenceInfo {};
+    vkStagingRingFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    vkStagingRingFenceInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+    for (auto& fence : vkStagingRingFences) {
+        if (vkCreateFence(vkDevice, &vkStagingRingFenceInfo, nullptr, &fence) != VK_SUCCESS) {
+            std::cerr << "Failed to create a fence!" << std::endl;
+            abort();
+        }
+    }
 
-    // Define memory allocate info.
-    VkMemoryAllocateInfo vkVertexBufferAllocInfo{};
-    vkVertexBufferAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkVertexBufferAllocInfo.allocationSize = vkVertexBufferMemRequirements.size;
+    // Index of the segment that will be used for the next chunk.
+    size_t stagingRingSegment = 0;
+
+    // Upload size bytes into dstBuffer starting from dstOffset.
+    // The fillChunk callback writes a chunk of the data into the mapped staging memory.
+    // It receives a pointer to write into, offset of the chunk in the source data and its size.
+    auto uploadToBuffer = [&](VkBuffer dstBuffer, VkDeviceSize dstOffset, VkDeviceSize size, const std::function< void(void*, VkDeviceSize, VkDeviceSize) >& fillChunk) {
+        for (VkDeviceSize offset = 0; offset < size; offset += STAGING_RING_SEGMENT_SIZE) {
+            const VkDeviceSize chunkSize = std::min(STAGING_RING_SEGMENT_SIZE, size - offset);
+
+            // Wait until the transfer queue finishes the previous copy from this segment.
+            VkFence vkSegmentFence = vkStagingRingFences[stagingRingSegment];
+            vkWaitForFences(vkDevice, 1, &vkSegmentFence, VK_TRUE, UINT64_MAX);
+            vkResetFences(vkDevice, 1, &vkSegmentFence);
+
+            // Fill the segment.
+            const VkDeviceSize segmentOffset = STAGING_RING_SEGMENT_SIZE * stagingRingSegment;
+            fillChunk(static_cast< char* >(stagingRingData) + segmentOffset, offset, chunkSize);
+
+            // Record a copy command.
+            VkCommandBuffer vkSegmentCmdBuffer = vkStagingRingCmdBuffers[stagingRingSegment];
+            vkResetCommandBuffer(vkSegmentCmdBuffer, 0);
+            VkCommandBufferBeginInfo vkSegmentCmdBufferBeginInfo {};
+            vkSegmentCmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            vkSegmentCmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(vkSegmentCmdBuffer, &vkSegmentCmdBufferBeginInfo) != VK_SUCCESS) {
+                std::cerr << "Failed to begin a command buffer!" << std::endl;
+                abort();
+            }
+            VkBufferCopy copyRegion{};
+            copyRegion.srcOffset = segmentOffset;
+            copyRegion.dstOffset = dstOffset + offset;
+            copyRegion.size = chunkSize;
+            vkCmdCopyBuffer(vkSegmentCmdBuffer, vkStagingRingBuffer, dstBuffer, 1, &copyRegion);
+            if (vkEndCommandBuffer(vkSegmentCmdBuffer) != VK_SUCCESS) {
+                std::cerr << "Failed to end a command buffer!" << std::endl;
+                abort();
+            }
 
-    // Find a suitable memory type.
-    uint32_t vkVertexBufferMemTypeIndex = UINT32_MAX;
-    VkMemoryPropertyFlags vkVertexBufferMemFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkVertexBufferMemRequirements.memoryTypeBits & (1 << i)) &&
-                (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & vkVertexBufferMemFlags) == vkVertexBufferMemFlags) {
-            vkVertexBufferMemTypeIndex = i;
-            break;
+            // Submit the copy without waiting for it.
+            VkSubmitInfo vkSegmentSubmitInfo{};
+            vkSegmentSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            vkSegmentSubmitInfo.commandBufferCount = 1;
+            vkSegmentSubmitInfo.pCommandBuffers = &vkSegmentCmdBuffer;
+            if (vkQueueSubmit(vkTransferQueue, 1, &vkSegmentSubmitInfo, vkSegmentFence) != VK_SUCCESS) {
+                std::cerr << "Failed to submit a transfer!" << std::endl;
+                abort();
+            }
+
+            // Switch to the next segment.
+            stagingRingSegment = (stagingRingSegment + 1) % STAGING_RING_SEGMENT_COUNT;
+        }
+    };
+
+    // Upload data from the host memory into dstBuffer.
+    auto uploadDataToBuffer = [&](VkBuffer dstBuffer, const void* data, VkDeviceSize size) {
+        uploadToBuffer(dstBuffer, 0, size, [&](void* chunk, VkDeviceSize offset, VkDeviceSize chunkSize) {
+            memcpy(chunk, static_cast< const char* >(data) + offset, static_cast< size_t >(chunkSize));
+        });
+    };
+
+    // Wait until all pending uploads are finished, so the uploaded buffers can be used.
+    auto flushUploads = [&]() {
+        if (vkWaitForFences(vkDevice, static_cast< uint32_t >(vkStagingRingFences.size()), vkStagingRingFences.data(), VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            std::cerr << "Failed to wait for a fence!" << std::endl;
+            abort();
+        }
+    };
+
+    // Assets are mapped into the address space instead of being read.
+    // With an archive startup maps one file and reads it sequentially,
+    // instead of opening and reading every shader and mesh on its own.
+    AssetReader assetReader;
+    if (!assetArchivePath.empty()) {
+        if (!assetReader.openArchive(assetArchivePath)) {
+            std::cerr << "Failed to open the asset archive " << assetArchivePath << "!" << std::endl;
+            abort();
+        }
+        std::cout << "Loading assets from " << assetArchivePath << " (" << assetReader.archiveAssets.size() << " assets)" << std::endl;
+    }
+
+    // Each mesh file is loaded in the same way. If no files are given,
+    // we load the built-in cube, which is denoted by an empty path.
+    std::vector< Mesh > meshes;
+    std::vector< std::string > meshSources = meshFilePaths;
+    if (meshSources.empty()) {
+        meshSources.push_back("");
+    }
+    for (const std::string& meshFilePath : meshSources) {
+        // -------------------
+        // 2: Map a mesh file
+        // -------------------
+
+        // Mesh data in the format described by MeshFileHeader and the position of the next read in it.
+        AssetView meshData;
+        size_t meshReadOffset = 0;
+        // Serialized built-in cube, it should live as long as the view.
+        std::string cubeData;
+        if (!meshFilePath.empty()) {
+            // Find the mesh in the archive or map its file.
+            meshData = assetReader.find(meshFilePath);
+            if (meshData.data == nullptr) {
+                std::cerr << "Mesh file " << meshFilePath << " not found!" << std::endl;
+                abort();
+            }
+        } else {
+            // Create a cube specifying its vertices.
+            const std::vector< glm::vec3 > cubeVertices
+            {
+                { -0.5f, -0.5f, -0.5f },
+                { -0.5f,  0.5f, -0.5f },
+                {  0.5f, -0.5f, -0.5f },
+                {  0.5f,  0.5f, -0.5f },
+                { -0.5f, -0.5f,  0.5f },
+                { -0.5f,  0.5f,  0.5f },
+                {  0.5f, -0.5f,  0.5f },
+                {  0.5f,  0.5f,  0.5f },
+            };
+            // Each triplet of indices represents one triangle.
+            const std::vector< uint16_t > cubeIndices
+            {
+                0, 1, 2,  3, 2, 1,
+                0, 4, 1,  5, 1, 4,
+                6, 2, 7,  3, 7, 2,
+                5, 4, 7,  6, 7, 4,
+                3, 1, 7,  5, 7, 1,
+                4, 0, 2,  4, 2, 6,
+            };
+            // Serialize the cube into the mesh file format, so it goes through the same loading path.
+            // Vertices are shared by faces, so the cube has no vertex normals and uses version 1,
+            // shaders compute face normals for it.
+            MeshFileHeader cubeHeader{};
+            cubeHeader.magic = MESH_FILE_MAGIC;
+            cubeHeader.version = 1;
+            cubeHeader.vertexCount = static_cast< uint32_t >(cubeVertices.size());
+            cubeHeader.indexCount = static_cast< uint32_t >(cubeIndices.size());
+            cubeHeader.indexSize = sizeof(uint16_t);
+            cubeData.append(reinterpret_cast< const char* >(&cubeHeader), sizeof(cubeHeader));
+            cubeData.append(reinterpret_cast< const char* >(cubeVertices.data()), sizeof(cubeVertices[0]) * cubeVertices.size());
+            cubeData.append(reinterpret_cast< const char* >(cubeIndices.data()), sizeof(cubeIndices[0]) * cubeIndices.size());
+            meshData.data = reinterpret_cast< const uint8_t* >(cubeData.data());
+            meshData.size = cubeData.size();
+        }
+
+        // Read and validate the header.
+        MeshFileHeader meshHeader{};
+        if (meshData.size >= sizeof(meshHeader)) {
+            memcpy(&meshHeader, meshData.data, sizeof(meshHeader));
+            meshReadOffset = sizeof(meshHeader);
+        }
+        if (meshReadOffset == 0 || meshHeader.magic != MESH_FILE_MAGIC || meshHeader.version < 1 || meshHeader.version > MESH_FILE_VERSION) {
+            std::cerr << "Invalid mesh file header!" << std::endl;
+            abort();
+        }
+        if ((meshHeader.indexSize != sizeof(uint16_t) && meshHeader.indexSize != sizeof(uint32_t)) ||
+                meshHeader.vertexCount == 0 || meshHeader.indexCount == 0 || meshHeader.indexCount % 3 != 0) {
+            std::cerr << "Invalid mesh geometry description!" << std::endl;
+            abort();
+        }
+        const VkIndexType meshIndexType = (meshHeader.indexSize == sizeof(uint16_t)) ? VK_INDEX_TYPE_UINT16 : VK_INDEX_TYPE_UINT32;
+
+        const bool meshHasAttributes = meshHeader.version >= 2;
+
+        // Calculate buffer sizes.
+        VkDeviceSize vertexBufferSize = sizeof(glm::vec3) * meshHeader.vertexCount;
+        VkDeviceSize indexBufferSize = static_cast< VkDeviceSize >(meshHeader.indexSize) * meshHeader.indexCount;
+        VkDeviceSize attributeBufferSize = sizeof(VertexAttributes) * meshHeader.vertexCount;
+
+        // ---------------------------------------------
+        // 3: Create device-local vertex and index buffers
+        // ---------------------------------------------
+
+        // Describe a vertex buffer.
+        // It will be filled by transfer commands, so it should be a transfer destination.
+        // Closest hit shaders read it as a storage buffer.
+        VkBufferCreateInfo vkVertexBufferInfo{};
+        vkVertexBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkVertexBufferInfo.size = vertexBufferSize;
+        vkVertexBufferInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | buildInputBufferUsage;
+        vkVertexBufferInfo.sharingMode = uploadSharingMode;
+        vkVertexBufferInfo.queueFamilyIndexCount = static_cast< uint32_t >(uploadQueueFamilies.size());
+        vkVertexBufferInfo.pQueueFamilyIndices = uploadQueueFamilies.data();
+
+        // Create a vertex buffer.
+        VkBuffer vkVertexBuffer;
+        if (vkCreateBuffer(vkDevice, &vkVertexBufferInfo, nullptr, &vkVertexBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create a vertex buffer!" << std::endl;
+            abort();
+        }
+
+        // Retrieve memory requirements for the vertex buffer.
+        VkMemoryRequirements vkVertexBufferMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, vkVertexBuffer, &vkVertexBufferMemRequirements);
+
+        // Allocate memory for the vertex buffer.
+        MemoryAllocation vkVertexBufferMemory = memoryArena.allocate(vkVertexBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        // Bind the buffer to the allocated memory.
+        vkBindBufferMemory(vkDevice, vkVertexBuffer, vkVertexBufferMemory.memory, vkVertexBufferMemory.offset);
+
+        // Describe an index buffer.
+        // Shaders read 16-bit indices in pairs packed into 32-bit words,
+        // so the buffer size is rounded up to whole words.
+        VkBufferCreateInfo vkIndexBufferInfo{};
+        vkIndexBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkIndexBufferInfo.size = (indexBufferSize + sizeof(uint32_t) - 1) / sizeof(uint32_t) * sizeof(uint32_t);
+        vkIndexBufferInfo.usage = VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | buildInputBufferUsage;
+        vkIndexBufferInfo.sharingMode = uploadSharingMode;
+        vkIndexBufferInfo.queueFamilyIndexCount = static_cast< uint32_t >(uploadQueueFamilies.size());
+        vkIndexBufferInfo.pQueueFamilyIndices = uploadQueueFamilies.data();
+
+        // Create an index buffer.
+        VkBuffer vkIndexBuffer;
+        if (vkCreateBuffer(vkDevice, &vkIndexBufferInfo, nullptr, &vkIndexBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create an index buffer!" << std::endl;
+            abort();
+        }
+
+        // Retrieve memory requirements for the index buffer.
+        VkMemoryRequirements vkIndexBufferMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, vkIndexBuffer, &vkIndexBufferMemRequirements);
+
+        // Allocate memory for the index buffer.
+        MemoryAllocation vkIndexBufferMemory = memoryArena.allocate(vkIndexBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        // Bind the buffer to the allocated memory.
+        vkBindBufferMemory(vkDevice, vkIndexBuffer, vkIndexBufferMemory.memory, vkIndexBufferMemory.offset);
+
+        // Describe an attribute buffer if the mesh has attributes.
+        // Only closest hit shaders read it.
+        VkBuffer vkAttributeBuffer = VK_NULL_HANDLE;
+        MemoryAllocation vkAttributeBufferMemory{};
+        if (meshHasAttributes) {
+            VkBufferCreateInfo vkAttributeBufferInfo{};
+            vkAttributeBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+            vkAttributeBufferInfo.size = attributeBufferSize;
+            vkAttributeBufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            vkAttributeBufferInfo.sharingMode = uploadSharingMode;
+            vkAttributeBufferInfo.queueFamilyIndexCount = static_cast< uint32_t >(uploadQueueFamilies.size());
+            vkAttributeBufferInfo.pQueueFamilyIndices = uploadQueueFamilies.data();
+
+            // Create an attribute buffer.
+            if (vkCreateBuffer(vkDevice, &vkAttributeBufferInfo, nullptr, &vkAttributeBuffer) != VK_SUCCESS) {
+                std::cerr << "Failed to create an attribute buffer!" << std::endl;
+                abort();
+            }
+
+            // Retrieve memory requirements for the attribute buffer.
+            VkMemoryRequirements vkAttributeBufferMemRequirements;
+            vkGetBufferMemoryRequirements(vkDevice, vkAttributeBuffer, &vkAttributeBufferMemRequirements);
+
+            // Allocate memory for the attribute buffer.
+            vkAttributeBufferMemory = memoryArena.allocate(vkAttributeBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+            // Bind the buffer to the allocated memory.
+            vkBindBufferMemory(vkDevice, vkAttributeBuffer, vkAttributeBufferMemory.memory, vkAttributeBufferMemory.offset);
+        }
+
+        // ---------------------------
+        // 4: Stream the mesh data
+        // ---------------------------
+
+        // Upload the given amount of bytes from the mapped mesh into the destination buffer.
+        // Each chunk is copied from mapped pages directly into the mapped staging memory.
+        auto streamMeshData = [&](VkBuffer dstBuffer, VkDeviceSize size) {
+            if (size > meshData.size - meshReadOffset) {
+                std::cerr << "Unexpected end of the mesh file!" << std::endl;
+                abort();
+            }
+            const uint8_t* source = meshData.data + meshReadOffset;
+            uploadToBuffer(dstBuffer, 0, size, [&](void* chunk, VkDeviceSize offset, VkDeviceSize chunkSize) {
+                memcpy(chunk, source + offset, static_cast< size_t >(chunkSize));
+            });
+            meshReadOffset += static_cast< size_t >(size);
+        };
+
+        // Vertices go first in the file, then indices and attributes.
+        streamMeshData(vkVertexBuffer, vertexBufferSize);
+
+        // Every index should refer to an existing vertex, the BLAS build and
+        // closest hit shaders would read past the vertex buffer otherwise.
+        // The indices are checked in the mapped file before they are uploaded.
+        if (indexBufferSize <= meshData.size - meshReadOffset) {
+            const uint8_t* indexData = meshData.data + meshReadOffset;
+            uint32_t maxIndex = 0;
+            for (uint32_t i = 0; i < meshHeader.indexCount; i++) {
+                uint32_t index = 0;
+                if (meshIndexType == VK_INDEX_TYPE_UINT16) {
+                    uint16_t index16;
+                    memcpy(&index16, indexData + i * sizeof(uint16_t), sizeof(uint16_t));
+                    index = index16;
+                } else {
+                    memcpy(&index, indexData + i * sizeof(uint32_t), sizeof(uint32_t));
+                }
+                maxIndex = std::max(maxIndex, index);
+            }
+            if (maxIndex >= meshHeader.vertexCount) {
+                std::cerr << "Mesh index " << maxIndex << " is out of " << meshHeader.vertexCount << " vertices!" << std::endl;
+                abort();
+            }
         }
+        streamMeshData(vkIndexBuffer, indexBufferSize);
+        if (meshHasAttributes) {
+            streamMeshData(vkAttributeBuffer, attributeBufferSize);
+        }
+
+        // Keep the mesh buffers, the BLAS is created later.
+        Mesh mesh{};
+        mesh.vertexCount = meshHeader.vertexCount;
+        mesh.indexCount = meshHeader.indexCount;
+        mesh.indexType = meshIndexType;
+        mesh.vertexBuffer = vkVertexBuffer;
+        mesh.vertexBufferMemory = vkVertexBufferMemory;
+        mesh.indexBuffer = vkIndexBuffer;
+        mesh.indexBufferMemory = vkIndexBufferMemory;
+        mesh.attributeBuffer = vkAttributeBuffer;
+        mesh.attributeBufferMemory = vkAttributeBufferMemory;
+        meshes.push_back(mesh);
+    }
+
+    // Closest hit shaders fetch vertices and indices of the hit mesh by themselves,
+    // so they should know the index size and whether the mesh has attributes.
+    std::vector< MeshShaderInfo > meshShaderInfos;
+    for (const Mesh& mesh : meshes) {
+        MeshShaderInfo info{};
+        info.indexSize = (mesh.indexType == VK_INDEX_TYPE_UINT16) ? sizeof(uint16_t) : sizeof(uint32_t);
+        info.hasAttributes = (mesh.attributeBuffer != VK_NULL_HANDLE) ? 1 : 0;
+        meshShaderInfos.push_back(info);
     }
-    vkVertexBufferAllocInfo.memoryTypeIndex = vkVertexBufferMemTypeIndex;
 
-    // Allocate memory for the vertex buffer.
-    VkDeviceMemory vkVertexBufferMemory;
-    if (vkAllocateMemory(vkDevice, &vkVertexBufferAllocInfo, nullptr, &vkVertexBufferMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory for the vertex buffer!" << std::endl;
+    // Describe a mesh info buffer.
+    VkBufferCreateInfo vkMeshInfoBufferInfo{};
+    vkMeshInfoBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vkMeshInfoBufferInfo.size = sizeof(MeshShaderInfo) * meshShaderInfos.size();
+    vkMeshInfoBufferInfo.usage = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    vkMeshInfoBufferInfo.sharingMode = uploadSharingMode;
+    vkMeshInfoBufferInfo.queueFamilyIndexCount = static_cast< uint32_t >(uploadQueueFamilies.size());
+    vkMeshInfoBufferInfo.pQueueFamilyIndices = uploadQueueFamilies.data();
+
+    // Create a mesh info buffer.
+    VkBuffer vkMeshInfoBuffer;
+    if (vkCreateBuffer(vkDevice, &vkMeshInfoBufferInfo, nullptr, &vkMeshInfoBuffer) != VK_SUCCESS) {
+        std::cerr << "Failed to create a mesh info buffer!" << std::endl;
         abort();
     }
 
-    // Bind the buffer to the allocated memory.
-    vkBindBufferMemory(vkDevice, vkVertexBuffer, vkVertexBufferMemory, 0);
+    // Retrieve memory requirements for the mesh info buffer.
+    VkMemoryRequirements vkMeshInfoBufferMemRequirements;
+    vkGetBufferMemoryRequirements(vkDevice, vkMeshInfoBuffer, &vkMeshInfoBufferMemRequirements);
+
+    // Allocate memory for the mesh info buffer.
+    MemoryAllocation vkMeshInfoBufferMemory = memoryArena.allocate(vkMeshInfoBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
 
-    // Copy our vertices to the allocated memory.
-    void* vertexBufferMemoryData;
-    vkMapMemory(vkDevice, vkVertexBufferMemory, 0, vertexBufferSize, 0, &vertexBufferMemoryData);
-    memcpy(vertexBufferMemoryData, vertices.data(), (size_t) vertexBufferSize);
-    vkUnmapMemory(vkDevice, vkVertexBufferMemory);
+    // Bind the buffer to the allocated memory and upload infos.
+    vkBindBufferMemory(vkDevice, vkMeshInfoBuffer, vkMeshInfoBufferMemory.memory, vkMeshInfoBufferMemory.offset);
+    uploadDataToBuffer(vkMeshInfoBuffer, meshShaderInfos.data(), vkMeshInfoBufferInfo.size);
 
     // ==========================================================================
     //                    STEP 14: Import extension function
@@ -835,6 +3315,8 @@ int main()
     // in the particular device. Instead we can retrieve a pointer to the
     // extension function via vkGetDeviceProcAddr() call.
     // For ray tracing we would need a couple of them.
+    // Only functions of the selected ray tracing backend are available,
+    // pointers to the other ones stay null and are never called.
     // ==========================================================================
 
     PFN_vkCreateAccelerationStructureNV vkCreateAccelerationStructureNV = reinterpret_cast<PFN_vkCreateAccelerationStructureNV>(vkGetDeviceProcAddr(vkDevice, "vkCreateAccelerationStructureNV"));
@@ -843,100 +3325,235 @@ int main()
     PFN_vkGetAccelerationStructureHandleNV vkGetAccelerationStructureHandleNV = reinterpret_cast<PFN_vkGetAccelerationStructureHandleNV>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureHandleNV"));
     PFN_vkGetAccelerationStructureMemoryRequirementsNV vkGetAccelerationStructureMemoryRequirementsNV = reinterpret_cast<PFN_vkGetAccelerationStructureMemoryRequirementsNV>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureMemoryRequirementsNV"));
     PFN_vkCmdBuildAccelerationStructureNV vkCmdBuildAccelerationStructureNV = reinterpret_cast<PFN_vkCmdBuildAccelerationStructureNV>(vkGetDeviceProcAddr(vkDevice, "vkCmdBuildAccelerationStructureNV"));
+    PFN_vkCmdWriteAccelerationStructuresPropertiesNV vkCmdWriteAccelerationStructuresPropertiesNV = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesNV>(vkGetDeviceProcAddr(vkDevice, "vkCmdWriteAccelerationStructuresPropertiesNV"));
+    PFN_vkCmdCopyAccelerationStructureNV vkCmdCopyAccelerationStructureNV = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureNV>(vkGetDeviceProcAddr(vkDevice, "vkCmdCopyAccelerationStructureNV"));
     PFN_vkCreateRayTracingPipelinesNV vkCreateRayTracingPipelinesNV = reinterpret_cast<PFN_vkCreateRayTracingPipelinesNV>(vkGetDeviceProcAddr(vkDevice, "vkCreateRayTracingPipelinesNV"));
     PFN_vkGetRayTracingShaderGroupHandlesNV vkGetRayTracingShaderGroupHandlesNV = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesNV>(vkGetDeviceProcAddr(vkDevice, "vkGetRayTracingShaderGroupHandlesNV"));
     PFN_vkCmdTraceRaysNV vkCmdTraceRaysNV = reinterpret_cast<PFN_vkCmdTraceRaysNV>(vkGetDeviceProcAddr(vkDevice, "vkCmdTraceRaysNV"));
 
+    // Functions of the KHR backend.
+    PFN_vkGetBufferDeviceAddress vkGetBufferDeviceAddress = reinterpret_cast<PFN_vkGetBufferDeviceAddress>(vkGetDeviceProcAddr(vkDevice, "vkGetBufferDeviceAddress"));
+    PFN_vkCreateAccelerationStructureKHR vkCreateAccelerationStructureKHR = reinterpret_cast<PFN_vkCreateAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkCreateAccelerationStructureKHR"));
+    PFN_vkDestroyAccelerationStructureKHR vkDestroyAccelerationStructureKHR = reinterpret_cast<PFN_vkDestroyAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkDestroyAccelerationStructureKHR"));
+    PFN_vkGetAccelerationStructureBuildSizesKHR vkGetAccelerationStructureBuildSizesKHR = reinterpret_cast<PFN_vkGetAccelerationStructureBuildSizesKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureBuildSizesKHR"));
+    PFN_vkGetAccelerationStructureDeviceAddressKHR vkGetAccelerationStructureDeviceAddressKHR = reinterpret_cast<PFN_vkGetAccelerationStructureDeviceAddressKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetAccelerationStructureDeviceAddressKHR"));
+    PFN_vkCmdBuildAccelerationStructuresKHR vkCmdBuildAccelerationStructuresKHR = reinterpret_cast<PFN_vkCmdBuildAccelerationStructuresKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdBuildAccelerationStructuresKHR"));
+    PFN_vkCmdWriteAccelerationStructuresPropertiesKHR vkCmdWriteAccelerationStructuresPropertiesKHR = reinterpret_cast<PFN_vkCmdWriteAccelerationStructuresPropertiesKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdWriteAccelerationStructuresPropertiesKHR"));
+    PFN_vkCmdCopyAccelerationStructureKHR vkCmdCopyAccelerationStructureKHR = reinterpret_cast<PFN_vkCmdCopyAccelerationStructureKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdCopyAccelerationStructureKHR"));
+    PFN_vkCreateRayTracingPipelinesKHR vkCreateRayTracingPipelinesKHR = reinterpret_cast<PFN_vkCreateRayTracingPipelinesKHR>(vkGetDeviceProcAddr(vkDevice, "vkCreateRayTracingPipelinesKHR"));
+    PFN_vkGetRayTracingShaderGroupHandlesKHR vkGetRayTracingShaderGroupHandlesKHR = reinterpret_cast<PFN_vkGetRayTracingShaderGroupHandlesKHR>(vkGetDeviceProcAddr(vkDevice, "vkGetRayTracingShaderGroupHandlesKHR"));
+    PFN_vkCmdTraceRaysKHR vkCmdTraceRaysKHR = reinterpret_cast<PFN_vkCmdTraceRaysKHR>(vkGetDeviceProcAddr(vkDevice, "vkCmdTraceRaysKHR"));
+
     // ==========================================================================
     //                    STEP 15: Create a BLAS
     // ==========================================================================
     // Bottom level acceleration structure describes geometry of an object
     // regardles to its position in the world space.
     // So each unique type of objects is described by its own BLAS.
+    // We create one BLAS per loaded mesh.
     // ==========================================================================
 
-    // First we need to describe geometry of the object.
-    // Geometry refers to the vertex buffer and could be either indexed or not indexed.
-    // We use not indexed geometry for simplicity.
-    VkGeometryNV geometry{};
-    geometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
-    geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_NV;
-    geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_GEOMETRY_TRIANGLES_NV;
-    geometry.geometry.triangles.vertexData = vkVertexBuffer;
-    geometry.geometry.triangles.vertexOffset = 0;
-    geometry.geometry.triangles.vertexCount = static_cast<uint32_t>(vertices.size());
-    geometry.geometry.triangles.vertexStride = sizeof(glm::vec3);
-    geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
-    geometry.geometry.triangles.indexType = VK_INDEX_TYPE_NONE_NV;
-    geometry.geometry.triangles.transformData = VK_NULL_HANDLE;
-    geometry.geometry.triangles.transformOffset = 0;
-    geometry.geometry.aabbs = {};
-    geometry.geometry.aabbs.sType = { VK_STRUCTURE_TYPE_GEOMETRY_AABB_NV };
-    geometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
+    // The geometry is static, so BLASes may be compacted after the build.
+    VkBuildAccelerationStructureFlagsNV blasBuildFlags = VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_NV;
+    if (compactBlas) {
+        blasBuildFlags |= VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_COMPACTION_BIT_NV;
+    }
 
-    // Fill in acceleration structure info.
+    // Fill in acceleration structure info for the given mesh.
     // For blas we provide geometry and ignore instances.
-    VkAccelerationStructureInfoNV blasInfo{};
-    blasInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
-    blasInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
-    blasInfo.instanceCount = 0;
-    blasInfo.geometryCount = 1;
-    blasInfo.pGeometries = &geometry;
-
-    // Acceleration structure create info.
-    VkAccelerationStructureCreateInfoNV blasCreateInfo{};
-    blasCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
-    blasCreateInfo.info = blasInfo;
-    VkAccelerationStructureNV vkBottomLevelAccelerationStructure;
-    if (vkCreateAccelerationStructureNV(vkDevice, &blasCreateInfo, nullptr, &vkBottomLevelAccelerationStructure) != VK_SUCCESS) {
-        std::cerr << "Failed to create a bottom level acceleration structure!" << std::endl;
-        abort();
-    }
+    auto getBlasInfo = [&](const Mesh& mesh) {
+        VkAccelerationStructureInfoNV blasInfo{};
+        blasInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+        blasInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
+        blasInfo.flags = blasBuildFlags;
+        blasInfo.instanceCount = 0;
+        blasInfo.geometryCount = 1;
+        blasInfo.pGeometries = &mesh.geometry;
+        return blasInfo;
+    };
 
-    // Get memory requirements.
-    VkAccelerationStructureMemoryRequirementsInfoNV blasMemoryRequirementsInfo{};
-    blasMemoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
-    blasMemoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_OBJECT_NV;
-    blasMemoryRequirementsInfo.accelerationStructure = vkBottomLevelAccelerationStructure;
-    VkMemoryRequirements2 blasMemoryRequirements2{};
-    blasMemoryRequirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
-    vkGetAccelerationStructureMemoryRequirementsNV(vkDevice, &blasMemoryRequirementsInfo, &blasMemoryRequirements2);
-
-    // Find a suitable memory type.
-    VkMemoryAllocateInfo blasMemoryAllocateInfo{};
-    blasMemoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    blasMemoryAllocateInfo.allocationSize = blasMemoryRequirements2.memoryRequirements.size;
-    uint32_t colorImageMemoryTypeIndex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((blasMemoryRequirements2.memoryRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
-            colorImageMemoryTypeIndex = i;
-            break;
+    // Memory requirements of acceleration structures are retrieved in the same way.
+    auto getAccelerationStructureMemoryRequirements = [&](VkAccelerationStructureNV accelerationStructure, VkAccelerationStructureMemoryRequirementsTypeNV type) {
+        VkAccelerationStructureMemoryRequirementsInfoNV memoryRequirementsInfo{};
+        memoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
+        memoryRequirementsInfo.type = type;
+        memoryRequirementsInfo.accelerationStructure = accelerationStructure;
+        VkMemoryRequirements2 memoryRequirements2{};
+        memoryRequirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
+        vkGetAccelerationStructureMemoryRequirementsNV(vkDevice, &memoryRequirementsInfo, &memoryRequirements2);
+        return memoryRequirements2.memoryRequirements;
+    };
+
+    // Create an acceleration structure of the NV backend, bind it to memory and get its handle.
+    // Scratch sizes are taken from memory requirements of the acceleration structure.
+    auto createAccelerationStructureNv = [&](AccelerationStructure& accelerationStructure, const VkAccelerationStructureCreateInfoNV& createInfo) {
+        if (vkCreateAccelerationStructureNV(vkDevice, &createInfo, nullptr, &accelerationStructure.nv) != VK_SUCCESS) {
+            std::cerr << "Failed to create an acceleration structure!" << std::endl;
+            abort();
         }
-    }
-    blasMemoryAllocateInfo.memoryTypeIndex = colorImageMemoryTypeIndex;
 
-    // Allocate memory for the acceleration structure.
-    VkDeviceMemory vkBlasMemory;
-    if (vkAllocateMemory(vkDevice, &blasMemoryAllocateInfo, nullptr, &vkBlasMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory!" << std::endl;
-        abort();
-    }
+        // Allocate memory for the acceleration structure.
+        accelerationStructure.memory = memoryArena.allocate(getAccelerationStructureMemoryRequirements(accelerationStructure.nv, VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_OBJECT_NV), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+        // Bind the acceleration structure to the memory.
+        VkBindAccelerationStructureMemoryInfoNV memoryInfo{};
+        memoryInfo.sType = VK_STRUCTURE_TYPE_BIND_ACCELERATION_STRUCTURE_MEMORY_INFO_NV;
+        memoryInfo.accelerationStructure = accelerationStructure.nv;
+        memoryInfo.memory = accelerationStructure.memory.memory;
+        memoryInfo.memoryOffset = accelerationStructure.memory.offset;
+        if (vkBindAccelerationStructureMemoryNV(vkDevice, 1, &memoryInfo) != VK_SUCCESS) {
+            std::cerr << "Failed to bind acceleration structure memory!" << std::endl;
+            abort();
+        }
 
-    // Bind bottom level acceleration structure to the memory.
-    VkBindAccelerationStructureMemoryInfoNV blasMemoryInfo{};
-    blasMemoryInfo.sType = VK_STRUCTURE_TYPE_BIND_ACCELERATION_STRUCTURE_MEMORY_INFO_NV;
-    blasMemoryInfo.accelerationStructure = vkBottomLevelAccelerationStructure;
-    blasMemoryInfo.memory = vkBlasMemory;
-    if (vkBindAccelerationStructureMemoryNV(vkDevice, 1, &blasMemoryInfo) != VK_SUCCESS) {
-        std::cerr << "Failed to bind bottom level acceleration structure memory!" << std::endl;
-        abort();
-    }
+        // Get acceleration structure handle.
+        if (vkGetAccelerationStructureHandleNV(vkDevice, accelerationStructure.nv, sizeof(uint64_t), &accelerationStructure.reference) != VK_SUCCESS) {
+            std::cerr << "Failed to get acceleration structure handle!" << std::endl;
+            abort();
+        }
 
-    // Get acceleration structure handle.
-    uint64_t vkBlasHandle;
-    if (vkGetAccelerationStructureHandleNV(vkDevice, vkBottomLevelAccelerationStructure, sizeof(uint64_t), &vkBlasHandle) != VK_SUCCESS) {
-        std::cerr << "Failed to get bottom level acceleration structure handle!" << std::endl;
-        abort();
+        // Remember how much scratch memory builds and updates need.
+        const VkMemoryRequirements buildScratchRequirements = getAccelerationStructureMemoryRequirements(accelerationStructure.nv, VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_BUILD_SCRATCH_NV);
+        const VkMemoryRequirements updateScratchRequirements = getAccelerationStructureMemoryRequirements(accelerationStructure.nv, VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_UPDATE_SCRATCH_NV);
+        accelerationStructure.buildScratchSize = buildScratchRequirements.size;
+        accelerationStructure.updateScratchSize = updateScratchRequirements.size;
+        accelerationStructure.scratchAlignment = std::max< VkDeviceSize >(buildScratchRequirements.alignment, 1);
+    };
+
+    // The KHR backend refers to buffers by their device addresses.
+    auto getBufferDeviceAddress = [&](VkBuffer buffer) {
+        VkBufferDeviceAddressInfo addressInfo{};
+        addressInfo.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+        addressInfo.buffer = buffer;
+        return vkGetBufferDeviceAddress(vkDevice, &addressInfo);
+    };
+
+    // Query sizes of a KHR acceleration structure and scratch memory for the given build.
+    // Returns the size of the acceleration structure itself.
+    auto getAccelerationStructureBuildSizes = [&](AccelerationStructure& accelerationStructure, const VkAccelerationStructureBuildGeometryInfoKHR& buildInfo, uint32_t primitiveCount) {
+        VkAccelerationStructureBuildSizesInfoKHR buildSizes{};
+        buildSizes.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_SIZES_INFO_KHR;
+        vkGetAccelerationStructureBuildSizesKHR(vkDevice, VK_ACCELERATION_STRUCTURE_BUILD_TYPE_DEVICE_KHR, &buildInfo, &primitiveCount, &buildSizes);
+        accelerationStructure.buildScratchSize = buildSizes.buildScratchSize;
+        accelerationStructure.updateScratchSize = buildSizes.updateScratchSize;
+        accelerationStructure.scratchAlignment = std::max< VkDeviceSize >(accelerationStructureProperties.minAccelerationStructureScratchOffsetAlignment, 1);
+        return buildSizes.accelerationStructureSize;
+    };
+
+    // Create an acceleration structure of the KHR backend.
+    // Unlike NV ones, KHR acceleration structures are placed into a buffer of the given size.
+    auto createAccelerationStructureKhr = [&](AccelerationStructure& accelerationStructure, VkAccelerationStructureTypeKHR type, VkDeviceSize size) {
+        // Describe a buffer keeping the acceleration structure.
+        VkBufferCreateInfo vkBufferInfo{};
+        vkBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkBufferInfo.size = size;
+        vkBufferInfo.usage = VK_BUFFER_USAGE_ACCELERATION_STRUCTURE_STORAGE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT;
+        vkBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(vkDevice, &vkBufferInfo, nullptr, &accelerationStructure.buffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create an acceleration structure buffer!" << std::endl;
+            abort();
+        }
+
+        // Allocate memory for the buffer and bind it.
+        VkMemoryRequirements vkMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, accelerationStructure.buffer, &vkMemRequirements);
+        accelerationStructure.memory = memoryArena.allocate(vkMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+        vkBindBufferMemory(vkDevice, accelerationStructure.buffer, accelerationStructure.memory.memory, accelerationStructure.memory.offset);
+
+        // Create the acceleration structure in the buffer.
+        VkAccelerationStructureCreateInfoKHR createInfo{};
+        createInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_KHR;
+        createInfo.buffer = accelerationStructure.buffer;
+        createInfo.offset = 0;
+        createInfo.size = size;
+        createInfo.type = type;
+        if (vkCreateAccelerationStructureKHR(vkDevice, &createInfo, nullptr, &accelerationStructure.khr) != VK_SUCCESS) {
+            std::cerr << "Failed to create an acceleration structure!" << std::endl;
+            abort();
+        }
+
+        // TLAS instances refer to the acceleration structure by its device address.
+        VkAccelerationStructureDeviceAddressInfoKHR addressInfo{};
+        addressInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_DEVICE_ADDRESS_INFO_KHR;
+        addressInfo.accelerationStructure = accelerationStructure.khr;
+        accelerationStructure.reference = vkGetAccelerationStructureDeviceAddressKHR(vkDevice, &addressInfo);
+    };
+
+    // Destroy an acceleration structure created by any of backends.
+    auto destroyAccelerationStructure = [&](AccelerationStructure& accelerationStructure) {
+        if (useKhrRayTracing) {
+            vkDestroyAccelerationStructureKHR(vkDevice, accelerationStructure.khr, nullptr);
+            vkDestroyBuffer(vkDevice, accelerationStructure.buffer, nullptr);
+        } else {
+            vkDestroyAccelerationStructureNV(vkDevice, accelerationStructure.nv, nullptr);
+        }
+        memoryArena.free(accelerationStructure.memory);
+    };
+
+    // Fill in build info of the KHR backend for the given mesh.
+    // Flags of both backends have the same values.
+    auto getBlasBuildInfoKhr = [&](const Mesh& mesh) {
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR;
+        buildInfo.flags = blasBuildFlags;
+        buildInfo.mode = VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR;
+        buildInfo.dstAccelerationStructure = mesh.blas.khr;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &mesh.geometryKhr;
+        return buildInfo;
+    };
+
+    for (Mesh& mesh : meshes) {
+        // The KHR backend describes the same geometry by device addresses of buffers
+        // and takes the size of the acceleration structure from the build info.
+        if (useKhrRayTracing) {
+            VkAccelerationStructureGeometryKHR& geometry = mesh.geometryKhr;
+            geometry = {};
+            geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+            geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_KHR;
+            geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_TRIANGLES_DATA_KHR;
+            geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+            geometry.geometry.triangles.vertexData.deviceAddress = getBufferDeviceAddress(mesh.vertexBuffer);
+            geometry.geometry.triangles.vertexStride = sizeof(glm::vec3);
+            geometry.geometry.triangles.maxVertex = mesh.vertexCount - 1;
+            geometry.geometry.triangles.indexType = mesh.indexType;
+            geometry.geometry.triangles.indexData.deviceAddress = getBufferDeviceAddress(mesh.indexBuffer);
+            geometry.geometry.triangles.transformData.deviceAddress = 0;
+            geometry.flags = VK_GEOMETRY_OPAQUE_BIT_KHR;
+
+            const VkDeviceSize blasSize = getAccelerationStructureBuildSizes(mesh.blas, getBlasBuildInfoKhr(mesh), mesh.indexCount / 3);
+            createAccelerationStructureKhr(mesh.blas, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, blasSize);
+            continue;
+        }
+
+        // First we need to describe geometry of the object.
+        // Geometry refers to the vertex buffer and could be either indexed or not indexed.
+        // We use indexed geometry to avoid duplicated vertices.
+        VkGeometryNV& geometry = mesh.geometry;
+        geometry.sType = VK_STRUCTURE_TYPE_GEOMETRY_NV;
+        geometry.geometryType = VK_GEOMETRY_TYPE_TRIANGLES_NV;
+        geometry.geometry.triangles.sType = VK_STRUCTURE_TYPE_GEOMETRY_TRIANGLES_NV;
+        geometry.geometry.triangles.vertexData = mesh.vertexBuffer;
+        geometry.geometry.triangles.vertexOffset = 0;
+        geometry.geometry.triangles.vertexCount = mesh.vertexCount;
+        geometry.geometry.triangles.vertexStride = sizeof(glm::vec3);
+        geometry.geometry.triangles.vertexFormat = VK_FORMAT_R32G32B32_SFLOAT;
+        geometry.geometry.triangles.indexData = mesh.indexBuffer;
+        geometry.geometry.triangles.indexOffset = 0;
+        geometry.geometry.triangles.indexCount = mesh.indexCount;
+        geometry.geometry.triangles.indexType = mesh.indexType;
+        geometry.geometry.triangles.transformData = VK_NULL_HANDLE;
+        geometry.geometry.triangles.transformOffset = 0;
+        geometry.geometry.aabbs = {};
+        geometry.geometry.aabbs.sType = { VK_STRUCTURE_TYPE_GEOMETRY_AABB_NV };
+        geometry.flags = VK_GEOMETRY_OPAQUE_BIT_NV;
+
+        // Acceleration structure create info.
+        VkAccelerationStructureCreateInfoNV blasCreateInfo{};
+        blasCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
+        blasCreateInfo.info = getBlasInfo(mesh);
+        createAccelerationStructureNv(mesh.blas, blasCreateInfo);
     }
 
     // ==========================================================================
@@ -950,149 +3567,148 @@ int main()
     // it is accessible by the GPU in the build stage.
     // ==========================================================================
 
+    // -------------------------------
+    // 1: Describe geometry instances
+    // -------------------------------
+
+    // Instances refer to BLASes of loaded meshes one by one and are placed into a cubic grid.
+    // The grid is scaled to fit into a unit cube, so the camera sees all instances.
+    const uint32_t instanceGridSize = static_cast< uint32_t >(std::ceil(std::cbrt(static_cast< double >(instanceCount)) - 1e-6));
+    const float instanceScale = 1.0f / instanceGridSize;
+
+    // Fill in instances for the given moment of time.
+    // Each instance rotates around its own vertical axis with a different phase.
+    auto writeInstances = [&](VkAccelerationStructureInstanceKHR* instances, float time) {
+        for (uint32_t i = 0; i < instanceCount; i++) {
+            // Position of the instance in the grid.
+            const glm::vec3 cell(i % instanceGridSize, (i / instanceGridSize) % instanceGridSize, i / (instanceGridSize * instanceGridSize));
+            const glm::vec3 position = (cell + glm::vec3(0.5f)) * instanceScale - glm::vec3(0.5f);
+            const float angle = time * INSTANCE_ROTATION_SPEED + i * 0.7f;
+            const glm::mat4 model = glm::translate(position) *
+                                    glm::rotate(angle, glm::vec3(0.0f, 0.0f, 1.0f)) *
+                                    glm::scale(glm::vec3(instanceScale * INSTANCE_FILL_FACTOR));
+
+            // Transformation is a row-major 3x4 matrix, while GLM stores matrices column by column.
+            VkTransformMatrixKHR transform;
+            for (int row = 0; row < 3; row++) {
+                for (int column = 0; column < 4; column++) {
+                    transform.matrix[row][column] = model[column][row];
+                }
+            }
+
+            // Create an instance of BLAS having the given transformation.
+            // Custom index tells shaders which mesh was hit.
+            // Record offset selects the hit record of the instance material in the shader binding table.
+            const uint32_t meshIndex = i % static_cast< uint32_t >(meshes.size());
+            VkAccelerationStructureInstanceKHR& geometryInstance = instances[i];
+            geometryInstance.transform = transform;
+            geometryInstance.instanceCustomIndex = meshIndex;
+            geometryInstance.mask = 0xff;
+            geometryInstance.instanceShaderBindingTableRecordOffset = i % static_cast< uint32_t >(MATERIALS.size());
+            geometryInstance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
+            geometryInstance.accelerationStructureReference = meshes[meshIndex].blas.reference;
+        }
+    };
+
     // -----------------------------
-    // 1: Create a geometry instance
+    // 2: Create instance buffers
     // -----------------------------
 
-    // Transformation that we want to apply to the created geometry.
-    // So far it is just a unit matrix.
-    VkTransformMatrixKHR transform = {
-        {
-            { 1.0f, 0.0f, 0.0f, 0.0f },
-            { 0.0f, 1.0f, 0.0f, 0.0f },
-            { 0.0f, 0.0f, 1.0f, 0.0f },
-        }
-    };
-
-    // Create an instance of BLAS having the given transformation.
-    VkAccelerationStructureInstanceKHR geometryInstance{};
-    geometryInstance.transform = transform;
-    geometryInstance.instanceCustomIndex = 0;
-    geometryInstance.mask = 0xff;
-    geometryInstance.instanceShaderBindingTableRecordOffset = 0;
-    geometryInstance.flags = VK_GEOMETRY_INSTANCE_TRIANGLE_CULL_DISABLE_BIT_NV;
-    geometryInstance.accelerationStructureReference = vkBlasHandle;
-
-    // Describe an intance buffer.
-    VkBufferCreateInfo vkInstanceBufferInfo{};
-    vkInstanceBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vkInstanceBufferInfo.size = sizeof(VkAccelerationStructureInstanceKHR);
-    vkInstanceBufferInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
-    vkInstanceBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    // ----------------------------
-    // 2: Create an instance buffer
-    // ----------------------------
-
-    // Create an instance buffer.
-    VkBuffer vkInstanceBufferHandle;
-    if (vkCreateBuffer(vkDevice, &vkInstanceBufferInfo, nullptr, &vkInstanceBufferHandle) != VK_SUCCESS) {
-        std::cerr << "Failed to create an instance buffer!" << std::endl;
-        abort();
-    }
-
-    // Retrieve memory requirements for the instance buffer.
-    VkMemoryRequirements vkInstanceBufferMemRequirements;
-    vkGetBufferMemoryRequirements(vkDevice, vkInstanceBufferHandle, &vkInstanceBufferMemRequirements);
+    // Instances move every frame, so the CPU rewrites the instance buffer before
+    // each TLAS update. To not overwrite data that is still read by a frame in flight,
+    // we create one instance buffer per frame in flight. The buffers are small and
+    // written every frame, so we keep them in host-visible memory and prefer
+    // memory that is device-local at the same time.
+    const VkDeviceSize instanceBufferSize = sizeof(VkAccelerationStructureInstanceKHR) * instanceCount;
+    auto createInstanceBuffer = [&](VkBuffer& buffer, MemoryAllocation& memory) {
+        // Describe an intance buffer.
+        VkBufferCreateInfo vkInstanceBufferInfo{};
+        vkInstanceBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkInstanceBufferInfo.size = instanceBufferSize;
+        vkInstanceBufferInfo.usage = useKhrRayTracing ? buildInputBufferUsage : VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
+        vkInstanceBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        // Create an instance buffer.
+        if (vkCreateBuffer(vkDevice, &vkInstanceBufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create an instance buffer!" << std::endl;
+            abort();
+        }
 
-    // Define memory allocate info.
-    VkMemoryAllocateInfo vkInstanceBufferAllocInfo{};
-    vkInstanceBufferAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkInstanceBufferAllocInfo.allocationSize = vkInstanceBufferMemRequirements.size;
+        // Retrieve memory requirements for the instance buffer.
+        VkMemoryRequirements vkInstanceBufferMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, buffer, &vkInstanceBufferMemRequirements);
 
-    // Find a suitable memory type.
-    VkMemoryPropertyFlags vkInstanceBufferMemoryFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT;
-    uint32_t instanceBufferMemoryTypeInex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkInstanceBufferMemRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & vkInstanceBufferMemoryFlags) == vkInstanceBufferMemoryFlags) {
-            instanceBufferMemoryTypeInex = i;
-            break;
-        }
-    }
-    vkInstanceBufferAllocInfo.memoryTypeIndex = instanceBufferMemoryTypeInex;
+        // Allocate memory for the instance buffer.
+        memory = memoryArena.allocate(vkInstanceBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-    // Allocate memory for the instance buffer.
-    VkDeviceMemory vkInstanceBufferMemory;
-    if (vkAllocateMemory(vkDevice, &vkInstanceBufferAllocInfo, nullptr, &vkInstanceBufferMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory for the instance buffer!" << std::endl;
-        abort();
+        // Bind the buffer to the allocated memory.
+        vkBindBufferMemory(vkDevice, buffer, memory.memory, memory.offset);
+    };
+    std::array< VkBuffer, MAX_FRAMES_IN_FLIGHT > vkInstanceBuffers;
+    std::array< MemoryAllocation, MAX_FRAMES_IN_FLIGHT > vkInstanceBufferMemories;
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        createInstanceBuffer(vkInstanceBuffers[i], vkInstanceBufferMemories[i]);
     }
 
-    // Bind the buffer to the allocated memory.
-    vkBindBufferMemory(vkDevice, vkInstanceBufferHandle, vkInstanceBufferMemory, 0);
-
-    // Copy our geometry to the allocated memory.
-    void* instanceBufferMemoryData;
-    vkMapMemory(vkDevice, vkInstanceBufferMemory, 0, sizeof(geometryInstance), 0, &instanceBufferMemoryData);
-    memcpy(instanceBufferMemoryData, &geometryInstance, sizeof(geometryInstance));
-    vkUnmapMemory(vkDevice, vkInstanceBufferMemory);
+    // The first build runs on the compute queue in parallel with the first frames,
+    // which already rewrite per-frame instance buffers. So the build reads initial
+    // positions of instances from its own buffer released after the build.
+    VkBuffer vkBuildInstanceBuffer;
+    MemoryAllocation vkBuildInstanceBufferMemory;
+    createInstanceBuffer(vkBuildInstanceBuffer, vkBuildInstanceBufferMemory);
+    writeInstances(static_cast< VkAccelerationStructureInstanceKHR* >(vkBuildInstanceBufferMemory.mappedData), 0.0f);
 
     // --------------
     // 3: Create TLAS
     // --------------
 
+    // The TLAS is refitted every frame, so it should allow updates.
+    const VkBuildAccelerationStructureFlagsNV tlasBuildFlags = VK_BUILD_ACCELERATION_STRUCTURE_ALLOW_UPDATE_BIT_NV | VK_BUILD_ACCELERATION_STRUCTURE_PREFER_FAST_TRACE_BIT_NV;
+
     // Fill in acceleration structure info.
     // For tlas we provide intances and ignore geometry.
     VkAccelerationStructureInfoNV tlasInfo{};
     tlasInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
     tlasInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV;
-    tlasInfo.instanceCount = 1;
+    tlasInfo.flags = tlasBuildFlags;
+    tlasInfo.instanceCount = instanceCount;
     tlasInfo.geometryCount = 0;
 
-    // Acceleration structure create info.
-    VkAccelerationStructureCreateInfoNV tlasCreateInfo{};
-    tlasCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
-    tlasCreateInfo.info = tlasInfo;
-    VkAccelerationStructureNV vkTopLevelAccelerationStructure;
-    if (vkCreateAccelerationStructureNV(vkDevice, &tlasCreateInfo, nullptr, &vkTopLevelAccelerationStructure) != VK_SUCCESS) {
-        std::cerr << "Failed to create a top level acceleration structure!" << std::endl;
-        abort();
-    }
-
-    // Get memory requirements.
-    VkAccelerationStructureMemoryRequirementsInfoNV tlasMemoryRequirementsInfo{};
-    tlasMemoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
-    tlasMemoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_OBJECT_NV;
-    tlasMemoryRequirementsInfo.accelerationStructure = vkTopLevelAccelerationStructure;
-    VkMemoryRequirements2 tlasMemoryRequirements2{};
-    tlasMemoryRequirements2.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
-    vkGetAccelerationStructureMemoryRequirementsNV(vkDevice, &tlasMemoryRequirementsInfo, &tlasMemoryRequirements2);
-
-    // Find a suitable memory type.
-    VkMemoryAllocateInfo tlasMemoryAllocateInfo{};
-    tlasMemoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    tlasMemoryAllocateInfo.allocationSize = tlasMemoryRequirements2.memoryRequirements.size;
-    uint32_t tlasMemoryTypeIndex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((tlasMemoryRequirements2.memoryRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
-            tlasMemoryTypeIndex = i;
-            break;
-        }
-    }
-    tlasMemoryAllocateInfo.memoryTypeIndex = tlasMemoryTypeIndex;
-
-    // Allocate memory for the acceleration structure.
-    VkDeviceMemory vkTlasMemory;
-    if (vkAllocateMemory(vkDevice, &tlasMemoryAllocateInfo, nullptr, &vkTlasMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory!" << std::endl;
-        abort();
-    }
+    // The KHR backend describes instances as a geometry referring to the instance buffer.
+    auto getTlasGeometryKhr = [&](VkBuffer instanceBuffer) {
+        VkAccelerationStructureGeometryKHR geometry{};
+        geometry.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_KHR;
+        geometry.geometryType = VK_GEOMETRY_TYPE_INSTANCES_KHR;
+        geometry.geometry.instances.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_GEOMETRY_INSTANCES_DATA_KHR;
+        geometry.geometry.instances.arrayOfPointers = VK_FALSE;
+        geometry.geometry.instances.data.deviceAddress = getBufferDeviceAddress(instanceBuffer);
+        return geometry;
+    };
 
-    // Bind top level acceleration structure to the memory.
-    VkBindAccelerationStructureMemoryInfoNV tlasMemoryInfo{};
-    tlasMemoryInfo.sType = VK_STRUCTURE_TYPE_BIND_ACCELERATION_STRUCTURE_MEMORY_INFO_NV;
-    tlasMemoryInfo.accelerationStructure = vkTopLevelAccelerationStructure;
-    tlasMemoryInfo.memory = vkTlasMemory;
-    if (vkBindAccelerationStructureMemoryNV(vkDevice, 1, &tlasMemoryInfo) != VK_SUCCESS) {
-        std::cerr << "Failed to bind top level acceleration structure memory!" << std::endl;
-        abort();
-    }
+    // Fill in build info of the KHR backend for the TLAS.
+    // The geometry should stay alive until the build is recorded.
+    auto getTlasBuildInfoKhr = [&](const VkAccelerationStructureGeometryKHR& geometry, VkBuildAccelerationStructureModeKHR mode) {
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_BUILD_GEOMETRY_INFO_KHR;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR;
+        buildInfo.flags = tlasBuildFlags;
+        buildInfo.mode = mode;
+        buildInfo.geometryCount = 1;
+        buildInfo.pGeometries = &geometry;
+        return buildInfo;
+    };
 
-    // Get acceleration structure handle.
-    uint64_t vkTlasHandle;
-    if (vkGetAccelerationStructureHandleNV(vkDevice, vkTopLevelAccelerationStructure, sizeof(uint64_t), &vkTlasHandle) != VK_SUCCESS) {
-        std::cerr << "Failed to get top level acceleration structure handle!" << std::endl;
-        abort();
+    // Create the acceleration structure.
+    AccelerationStructure vkTopLevelAccelerationStructure;
+    if (useKhrRayTracing) {
+        const VkAccelerationStructureGeometryKHR tlasGeometry = getTlasGeometryKhr(vkBuildInstanceBuffer);
+        const VkDeviceSize tlasSize = getAccelerationStructureBuildSizes(vkTopLevelAccelerationStructure, getTlasBuildInfoKhr(tlasGeometry, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR), instanceCount);
+        createAccelerationStructureKhr(vkTopLevelAccelerationStructure, VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_KHR, tlasSize);
+    } else {
+        VkAccelerationStructureCreateInfoNV tlasCreateInfo{};
+        tlasCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
+        tlasCreateInfo.info = tlasInfo;
+        createAccelerationStructureNv(vkTopLevelAccelerationStructure, tlasCreateInfo);
     }
 
     // ==========================================================================
@@ -1103,27 +3719,37 @@ int main()
     // memory we have to allocate. This memory is called a scratch buffer.
     // ==========================================================================
 
-    // Collect memory requirements for BLAS and TLAS.
-    VkAccelerationStructureMemoryRequirementsInfoNV asMemoryRequirementsInfo{};
-    asMemoryRequirementsInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_INFO_NV;
-    asMemoryRequirementsInfo.type = VK_ACCELERATION_STRUCTURE_MEMORY_REQUIREMENTS_TYPE_BUILD_SCRATCH_NV;
-    VkMemoryRequirements2 memReqBottomLevelAS{};
-    memReqBottomLevelAS.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
-    asMemoryRequirementsInfo.accelerationStructure = vkBottomLevelAccelerationStructure;
-    vkGetAccelerationStructureMemoryRequirementsNV(vkDevice, &asMemoryRequirementsInfo, &memReqBottomLevelAS);
-    VkMemoryRequirements2 memReqTopLevelAS{};
-    memReqTopLevelAS.sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2;
-    asMemoryRequirementsInfo.accelerationStructure = vkTopLevelAccelerationStructure;
-    vkGetAccelerationStructureMemoryRequirementsNV(vkDevice, &asMemoryRequirementsInfo, &memReqTopLevelAS);
+    // BLASes do not depend on each other, so they can be built at the same time
+    // if each of them has its own part of the scratch pool. We place scratch areas
+    // of BLASes one after another until the pool budget is exceeded, and then
+    // start a new group from the beginning of the pool. Groups are separated by
+    // barriers in the build, so they safely reuse the same memory.
+    // Scratch memory of the BLAS starting a new group has zero offset.
+    VkDeviceSize scratchBufferSize = 0;
+    VkDeviceSize scratchGroupSize = 0;
+    for (Mesh& mesh : meshes) {
+        const VkDeviceSize alignment = mesh.blas.scratchAlignment;
+        VkDeviceSize offset = (scratchGroupSize + alignment - 1) / alignment * alignment;
+        if (offset > 0 && offset + mesh.blas.buildScratchSize > BLAS_SCRATCH_POOL_BUDGET) {
+            offset = 0;
+        }
+        mesh.scratchOffset = offset;
+        scratchGroupSize = offset + mesh.blas.buildScratchSize;
+        scratchBufferSize = std::max(scratchBufferSize, scratchGroupSize);
+    }
+
+    // The TLAS is built after all BLASes, so it reuses the pool from the beginning.
+    scratchBufferSize = std::max(scratchBufferSize, vkTopLevelAccelerationStructure.buildScratchSize);
 
-    // Make the scratch buffer enough big for both of them.
-    const VkDeviceSize scratchBufferSize = std::max(memReqBottomLevelAS.memoryRequirements.size, memReqTopLevelAS.memoryRequirements.size);
+    // The KHR backend reads scratch memory by device addresses, it is a storage buffer for it.
+    const VkBufferUsageFlags scratchBufferUsage = useKhrRayTracing ?
+        (VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT) : VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
 
     // Describe a buffer.
     VkBufferCreateInfo vkScratchBufferInfo{};
     vkScratchBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
     vkScratchBufferInfo.size = scratchBufferSize;
-    vkScratchBufferInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
+    vkScratchBufferInfo.usage = scratchBufferUsage;
     vkScratchBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
     // Create a buffer.
@@ -1133,34 +3759,48 @@ int main()
         abort();
     }
 
-    // Retrieve memory requirements for the vertex buffer.
+    // Retrieve memory requirements for the scratch buffer.
+    // Scratch offsets of BLASes assume the buffer starts at the scratch alignment.
     VkMemoryRequirements vkScratchBufferMemRequirements;
     vkGetBufferMemoryRequirements(vkDevice, vkScratchBufferHandle, &vkScratchBufferMemRequirements);
-
-    // Define memory allocate info.
-    VkMemoryAllocateInfo vkScratchBufferAllocInfo{};
-    vkScratchBufferAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkScratchBufferAllocInfo.allocationSize = vkScratchBufferMemRequirements.size;
-
-    // Find a suitable memory type.
-    uint32_t scratchBufferMemoryTypeInex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkScratchBufferMemRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
-            scratchBufferMemoryTypeInex = i;
-            break;
-        }
-    }
-    vkScratchBufferAllocInfo.memoryTypeIndex = scratchBufferMemoryTypeInex;
+    vkScratchBufferMemRequirements.alignment = std::max(vkScratchBufferMemRequirements.alignment, vkTopLevelAccelerationStructure.scratchAlignment);
 
     // Allocate memory for the scratch buffer.
-    VkDeviceMemory vkScratchBufferMemory;
-    if (vkAllocateMemory(vkDevice, &vkScratchBufferAllocInfo, nullptr, &vkScratchBufferMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory for the scratch buffer!" << std::endl;
+    MemoryAllocation vkScratchBufferMemory = memoryArena.allocate(vkScratchBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
+    // Bind the buffer to the allocated memory.
+    vkBindBufferMemory(vkDevice, vkScratchBufferHandle, vkScratchBufferMemory.memory, vkScratchBufferMemory.offset);
+    const VkDeviceAddress vkScratchBufferAddress = useKhrRayTracing ? getBufferDeviceAddress(vkScratchBufferHandle) : 0;
+
+    // The TLAS is updated every frame, which needs a scratch buffer as well.
+    // Update scratch is usually much smaller than the build one and is kept
+    // until the end of the application. All updates are executed on
+    // the graphics queue one after another, so one buffer is enough.
+    // Describe an update scratch buffer.
+    VkBufferCreateInfo vkUpdateScratchBufferInfo{};
+    vkUpdateScratchBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    vkUpdateScratchBufferInfo.size = std::max< VkDeviceSize >(vkTopLevelAccelerationStructure.updateScratchSize, 1);
+    vkUpdateScratchBufferInfo.usage = scratchBufferUsage;
+    vkUpdateScratchBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    // Create an update scratch buffer.
+    VkBuffer vkUpdateScratchBufferHandle;
+    if (vkCreateBuffer(vkDevice, &vkUpdateScratchBufferInfo, nullptr, &vkUpdateScratchBufferHandle) != VK_SUCCESS) {
+        std::cerr << "Failed to create an update scratch buffer!" << std::endl;
         abort();
     }
 
+    // Retrieve memory requirements for the update scratch buffer.
+    VkMemoryRequirements vkUpdateScratchBufferMemRequirements;
+    vkGetBufferMemoryRequirements(vkDevice, vkUpdateScratchBufferHandle, &vkUpdateScratchBufferMemRequirements);
+    vkUpdateScratchBufferMemRequirements.alignment = std::max(vkUpdateScratchBufferMemRequirements.alignment, vkTopLevelAccelerationStructure.scratchAlignment);
+
+    // Allocate memory for the update scratch buffer.
+    MemoryAllocation vkUpdateScratchBufferMemory = memoryArena.allocate(vkUpdateScratchBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
+
     // Bind the buffer to the allocated memory.
-    vkBindBufferMemory(vkDevice, vkScratchBufferHandle, vkScratchBufferMemory, 0);
+    vkBindBufferMemory(vkDevice, vkUpdateScratchBufferHandle, vkUpdateScratchBufferMemory.memory, vkUpdateScratchBufferMemory.offset);
+    const VkDeviceAddress vkUpdateScratchBufferAddress = useKhrRayTracing ? getBufferDeviceAddress(vkUpdateScratchBufferHandle) : 0;
 
     // ==========================================================================
     //                    STEP 18: Build acceleration structures
@@ -1168,16 +3808,28 @@ int main()
     // Acceleration structures should be built on the GPU before
     // they are used first time. To do this we need to create a temporary
     // command pool and execute build commands.
+    // Builds are executed on the compute queue, so they may run in parallel
+    // with rendering. The host does not wait for them: the first frame waits
+    // on a semaphore instead, and temporary build resources are released by
+    // the main loop once the build fence is signaled.
     // ==========================================================================
 
+    // Make sure the vertex, index and mesh info buffers are completely uploaded
+    // by the transfer queue before the build and shaders read them.
+    flushUploads();
+
     // Pick a graphics queue.
     VkQueue vkGraphicsQueue;
     vkGetDeviceQueue(vkDevice, queueFamilyIndices.graphicsFamily.value(), 0, &vkGraphicsQueue);
 
+    // Pick a compute queue.
+    VkQueue vkComputeQueue;
+    vkGetDeviceQueue(vkDevice, queueFamilyIndices.computeFamily.value(), 0, &vkComputeQueue);
+
     // Create a command pool.
     VkCommandPoolCreateInfo vkBuildASPoolInfo{};
     vkBuildASPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    vkBuildASPoolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+    vkBuildASPoolInfo.queueFamilyIndex = queueFamilyIndices.computeFamily.value();
     vkBuildASPoolInfo.flags = 0;
     VkCommandPool vkBuildASCommandPool;
     if (vkCreateCommandPool(vkDevice, &vkBuildASPoolInfo, nullptr, &vkBuildASCommandPool) != VK_SUCCESS) {
@@ -1197,53 +3849,277 @@ int main()
         abort();
     }
 
+    // Create fence that signals when the GPU finishes the build.
+    VkFenceCreateInfo vkBuildASFenceInfo {};
+    vkBuildASFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+    vkBuildASFenceInfo.flags = 0;
+    VkFence vkBuildASFence;
+    if (vkCreateFence(vkDevice, &vkBuildASFenceInfo, nullptr, &vkBuildASFence) != VK_SUCCESS) {
+        std::cerr << "Failed to create a fence!" << std::endl;
+        abort();
+    }
+
     // Begin command execution.
     VkCommandBufferBeginInfo vkBuildASCmdBufferBeginInfo {};
     vkBuildASCmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    if (vkBeginCommandBuffer(vkBuildASCmdBuffer, &vkBuildASCmdBufferBeginInfo) != VK_SUCCESS) {
-        std::cerr << "Failed to begin a command buffer!" << std::endl;
-        abort();
+    vkBuildASCmdBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+    auto beginBuildCommands = [&]() {
+        if (vkBeginCommandBuffer(vkBuildASCmdBuffer, &vkBuildASCmdBufferBeginInfo) != VK_SUCCESS) {
+            std::cerr << "Failed to begin a command buffer!" << std::endl;
+            abort();
+        }
+    };
+
+    // Submit recorded commands and wait until the GPU executes them.
+    // After that the command buffer can be recorded again.
+    auto submitBuildCommands = [&]() {
+        // End command execution.
+        if (vkEndCommandBuffer(vkBuildASCmdBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to end a command buffer!" << std::endl;
+            abort();
+        }
+
+        // Submit the command buffer to the queue.
+        VkSubmitInfo vkBuildASsubmitInfo{};
+        vkBuildASsubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        vkBuildASsubmitInfo.commandBufferCount = 1;
+        vkBuildASsubmitInfo.pCommandBuffers = &vkBuildASCmdBuffer;
+        vkQueueSubmit(vkComputeQueue, 1, &vkBuildASsubmitInfo, vkBuildASFence);
+
+        // Wait for the fence to signal that the command buffer has finished executing.
+        if (vkWaitForFences(vkDevice, 1, &vkBuildASFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            std::cerr << "Failed to wait for a fence!" << std::endl;
+            abort();
+        }
+
+        // Prepare the fence and the command buffer for the next submission.
+        vkResetFences(vkDevice, 1, &vkBuildASFence);
+        vkResetCommandPool(vkDevice, vkBuildASCommandPool, 0);
+    };
+
+    // Properties of queue families tell whether queues support timestamps.
+    uint32_t vkDeviceQueueFamilyCount = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &vkDeviceQueueFamilyCount, nullptr);
+    std::vector< VkQueueFamilyProperties > vkDeviceQueueFamilies(vkDeviceQueueFamilyCount);
+    vkGetPhysicalDeviceQueueFamilyProperties(vkPhysicalDevice, &vkDeviceQueueFamilyCount, vkDeviceQueueFamilies.data());
+
+    // Convert a difference of two timestamps into milliseconds.
+    // Only timestampValidBits of a timestamp are meaningful, so the difference is masked.
+    auto timestampsToMs = [&](uint64_t begin, uint64_t end, uint32_t validBits) {
+        const uint64_t mask = (validBits >= 64) ? ~0ull : ((1ull << validBits) - 1);
+        return static_cast< double >((end - begin) & mask) * deviceProps2.properties.limits.timestampPeriod / 1e6;
+    };
+
+    // Timestamps written during the build.
+    constexpr const uint32_t BUILD_TIMESTAMP_BEGIN = 0;
+    constexpr const uint32_t BUILD_TIMESTAMP_BLAS_END = 1;
+    constexpr const uint32_t BUILD_TIMESTAMP_TLAS_END = 2;
+    constexpr const uint32_t NUM_BUILD_TIMESTAMPS = 3;
+
+    // Create a query pool for build timestamps if the compute queue supports them.
+    const uint32_t buildTimestampValidBits = vkDeviceQueueFamilies[queueFamilyIndices.computeFamily.value()].timestampValidBits;
+    VkQueryPool vkBuildTimestampPool = VK_NULL_HANDLE;
+    if (buildTimestampValidBits > 0) {
+        VkQueryPoolCreateInfo vkTimestampPoolInfo{};
+        vkTimestampPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        vkTimestampPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        vkTimestampPoolInfo.queryCount = NUM_BUILD_TIMESTAMPS;
+        if (vkCreateQueryPool(vkDevice, &vkTimestampPoolInfo, nullptr, &vkBuildTimestampPool) != VK_SUCCESS) {
+            std::cerr << "Failed to create a query pool!" << std::endl;
+            abort();
+        }
     }
 
-    // Build BLAS
-    VkAccelerationStructureInfoNV buildInfo{};
-    buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
-    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
-    buildInfo.geometryCount = 1;
-    buildInfo.pGeometries = &geometry;
-    vkCmdBuildAccelerationStructureNV(
-                vkBuildASCmdBuffer,
-                &buildInfo,
-                VK_NULL_HANDLE,
-                0,
-                VK_FALSE,
-                vkBottomLevelAccelerationStructure,
-                VK_NULL_HANDLE,
-                vkScratchBufferHandle,
-                0);
+    // ----------------
+    // 1: Build BLASes
+    // ----------------
 
-    // Wait until the build finishes because we use the same scratch buffer for both structures.
+    // Measure how long it takes to build all acceleration structures.
+    const auto buildStartTime = std::chrono::steady_clock::now();
+
+    beginBuildCommands();
+    if (vkBuildTimestampPool != VK_NULL_HANDLE) {
+        vkCmdResetQueryPool(vkBuildASCmdBuffer, vkBuildTimestampPool, 0, NUM_BUILD_TIMESTAMPS);
+        vkCmdWriteTimestamp(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, vkBuildTimestampPool, BUILD_TIMESTAMP_BEGIN);
+    }
+
+    // Barrier that waits until previous builds finish, so their results are
+    // visible and their scratch memory can be reused.
     VkMemoryBarrier memoryBarrier {};
     memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
     memoryBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
     memoryBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
+
+    // Build all BLASes.
+    // Builds of one scratch group use different parts of the pool, so they
+    // are recorded back to back and the GPU can execute them in parallel.
+    // Build flags should be the same as ones BLASes were created with.
+    for (size_t i = 0; i < meshes.size(); i++) {
+        if (i > 0 && meshes[i].scratchOffset == 0) {
+            vkCmdPipelineBarrier(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+        }
+        if (useKhrRayTracing) {
+            // The KHR backend takes the scratch memory and the triangle count of the geometry directly.
+            VkAccelerationStructureBuildGeometryInfoKHR buildInfo = getBlasBuildInfoKhr(meshes[i]);
+            buildInfo.scratchData.deviceAddress = vkScratchBufferAddress + meshes[i].scratchOffset;
+            VkAccelerationStructureBuildRangeInfoKHR buildRange{};
+            buildRange.primitiveCount = meshes[i].indexCount / 3;
+            const VkAccelerationStructureBuildRangeInfoKHR* buildRanges = &buildRange;
+            vkCmdBuildAccelerationStructuresKHR(vkBuildASCmdBuffer, 1, &buildInfo, &buildRanges);
+            continue;
+        }
+        const VkAccelerationStructureInfoNV buildInfo = getBlasInfo(meshes[i]);
+        vkCmdBuildAccelerationStructureNV(
+                    vkBuildASCmdBuffer,
+                    &buildInfo,
+                    VK_NULL_HANDLE,
+                    0,
+                    VK_FALSE,
+                    meshes[i].blas.nv,
+                    VK_NULL_HANDLE,
+                    vkScratchBufferHandle,
+                    meshes[i].scratchOffset);
+    }
+
+    // Wait until all BLAS builds finish before the TLAS build
+    // because the TLAS refers to them and reuses the scratch pool.
     vkCmdPipelineBarrier(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+    if (vkBuildTimestampPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, vkBuildTimestampPool, BUILD_TIMESTAMP_BLAS_END);
+    }
 
-    // Build TLAS.
-    buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV;
-    buildInfo.pGeometries = 0;
-    buildInfo.geometryCount = 0;
-    buildInfo.instanceCount = 1;
-    vkCmdBuildAccelerationStructureNV(
-                vkBuildASCmdBuffer,
-                &buildInfo,
-                vkInstanceBufferHandle,
-                0,
-                VK_FALSE,
-                vkTopLevelAccelerationStructure,
-                VK_NULL_HANDLE,
-                vkScratchBufferHandle,
-                0);
+    // ------------------
+    // 2: Compact BLASes
+    // ------------------
+
+    // The driver reserves memory for the worst case when a BLAS is created.
+    // After the build it knows how much memory the BLAS really needs, so
+    // we can query this size, create a tight BLAS and copy the original into it.
+    // The TLAS refers to BLAS handles, so compaction should happen before the TLAS build.
+    std::vector< AccelerationStructure > uncompactedBlases;
+    if (compactBlas) {
+        // Create a query pool for compacted sizes of all BLASes.
+        // Each backend has its own query type.
+        const VkQueryType compactedSizeQueryType = useKhrRayTracing ? VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_KHR
+                                                                    : VK_QUERY_TYPE_ACCELERATION_STRUCTURE_COMPACTED_SIZE_NV;
+        VkQueryPoolCreateInfo vkCompactedSizeQueryPoolInfo{};
+        vkCompactedSizeQueryPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        vkCompactedSizeQueryPoolInfo.queryType = compactedSizeQueryType;
+        vkCompactedSizeQueryPoolInfo.queryCount = static_cast< uint32_t >(meshes.size());
+        VkQueryPool vkCompactedSizeQueryPool;
+        if (vkCreateQueryPool(vkDevice, &vkCompactedSizeQueryPoolInfo, nullptr, &vkCompactedSizeQueryPool) != VK_SUCCESS) {
+            std::cerr << "Failed to create a query pool!" << std::endl;
+            abort();
+        }
+
+        // Query compacted sizes once the builds are finished.
+        // The barrier above makes build results visible for the query.
+        vkCmdResetQueryPool(vkBuildASCmdBuffer, vkCompactedSizeQueryPool, 0, vkCompactedSizeQueryPoolInfo.queryCount);
+        if (useKhrRayTracing) {
+            std::vector< VkAccelerationStructureKHR > builtBlases;
+            for (const Mesh& mesh : meshes) {
+                builtBlases.push_back(mesh.blas.khr);
+            }
+            vkCmdWriteAccelerationStructuresPropertiesKHR(vkBuildASCmdBuffer, static_cast< uint32_t >(builtBlases.size()), builtBlases.data(), compactedSizeQueryType, vkCompactedSizeQueryPool, 0);
+        } else {
+            std::vector< VkAccelerationStructureNV > builtBlases;
+            for (const Mesh& mesh : meshes) {
+                builtBlases.push_back(mesh.blas.nv);
+            }
+            vkCmdWriteAccelerationStructuresPropertiesNV(vkBuildASCmdBuffer, static_cast< uint32_t >(builtBlases.size()), builtBlases.data(), compactedSizeQueryType, vkCompactedSizeQueryPool, 0);
+        }
+
+        // We need sizes on the CPU side, so wait for the builds here.
+        submitBuildCommands();
+
+        // Read compacted sizes.
+        std::vector< VkDeviceSize > compactedSizes(meshes.size());
+        if (vkGetQueryPoolResults(vkDevice, vkCompactedSizeQueryPool, 0, vkCompactedSizeQueryPoolInfo.queryCount, sizeof(VkDeviceSize) * compactedSizes.size(), compactedSizes.data(), sizeof(VkDeviceSize), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+            std::cerr << "Failed to get compacted BLAS sizes!" << std::endl;
+            abort();
+        }
+        vkDestroyQueryPool(vkDevice, vkCompactedSizeQueryPool, nullptr);
+
+        beginBuildCommands();
+        VkDeviceSize uncompactedMemorySize = 0;
+        VkDeviceSize compactedMemorySize = 0;
+        for (size_t i = 0; i < meshes.size(); i++) {
+            Mesh& mesh = meshes[i];
+
+            // Create a compacted BLAS and copy the original BLAS into it.
+            // Copies do not depend on each other, so they can run in parallel.
+            AccelerationStructure compactedBlas;
+            if (useKhrRayTracing) {
+                createAccelerationStructureKhr(compactedBlas, VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_KHR, compactedSizes[i]);
+                VkCopyAccelerationStructureInfoKHR copyInfo{};
+                copyInfo.sType = VK_STRUCTURE_TYPE_COPY_ACCELERATION_STRUCTURE_INFO_KHR;
+                copyInfo.src = mesh.blas.khr;
+                copyInfo.dst = compactedBlas.khr;
+                copyInfo.mode = VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_KHR;
+                vkCmdCopyAccelerationStructureKHR(vkBuildASCmdBuffer, &copyInfo);
+            } else {
+                // Compacted structure ignores geometry and only needs the size.
+                VkAccelerationStructureCreateInfoNV compactBlasCreateInfo{};
+                compactBlasCreateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_CREATE_INFO_NV;
+                compactBlasCreateInfo.compactedSize = compactedSizes[i];
+                compactBlasCreateInfo.info.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+                compactBlasCreateInfo.info.type = VK_ACCELERATION_STRUCTURE_TYPE_BOTTOM_LEVEL_NV;
+                compactBlasCreateInfo.info.flags = blasBuildFlags;
+                createAccelerationStructureNv(compactedBlas, compactBlasCreateInfo);
+                vkCmdCopyAccelerationStructureNV(vkBuildASCmdBuffer, compactedBlas.nv, mesh.blas.nv, VK_COPY_ACCELERATION_STRUCTURE_MODE_COMPACT_NV);
+            }
+            uncompactedMemorySize += mesh.blas.memory.size;
+            compactedMemorySize += compactedBlas.memory.size;
+
+            // The original BLAS is released once the copy is finished.
+            // From now on the compacted BLAS is used everywhere,
+            // instances refer to its handle or address.
+            uncompactedBlases.push_back(mesh.blas);
+            mesh.blas = compactedBlas;
+        }
+        vkCmdPipelineBarrier(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, 0, 1, &memoryBarrier, 0, 0, 0, 0);
+        writeInstances(static_cast< VkAccelerationStructureInstanceKHR* >(vkBuildInstanceBufferMemory.mappedData), 0.0f);
+
+        std::cout << "BLAS memory compacted from " << uncompactedMemorySize << " to " << compactedMemorySize << " bytes" << std::endl;
+    }
+
+    // ----------------
+    // 3: Build TLAS
+    // ----------------
+
+    // Build TLAS from the initial instance positions.
+    // Build flags should be the same as ones the TLAS was created with.
+    if (useKhrRayTracing) {
+        const VkAccelerationStructureGeometryKHR tlasGeometry = getTlasGeometryKhr(vkBuildInstanceBuffer);
+        VkAccelerationStructureBuildGeometryInfoKHR buildInfo = getTlasBuildInfoKhr(tlasGeometry, VK_BUILD_ACCELERATION_STRUCTURE_MODE_BUILD_KHR);
+        buildInfo.dstAccelerationStructure = vkTopLevelAccelerationStructure.khr;
+        buildInfo.scratchData.deviceAddress = vkScratchBufferAddress;
+        VkAccelerationStructureBuildRangeInfoKHR buildRange{};
+        buildRange.primitiveCount = instanceCount;
+        const VkAccelerationStructureBuildRangeInfoKHR* buildRanges = &buildRange;
+        vkCmdBuildAccelerationStructuresKHR(vkBuildASCmdBuffer, 1, &buildInfo, &buildRanges);
+    } else {
+        VkAccelerationStructureInfoNV buildInfo{};
+        buildInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+        buildInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV;
+        buildInfo.flags = tlasInfo.flags;
+        buildInfo.pGeometries = 0;
+        buildInfo.geometryCount = 0;
+        buildInfo.instanceCount = instanceCount;
+        vkCmdBuildAccelerationStructureNV(
+                    vkBuildASCmdBuffer,
+                    &buildInfo,
+                    vkBuildInstanceBuffer,
+                    0,
+                    VK_FALSE,
+                    vkTopLevelAccelerationStructure.nv,
+                    VK_NULL_HANDLE,
+                    vkScratchBufferHandle,
+                    0);
+    }
+    if (vkBuildTimestampPool != VK_NULL_HANDLE) {
+        vkCmdWriteTimestamp(vkBuildASCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, vkBuildTimestampPool, BUILD_TIMESTAMP_TLAS_END);
+    }
 
     // End command execution.
     if (vkEndCommandBuffer(vkBuildASCmdBuffer) != VK_SUCCESS) {
@@ -1251,114 +4127,445 @@ int main()
         abort();
     }
 
-    // Create fence that will suspend the execution until GPU finishes.
-    VkFenceCreateInfo vkBuildASFenceInfo {};
-    vkBuildASFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    vkBuildASFenceInfo.flags = 0;
-    VkFence vkBuildASFence;
-    if (vkCreateFence(vkDevice, &vkBuildASFenceInfo, nullptr, &vkBuildASFence) != VK_SUCCESS) {
-        std::cerr << "Failed to create a fence!" << std::endl;
+    // Create a semaphore that signals the graphics queue that acceleration structures are ready.
+    VkSemaphoreCreateInfo vkBuildASSemaphoreInfo{};
+    vkBuildASSemaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    VkSemaphore vkBuildASSemaphore;
+    if (vkCreateSemaphore(vkDevice, &vkBuildASSemaphoreInfo, nullptr, &vkBuildASSemaphore) != VK_SUCCESS) {
+        std::cerr << "Failed to create a semaphore!" << std::endl;
         abort();
     }
 
-    // Submit the command buffer to the queue.
+    // Submit remaining commands without waiting for them.
     VkSubmitInfo vkBuildASsubmitInfo{};
     vkBuildASsubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
     vkBuildASsubmitInfo.commandBufferCount = 1;
     vkBuildASsubmitInfo.pCommandBuffers = &vkBuildASCmdBuffer;
-    vkQueueSubmit(vkGraphicsQueue, 1, &vkBuildASsubmitInfo, vkBuildASFence);
-
-    // Wait for the fence to signal that the command buffer has finished executing.
-    if (vkWaitForFences(vkDevice, 1, &vkBuildASFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
-        std::cerr << "Failed to wait for a fence!" << std::endl;
+    vkBuildASsubmitInfo.signalSemaphoreCount = 1;
+    vkBuildASsubmitInfo.pSignalSemaphores = &vkBuildASSemaphore;
+    if (vkQueueSubmit(vkComputeQueue, 1, &vkBuildASsubmitInfo, vkBuildASFence) != VK_SUCCESS) {
+        std::cerr << "Failed to submit acceleration structure builds!" << std::endl;
         abort();
     }
 
-    // Clean up the command pool and the fence.
-    vkDestroyFence(vkDevice, vkBuildASFence, nullptr);
-    vkFreeCommandBuffers(vkDevice, vkBuildASCommandPool, 1, &vkBuildASCmdBuffer);
-    vkDestroyCommandPool(vkDevice, vkBuildASCommandPool, nullptr);
+    // Whether the first frame still has to wait for vkBuildASSemaphore.
+    bool waitForBuildASSemaphore = true;
+
+    // A semaphore is waited by one GPU of a device group, while every GPU uses its own acceleration structures.
+    // The fence is signaled once builds are finished on all GPUs, so multi-GPU mode waits for it instead.
+    if (multiGpu) {
+        if (vkWaitForFences(vkDevice, 1, &vkBuildASFence, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            std::cerr << "Failed to wait for a fence!" << std::endl;
+            abort();
+        }
+        waitForBuildASSemaphore = false;
+    }
+
+    // Release resources used only during the build.
+    // Should be called once the build fence is signaled.
+    bool buildResourcesReleased = false;
+    auto releaseBuildResources = [&]() {
+        // Report the build time.
+        // GPU timestamps are precise. Without them we use the moment the fence
+        // is noticed by the main loop as the end of the build, so this is an upper bound.
+        if (vkBuildTimestampPool != VK_NULL_HANDLE) {
+            std::array< uint64_t, NUM_BUILD_TIMESTAMPS > timestamps{};
+            if (vkGetQueryPoolResults(vkDevice, vkBuildTimestampPool, 0, NUM_BUILD_TIMESTAMPS, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) == VK_SUCCESS) {
+                std::cout << "Built " << meshes.size() << " BLAS(es) in " << timestampsToMs(timestamps[BUILD_TIMESTAMP_BEGIN], timestamps[BUILD_TIMESTAMP_BLAS_END], buildTimestampValidBits) << " ms"
+                          << (compactBlas ? " and compacted them with the TLAS build in " : " and the TLAS in ") << timestampsToMs(timestamps[BUILD_TIMESTAMP_BLAS_END], timestamps[BUILD_TIMESTAMP_TLAS_END], buildTimestampValidBits) << " ms on the GPU" << std::endl;
+            }
+            vkDestroyQueryPool(vkDevice, vkBuildTimestampPool, nullptr);
+        } else {
+            const auto buildTime = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - buildStartTime).count();
+            std::cout << "Built " << meshes.size() << " BLAS(es) and the TLAS in " << buildTime << " ms" << std::endl;
+        }
+
+        // Release uncompacted BLASes.
+        for (auto& uncompactedBlas : uncompactedBlases) {
+            destroyAccelerationStructure(uncompactedBlas);
+        }
+        uncompactedBlases.clear();
+
+        // Clean up the command pool and the fence.
+        vkDestroyFence(vkDevice, vkBuildASFence, nullptr);
+        vkFreeCommandBuffers(vkDevice, vkBuildASCommandPool, 1, &vkBuildASCmdBuffer);
+        vkDestroyCommandPool(vkDevice, vkBuildASCommandPool, nullptr);
+
+        // Destroy the instance buffer of the build.
+        memoryArena.free(vkBuildInstanceBufferMemory);
+        vkDestroyBuffer(vkDevice, vkBuildInstanceBuffer, nullptr);
 
-    // Destroy the scratch buffer and free the memory.
-    vkFreeMemory(vkDevice, vkScratchBufferMemory, nullptr);
-    vkDestroyBuffer(vkDevice, vkScratchBufferHandle, nullptr);
+        // Destroy the scratch buffer and free the memory.
+        memoryArena.free(vkScratchBufferMemory);
+        vkDestroyBuffer(vkDevice, vkScratchBufferHandle, nullptr);
+
+        buildResourcesReleased = true;
+    };
 
     // ==========================================================================
     //                    STEP 19: Create a storage image
     // ==========================================================================
     // Ray tracing pipeline does not contain usual color attachments, so
-    // the rendering writes color output into an image and then this image is copied
-    // to the framebuffers. The image we will use is called a storage image.
-    // ==========================================================================
-
-    // Description of a storage image.
-    VkImageCreateInfo vkStorageImageInfo{};
-    vkStorageImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
-    vkStorageImageInfo.imageType = VK_IMAGE_TYPE_2D;
-    vkStorageImageInfo.extent.width = vkSelectedExtent.width;
-    vkStorageImageInfo.extent.height = vkSelectedExtent.height;
-    vkStorageImageInfo.extent.depth = 1;
-    vkStorageImageInfo.mipLevels = 1;
-    vkStorageImageInfo.arrayLayers = 1;
-    vkStorageImageInfo.format = vkSelectedFormat.format;
-    vkStorageImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
-    vkStorageImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    vkStorageImageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
-    vkStorageImageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
-    vkStorageImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
-
-    // Create a storage image.
-    VkImage vkStorageImage;
-    if (vkCreateImage(vkDevice, &vkStorageImageInfo, nullptr, &vkStorageImage) != VK_SUCCESS) {
-        std::cerr << "Failed to create an image!" << std::endl;
-        abort();
-    }
+    // the rendering writes color output into an image and then a tone mapping
+    // compute pass converts it into the framebuffer. The image we will use is called
+    // a storage image. Rays write float radiance, which keeps precision for accumulation
+    // and denoising. If swap chain images support storage usage, the tone mapping pass
+    // writes them directly. Otherwise it writes an RGBA8 display image, which is blitted
+    // into the swap chain image. Readback copies the display image
+    // into host memory as well.
+    // ==========================================================================
+
+    // Each frame in flight has its own radiance image and display image, so consecutive frames
+    // do not wait for each other to stop using them.
+    // Tone mapping directly into swap chain images needs no display images.
+    std::array< VkImage, MAX_FRAMES_IN_FLIGHT > vkStorageImages{};
+    std::array< MemoryAllocation, MAX_FRAMES_IN_FLIGHT > vkStorageImageMemories{};
+    std::array< VkImageView, MAX_FRAMES_IN_FLIGHT > vkStorageImageViews{};
+    // Aliases of radiance images bound to memory of the presenting GPU in multi-GPU mode.
+    // They share the layout of radiance images, the general one, and are never transitioned.
+    std::array< VkImage, MAX_FRAMES_IN_FLIGHT > vkPeerStorageImages{};
+    std::array< VkImage, MAX_FRAMES_IN_FLIGHT > vkDisplayImages{};
+    std::array< MemoryAllocation, MAX_FRAMES_IN_FLIGHT > vkDisplayImageMemories{};
+    std::array< VkImageView, MAX_FRAMES_IN_FLIGHT > vkDisplayImageViews{};
+    // Readback buffers form a ring with one buffer per frame in flight as well.
+    // They prefer host-cached memory, so the encoder reads pixels at full CPU speed
+    // instead of going through uncached write-combined pages.
+    // Non-coherent memory is invalidated before the encoder reads it, so allocations
+    // are aligned to the atom size of the device.
+    std::array< VkBuffer, MAX_FRAMES_IN_FLIGHT > vkReadbackBuffers{};
+    std::array< MemoryAllocation, MAX_FRAMES_IN_FLIGHT > vkReadbackBufferMemories{};
+    bool readbackMemoryCoherent = true;
+    VkPhysicalDeviceProperties vkReadbackDeviceProperties;
+    vkGetPhysicalDeviceProperties(vkPhysicalDevice, &vkReadbackDeviceProperties);
+    const VkDeviceSize readbackAtomSize = std::max< VkDeviceSize >(vkReadbackDeviceProperties.limits.nonCoherentAtomSize, 1);
+    // Storage images have the swap chain resolution and are created again when it changes.
+    // Dynamic resolution traces only a part of the radiance image.
+    auto createStorageImages = [&]() {
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            // Description of a radiance image.
+            VkImageCreateInfo vkStorageImageInfo{};
+            vkStorageImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            vkStorageImageInfo.imageType = VK_IMAGE_TYPE_2D;
+            vkStorageImageInfo.extent.width = vkSelectedExtent.width;
+            vkStorageImageInfo.extent.height = vkSelectedExtent.height;
+            vkStorageImageInfo.extent.depth = 1;
+            vkStorageImageInfo.mipLevels = 1;
+            vkStorageImageInfo.arrayLayers = 1;
+            vkStorageImageInfo.format = RADIANCE_IMAGE_FORMAT;
+            vkStorageImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            vkStorageImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            // Only shaders touch the image, except for bands copied between GPUs of a device group.
+            // The copy goes through an alias of the image, and aliases created with the same
+            // parameters and the alias flag share their content.
+            vkStorageImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+            if (multiGpu) {
+                vkStorageImageInfo.flags = VK_IMAGE_CREATE_ALIAS_BIT;
+                vkStorageImageInfo.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+            }
+            vkStorageImageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
+            vkStorageImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    // Get memory requirements.
-    VkMemoryRequirements vkStorageImageMemRequirements;
-    vkGetImageMemoryRequirements(vkDevice, vkStorageImage, &vkStorageImageMemRequirements);
+            // Create a radiance image.
+            if (vkCreateImage(vkDevice, &vkStorageImageInfo, nullptr, &vkStorageImages[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create storage image #" << i << "!" << std::endl;
+                abort();
+            }
 
-    // Find suitable memory type.
-    VkMemoryAllocateInfo vkStorageImageAllocInfo{};
-    vkStorageImageAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkStorageImageAllocInfo.allocationSize = vkStorageImageMemRequirements.size;
-    uint32_t storageImageMemoryTypeInex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkStorageImageMemRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT)) {
-            storageImageMemoryTypeInex = i;
-            break;
+            // Get memory requirements.
+            VkMemoryRequirements vkStorageImageMemRequirements;
+            vkGetImageMemoryRequirements(vkDevice, vkStorageImages[i], &vkStorageImageMemRequirements);
+
+            // Allocate memory for the radiance image.
+            vkStorageImageMemories[i] = memoryArena.allocate(vkStorageImageMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+
+            // Bind the image to the memory.
+            vkBindImageMemory(vkDevice, vkStorageImages[i], vkStorageImageMemories[i].memory, vkStorageImageMemories[i].offset);
+
+            // Describe an image view.
+            VkImageViewCreateInfo vkStorageImageViewInfo{};
+            vkStorageImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            vkStorageImageViewInfo.image = vkStorageImages[i];
+            vkStorageImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            vkStorageImageViewInfo.format = RADIANCE_IMAGE_FORMAT;
+            vkStorageImageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+            vkStorageImageViewInfo.subresourceRange.baseMipLevel = 0;
+            vkStorageImageViewInfo.subresourceRange.levelCount = 1;
+            vkStorageImageViewInfo.subresourceRange.baseArrayLayer = 0;
+            vkStorageImageViewInfo.subresourceRange.layerCount = 1;
+
+            // Create an image view.
+            if (vkCreateImageView(vkDevice, &vkStorageImageViewInfo, nullptr, &vkStorageImageViews[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create texture image view!" << std::endl;
+                abort();
+            }
+            if (!multiGpu) {
+                continue;
+            }
+
+            // Every GPU of a device group has its own instance of the radiance image.
+            // The peer alias is bound to the instance of the presenting GPU on all GPUs,
+            // so the other GPUs copy their bands into it. Copies into peer memory are
+            // the one peer access every device group should support, check it anyway.
+            const uint32_t heapIndex = vkPhysicalDeviceMemoryProperties.memoryTypes[vkStorageImageMemories[i].poolIndex / 2].heapIndex;
+            for (uint32_t device = 1; device < deviceGroupSize; device++) {
+                VkPeerMemoryFeatureFlags vkPeerMemoryFeatures = 0;
+                vkGetDeviceGroupPeerMemoryFeatures(vkDevice, heapIndex, device, 0, &vkPeerMemoryFeatures);
+                if (!(vkPeerMemoryFeatures & VK_PEER_MEMORY_FEATURE_COPY_DST_BIT)) {
+                    std::cerr << "GPU #" << device << " cannot copy into memory of the presenting GPU!" << std::endl;
+                    abort();
+                }
+            }
+            if (vkCreateImage(vkDevice, &vkStorageImageInfo, nullptr, &vkPeerStorageImages[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create peer storage image #" << i << "!" << std::endl;
+                abort();
+            }
+            std::array< uint32_t, MAX_DEVICE_GROUP_SIZE > peerDeviceIndices{};
+            VkBindImageMemoryDeviceGroupInfo vkPeerBindDeviceGroupInfo{};
+            vkPeerBindDeviceGroupInfo.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_DEVICE_GROUP_INFO;
+            vkPeerBindDeviceGroupInfo.deviceIndexCount = deviceGroupSize;
+            vkPeerBindDeviceGroupInfo.pDeviceIndices = peerDeviceIndices.data();
+            VkBindImageMemoryInfo vkPeerBindInfo{};
+            vkPeerBindInfo.sType = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO;
+            vkPeerBindInfo.pNext = &vkPeerBindDeviceGroupInfo;
+            vkPeerBindInfo.image = vkPeerStorageImages[i];
+            vkPeerBindInfo.memory = vkStorageImageMemories[i].memory;
+            vkPeerBindInfo.memoryOffset = vkStorageImageMemories[i].offset;
+            if (vkBindImageMemory2(vkDevice, 1, &vkPeerBindInfo) != VK_SUCCESS) {
+                std::cerr << "Failed to bind peer storage image #" << i << "!" << std::endl;
+                abort();
+            }
         }
-    }
-    vkStorageImageAllocInfo.memoryTypeIndex = storageImageMemoryTypeInex;
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && !tonemapIntoSwapChain; i++) {
+            // Description of a display image.
+            // Its format always supports storage usage, it is converted into the swap chain format by the blit.
+            VkImageCreateInfo vkDisplayImageInfo{};
+            vkDisplayImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            vkDisplayImageInfo.imageType = VK_IMAGE_TYPE_2D;
+            vkDisplayImageInfo.extent.width = vkSelectedExtent.width;
+            vkDisplayImageInfo.extent.height = vkSelectedExtent.height;
+            vkDisplayImageInfo.extent.depth = 1;
+            vkDisplayImageInfo.mipLevels = 1;
+            vkDisplayImageInfo.arrayLayers = 1;
+            vkDisplayImageInfo.format = DISPLAY_IMAGE_FORMAT;
+            vkDisplayImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            vkDisplayImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            vkDisplayImageInfo.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_STORAGE_BIT;
+            vkDisplayImageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
+            vkDisplayImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+            // Create a display image.
+            if (vkCreateImage(vkDevice, &vkDisplayImageInfo, nullptr, &vkDisplayImages[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create display image #" << i << "!" << std::endl;
+                abort();
+            }
 
-    // Allocate memory for the storage image.
-    VkDeviceMemory vkStorageImageMemory;
-    if (vkAllocateMemory(vkDevice, &vkStorageImageAllocInfo, nullptr, &vkStorageImageMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate image memory!" << std::endl;
-        abort();
-    }
+            // Allocate and bind memory.
+            VkMemoryRequirements vkDisplayImageMemRequirements;
+            vkGetImageMemoryRequirements(vkDevice, vkDisplayImages[i], &vkDisplayImageMemRequirements);
+            vkDisplayImageMemories[i] = memoryArena.allocate(vkDisplayImageMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+            vkBindImageMemory(vkDevice, vkDisplayImages[i], vkDisplayImageMemories[i].memory, vkDisplayImageMemories[i].offset);
+
+            // Describe an image view.
+            VkImageViewCreateInfo vkDisplayImageViewInfo{};
+            vkDisplayImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            vkDisplayImageViewInfo.image = vkDisplayImages[i];
+            vkDisplayImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            vkDisplayImageViewInfo.format = DISPLAY_IMAGE_FORMAT;
+            vkDisplayImageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+            // Create an image view.
+            if (vkCreateImageView(vkDevice, &vkDisplayImageViewInfo, nullptr, &vkDisplayImageViews[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create display image view #" << i << "!" << std::endl;
+                abort();
+            }
+        }
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && readback; i++) {
+            // Description of a readback buffer, it gets tightly packed rows of the display image.
+            VkBufferCreateInfo vkReadbackBufferInfo{};
+            vkReadbackBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+            vkReadbackBufferInfo.size = static_cast< VkDeviceSize >(vkSelectedExtent.width) * vkSelectedExtent.height * 4;
+            vkReadbackBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+            vkReadbackBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+            // Create a readback buffer.
+            if (vkCreateBuffer(vkDevice, &vkReadbackBufferInfo, nullptr, &vkReadbackBuffers[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create readback buffer #" << i << "!" << std::endl;
+                abort();
+            }
 
-    // Bind the image to the memory.
-    vkBindImageMemory(vkDevice, vkStorageImage, vkStorageImageMemory, 0);
-
-    // Describe an image view.
-    VkImageViewCreateInfo vkStorageImageViewInfo{};
-    vkStorageImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
-    vkStorageImageViewInfo.image = vkStorageImage;
-    vkStorageImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
-    vkStorageImageViewInfo.format = vkSelectedFormat.format;
-    vkStorageImageViewInfo.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-    vkStorageImageViewInfo.subresourceRange.baseMipLevel = 0;
-    vkStorageImageViewInfo.subresourceRange.levelCount = 1;
-    vkStorageImageViewInfo.subresourceRange.baseArrayLayer = 0;
-    vkStorageImageViewInfo.subresourceRange.layerCount = 1;
-
-    // Create an image view.
-    VkImageView vkStorageImageView;
-    if (vkCreateImageView(vkDevice, &vkStorageImageViewInfo, nullptr, &vkStorageImageView) != VK_SUCCESS) {
-        std::cerr << "Failed to create texture image view!" << std::endl;
-        abort();
-    }
+            // Allocate and bind host-visible memory, host-cached if there is such.
+            // Host-visible blocks of the memory arena are persistently mapped.
+            VkMemoryRequirements vkReadbackBufferMemRequirements;
+            vkGetBufferMemoryRequirements(vkDevice, vkReadbackBuffers[i], &vkReadbackBufferMemRequirements);
+            vkReadbackBufferMemRequirements.alignment = std::max(vkReadbackBufferMemRequirements.alignment, readbackAtomSize);
+            vkReadbackBufferMemRequirements.size = (vkReadbackBufferMemRequirements.size + readbackAtomSize - 1) / readbackAtomSize * readbackAtomSize;
+            vkReadbackBufferMemories[i] = memoryArena.allocate(vkReadbackBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, false, VK_MEMORY_PROPERTY_HOST_CACHED_BIT);
+            vkBindBufferMemory(vkDevice, vkReadbackBuffers[i], vkReadbackBufferMemories[i].memory, vkReadbackBufferMemories[i].offset);
+
+            // Pools of the arena belong to memory types, see MemoryArena::pools.
+            const uint32_t memoryTypeIndex = vkReadbackBufferMemories[i].poolIndex / 2;
+            readbackMemoryCoherent = (memoryArena.memoryProperties.memoryTypes[memoryTypeIndex].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) != 0;
+        }
+    };
+    auto destroyStorageImages = [&]() {
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            vkDestroyImageView(vkDevice, vkStorageImageViews[i], nullptr);
+            memoryArena.free(vkStorageImageMemories[i]);
+            vkDestroyImage(vkDevice, vkStorageImages[i], nullptr);
+            if (multiGpu) {
+                vkDestroyImage(vkDevice, vkPeerStorageImages[i], nullptr);
+            }
+        }
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && !tonemapIntoSwapChain; i++) {
+            vkDestroyImageView(vkDevice, vkDisplayImageViews[i], nullptr);
+            memoryArena.free(vkDisplayImageMemories[i]);
+            vkDestroyImage(vkDevice, vkDisplayImages[i], nullptr);
+        }
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && readback; i++) {
+            memoryArena.free(vkReadbackBufferMemories[i]);
+            vkDestroyBuffer(vkDevice, vkReadbackBuffers[i], nullptr);
+        }
+    };
+    createStorageImages();
+
+    // Accumulation image keeps the running average of all samples traced since
+    // the camera moved. It has float components, so many samples can be averaged
+    // without banding. Unlike storage images there is only one accumulation image:
+    // each frame reads the result of the previous one.
+    // Without accumulation the shader does not touch it, but the descriptor should
+    // still refer to a valid image, so a 1x1 image is created.
+    VkImage vkAccumulationImage = VK_NULL_HANDLE;
+    MemoryAllocation vkAccumulationImageMemory{};
+    VkImageView vkAccumulationImageView = VK_NULL_HANDLE;
+    auto createAccumulationImage = [&]() {
+        // Description of the accumulation image.
+        VkImageCreateInfo vkAccumulationImageInfo{};
+        vkAccumulationImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        vkAccumulationImageInfo.imageType = VK_IMAGE_TYPE_2D;
+        vkAccumulationImageInfo.extent.width = accumulate ? vkSelectedExtent.width : 1;
+        vkAccumulationImageInfo.extent.height = accumulate ? vkSelectedExtent.height : 1;
+        vkAccumulationImageInfo.extent.depth = 1;
+        vkAccumulationImageInfo.mipLevels = 1;
+        vkAccumulationImageInfo.arrayLayers = 1;
+        vkAccumulationImageInfo.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        vkAccumulationImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+        vkAccumulationImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        vkAccumulationImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        vkAccumulationImageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
+        vkAccumulationImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+        // Create the accumulation image.
+        if (vkCreateImage(vkDevice, &vkAccumulationImageInfo, nullptr, &vkAccumulationImage) != VK_SUCCESS) {
+            std::cerr << "Failed to create the accumulation image!" << std::endl;
+            abort();
+        }
+
+        // Allocate and bind memory.
+        VkMemoryRequirements vkAccumulationImageMemRequirements;
+        vkGetImageMemoryRequirements(vkDevice, vkAccumulationImage, &vkAccumulationImageMemRequirements);
+        vkAccumulationImageMemory = memoryArena.allocate(vkAccumulationImageMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+        vkBindImageMemory(vkDevice, vkAccumulationImage, vkAccumulationImageMemory.memory, vkAccumulationImageMemory.offset);
+
+        // Describe an image view.
+        VkImageViewCreateInfo vkAccumulationImageViewInfo{};
+        vkAccumulationImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        vkAccumulationImageViewInfo.image = vkAccumulationImage;
+        vkAccumulationImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        vkAccumulationImageViewInfo.format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        vkAccumulationImageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+        // Create an image view.
+        if (vkCreateImageView(vkDevice, &vkAccumulationImageViewInfo, nullptr, &vkAccumulationImageView) != VK_SUCCESS) {
+            std::cerr << "Failed to create the accumulation image view!" << std::endl;
+            abort();
+        }
+    };
+    auto destroyAccumulationImage = [&]() {
+        vkDestroyImageView(vkDevice, vkAccumulationImageView, nullptr);
+        memoryArena.free(vkAccumulationImageMemory);
+        vkDestroyImage(vkDevice, vkAccumulationImage, nullptr);
+    };
+    createAccumulationImage();
+
+    // Denoiser images. Like the accumulation image they are shared by all frames in flight,
+    // because each frame reads what the previous one wrote:
+    //  - two G-buffers with the world space normal and the hit distance of primary rays,
+    //    the current frame writes one of them and compares it with the other one;
+    //  - motion vectors in pixels from the previous frame to the current one;
+    //  - two history images with the temporally accumulated color and the history length;
+    //  - two images a-trous iterations ping-pong between.
+    // Images of the current frame are selected by parity of the frame counter.
+    // Without denoising the shaders do not touch them, so they are created 1x1.
+    constexpr size_t DENOISER_IMAGE_GBUFFER = 0;
+    constexpr size_t DENOISER_IMAGE_MOTION = 2;
+    constexpr size_t DENOISER_IMAGE_HISTORY = 3;
+    constexpr size_t DENOISER_IMAGE_FILTER = 5;
+    constexpr size_t DENOISER_IMAGE_COUNT = 7;
+    const std::array< VkFormat, DENOISER_IMAGE_COUNT > vkDenoiserImageFormats = {
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        VK_FORMAT_R16G16_SFLOAT,
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        VK_FORMAT_R16G16B16A16_SFLOAT,
+        VK_FORMAT_R16G16B16A16_SFLOAT
+    };
+    std::array< VkImage, DENOISER_IMAGE_COUNT > vkDenoiserImages{};
+    std::array< MemoryAllocation, DENOISER_IMAGE_COUNT > vkDenoiserImageMemories{};
+    std::array< VkImageView, DENOISER_IMAGE_COUNT > vkDenoiserImageViews{};
+    auto createDenoiserImages = [&]() {
+        for (size_t i = 0; i < DENOISER_IMAGE_COUNT; i++) {
+            // Description of a denoiser image.
+            VkImageCreateInfo vkDenoiserImageInfo{};
+            vkDenoiserImageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+            vkDenoiserImageInfo.imageType = VK_IMAGE_TYPE_2D;
+            vkDenoiserImageInfo.extent.width = denoise ? vkSelectedExtent.width : 1;
+            vkDenoiserImageInfo.extent.height = denoise ? vkSelectedExtent.height : 1;
+            vkDenoiserImageInfo.extent.depth = 1;
+            vkDenoiserImageInfo.mipLevels = 1;
+            vkDenoiserImageInfo.arrayLayers = 1;
+            vkDenoiserImageInfo.format = vkDenoiserImageFormats[i];
+            vkDenoiserImageInfo.tiling = VK_IMAGE_TILING_OPTIMAL;
+            vkDenoiserImageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            vkDenoiserImageInfo.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+            vkDenoiserImageInfo.samples = VkSampleCountFlagBits::VK_SAMPLE_COUNT_1_BIT;
+            vkDenoiserImageInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+            // Create the denoiser image.
+            if (vkCreateImage(vkDevice, &vkDenoiserImageInfo, nullptr, &vkDenoiserImages[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create denoiser image #" << i << "!" << std::endl;
+                abort();
+            }
+
+            // Allocate and bind memory.
+            VkMemoryRequirements vkDenoiserImageMemRequirements;
+            vkGetImageMemoryRequirements(vkDevice, vkDenoiserImages[i], &vkDenoiserImageMemRequirements);
+            vkDenoiserImageMemories[i] = memoryArena.allocate(vkDenoiserImageMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, true);
+            vkBindImageMemory(vkDevice, vkDenoiserImages[i], vkDenoiserImageMemories[i].memory, vkDenoiserImageMemories[i].offset);
+
+            // Describe an image view.
+            VkImageViewCreateInfo vkDenoiserImageViewInfo{};
+            vkDenoiserImageViewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+            vkDenoiserImageViewInfo.image = vkDenoiserImages[i];
+            vkDenoiserImageViewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+            vkDenoiserImageViewInfo.format = vkDenoiserImageFormats[i];
+            vkDenoiserImageViewInfo.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+            // Create an image view.
+            if (vkCreateImageView(vkDevice, &vkDenoiserImageViewInfo, nullptr, &vkDenoiserImageViews[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create denoiser image view #" << i << "!" << std::endl;
+                abort();
+            }
+        }
+    };
+    auto destroyDenoiserImages = [&]() {
+        for (size_t i = 0; i < DENOISER_IMAGE_COUNT; i++) {
+            vkDestroyImageView(vkDevice, vkDenoiserImageViews[i], nullptr);
+            memoryArena.free(vkDenoiserImageMemories[i]);
+            vkDestroyImage(vkDevice, vkDenoiserImages[i], nullptr);
+        }
+    };
+    createDenoiserImages();
 
     // ==========================================================================
     //                    STEP 20: Change image layout
@@ -1370,89 +4577,105 @@ int main()
     // See https://www.khronos.org/registry/vulkan/specs/1.2-extensions/html/vkspec.html#synchronization-image-layout-transitions
     // ==========================================================================
 
-    // Create a command pool.
-    VkCommandPoolCreateInfo vkSetImageLayoutPoolInfo{};
-    vkSetImageLayoutPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
-    vkSetImageLayoutPoolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-    vkSetImageLayoutPoolInfo.flags = 0;
-    VkCommandPool vkSetImageLayoutCommandPool;
-    if (vkCreateCommandPool(vkDevice, &vkSetImageLayoutPoolInfo, nullptr, &vkSetImageLayoutCommandPool) != VK_SUCCESS) {
-        std::cerr << "Failed to create a command pool!" << std::endl;
-        abort();
-    }
+    // Storage images are transitioned every time they are created.
+    // The accumulation image and denoiser images are transitioned together with them.
+    auto initializeStorageImageLayouts = [&]() {
+        // Create a command pool.
+        VkCommandPoolCreateInfo vkSetImageLayoutPoolInfo{};
+        vkSetImageLayoutPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+        vkSetImageLayoutPoolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
+        vkSetImageLayoutPoolInfo.flags = 0;
+        VkCommandPool vkSetImageLayoutCommandPool;
+        if (vkCreateCommandPool(vkDevice, &vkSetImageLayoutPoolInfo, nullptr, &vkSetImageLayoutCommandPool) != VK_SUCCESS) {
+            std::cerr << "Failed to create a command pool!" << std::endl;
+            abort();
+        }
 
-    // Create one command buffer.
-    VkCommandBufferAllocateInfo vkSetImageLayoutCmdBufAllocateInfo{};
-    vkSetImageLayoutCmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    vkSetImageLayoutCmdBufAllocateInfo.commandPool = vkSetImageLayoutCommandPool;
-    vkSetImageLayoutCmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkSetImageLayoutCmdBufAllocateInfo.commandBufferCount = 1;
-    VkCommandBuffer vkSetImageLayoutCmdBuffer;
-    if (vkAllocateCommandBuffers(vkDevice, &vkSetImageLayoutCmdBufAllocateInfo, &vkSetImageLayoutCmdBuffer) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate command buffers!" << std::endl;
-        abort();
-    }
+        // Create one command buffer.
+        VkCommandBufferAllocateInfo vkSetImageLayoutCmdBufAllocateInfo{};
+        vkSetImageLayoutCmdBufAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        vkSetImageLayoutCmdBufAllocateInfo.commandPool = vkSetImageLayoutCommandPool;
+        vkSetImageLayoutCmdBufAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+        vkSetImageLayoutCmdBufAllocateInfo.commandBufferCount = 1;
+        VkCommandBuffer vkSetImageLayoutCmdBuffer;
+        if (vkAllocateCommandBuffers(vkDevice, &vkSetImageLayoutCmdBufAllocateInfo, &vkSetImageLayoutCmdBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate command buffers!" << std::endl;
+            abort();
+        }
 
-    // Begin command execution.
-    VkCommandBufferBeginInfo vkSetImageLayoutCmdBufferBeginInfo {};
-    vkSetImageLayoutCmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    if (vkBeginCommandBuffer(vkSetImageLayoutCmdBuffer, &vkSetImageLayoutCmdBufferBeginInfo) != VK_SUCCESS) {
-        std::cerr << "Failed to begin a command buffer!" << std::endl;
-        abort();
-    }
+        // Begin command execution.
+        VkCommandBufferBeginInfo vkSetImageLayoutCmdBufferBeginInfo {};
+        vkSetImageLayoutCmdBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        if (vkBeginCommandBuffer(vkSetImageLayoutCmdBuffer, &vkSetImageLayoutCmdBufferBeginInfo) != VK_SUCCESS) {
+            std::cerr << "Failed to begin a command buffer!" << std::endl;
+            abort();
+        }
 
-    // Change image layout.
-    VkImageMemoryBarrier imageMemoryBarrier {};
-    imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-    imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-    imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-    imageMemoryBarrier.image = vkStorageImage;
-    imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-    imageMemoryBarrier.srcAccessMask = 0;
-    vkCmdPipelineBarrier(
-        vkSetImageLayoutCmdBuffer,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-        VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-        0,
-        0, nullptr,
-        0, nullptr,
-        1, &imageMemoryBarrier);
+        // Change layout of all storage images, the accumulation image and denoiser images.
+        // Swap chain images are transitioned every frame, so display images
+        // are skipped if the tone mapping pass writes swap chain images directly.
+        std::vector< VkImage > vkGeneralLayoutImages = { vkAccumulationImage };
+        vkGeneralLayoutImages.insert(vkGeneralLayoutImages.end(), vkDenoiserImages.begin(), vkDenoiserImages.end());
+        vkGeneralLayoutImages.insert(vkGeneralLayoutImages.end(), vkStorageImages.begin(), vkStorageImages.end());
+        if (!tonemapIntoSwapChain) {
+            vkGeneralLayoutImages.insert(vkGeneralLayoutImages.end(), vkDisplayImages.begin(), vkDisplayImages.end());
+        }
+        std::vector< VkImageMemoryBarrier > imageMemoryBarriers(vkGeneralLayoutImages.size());
+        for (size_t i = 0; i < vkGeneralLayoutImages.size(); i++) {
+            VkImageMemoryBarrier& imageMemoryBarrier = imageMemoryBarriers[i];
+            imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            imageMemoryBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+            imageMemoryBarrier.image = vkGeneralLayoutImages[i];
+            imageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            imageMemoryBarrier.srcAccessMask = 0;
+        }
+        vkCmdPipelineBarrier(
+            vkSetImageLayoutCmdBuffer,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            0,
+            0, nullptr,
+            0, nullptr,
+            static_cast< uint32_t >(imageMemoryBarriers.size()), imageMemoryBarriers.data());
 
-    // End command execution.
-    if (vkEndCommandBuffer(vkSetImageLayoutCmdBuffer) != VK_SUCCESS) {
-        std::cerr << "Failed to end a command buffer!" << std::endl;
-        abort();
-    }
+        // End command execution.
+        if (vkEndCommandBuffer(vkSetImageLayoutCmdBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to end a command buffer!" << std::endl;
+            abort();
+        }
 
-    // Create fence that will suspend the execution until GPU finishes.
-    VkFenceCreateInfo vkSetImageLayoutFenceInfo {};
-    vkSetImageLayoutFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    vkSetImageLayoutFenceInfo.flags = 0;
-    VkFence vkSetImageLayout;
-    if (vkCreateFence(vkDevice, &vkSetImageLayoutFenceInfo, nullptr, &vkSetImageLayout) != VK_SUCCESS) {
-        std::cerr << "Failed to create a fence!" << std::endl;
-        abort();
-    }
+        // Create fence that will suspend the execution until GPU finishes.
+        VkFenceCreateInfo vkSetImageLayoutFenceInfo {};
+        vkSetImageLayoutFenceInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+        vkSetImageLayoutFenceInfo.flags = 0;
+        VkFence vkSetImageLayout;
+        if (vkCreateFence(vkDevice, &vkSetImageLayoutFenceInfo, nullptr, &vkSetImageLayout) != VK_SUCCESS) {
+            std::cerr << "Failed to create a fence!" << std::endl;
+            abort();
+        }
 
-    // Submit the command buffer to the queue.
-    VkSubmitInfo vkSetImageLayoutsubmitInfo{};
-    vkSetImageLayoutsubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-    vkSetImageLayoutsubmitInfo.commandBufferCount = 1;
-    vkSetImageLayoutsubmitInfo.pCommandBuffers = &vkSetImageLayoutCmdBuffer;
-    vkQueueSubmit(vkGraphicsQueue, 1, &vkSetImageLayoutsubmitInfo, vkSetImageLayout);
+        // Submit the command buffer to the queue.
+        VkSubmitInfo vkSetImageLayoutsubmitInfo{};
+        vkSetImageLayoutsubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+        vkSetImageLayoutsubmitInfo.commandBufferCount = 1;
+        vkSetImageLayoutsubmitInfo.pCommandBuffers = &vkSetImageLayoutCmdBuffer;
+        vkQueueSubmit(vkGraphicsQueue, 1, &vkSetImageLayoutsubmitInfo, vkSetImageLayout);
 
-    // Wait for the fence to signal that the command buffer has finished executing.
-    if (vkWaitForFences(vkDevice, 1, &vkSetImageLayout, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
-        std::cerr << "Failed to wait for a fence!" << std::endl;
-        abort();
-    }
+        // Wait for the fence to signal that the command buffer has finished executing.
+        if (vkWaitForFences(vkDevice, 1, &vkSetImageLayout, VK_TRUE, UINT64_MAX) != VK_SUCCESS) {
+            std::cerr << "Failed to wait for a fence!" << std::endl;
+            abort();
+        }
 
-    // Clean up the command pool and the fence.
-    vkDestroyFence(vkDevice, vkSetImageLayout, nullptr);
-    vkFreeCommandBuffers(vkDevice, vkSetImageLayoutCommandPool, 1, &vkSetImageLayoutCmdBuffer);
-    vkDestroyCommandPool(vkDevice, vkSetImageLayoutCommandPool, nullptr);
+        // Clean up the command pool and the fence.
+        vkDestroyFence(vkDevice, vkSetImageLayout, nullptr);
+        vkFreeCommandBuffers(vkDevice, vkSetImageLayoutCommandPool, 1, &vkSetImageLayoutCmdBuffer);
+        vkDestroyCommandPool(vkDevice, vkSetImageLayoutCommandPool, nullptr);
+    };
+    initializeStorageImageLayouts();
 
     // ==========================================================================
     //                    STEP 21: Load shaders
@@ -1461,37 +4684,29 @@ int main()
     // - raygen, to generate a ray, trace it and write color output
     // - raymiss, to produce a color if the ray misses geometry
     // - rayhit, to produce a color if the ray hits geometry
+    // Each shader is compiled twice: for GL_NV_ray_tracing and for GL_EXT_ray_tracing
+    // used by the KHR backend. We load binaries of the selected backend.
+    // Binaries are mapped from the asset archive or from their own files.
     // ==========================================================================
 
+    const std::string shaderFileSuffix = useKhrRayTracing ? ".khr.spv" : ".spv";
+
     // ---------
     // 1: RayGen
     // ---------
 
-    // Open file.
-    std::ifstream raygenShaderFile("main.rgen.spv", std::ios::ate | std::ios::binary);
-    if (!raygenShaderFile.is_open()) {
+    // Map the shader binary, the driver reads the code straight from mapped pages.
+    const AssetView raygenShaderCode = assetReader.find("main.rgen" + shaderFileSuffix);
+    if (raygenShaderCode.data == nullptr) {
         std::cerr << "Raygen shader file not found!" << std::endl;
         abort();
     }
 
-    // Calculate file size.
-    size_t raygenFileSize = static_cast< size_t >(raygenShaderFile.tellg());
-
-    // Jump to the beginning of the file.
-    raygenShaderFile.seekg(0);
-
-    // Read shader code.
-    std::vector< char > raygenShaderBuffer(raygenFileSize);
-    raygenShaderFile.read(raygenShaderBuffer.data(), raygenFileSize);
-
-    // Close the file.
-    raygenShaderFile.close();
-
     // Shader module creation info.
     VkShaderModuleCreateInfo vkRaygenShaderCreateInfo{};
     vkRaygenShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    vkRaygenShaderCreateInfo.codeSize = raygenShaderBuffer.size();
-    vkRaygenShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(raygenShaderBuffer.data());
+    vkRaygenShaderCreateInfo.codeSize = raygenShaderCode.size;
+    vkRaygenShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(raygenShaderCode.data);
 
     // Create a shader module.
     VkShaderModule vkRaygenShaderModule;
@@ -1507,99 +4722,239 @@ int main()
     vkRaygenShaderModuleCreateInfo.module = vkRaygenShaderModule;
     vkRaygenShaderModuleCreateInfo.pName = "main";
 
+    // Amount of samples per pixel is a specialization constant, so the driver
+    // compiles the sample loop for a known trip count.
+    VkSpecializationMapEntry vkSamplesPerPixelMapEntry{};
+    vkSamplesPerPixelMapEntry.constantID = 0;
+    vkSamplesPerPixelMapEntry.offset = 0;
+    vkSamplesPerPixelMapEntry.size = sizeof(samplesPerPixel);
+    VkSpecializationInfo vkRaygenSpecializationInfo{};
+    vkRaygenSpecializationInfo.mapEntryCount = 1;
+    vkRaygenSpecializationInfo.pMapEntries = &vkSamplesPerPixelMapEntry;
+    vkRaygenSpecializationInfo.dataSize = sizeof(samplesPerPixel);
+    vkRaygenSpecializationInfo.pData = &samplesPerPixel;
+    vkRaygenShaderModuleCreateInfo.pSpecializationInfo = &vkRaygenSpecializationInfo;
+
     // ----------
     // 2: RayMiss
     // ----------
 
-    // Open file.
-    std::ifstream raymissShaderFile("main.rmiss.spv", std::ios::ate | std::ios::binary);
-    if (!raymissShaderFile.is_open()) {
+    // Map the shader binary, the driver reads the code straight from mapped pages.
+    const AssetView raymissShaderCode = assetReader.find("main.rmiss" + shaderFileSuffix);
+    if (raymissShaderCode.data == nullptr) {
         std::cerr << "Raymiss shader file not found!" << std::endl;
         abort();
     }
 
-    // Calculate file size.
-    size_t raymissFileSize = static_cast< size_t >(raymissShaderFile.tellg());
+    // Shader module creation info.
+    VkShaderModuleCreateInfo vkRaymissShaderCreateInfo{};
+    vkRaymissShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    vkRaymissShaderCreateInfo.codeSize = raymissShaderCode.size;
+    vkRaymissShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(raymissShaderCode.data);
+
+    // Create a shader module.
+    VkShaderModule vkRaymissShaderModule;
+    if (vkCreateShaderModule(vkDevice, &vkRaymissShaderCreateInfo, nullptr, &vkRaymissShaderModule) != VK_SUCCESS) {
+        std::cerr << "Failed to create a shader!" << std::endl;
+        abort();
+    }
+
+    // Create a pipeline stage for the shader.
+    VkPipelineShaderStageCreateInfo vkRaymissShaderModuleCreateInfo{};
+    vkRaymissShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vkRaymissShaderModuleCreateInfo.stage = VK_SHADER_STAGE_MISS_BIT_NV;
+    vkRaymissShaderModuleCreateInfo.module = vkRaymissShaderModule;
+    vkRaymissShaderModuleCreateInfo.pName = "main";
 
-    // Jump to the beginning of the file.
-    raymissShaderFile.seekg(0);
+    // -----------------
+    // 3: Shadow RayMiss
+    // -----------------
 
-    // Read shader code.
-    std::vector< char > raymissShaderBuffer(raymissFileSize);
-    raymissShaderFile.read(raymissShaderBuffer.data(), raymissFileSize);
+    // Shadow rays use their own miss shader, which tells that the light is visible.
 
-    // Close the file.
-    raymissShaderFile.close();
+    // Map the shader binary, the driver reads the code straight from mapped pages.
+    const AssetView shadowMissShaderCode = assetReader.find("shadow.rmiss" + shaderFileSuffix);
+    if (shadowMissShaderCode.data == nullptr) {
+        std::cerr << "Shadow raymiss shader file not found!" << std::endl;
+        abort();
+    }
 
     // Shader module creation info.
-    VkShaderModuleCreateInfo vkRaymissShaderCreateInfo{};
-    vkRaymissShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    vkRaymissShaderCreateInfo.codeSize = raymissShaderBuffer.size();
-    vkRaymissShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(raymissShaderBuffer.data());
+    VkShaderModuleCreateInfo vkShadowMissShaderCreateInfo{};
+    vkShadowMissShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    vkShadowMissShaderCreateInfo.codeSize = shadowMissShaderCode.size;
+    vkShadowMissShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(shadowMissShaderCode.data);
+
+    // Create a shader module.
+    VkShaderModule vkShadowMissShaderModule;
+    if (vkCreateShaderModule(vkDevice, &vkShadowMissShaderCreateInfo, nullptr, &vkShadowMissShaderModule) != VK_SUCCESS) {
+        std::cerr << "Failed to create a shader!" << std::endl;
+        abort();
+    }
+
+    // Create a pipeline stage for the shader.
+    VkPipelineShaderStageCreateInfo vkShadowMissShaderModuleCreateInfo{};
+    vkShadowMissShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vkShadowMissShaderModuleCreateInfo.stage = VK_SHADER_STAGE_MISS_BIT_NV;
+    vkShadowMissShaderModuleCreateInfo.module = vkShadowMissShaderModule;
+    vkShadowMissShaderModuleCreateInfo.pName = "main";
+
+    // ---------
+    // 4: RayHit
+    // ---------
+
+    // Map the shader binary, the driver reads the code straight from mapped pages.
+    const AssetView rayhitShaderCode = assetReader.find("main.rchit" + shaderFileSuffix);
+    if (rayhitShaderCode.data == nullptr) {
+        std::cerr << "Rayhit shader file not found!" << std::endl;
+        abort();
+    }
+
+    // Shader module creation info.
+    VkShaderModuleCreateInfo vkRayhitShaderCreateInfo{};
+    vkRayhitShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    vkRayhitShaderCreateInfo.codeSize = rayhitShaderCode.size;
+    vkRayhitShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(rayhitShaderCode.data);
 
     // Create a shader module.
-    VkShaderModule vkRaymissShaderModule;
-    if (vkCreateShaderModule(vkDevice, &vkRaymissShaderCreateInfo, nullptr, &vkRaymissShaderModule) != VK_SUCCESS) {
+    VkShaderModule vkRayhitShaderModule;
+    if (vkCreateShaderModule(vkDevice, &vkRayhitShaderCreateInfo, nullptr, &vkRayhitShaderModule) != VK_SUCCESS) {
         std::cerr << "Failed to create a shader!" << std::endl;
         abort();
     }
 
-    // Create a pipeline stage for the shader.
-    VkPipelineShaderStageCreateInfo vkRaymissShaderModuleCreateInfo{};
-    vkRaymissShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vkRaymissShaderModuleCreateInfo.stage = VK_SHADER_STAGE_MISS_BIT_NV;
-    vkRaymissShaderModuleCreateInfo.module = vkRaymissShaderModule;
-    vkRaymissShaderModuleCreateInfo.pName = "main";
+    // Shading model is a specialization constant of the shader.
+    // Each model gets its own pipeline stage, so the driver compiles
+    // a separate closest hit shader without branches on the model.
+    // Whether shadow rays are traced is another constant, so devices without
+    // ray recursion get shaders without the shadow ray.
+    struct RayhitSpecialization
+    {
+        uint32_t materialModel;
+        VkBool32 castShadows;
+    };
+    std::array< VkSpecializationMapEntry, 2 > vkRayhitMapEntries{};
+    vkRayhitMapEntries[0].constantID = 0;
+    vkRayhitMapEntries[0].offset = offsetof(RayhitSpecialization, materialModel);
+    vkRayhitMapEntries[0].size = sizeof(uint32_t);
+    vkRayhitMapEntries[1].constantID = 1;
+    vkRayhitMapEntries[1].offset = offsetof(RayhitSpecialization, castShadows);
+    vkRayhitMapEntries[1].size = sizeof(VkBool32);
+    std::array< RayhitSpecialization, NUM_MATERIAL_MODELS > rayhitSpecializations;
+    std::array< VkSpecializationInfo, NUM_MATERIAL_MODELS > vkRayhitSpecializationInfos{};
+    std::array< VkPipelineShaderStageCreateInfo, NUM_MATERIAL_MODELS > vkRayhitShaderModuleCreateInfos{};
+    for (uint32_t model = 0; model < NUM_MATERIAL_MODELS; model++) {
+        rayhitSpecializations[model].materialModel = model;
+        rayhitSpecializations[model].castShadows = castShadows ? VK_TRUE : VK_FALSE;
+        vkRayhitSpecializationInfos[model].mapEntryCount = static_cast< uint32_t >(vkRayhitMapEntries.size());
+        vkRayhitSpecializationInfos[model].pMapEntries = vkRayhitMapEntries.data();
+        vkRayhitSpecializationInfos[model].dataSize = sizeof(RayhitSpecialization);
+        vkRayhitSpecializationInfos[model].pData = &rayhitSpecializations[model];
+
+        // Create a pipeline stage for the shader.
+        VkPipelineShaderStageCreateInfo& vkRayhitShaderModuleCreateInfo = vkRayhitShaderModuleCreateInfos[model];
+        vkRayhitShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vkRayhitShaderModuleCreateInfo.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+        vkRayhitShaderModuleCreateInfo.module = vkRayhitShaderModule;
+        vkRayhitShaderModuleCreateInfo.pName = "main";
+        vkRayhitShaderModuleCreateInfo.pSpecializationInfo = &vkRayhitSpecializationInfos[model];
+    }
 
-    // ---------
-    // 3: RayHit
-    // ---------
+    // -----------
+    // 5: Denoiser
+    // -----------
+
+    // The denoiser is a compute shader, it is not a part of the ray tracing pipeline.
+    // Its module is created only if the denoiser is enabled, the shader indexes image arrays
+    // dynamically and the device feature for it is enabled only then.
+    VkShaderModule vkDenoiseShaderModule = VK_NULL_HANDLE;
+    if (denoise) {
+        // Map the shader binary, the driver reads the code straight from mapped pages.
+        const AssetView denoiseShaderCode = assetReader.find("denoise.comp" + shaderFileSuffix);
+        if (denoiseShaderCode.data == nullptr) {
+            std::cerr << "Denoiser shader file not found!" << std::endl;
+            abort();
+        }
 
-    // Open file.
-    std::ifstream rayhitShaderFile("main.rchit.spv", std::ios::ate | std::ios::binary);
-    if (!rayhitShaderFile.is_open()) {
-        std::cerr << "Rayhit shader file not found!" << std::endl;
-        abort();
+        // Shader module creation info.
+        VkShaderModuleCreateInfo vkDenoiseShaderCreateInfo{};
+        vkDenoiseShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+        vkDenoiseShaderCreateInfo.codeSize = denoiseShaderCode.size;
+        vkDenoiseShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(denoiseShaderCode.data);
+
+        // Create a shader module.
+        if (vkCreateShaderModule(vkDevice, &vkDenoiseShaderCreateInfo, nullptr, &vkDenoiseShaderModule) != VK_SUCCESS) {
+            std::cerr << "Failed to create a shader!" << std::endl;
+            abort();
+        }
     }
 
-    // Calculate file size.
-    size_t rayhitFileSize = static_cast< size_t >(rayhitShaderFile.tellg());
+    // The pass is a specialization constant of the shader, each pass gets its own pipeline.
+    VkSpecializationMapEntry vkDenoiserPassMapEntry{};
+    vkDenoiserPassMapEntry.constantID = 0;
+    vkDenoiserPassMapEntry.offset = 0;
+    vkDenoiserPassMapEntry.size = sizeof(uint32_t);
+    const std::array< uint32_t, 2 > denoiserPasses = { DENOISER_PASS_TEMPORAL, DENOISER_PASS_ATROUS };
+    std::array< VkSpecializationInfo, 2 > vkDenoiseSpecializationInfos{};
+    std::array< VkPipelineShaderStageCreateInfo, 2 > vkDenoiseShaderModuleCreateInfos{};
+    for (size_t pass = 0; pass < denoiserPasses.size(); pass++) {
+        vkDenoiseSpecializationInfos[pass].mapEntryCount = 1;
+        vkDenoiseSpecializationInfos[pass].pMapEntries = &vkDenoiserPassMapEntry;
+        vkDenoiseSpecializationInfos[pass].dataSize = sizeof(uint32_t);
+        vkDenoiseSpecializationInfos[pass].pData = &denoiserPasses[pass];
+
+        // Create a pipeline stage for the shader.
+        VkPipelineShaderStageCreateInfo& vkDenoiseShaderModuleCreateInfo = vkDenoiseShaderModuleCreateInfos[pass];
+        vkDenoiseShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+        vkDenoiseShaderModuleCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+        vkDenoiseShaderModuleCreateInfo.module = vkDenoiseShaderModule;
+        vkDenoiseShaderModuleCreateInfo.pName = "main";
+        vkDenoiseShaderModuleCreateInfo.pSpecializationInfo = &vkDenoiseSpecializationInfos[pass];
+    }
 
-    // Jump to the beginning of the file.
-    rayhitShaderFile.seekg(0);
+    // ---------------
+    // 6: Tone mapping
+    // ---------------
 
-    // Read shader code.
-    std::vector< char > rayhitShaderBuffer(rayhitFileSize);
-    rayhitShaderFile.read(rayhitShaderBuffer.data(), rayhitFileSize);
+    // The tone mapping pass converts traced radiance into display colors, it is a compute shader as well.
 
-    // Close the file.
-    rayhitShaderFile.close();
+    // Map the shader binary, the driver reads the code straight from mapped pages.
+    const AssetView tonemapShaderCode = assetReader.find("tonemap.comp" + shaderFileSuffix);
+    if (tonemapShaderCode.data == nullptr) {
+        std::cerr << "Tone mapping shader file not found!" << std::endl;
+        abort();
+    }
 
     // Shader module creation info.
-    VkShaderModuleCreateInfo vkRayhitShaderCreateInfo{};
-    vkRayhitShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-    vkRayhitShaderCreateInfo.codeSize = rayhitShaderBuffer.size();
-    vkRayhitShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(rayhitShaderBuffer.data());
+    VkShaderModuleCreateInfo vkTonemapShaderCreateInfo{};
+    vkTonemapShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+    vkTonemapShaderCreateInfo.codeSize = tonemapShaderCode.size;
+    vkTonemapShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(tonemapShaderCode.data);
 
     // Create a shader module.
-    VkShaderModule vkRayhitShaderModule;
-    if (vkCreateShaderModule(vkDevice, &vkRayhitShaderCreateInfo, nullptr, &vkRayhitShaderModule) != VK_SUCCESS) {
+    VkShaderModule vkTonemapShaderModule;
+    if (vkCreateShaderModule(vkDevice, &vkTonemapShaderCreateInfo, nullptr, &vkTonemapShaderModule) != VK_SUCCESS) {
         std::cerr << "Failed to create a shader!" << std::endl;
         abort();
     }
 
     // Create a pipeline stage for the shader.
-    VkPipelineShaderStageCreateInfo vkRayhitShaderModuleCreateInfo{};
-    vkRayhitShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-    vkRayhitShaderModuleCreateInfo.stage = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
-    vkRayhitShaderModuleCreateInfo.module = vkRayhitShaderModule;
-    vkRayhitShaderModuleCreateInfo.pName = "main";
-
-    std::array<VkPipelineShaderStageCreateInfo, 3> shaderStages {
+    VkPipelineShaderStageCreateInfo vkTonemapShaderModuleCreateInfo{};
+    vkTonemapShaderModuleCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    vkTonemapShaderModuleCreateInfo.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    vkTonemapShaderModuleCreateInfo.module = vkTonemapShaderModule;
+    vkTonemapShaderModuleCreateInfo.pName = "main";
+
+    // Stages go in the order of shader groups using them.
+    std::vector< VkPipelineShaderStageCreateInfo > shaderStages {
         vkRaygenShaderModuleCreateInfo,
-        vkRayhitShaderModuleCreateInfo,
         vkRaymissShaderModuleCreateInfo,
+        vkShadowMissShaderModuleCreateInfo
     };
+    shaderStages.insert(shaderStages.end(), vkRayhitShaderModuleCreateInfos.begin(), vkRayhitShaderModuleCreateInfos.end());
+
+    // Shader modules and mesh buffers have their own copies of the data, so assets can be unmapped.
+    assetReader.close();
 
     // ==========================================================================
     //                    STEP 22: Set up shader groups
@@ -1609,11 +4964,17 @@ int main()
     // ==========================================================================
 
     // Indices for the different ray tracing shader types used in this example and their total amount.
+    // Each shading model has its own hit group, they start at INDEX_CLOSEST_HIT.
+    // Shader stages have the same indices as their groups.
+    // Miss groups go one after another, shadow rays select the second one by the miss index.
     constexpr const int INDEX_RAYGEN = 0;
-    constexpr const int INDEX_CLOSEST_HIT = 1;
-    constexpr const int INDEX_MISS = 2;
+    constexpr const int INDEX_MISS = 1;
+    constexpr const int INDEX_SHADOW_MISS = 2;
+    constexpr const int INDEX_CLOSEST_HIT = 3;
+
+    constexpr const int NUM_MISS_SHADERS = INDEX_CLOSEST_HIT - INDEX_MISS;
 
-    constexpr const int NUM_SHADER_GROUPS = 3;
+    constexpr const int NUM_SHADER_GROUPS = INDEX_CLOSEST_HIT + NUM_MATERIAL_MODELS;
 
     // Declare ray tracing shader groups and initialize them with default values.
     std::array<VkRayTracingShaderGroupCreateInfoNV, NUM_SHADER_GROUPS> groups{};
@@ -1632,9 +4993,14 @@ int main()
     groups[INDEX_MISS].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_NV;
     groups[INDEX_MISS].generalShader = INDEX_MISS;
 
-    groups[INDEX_CLOSEST_HIT].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_NV;
-    groups[INDEX_CLOSEST_HIT].generalShader = VK_SHADER_UNUSED_NV;
-    groups[INDEX_CLOSEST_HIT].closestHitShader = INDEX_CLOSEST_HIT;
+    groups[INDEX_SHADOW_MISS].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_GENERAL_NV;
+    groups[INDEX_SHADOW_MISS].generalShader = INDEX_SHADOW_MISS;
+
+    for (uint32_t model = 0; model < NUM_MATERIAL_MODELS; model++) {
+        groups[INDEX_CLOSEST_HIT + model].type = VK_RAY_TRACING_SHADER_GROUP_TYPE_TRIANGLES_HIT_GROUP_NV;
+        groups[INDEX_CLOSEST_HIT + model].generalShader = VK_SHADER_UNUSED_NV;
+        groups[INDEX_CLOSEST_HIT + model].closestHitShader = INDEX_CLOSEST_HIT + model;
+    }
 
     // ==========================================================================
     //                    STEP 23: Create pipeline layout
@@ -1644,12 +5010,18 @@ int main()
     // After that particular values of uniforms should be written.
     // ==========================================================================
 
-    // Binding of TLAS used by the ray gen shader to initiate ray tracing.
+    // Descriptor type of acceleration structures differs between backends.
+    // Shader stages, pipeline stages and access flags of both backends have the same values.
+    const VkDescriptorType vkAccelerationStructureDescriptorType = useKhrRayTracing ? VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_KHR
+                                                                                    : VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
+
+    // Binding of TLAS used by the ray gen shader to initiate ray tracing
+    // and by closest hit shaders to trace shadow rays.
     VkDescriptorSetLayoutBinding vkAccelerationStructureLayoutBinding{};
     vkAccelerationStructureLayoutBinding.binding = 0;
-    vkAccelerationStructureLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
+    vkAccelerationStructureLayoutBinding.descriptorType = vkAccelerationStructureDescriptorType;
     vkAccelerationStructureLayoutBinding.descriptorCount = 1;
-    vkAccelerationStructureLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+    vkAccelerationStructureLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV | VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
 
     // Binding of a storage image to save output color.
     VkDescriptorSetLayoutBinding vkStorageImageLayoutBinding{};
@@ -1661,15 +5033,69 @@ int main()
     // Binding of a uniform buffer that contains view and projection matrixes.
     VkDescriptorSetLayoutBinding vkUniformBufferBinding{};
     vkUniformBufferBinding.binding = 2;
-    vkUniformBufferBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+    // It is dynamic, so each frame selects its own part of the buffer.
+    vkUniformBufferBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
     vkUniformBufferBinding.descriptorCount = 1;
     vkUniformBufferBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
 
+    // Binding of the accumulation image that keeps the average of traced samples.
+    VkDescriptorSetLayoutBinding vkAccumulationImageLayoutBinding{};
+    vkAccumulationImageLayoutBinding.binding = 3;
+    vkAccumulationImageLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkAccumulationImageLayoutBinding.descriptorCount = 1;
+    vkAccumulationImageLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+
+    // Binding of mesh infos, one per mesh.
+    VkDescriptorSetLayoutBinding vkMeshInfoBinding{};
+    vkMeshInfoBinding.binding = 4;
+    vkMeshInfoBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    vkMeshInfoBinding.descriptorCount = 1;
+    vkMeshInfoBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+
+    // Bindings of vertex, index and attribute buffers of all meshes.
+    // These are arrays indexed by the custom index of the hit instance,
+    // which is the index of its mesh, so closest hit shaders may fetch any mesh.
+    const uint32_t meshCount = static_cast< uint32_t >(meshes.size());
+    VkDescriptorSetLayoutBinding vkMeshVertexBinding{};
+    vkMeshVertexBinding.binding = 5;
+    vkMeshVertexBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    vkMeshVertexBinding.descriptorCount = meshCount;
+    vkMeshVertexBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+    VkDescriptorSetLayoutBinding vkMeshIndexBinding{};
+    vkMeshIndexBinding.binding = 6;
+    vkMeshIndexBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    vkMeshIndexBinding.descriptorCount = meshCount;
+    vkMeshIndexBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+    VkDescriptorSetLayoutBinding vkMeshAttributeBinding{};
+    vkMeshAttributeBinding.binding = 7;
+    vkMeshAttributeBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    vkMeshAttributeBinding.descriptorCount = meshCount;
+    vkMeshAttributeBinding.stageFlags = VK_SHADER_STAGE_CLOSEST_HIT_BIT_NV;
+
+    // Bindings of the denoiser G-buffers and motion vectors written by the ray gen shader.
+    VkDescriptorSetLayoutBinding vkGBufferLayoutBinding{};
+    vkGBufferLayoutBinding.binding = 8;
+    vkGBufferLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkGBufferLayoutBinding.descriptorCount = 2;
+    vkGBufferLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+    VkDescriptorSetLayoutBinding vkMotionLayoutBinding{};
+    vkMotionLayoutBinding.binding = 9;
+    vkMotionLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    vkMotionLayoutBinding.descriptorCount = 1;
+    vkMotionLayoutBinding.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+
     // Create descriptor set layout.
     std::vector<VkDescriptorSetLayoutBinding> bindings({
         vkAccelerationStructureLayoutBinding,
         vkStorageImageLayoutBinding,
-        vkUniformBufferBinding
+        vkUniformBufferBinding,
+        vkAccumulationImageLayoutBinding,
+        vkMeshInfoBinding,
+        vkMeshVertexBinding,
+        vkMeshIndexBinding,
+        vkMeshAttributeBinding,
+        vkGBufferLayoutBinding,
+        vkMotionLayoutBinding
     });
     VkDescriptorSetLayoutCreateInfo descriptorSetLayoutInfo{};
     descriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
@@ -1681,37 +5107,319 @@ int main()
         abort();
     }
 
+    // Push constants tell the ray generation shader which tile it traces.
+    struct TracePushConstants
+    {
+        // Position of the tile in the image.
+        uint32_t tileOffsetX;
+        uint32_t tileOffsetY;
+        // Size of the whole traced image, the launch size is only the size of the tile.
+        uint32_t renderWidth;
+        uint32_t renderHeight;
+    };
+    VkPushConstantRange vkTracePushConstantRange{};
+    vkTracePushConstantRange.stageFlags = VK_SHADER_STAGE_RAYGEN_BIT_NV;
+    vkTracePushConstantRange.offset = 0;
+    vkTracePushConstantRange.size = sizeof(TracePushConstants);
+
     // Create pipeline layout.
     VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo{};
     pipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
     pipelineLayoutCreateInfo.setLayoutCount = 1;
     pipelineLayoutCreateInfo.pSetLayouts = &vkDescriptorSetLayout;
+    pipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    pipelineLayoutCreateInfo.pPushConstantRanges = &vkTracePushConstantRange;
     VkPipelineLayout vkPipelineLayout;
     if (vkCreatePipelineLayout(vkDevice, &pipelineLayoutCreateInfo, nullptr, &vkPipelineLayout) != VK_SUCCESS) {
         std::cerr << "Failed to create a pipeline layout!" << std::endl;
         abort();
     }
 
+    // The tone mapping pass has its own layout with two storage images:
+    //  0 - the radiance image of the frame, 1 - the output image.
+    std::array< VkDescriptorSetLayoutBinding, 2 > tonemapBindings{};
+    for (uint32_t binding = 0; binding < tonemapBindings.size(); binding++) {
+        tonemapBindings[binding].binding = binding;
+        tonemapBindings[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        tonemapBindings[binding].descriptorCount = 1;
+        tonemapBindings[binding].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+    VkDescriptorSetLayoutCreateInfo tonemapDescriptorSetLayoutInfo{};
+    tonemapDescriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    tonemapDescriptorSetLayoutInfo.bindingCount = static_cast<uint32_t>(tonemapBindings.size());
+    tonemapDescriptorSetLayoutInfo.pBindings = tonemapBindings.data();
+    VkDescriptorSetLayout vkTonemapDescriptorSetLayout;
+    if (vkCreateDescriptorSetLayout(vkDevice, &tonemapDescriptorSetLayoutInfo, nullptr, &vkTonemapDescriptorSetLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a descriptor set layout!" << std::endl;
+        abort();
+    }
+
+    // Push constants tell the pass how much of the radiance image is traced and the exposure.
+    struct TonemapPushConstants
+    {
+        // Size of the traced part of the radiance image.
+        uint32_t renderWidth;
+        uint32_t renderHeight;
+        // Size of the output image, the traced part is scaled up to it.
+        uint32_t outputWidth;
+        uint32_t outputHeight;
+        // Exposure radiance is scaled by.
+        float exposure;
+        // Whether the pass encodes sRGB, zero if the output is encoded by the hardware.
+        uint32_t encodeSrgb;
+    };
+    VkPushConstantRange vkTonemapPushConstantRange{};
+    vkTonemapPushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    vkTonemapPushConstantRange.offset = 0;
+    vkTonemapPushConstantRange.size = sizeof(TonemapPushConstants);
+
+    // Create the tone mapping pipeline layout.
+    VkPipelineLayoutCreateInfo tonemapPipelineLayoutCreateInfo{};
+    tonemapPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    tonemapPipelineLayoutCreateInfo.setLayoutCount = 1;
+    tonemapPipelineLayoutCreateInfo.pSetLayouts = &vkTonemapDescriptorSetLayout;
+    tonemapPipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    tonemapPipelineLayoutCreateInfo.pPushConstantRanges = &vkTonemapPushConstantRange;
+    VkPipelineLayout vkTonemapPipelineLayout;
+    if (vkCreatePipelineLayout(vkDevice, &tonemapPipelineLayoutCreateInfo, nullptr, &vkTonemapPipelineLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a pipeline layout!" << std::endl;
+        abort();
+    }
+
+    // Denoiser passes share their own layout. They read and write the traced image
+    // in place and use the denoiser images, all of them are storage images:
+    //  0 - the traced image, 1 - G-buffers, 2 - motion vectors,
+    //  3 - history images, 4 - a-trous ping-pong images.
+    const std::array< uint32_t, 5 > denoiserImageCounts = { 1, 2, 1, 2, 2 };
+    std::vector< VkDescriptorSetLayoutBinding > denoiserBindings;
+    for (uint32_t binding = 0; binding < denoiserImageCounts.size(); binding++) {
+        VkDescriptorSetLayoutBinding vkDenoiserImageBinding{};
+        vkDenoiserImageBinding.binding = binding;
+        vkDenoiserImageBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+        vkDenoiserImageBinding.descriptorCount = denoiserImageCounts[binding];
+        vkDenoiserImageBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+        denoiserBindings.push_back(vkDenoiserImageBinding);
+    }
+    VkDescriptorSetLayoutCreateInfo denoiserDescriptorSetLayoutInfo{};
+    denoiserDescriptorSetLayoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    denoiserDescriptorSetLayoutInfo.bindingCount = static_cast<uint32_t>(denoiserBindings.size());
+    denoiserDescriptorSetLayoutInfo.pBindings = denoiserBindings.data();
+    VkDescriptorSetLayout vkDenoiserDescriptorSetLayout;
+    if (vkCreateDescriptorSetLayout(vkDevice, &denoiserDescriptorSetLayoutInfo, nullptr, &vkDenoiserDescriptorSetLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a descriptor set layout!" << std::endl;
+        abort();
+    }
+
+    // Push constants describe the pass: which images it reads and writes and the a-trous step.
+    struct DenoiserPushConstants
+    {
+        // Size of the traced part of images.
+        uint32_t renderWidth;
+        uint32_t renderHeight;
+        // Index of the G-buffer and the history image of the current frame, the other ones are of the previous frame.
+        uint32_t current;
+        // Whether the previous frame left a valid history.
+        uint32_t historyValid;
+        // Distance between a-trous filter taps in pixels.
+        uint32_t stepSize;
+        // A-trous input: 0 is the current history, 1 and 2 are ping-pong images.
+        uint32_t source;
+        // A-trous output: 0 and 1 are ping-pong images, 2 is the traced image.
+        uint32_t target;
+    };
+    VkPushConstantRange vkDenoiserPushConstantRange{};
+    vkDenoiserPushConstantRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    vkDenoiserPushConstantRange.offset = 0;
+    vkDenoiserPushConstantRange.size = sizeof(DenoiserPushConstants);
+
+    // Create the denoiser pipeline layout.
+    VkPipelineLayoutCreateInfo denoiserPipelineLayoutCreateInfo{};
+    denoiserPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    denoiserPipelineLayoutCreateInfo.setLayoutCount = 1;
+    denoiserPipelineLayoutCreateInfo.pSetLayouts = &vkDenoiserDescriptorSetLayout;
+    denoiserPipelineLayoutCreateInfo.pushConstantRangeCount = 1;
+    denoiserPipelineLayoutCreateInfo.pPushConstantRanges = &vkDenoiserPushConstantRange;
+    VkPipelineLayout vkDenoiserPipelineLayout;
+    if (vkCreatePipelineLayout(vkDevice, &denoiserPipelineLayoutCreateInfo, nullptr, &vkDenoiserPipelineLayout) != VK_SUCCESS) {
+        std::cerr << "Failed to create a pipeline layout!" << std::endl;
+        abort();
+    }
+
     // ==========================================================================
     //                    STEP 24: Create a pipeline
     // ==========================================================================
     // Ray tracing pipeline binds together shaders, shader groups and uniforms.
+    // Pipeline creation compiles shaders into the device code, which takes
+    // a lot of time. The driver can reuse compiled code from a pipeline cache,
+    // so we save the cache into a file and load it on the next start.
     // ==========================================================================
 
-    VkRayTracingPipelineCreateInfoNV vkRayTracingPipelineInfo{};
-    vkRayTracingPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_NV;
-    vkRayTracingPipelineInfo.stageCount = static_cast<uint32_t>(shaderStages.size());
-    vkRayTracingPipelineInfo.pStages = shaderStages.data();
-    vkRayTracingPipelineInfo.groupCount = static_cast<uint32_t>(groups.size());
-    vkRayTracingPipelineInfo.pGroups = groups.data();
-    vkRayTracingPipelineInfo.maxRecursionDepth = 1;
-    vkRayTracingPipelineInfo.layout = vkPipelineLayout;
-    VkPipeline vkPipeline;
-    if (vkCreateRayTracingPipelinesNV(vkDevice, VK_NULL_HANDLE, 1, &vkRayTracingPipelineInfo, nullptr, &vkPipeline) != VK_SUCCESS) {
+    // ------------------------
+    // 1: Load a pipeline cache
+    // ------------------------
+
+    // Header describing the current device and driver.
+    PipelineCacheFileHeader pipelineCacheHeader{};
+    pipelineCacheHeader.magic = PIPELINE_CACHE_FILE_MAGIC;
+    pipelineCacheHeader.vendorID = deviceProps2.properties.vendorID;
+    pipelineCacheHeader.deviceID = deviceProps2.properties.deviceID;
+    pipelineCacheHeader.driverVersion = deviceProps2.properties.driverVersion;
+    memcpy(pipelineCacheHeader.pipelineCacheUUID, deviceProps2.properties.pipelineCacheUUID, VK_UUID_SIZE);
+
+    // Read the cache data if the file exists and was created for the same device and driver.
+    // Otherwise we start with an empty cache.
+    std::vector< char > pipelineCacheData;
+    std::ifstream pipelineCacheInFile(PIPELINE_CACHE_FILE_NAME, std::ios::binary);
+    if (pipelineCacheInFile.is_open()) {
+        // Length of the file, the data size of the header should match the rest of it,
+        // so a corrupted header does not make us allocate more than the file has.
+        pipelineCacheInFile.seekg(0, std::ios::end);
+        const std::streamoff pipelineCacheFileSize = pipelineCacheInFile.tellg();
+        pipelineCacheInFile.seekg(0, std::ios::beg);
+        PipelineCacheFileHeader fileHeader{};
+        pipelineCacheInFile.read(reinterpret_cast< char* >(&fileHeader), sizeof(fileHeader));
+        if (pipelineCacheInFile &&
+                pipelineCacheFileSize >= static_cast< std::streamoff >(sizeof(fileHeader)) &&
+                fileHeader.dataSize == static_cast< uint64_t >(pipelineCacheFileSize) - sizeof(fileHeader) &&
+                fileHeader.magic == pipelineCacheHeader.magic &&
+                fileHeader.vendorID == pipelineCacheHeader.vendorID &&
+                fileHeader.deviceID == pipelineCacheHeader.deviceID &&
+                fileHeader.driverVersion == pipelineCacheHeader.driverVersion &&
+                memcmp(fileHeader.pipelineCacheUUID, pipelineCacheHeader.pipelineCacheUUID, VK_UUID_SIZE) == 0) {
+            pipelineCacheData.resize(static_cast< size_t >(fileHeader.dataSize));
+            pipelineCacheInFile.read(pipelineCacheData.data(), static_cast< std::streamsize >(pipelineCacheData.size()));
+            if (!pipelineCacheInFile) {
+                pipelineCacheData.clear();
+            }
+        }
+        pipelineCacheInFile.close();
+        if (pipelineCacheData.empty()) {
+            std::cout << "Pipeline cache file is outdated and will be recreated" << std::endl;
+        }
+    }
+
+    // Create a pipeline cache.
+    VkPipelineCacheCreateInfo vkPipelineCacheInfo{};
+    vkPipelineCacheInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    vkPipelineCacheInfo.initialDataSize = pipelineCacheData.size();
+    vkPipelineCacheInfo.pInitialData = pipelineCacheData.data();
+    VkPipelineCache vkPipelineCache;
+    if (vkCreatePipelineCache(vkDevice, &vkPipelineCacheInfo, nullptr, &vkPipelineCache) != VK_SUCCESS) {
+        std::cerr << "Failed to create a pipeline cache!" << std::endl;
+        abort();
+    }
+
+    // Save the pipeline cache into the file, so the next start is faster.
+    auto savePipelineCache = [&]() {
+        size_t dataSize = 0;
+        if (vkGetPipelineCacheData(vkDevice, vkPipelineCache, &dataSize, nullptr) != VK_SUCCESS) {
+            std::cerr << "Failed to get pipeline cache data!" << std::endl;
+            return;
+        }
+        std::vector< char > data(dataSize);
+        if (vkGetPipelineCacheData(vkDevice, vkPipelineCache, &dataSize, data.data()) != VK_SUCCESS) {
+            std::cerr << "Failed to get pipeline cache data!" << std::endl;
+            return;
+        }
+        PipelineCacheFileHeader fileHeader = pipelineCacheHeader;
+        fileHeader.dataSize = dataSize;
+        std::ofstream pipelineCacheOutFile(PIPELINE_CACHE_FILE_NAME, std::ios::binary | std::ios::trunc);
+        pipelineCacheOutFile.write(reinterpret_cast< const char* >(&fileHeader), sizeof(fileHeader));
+        pipelineCacheOutFile.write(data.data(), static_cast< std::streamsize >(dataSize));
+        if (!pipelineCacheOutFile) {
+            std::cerr << "Failed to write the pipeline cache file!" << std::endl;
+        }
+    };
+
+    // ---------------------
+    // 2: Create a pipeline
+    // ---------------------
+
+    // Hot shader reload creates the pipeline again from new shader stages on a background thread,
+    // so creation is a function of the stages. Everything else it reads does not change.
+    // Returns a null handle if the driver fails to create the pipeline.
+    auto createRayTracingPipeline = [&](const std::vector< VkPipelineShaderStageCreateInfo >& stages) {
+        VkPipeline pipeline = VK_NULL_HANDLE;
+        if (useKhrRayTracing) {
+            // The KHR backend describes shader groups with its own structure having the same fields.
+            std::array<VkRayTracingShaderGroupCreateInfoKHR, NUM_SHADER_GROUPS> groupsKhr{};
+            for (int i = 0; i < NUM_SHADER_GROUPS; i++) {
+                groupsKhr[i].sType = VK_STRUCTURE_TYPE_RAY_TRACING_SHADER_GROUP_CREATE_INFO_KHR;
+                groupsKhr[i].type = groups[i].type;
+                groupsKhr[i].generalShader = groups[i].generalShader;
+                groupsKhr[i].closestHitShader = groups[i].closestHitShader;
+                groupsKhr[i].anyHitShader = groups[i].anyHitShader;
+                groupsKhr[i].intersectionShader = groups[i].intersectionShader;
+            }
+
+            VkRayTracingPipelineCreateInfoKHR vkRayTracingPipelineInfo{};
+            vkRayTracingPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_KHR;
+            vkRayTracingPipelineInfo.stageCount = static_cast<uint32_t>(stages.size());
+            vkRayTracingPipelineInfo.pStages = stages.data();
+            vkRayTracingPipelineInfo.groupCount = static_cast<uint32_t>(groupsKhr.size());
+            vkRayTracingPipelineInfo.pGroups = groupsKhr.data();
+            vkRayTracingPipelineInfo.maxPipelineRayRecursionDepth = castShadows ? 2 : 1;
+            vkRayTracingPipelineInfo.layout = vkPipelineLayout;
+            // The pipeline is created immediately, so no deferred operation is given.
+            if (vkCreateRayTracingPipelinesKHR(vkDevice, VK_NULL_HANDLE, vkPipelineCache, 1, &vkRayTracingPipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+                return static_cast< VkPipeline >(VK_NULL_HANDLE);
+            }
+        } else {
+            VkRayTracingPipelineCreateInfoNV vkRayTracingPipelineInfo{};
+            vkRayTracingPipelineInfo.sType = VK_STRUCTURE_TYPE_RAY_TRACING_PIPELINE_CREATE_INFO_NV;
+            vkRayTracingPipelineInfo.stageCount = static_cast<uint32_t>(stages.size());
+            vkRayTracingPipelineInfo.pStages = stages.data();
+            vkRayTracingPipelineInfo.groupCount = static_cast<uint32_t>(groups.size());
+            vkRayTracingPipelineInfo.pGroups = groups.data();
+            vkRayTracingPipelineInfo.maxRecursionDepth = castShadows ? 2 : 1;
+            vkRayTracingPipelineInfo.layout = vkPipelineLayout;
+            if (vkCreateRayTracingPipelinesNV(vkDevice, vkPipelineCache, 1, &vkRayTracingPipelineInfo, nullptr, &pipeline) != VK_SUCCESS) {
+                return static_cast< VkPipeline >(VK_NULL_HANDLE);
+            }
+        }
+        return pipeline;
+    };
+    VkPipeline vkPipeline = createRayTracingPipeline(shaderStages);
+    if (vkPipeline == VK_NULL_HANDLE) {
         std::cerr << "Failed to create a pipeline!" << std::endl;
         abort();
     }
 
+    // -----------------------------
+    // 3: Create denoiser pipelines
+    // -----------------------------
+
+    // Each denoiser pass is a compute pipeline, they go into the same pipeline cache.
+    // Pipelines are created only if the denoiser is enabled.
+    std::array< VkPipeline, 2 > vkDenoiserPipelines{};
+    if (denoise) {
+        std::array< VkComputePipelineCreateInfo, 2 > vkDenoiserPipelineInfos{};
+        for (size_t pass = 0; pass < vkDenoiserPipelineInfos.size(); pass++) {
+            vkDenoiserPipelineInfos[pass].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+            vkDenoiserPipelineInfos[pass].stage = vkDenoiseShaderModuleCreateInfos[pass];
+            vkDenoiserPipelineInfos[pass].layout = vkDenoiserPipelineLayout;
+        }
+        if (vkCreateComputePipelines(vkDevice, vkPipelineCache, static_cast< uint32_t >(vkDenoiserPipelineInfos.size()), vkDenoiserPipelineInfos.data(), nullptr, vkDenoiserPipelines.data()) != VK_SUCCESS) {
+            std::cerr << "Failed to create denoiser pipelines!" << std::endl;
+            abort();
+        }
+    }
+
+    // ---------------------------------
+    // 4: Create a tone mapping pipeline
+    // ---------------------------------
+
+    // The tone mapping pass presents every frame, so its pipeline is always created.
+    VkComputePipelineCreateInfo vkTonemapPipelineInfo{};
+    vkTonemapPipelineInfo.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    vkTonemapPipelineInfo.stage = vkTonemapShaderModuleCreateInfo;
+    vkTonemapPipelineInfo.layout = vkTonemapPipelineLayout;
+    VkPipeline vkTonemapPipeline;
+    if (vkCreateComputePipelines(vkDevice, vkPipelineCache, 1, &vkTonemapPipelineInfo, nullptr, &vkTonemapPipeline) != VK_SUCCESS) {
+        std::cerr << "Failed to create a tone mapping pipeline!" << std::endl;
+        abort();
+    }
+
     // ==========================================================================
     //                STEP 25: Create a shader binding table
     // ==========================================================================
@@ -1723,66 +5431,121 @@ int main()
     // See https://www.willusher.io/graphics/2019/11/20/the-sbt-three-ways
     // ==========================================================================
 
-    // Size of the shader binding table.
-    const uint32_t shaderBindingTableSize = rayTracingProperties.shaderGroupBaseAlignment * NUM_SHADER_GROUPS;
+    // The table has three regions: the ray generation record, the miss records
+    // of primary and shadow rays and one hit record per material. A hit record is the handle of the hit group
+    // of the material model followed by the material parameters. Records are packed
+    // with strides rounded up to the handle alignment, only regions start at
+    // the base alignment. Instances select their hit record by the record offset.
+    auto alignUp = [](VkDeviceSize value, VkDeviceSize alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    };
+    const VkDeviceSize sbtRaygenStride = alignUp(shaderGroupHandleSize, shaderGroupHandleAlignment);
+    const VkDeviceSize sbtMissStride = alignUp(shaderGroupHandleSize, shaderGroupHandleAlignment);
+    const VkDeviceSize sbtHitStride = alignUp(shaderGroupHandleSize + sizeof(MaterialRecord), shaderGroupHandleAlignment);
+    const VkDeviceSize sbtRaygenOffset = 0;
+    const VkDeviceSize sbtMissOffset = alignUp(sbtRaygenOffset + sbtRaygenStride, shaderGroupBaseAlignment);
+    const VkDeviceSize sbtMissRegionSize = sbtMissStride * NUM_MISS_SHADERS;
+    const VkDeviceSize sbtHitOffset = alignUp(sbtMissOffset + sbtMissRegionSize, shaderGroupBaseAlignment);
+    const VkDeviceSize sbtHitRegionSize = sbtHitStride * MATERIALS.size();
 
-    // Describe a buffer.
-    VkBufferCreateInfo vkSbtBufferInfo{};
-    vkSbtBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    vkSbtBufferInfo.size = shaderBindingTableSize;
-    vkSbtBufferInfo.usage = VK_BUFFER_USAGE_RAY_TRACING_BIT_NV;
-    vkSbtBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    // Size of the shader binding table.
+    const VkDeviceSize shaderBindingTableSize = sbtHitOffset + sbtHitRegionSize;
 
-    // Create a buffer.
+    // The table holds handles of the pipeline, so hot shader reload builds a new table
+    // for every new pipeline. The table used by frames is kept in the variables below.
     VkBuffer vkShaderBindingTable;
-    if (vkCreateBuffer(vkDevice, &vkSbtBufferInfo, nullptr, &vkShaderBindingTable) != VK_SUCCESS) {
-        std::cerr << "Failed to create a shader binding table buffer!" << std::endl;
-        abort();
-    }
+    MemoryAllocation vkShaderBindingTableMemory;
+    VkDeviceAddress vkShaderBindingTableAddress;
+
+    // Create a buffer for a shader binding table.
+    // Tables are read by every ray tracing dispatch, so frames use tables in device-local memory.
+    // The table of the startup pipeline is uploaded through the staging ring. Tables of reloaded pipelines
+    // are written by the reload thread into host-visible memory and copied into a device-local table
+    // by the first frame of the new pipeline, so swapping a pipeline does not wait for an upload.
+    // The KHR backend refers to the table by its device address.
+    auto createShaderBindingTableBuffer = [&](bool hostVisible, VkBuffer& buffer, MemoryAllocation& memory, VkDeviceAddress& address) {
+        // Describe a buffer.
+        VkBufferCreateInfo vkSbtBufferInfo{};
+        vkSbtBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkSbtBufferInfo.size = shaderBindingTableSize;
+        vkSbtBufferInfo.usage = useKhrRayTracing ?
+            (VK_BUFFER_USAGE_SHADER_BINDING_TABLE_BIT_KHR | VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT) :
+            (VK_BUFFER_USAGE_RAY_TRACING_BIT_NV | VK_BUFFER_USAGE_TRANSFER_DST_BIT);
+        // Host-visible tables are copied into device-local ones.
+        if (hostVisible) {
+            vkSbtBufferInfo.usage |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT;
+        }
+        vkSbtBufferInfo.sharingMode = uploadSharingMode;
+        vkSbtBufferInfo.queueFamilyIndexCount = static_cast< uint32_t >(uploadQueueFamilies.size());
+        vkSbtBufferInfo.pQueueFamilyIndices = uploadQueueFamilies.data();
 
-    // Retrieve memory requirements for the buffer.
-    VkMemoryRequirements vkSbtBufferMemRequirements;
-    vkGetBufferMemoryRequirements(vkDevice, vkShaderBindingTable, &vkSbtBufferMemRequirements);
+        // Create a buffer.
+        if (vkCreateBuffer(vkDevice, &vkSbtBufferInfo, nullptr, &buffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create a shader binding table buffer!" << std::endl;
+            abort();
+        }
 
-    // Find suitable memory type.
-    VkMemoryAllocateInfo vkSbtBufferAllocInfo{};
-    vkSbtBufferAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkSbtBufferAllocInfo.allocationSize = vkSbtBufferMemRequirements.size;
-    uint32_t sbtMemoryTypeIndex = UINT32_MAX;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkSbtBufferMemRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)) {
-            sbtMemoryTypeIndex = i;
-            break;
+        // Retrieve memory requirements for the buffer.
+        VkMemoryRequirements vkSbtBufferMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, buffer, &vkSbtBufferMemRequirements);
+        // Shader group records should start at the base alignment in the device address space as well.
+        vkSbtBufferMemRequirements.alignment = std::max< VkDeviceSize >(vkSbtBufferMemRequirements.alignment, shaderGroupBaseAlignment);
+
+        // Allocate memory for the shader binding table.
+        // Host-visible memory is coherent, so records written by the CPU need no flush.
+        if (hostVisible) {
+            memory = memoryArena.allocate(vkSbtBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
+        } else {
+            memory = memoryArena.allocate(vkSbtBufferMemRequirements, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, false);
         }
-    }
-    vkSbtBufferAllocInfo.memoryTypeIndex = sbtMemoryTypeIndex;
 
-    // Allocate memory for the shader binding table.
-    VkDeviceMemory vkShaderBindingTableMemory;
-    if (vkAllocateMemory(vkDevice, &vkSbtBufferAllocInfo, nullptr, &vkShaderBindingTableMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate memory for the shader binding table!" << std::endl;
-        abort();
-    }
+        // Bind the buffer to the allocated memory.
+        vkBindBufferMemory(vkDevice, buffer, memory.memory, memory.offset);
+        address = useKhrRayTracing ? getBufferDeviceAddress(buffer) : 0;
+    };
 
-    // Bind the buffer to the allocated memory.
-    vkBindBufferMemory(vkDevice, vkShaderBindingTable, vkShaderBindingTableMemory, 0);
+    // Lay out records of the table of the given pipeline in the given memory of shaderBindingTableSize bytes.
+    // It touches nothing but the memory, so the reload thread may call it.
+    // Returns false if shader group handles cannot be retrieved.
+    auto writeShaderBindingTable = [&](VkPipeline pipeline, uint8_t* sbtData) {
+        // Retrieve shader group handles.
+        std::vector< uint8_t > shaderHandleStorage(shaderGroupHandleSize * NUM_SHADER_GROUPS);
+        const auto vkGetRayTracingShaderGroupHandles = useKhrRayTracing ? vkGetRayTracingShaderGroupHandlesKHR : vkGetRayTracingShaderGroupHandlesNV;
+        if (vkGetRayTracingShaderGroupHandles(vkDevice, pipeline, 0, NUM_SHADER_GROUPS, shaderHandleStorage.size(), shaderHandleStorage.data()) != VK_SUCCESS) {
+            return false;
+        }
 
-    // Retrieve shader group handles.
-    auto shaderHandleStorage = new uint8_t[shaderBindingTableSize];
-    if (vkGetRayTracingShaderGroupHandlesNV(vkDevice, vkPipeline, 0, NUM_SHADER_GROUPS, shaderBindingTableSize, shaderHandleStorage) != VK_SUCCESS) {
-        std::cerr << "Failed to getshader group handles!" << std::endl;
-        abort();
-    }
+        // Lay out records.
+        memset(sbtData, 0, static_cast< size_t >(shaderBindingTableSize));
+        memcpy(sbtData + sbtRaygenOffset,
+               shaderHandleStorage.data() + INDEX_RAYGEN * shaderGroupHandleSize,
+               shaderGroupHandleSize);
+        for (int i = 0; i < NUM_MISS_SHADERS; i++) {
+            memcpy(sbtData + sbtMissOffset + i * sbtMissStride,
+                   shaderHandleStorage.data() + (INDEX_MISS + i) * shaderGroupHandleSize,
+                   shaderGroupHandleSize);
+        }
+        for (size_t i = 0; i < MATERIALS.size(); i++) {
+            uint8_t* record = sbtData + sbtHitOffset + i * sbtHitStride;
+            memcpy(record,
+                   shaderHandleStorage.data() + (INDEX_CLOSEST_HIT + MATERIALS[i].model) * shaderGroupHandleSize,
+                   shaderGroupHandleSize);
+            memcpy(record + shaderGroupHandleSize, &MATERIALS[i].record, sizeof(MaterialRecord));
+        }
+        return true;
+    };
 
-    // Copy shader group handles to the buffer.
-    void* sbtBufferMemoryData;
-    vkMapMemory(vkDevice, vkShaderBindingTableMemory, 0, shaderBindingTableSize, 0, &sbtBufferMemoryData);
-    auto* sbtData = static_cast<uint8_t*>(sbtBufferMemoryData);
-    for(uint32_t group = 0; group < NUM_SHADER_GROUPS; group++) {
-        memcpy(sbtData, shaderHandleStorage + group * rayTracingProperties.shaderGroupHandleSize, rayTracingProperties.shaderGroupHandleSize);
-        sbtData += rayTracingProperties.shaderGroupBaseAlignment;
+    // Create the table of the startup pipeline, upload it through the staging ring and wait until it is ready.
+    createShaderBindingTableBuffer(false, vkShaderBindingTable, vkShaderBindingTableMemory, vkShaderBindingTableAddress);
+    {
+        std::vector< uint8_t > sbtData(shaderBindingTableSize);
+        if (!writeShaderBindingTable(vkPipeline, sbtData.data())) {
+            std::cerr << "Failed to getshader group handles!" << std::endl;
+            abort();
+        }
+        uploadDataToBuffer(vkShaderBindingTable, sbtData.data(), sbtData.size());
+        flushUploads();
     }
-    vkUnmapMemory(vkDevice, vkShaderBindingTableMemory);
 
     // ==========================================================================
     //                      STEP 26: Create uniform buffers
@@ -1791,19 +5554,41 @@ int main()
     // as uniform variables. In our case we should provide a view and a projection
     // matrices in order to generate rays. To avoid unneeded calculations on GPU,
     // the matrices are already inversed.
+    // The camera is controlled by the user, so the uniforms change every frame.
+    // In order to not overwrite data used by frames in flight, we keep a ring
+    // of uniform slots, one per frame in flight, in a single persistently mapped
+    // buffer. Shaders see the slot of the current frame via a dynamic offset.
     // ==========================================================================
 
+    // -------------------------------
+    // 1: Create a uniform buffer ring
+    // -------------------------------
+
     // Structure that we want to provide to the vertext shader.
     struct UniformBufferObject
     {
         glm::mat4 viewInv;
         glm::mat4 projInv;
+        // Amount of samples already accumulated, zero restarts accumulation.
+        uint32_t frameIndex;
+        // Whether the shader jitters samples and accumulates them.
+        uint32_t accumulate;
+        // Whether the shader jitters samples and writes denoiser inputs.
+        uint32_t denoise;
+        // Index of the G-buffer written by the frame.
+        uint32_t gbufferIndex;
+        // View and projection matrices of the previous frame, used to compute motion vectors.
+        glm::mat4 previousViewProj;
     };
 
+    // Dynamic offsets should be multiples of minUniformBufferOffsetAlignment,
+    // so each slot of the ring is aligned.
+    const VkDeviceSize uniformBufferAlignment = std::max< VkDeviceSize >(deviceProps2.properties.limits.minUniformBufferOffsetAlignment, 1);
+    const VkDeviceSize vkUniformBufferSlotSize = (sizeof(UniformBufferObject) + uniformBufferAlignment - 1) / uniformBufferAlignment * uniformBufferAlignment;
+
     // Get size of the uniform buffer.
-    VkDeviceSize vkUniformBufferSize = sizeof(UniformBufferObject);
+    VkDeviceSize vkUniformBufferSize = vkUniformBufferSlotSize * MAX_FRAMES_IN_FLIGHT;
 
-    // Create one uniform buffer per swap chain image.
     // Describe a buffer.
     VkBufferCreateInfo vkUniformBufferInfo{};
     vkUniformBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
@@ -1822,41 +5607,121 @@ int main()
     VkMemoryRequirements vkUniformBufferMemRequirements;
     vkGetBufferMemoryRequirements(vkDevice, vkUniformBuffer, &vkUniformBufferMemRequirements);
 
-    // Select suitable memory type.
-    VkMemoryAllocateInfo vkUniformBufferAllocInfo{};
-    vkUniformBufferAllocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    vkUniformBufferAllocInfo.allocationSize = vkUniformBufferMemRequirements.size;
-    uint32_t uniformBufferMemTypeIndex = UINT32_MAX;
-    VkMemoryPropertyFlags vkUniformBufferMemFlags = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
-    for (uint32_t i = 0; i < vkPhysicalDeviceMemoryProperties.memoryTypeCount; i++) {
-        if ((vkUniformBufferMemRequirements.memoryTypeBits & (1 << i)) && (vkPhysicalDeviceMemoryProperties.memoryTypes[i].propertyFlags & vkUniformBufferMemFlags) == vkUniformBufferMemFlags) {
-            uniformBufferMemTypeIndex = i;
-            break;
-        }
-    }
-    vkUniformBufferAllocInfo.memoryTypeIndex = uniformBufferMemTypeIndex;
+    // Allocate memory for the uniform buffer.
+    // The buffer is written every frame, so prefer memory that is device-local and host-visible.
+    MemoryAllocation vkUniformBufferMemory = memoryArena.allocate(vkUniformBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT);
 
-    // Allocate memory for the vertex buffer.
-    VkDeviceMemory vkUniformBufferMemory;
-    if (vkAllocateMemory(vkDevice, &vkUniformBufferAllocInfo, nullptr, &vkUniformBufferMemory) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate buffer memory!" << std::endl;
-        abort();
+    // Bind the buffer to the allocated memory.
+    vkBindBufferMemory(vkDevice, vkUniformBuffer, vkUniformBufferMemory.memory, vkUniformBufferMemory.offset);
+
+    // ---------------------
+    // 2: Set up the camera
+    // ---------------------
+
+    // The camera orbits around the target point.
+    // Drag the mouse with the left button pressed to rotate it and scroll to zoom.
+    struct OrbitCamera
+    {
+        // Point the camera looks at.
+        glm::vec3 target;
+        // Horizontal angle around the vertical axis.
+        float yaw;
+        // Vertical angle above the horizontal plane.
+        float pitch;
+        // Distance to the target.
+        float distance;
+        // Scroll offset accumulated by the scroll callback since the last frame.
+        double pendingScroll;
+        // Cursor position in the previous frame.
+        double lastCursorX;
+        double lastCursorY;
+    };
+
+    // Initial camera position is (2, 2, -2) looking at the origin.
+    const glm::vec3 initialEye(2.0f, 2.0f, -2.0f);
+    OrbitCamera camera{};
+    camera.target = glm::vec3(0.0f, 0.0f, 0.0f);
+    camera.distance = glm::length(initialEye - camera.target);
+    camera.yaw = std::atan2(initialEye.y, initialEye.x);
+    camera.pitch = std::asin(initialEye.z / camera.distance);
+
+    // Collect scroll events, they are applied once per frame.
+    // Headless mode has no input and the camera stays in the initial position.
+    if (!headless) {
+        glfwGetCursorPos(glfwWindow, &camera.lastCursorX, &camera.lastCursorY);
+        glfwSetWindowUserPointer(glfwWindow, &camera);
+        glfwSetScrollCallback(glfwWindow, [](GLFWwindow* window, double xoffset, double yoffset) {
+            (void) xoffset;
+            static_cast< OrbitCamera* >(glfwGetWindowUserPointer(window))->pendingScroll += yoffset;
+        });
     }
 
-    // Bind the buffer to the allocated memory.
-    vkBindBufferMemory(vkDevice, vkUniformBuffer, vkUniformBufferMemory, 0);
+    // Apply user input to the camera.
+    // Returns true if the camera has moved.
+    auto updateCamera = [&]() {
+        if (headless) {
+            return false;
+        }
+        const OrbitCamera previous = camera;
+
+        // Rotate the camera while the left mouse button is pressed.
+        double cursorX, cursorY;
+        glfwGetCursorPos(glfwWindow, &cursorX, &cursorY);
+        if (glfwGetMouseButton(glfwWindow, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
+            camera.yaw -= static_cast< float >(cursorX - camera.lastCursorX) * CAMERA_ROTATION_SPEED;
+            camera.pitch += static_cast< float >(cursorY - camera.lastCursorY) * CAMERA_ROTATION_SPEED;
+            camera.pitch = std::max(-CAMERA_MAX_PITCH, std::min(CAMERA_MAX_PITCH, camera.pitch));
+        }
+        camera.lastCursorX = cursorX;
+        camera.lastCursorY = cursorY;
+
+        // Zoom with the scroll wheel.
+        camera.distance *= std::pow(CAMERA_ZOOM_SPEED, static_cast< float >(camera.pendingScroll));
+        camera.distance = std::max(CAMERA_MIN_DISTANCE, std::min(CAMERA_MAX_DISTANCE, camera.distance));
+        camera.pendingScroll = 0.0;
 
-    // Fill in the uniform buffer object.
-    UniformBufferObject ubo{};
-    ubo.viewInv = glm::inverse(glm::lookAt(glm::vec3(2.0f, 2.0f, -2.0f), glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f)));
-    float aspectRatio = static_cast< float >(vkSelectedExtent.width) / vkSelectedExtent.height;
-    ubo.projInv = glm::inverse(glm::perspective(glm::radians(45.0f), aspectRatio, 0.1f, 10.0f));
+        return camera.yaw != previous.yaw || camera.pitch != previous.pitch || camera.distance != previous.distance;
+    };
 
-    // Write the uniform buffer object data.
-    void* data;
-    vkMapMemory(vkDevice, vkUniformBufferMemory, 0, sizeof(ubo), 0, &data);
-    memcpy(data, &ubo, sizeof(ubo));
-    vkUnmapMemory(vkDevice, vkUniformBufferMemory);
+    // Amount of frames accumulated since the camera moved or the image was recreated.
+    uint32_t accumulatedFrameCount = 0;
+
+    // Amount of frames denoised since denoiser images were recreated or the internal resolution changed.
+    // The first frame has no history and no previous camera to compute motion vectors with.
+    uint32_t denoisedFrameCount = 0;
+    glm::mat4 previousViewProjection(1.0f);
+    // Denoiser images selected for each frame in flight and whether the frame may use the history.
+    std::array< uint32_t, MAX_FRAMES_IN_FLIGHT > denoiserCurrentIndices{};
+    std::array< bool, MAX_FRAMES_IN_FLIGHT > denoiserHistoryValid{};
+
+    // Write uniforms for the current camera position into the ring slot of the given frame.
+    // The memory is already mapped by the memory arena, so this is just one copy.
+    // Every written frame adds one more sample to the accumulation.
+    auto writeUniforms = [&](size_t frame) {
+        const glm::vec3 eye = camera.target + camera.distance * glm::vec3(
+            std::cos(camera.pitch) * std::cos(camera.yaw),
+            std::cos(camera.pitch) * std::sin(camera.yaw),
+            std::sin(camera.pitch));
+        const glm::mat4 view = glm::lookAt(eye, camera.target, glm::vec3(0.0f, 0.0f, 1.0f));
+        float aspectRatio = static_cast< float >(vkSelectedExtent.width) / vkSelectedExtent.height;
+        const glm::mat4 proj = glm::perspective(glm::radians(45.0f), aspectRatio, 0.1f, 10.0f);
+        UniformBufferObject ubo{};
+        ubo.viewInv = glm::inverse(view);
+        ubo.projInv = glm::inverse(proj);
+        ubo.frameIndex = accumulatedFrameCount++;
+        ubo.accumulate = accumulate ? 1 : 0;
+
+        // G-buffers and history images alternate between frames.
+        const glm::mat4 viewProj = proj * view;
+        ubo.denoise = denoise ? 1 : 0;
+        ubo.gbufferIndex = denoisedFrameCount % 2;
+        ubo.previousViewProj = denoisedFrameCount > 0 ? previousViewProjection : viewProj;
+        denoiserCurrentIndices[frame] = ubo.gbufferIndex;
+        denoiserHistoryValid[frame] = denoisedFrameCount > 0;
+        previousViewProjection = viewProj;
+        denoisedFrameCount++;
+        memcpy(static_cast< uint8_t* >(vkUniformBufferMemory.mappedData) + vkUniformBufferSlotSize * frame, &ubo, sizeof(ubo));
+    };
 
     // ==========================================================================
     //                      STEP 27: Write descriptor sets
@@ -1865,246 +5730,1268 @@ int main()
     // write descriptor sets.
     // ==========================================================================
 
-    // Create a descriptor pool.
-    std::vector<VkDescriptorPoolSize> poolSizes = {
-        { VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV, 1 },
-        { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, 1 },
-        { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 1 }
-    };
-    VkDescriptorPoolCreateInfo descriptorPoolCreateInfo{};
-    descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-    descriptorPoolCreateInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
-    descriptorPoolCreateInfo.pPoolSizes = poolSizes.data();
-    descriptorPoolCreateInfo.maxSets = 1;
-    VkDescriptorPool vkDescriptorPool;
-    if (vkCreateDescriptorPool(vkDevice, &descriptorPoolCreateInfo, nullptr, &vkDescriptorPool) != VK_SUCCESS) {
-        std::cerr << "Failed to create a descriptor pool!" << std::endl;
-        abort();
-    }
+    // Descriptor sets refer to output images, so they are created again
+    // together with the swap chain and storage images.
+    VkDescriptorPool vkDescriptorPool = VK_NULL_HANDLE;
+    std::vector< VkDescriptorSet > vkDescriptorSets;
+    std::vector< VkDescriptorSet > vkDenoiserDescriptorSets;
+    std::vector< VkDescriptorSet > vkTonemapDescriptorSets;
+    // Tone mapping sets pair the radiance image of a frame with an output image:
+    // a swap chain image if the pass writes them directly, the display image of the frame otherwise.
+    auto getTonemapDescriptorSetIndex = [&](uint32_t imageIndex, size_t frame) {
+        return tonemapIntoSwapChain ? imageIndex * MAX_FRAMES_IN_FLIGHT + frame : frame;
+    };
+    auto createDescriptorSets = [&]() {
+        // Images rays are traced into, each frame in flight has a set referring to its radiance image.
+        const std::vector< VkImageView > vkOutputImageViews(vkStorageImageViews.begin(), vkStorageImageViews.end());
+        const uint32_t descriptorSetCount = static_cast< uint32_t >(vkOutputImageViews.size());
+
+        // Images tone mapping writes.
+        std::vector< VkImageView > vkTonemapOutputImageViews;
+        if (tonemapIntoSwapChain) {
+            vkTonemapOutputImageViews = vkSwapChainImageViews;
+        } else {
+            vkTonemapOutputImageViews.assign(vkDisplayImageViews.begin(), vkDisplayImageViews.end());
+        }
+        const uint32_t tonemapSetCount = tonemapIntoSwapChain ? static_cast< uint32_t >(vkTonemapOutputImageViews.size()) * MAX_FRAMES_IN_FLIGHT
+                                                              : MAX_FRAMES_IN_FLIGHT;
+
+        // Create a descriptor pool.
+        // Each frame also gets a denoiser set if the denoiser is enabled.
+        const uint32_t denoiserSetCount = denoise ? descriptorSetCount : 0;
+        std::vector<VkDescriptorPoolSize> poolSizes = {
+            { vkAccelerationStructureDescriptorType, descriptorSetCount },
+            // Output image, accumulation image, two G-buffers and motion vectors
+            // and all images of denoiser and tone mapping sets.
+            { VK_DESCRIPTOR_TYPE_STORAGE_IMAGE, descriptorSetCount * 5 + denoiserSetCount * 8 + tonemapSetCount * 2 },
+            { VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC, descriptorSetCount },
+            // Mesh infos and vertex, index and attribute buffers of each mesh.
+            { VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, descriptorSetCount * (1 + 3 * meshCount) }
+        };
+        VkDescriptorPoolCreateInfo descriptorPoolCreateInfo{};
+        descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+        descriptorPoolCreateInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size());
+        descriptorPoolCreateInfo.pPoolSizes = poolSizes.data();
+        descriptorPoolCreateInfo.maxSets = descriptorSetCount + denoiserSetCount + tonemapSetCount;
+        if (vkCreateDescriptorPool(vkDevice, &descriptorPoolCreateInfo, nullptr, &vkDescriptorPool) != VK_SUCCESS) {
+            std::cerr << "Failed to create a descriptor pool!" << std::endl;
+            abort();
+        }
 
-    // Allocate descriptior set that corresponds to the defined layout.
-    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo {};
-    descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-    descriptorSetAllocateInfo.descriptorPool = vkDescriptorPool;
-    descriptorSetAllocateInfo.pSetLayouts = &vkDescriptorSetLayout;
-    descriptorSetAllocateInfo.descriptorSetCount = 1;
-    VkDescriptorSet vkDescriptorSet;
-    if (vkAllocateDescriptorSets(vkDevice, &descriptorSetAllocateInfo, &vkDescriptorSet) != VK_SUCCESS) {
-        std::cerr << "Failed to allocate descriptor sets!" << std::endl;
-        abort();
-    }
+        // Allocate descriptior sets that correspond to the defined layout.
+        std::vector< VkDescriptorSetLayout > vkDescriptorSetLayouts(descriptorSetCount, vkDescriptorSetLayout);
+        VkDescriptorSetAllocateInfo descriptorSetAllocateInfo {};
+        descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        descriptorSetAllocateInfo.descriptorPool = vkDescriptorPool;
+        descriptorSetAllocateInfo.pSetLayouts = vkDescriptorSetLayouts.data();
+        descriptorSetAllocateInfo.descriptorSetCount = descriptorSetCount;
+        vkDescriptorSets.assign(descriptorSetCount, VK_NULL_HANDLE);
+        if (vkAllocateDescriptorSets(vkDevice, &descriptorSetAllocateInfo, vkDescriptorSets.data()) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate descriptor sets!" << std::endl;
+            abort();
+        }
+
+        // Sets differ only by the radiance image.
+        for (uint32_t i = 0; i < descriptorSetCount; i++) {
+            // Top level acceleration structure.
+            // Each backend passes it in its own structure.
+            VkWriteDescriptorSetAccelerationStructureNV descriptorAccelerationStructureInfo{};
+            descriptorAccelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_NV;
+            descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
+            descriptorAccelerationStructureInfo.pAccelerationStructures = &vkTopLevelAccelerationStructure.nv;
+            VkWriteDescriptorSetAccelerationStructureKHR descriptorAccelerationStructureInfoKhr{};
+            descriptorAccelerationStructureInfoKhr.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_KHR;
+            descriptorAccelerationStructureInfoKhr.accelerationStructureCount = 1;
+            descriptorAccelerationStructureInfoKhr.pAccelerationStructures = &vkTopLevelAccelerationStructure.khr;
+            VkWriteDescriptorSet accelerationStructureWrite{};
+            accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            if (useKhrRayTracing) {
+                accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfoKhr;
+            } else {
+                accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo;
+            }
+            accelerationStructureWrite.dstSet = vkDescriptorSets[i];
+            accelerationStructureWrite.dstBinding = 0;
+            accelerationStructureWrite.descriptorCount = 1;
+            accelerationStructureWrite.descriptorType = vkAccelerationStructureDescriptorType;
+
+            // Storage image.
+            VkDescriptorImageInfo storageImageDescriptor{};
+            storageImageDescriptor.imageView = vkOutputImageViews[i];
+            storageImageDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            VkWriteDescriptorSet storageImageWrite {};
+            storageImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            storageImageWrite.dstSet = vkDescriptorSets[i];
+            storageImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            storageImageWrite.dstBinding = 1;
+            storageImageWrite.pImageInfo = &storageImageDescriptor;
+            storageImageWrite.descriptorCount = 1;
+
+            // Uniform buffer providing view and projection matrices.
+            // The descriptor covers one slot of the ring, the slot is selected by a dynamic offset.
+            VkDescriptorBufferInfo uniformBufferInfo{};
+            uniformBufferInfo.buffer = vkUniformBuffer;
+            uniformBufferInfo.offset = 0;
+            uniformBufferInfo.range = sizeof(UniformBufferObject);
+            VkWriteDescriptorSet uniformBufferWrite {};
+            uniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            uniformBufferWrite.dstSet = vkDescriptorSets[i];
+            uniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+            uniformBufferWrite.dstBinding = 2;
+            uniformBufferWrite.pBufferInfo = &uniformBufferInfo;
+            uniformBufferWrite.descriptorCount = 1;
+
+            // Accumulation image, the same for all sets.
+            VkDescriptorImageInfo accumulationImageDescriptor{};
+            accumulationImageDescriptor.imageView = vkAccumulationImageView;
+            accumulationImageDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            VkWriteDescriptorSet accumulationImageWrite {};
+            accumulationImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            accumulationImageWrite.dstSet = vkDescriptorSets[i];
+            accumulationImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            accumulationImageWrite.dstBinding = 3;
+            accumulationImageWrite.pImageInfo = &accumulationImageDescriptor;
+            accumulationImageWrite.descriptorCount = 1;
+
+            // Mesh infos.
+            VkDescriptorBufferInfo meshInfoBufferInfo{};
+            meshInfoBufferInfo.buffer = vkMeshInfoBuffer;
+            meshInfoBufferInfo.offset = 0;
+            meshInfoBufferInfo.range = VK_WHOLE_SIZE;
+            VkWriteDescriptorSet meshInfoWrite {};
+            meshInfoWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            meshInfoWrite.dstSet = vkDescriptorSets[i];
+            meshInfoWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            meshInfoWrite.dstBinding = 4;
+            meshInfoWrite.pBufferInfo = &meshInfoBufferInfo;
+            meshInfoWrite.descriptorCount = 1;
+
+            // Vertex, index and attribute buffers of all meshes.
+            // Meshes without attributes refer to their vertex buffer instead,
+            // the descriptor should be valid but shaders never read it.
+            std::vector< VkDescriptorBufferInfo > meshVertexBufferInfos;
+            std::vector< VkDescriptorBufferInfo > meshIndexBufferInfos;
+            std::vector< VkDescriptorBufferInfo > meshAttributeBufferInfos;
+            for (const Mesh& mesh : meshes) {
+                meshVertexBufferInfos.push_back({ mesh.vertexBuffer, 0, VK_WHOLE_SIZE });
+                meshIndexBufferInfos.push_back({ mesh.indexBuffer, 0, VK_WHOLE_SIZE });
+                meshAttributeBufferInfos.push_back({ (mesh.attributeBuffer != VK_NULL_HANDLE) ? mesh.attributeBuffer : mesh.vertexBuffer, 0, VK_WHOLE_SIZE });
+            }
+            VkWriteDescriptorSet meshVertexWrite {};
+            meshVertexWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            meshVertexWrite.dstSet = vkDescriptorSets[i];
+            meshVertexWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+            meshVertexWrite.dstBinding = 5;
+            meshVertexWrite.pBufferInfo = meshVertexBufferInfos.data();
+            meshVertexWrite.descriptorCount = meshCount;
+            VkWriteDescriptorSet meshIndexWrite = meshVertexWrite;
+            meshIndexWrite.dstBinding = 6;
+            meshIndexWrite.pBufferInfo = meshIndexBufferInfos.data();
+            VkWriteDescriptorSet meshAttributeWrite = meshVertexWrite;
+            meshAttributeWrite.dstBinding = 7;
+            meshAttributeWrite.pBufferInfo = meshAttributeBufferInfos.data();
+
+            // Denoiser G-buffers and motion vectors, the same for all sets.
+            std::array< VkDescriptorImageInfo, 2 > gbufferDescriptors{};
+            for (size_t j = 0; j < gbufferDescriptors.size(); j++) {
+                gbufferDescriptors[j].imageView = vkDenoiserImageViews[DENOISER_IMAGE_GBUFFER + j];
+                gbufferDescriptors[j].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            }
+            VkWriteDescriptorSet gbufferWrite {};
+            gbufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+            gbufferWrite.dstSet = vkDescriptorSets[i];
+            gbufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+            gbufferWrite.dstBinding = 8;
+            gbufferWrite.pImageInfo = gbufferDescriptors.data();
+            gbufferWrite.descriptorCount = static_cast< uint32_t >(gbufferDescriptors.size());
+            VkDescriptorImageInfo motionDescriptor{};
+            motionDescriptor.imageView = vkDenoiserImageViews[DENOISER_IMAGE_MOTION];
+            motionDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+            VkWriteDescriptorSet motionWrite = gbufferWrite;
+            motionWrite.dstBinding = 9;
+            motionWrite.pImageInfo = &motionDescriptor;
+            motionWrite.descriptorCount = 1;
+
+            // Write descriptor sets.
+            std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
+                accelerationStructureWrite,
+                storageImageWrite,
+                uniformBufferWrite,
+                accumulationImageWrite,
+                meshInfoWrite,
+                meshVertexWrite,
+                meshIndexWrite,
+                meshAttributeWrite,
+                gbufferWrite,
+                motionWrite
+            };
+            vkUpdateDescriptorSets(vkDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
+        }
+
+        // Allocate tone mapping sets.
+        std::vector< VkDescriptorSetLayout > vkTonemapDescriptorSetLayouts(tonemapSetCount, vkTonemapDescriptorSetLayout);
+        VkDescriptorSetAllocateInfo tonemapDescriptorSetAllocateInfo {};
+        tonemapDescriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        tonemapDescriptorSetAllocateInfo.descriptorPool = vkDescriptorPool;
+        tonemapDescriptorSetAllocateInfo.pSetLayouts = vkTonemapDescriptorSetLayouts.data();
+        tonemapDescriptorSetAllocateInfo.descriptorSetCount = tonemapSetCount;
+        vkTonemapDescriptorSets.assign(tonemapSetCount, VK_NULL_HANDLE);
+        if (vkAllocateDescriptorSets(vkDevice, &tonemapDescriptorSetAllocateInfo, vkTonemapDescriptorSets.data()) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate tone mapping descriptor sets!" << std::endl;
+            abort();
+        }
+        for (uint32_t imageIndex = 0; imageIndex < (tonemapIntoSwapChain ? vkTonemapOutputImageViews.size() : 1); imageIndex++) {
+            for (size_t frame = 0; frame < MAX_FRAMES_IN_FLIGHT; frame++) {
+                const VkDescriptorSet vkTonemapDescriptorSet = vkTonemapDescriptorSets[getTonemapDescriptorSetIndex(imageIndex, frame)];
+                std::array< VkDescriptorImageInfo, 2 > tonemapImageDescriptors{};
+                tonemapImageDescriptors[0].imageView = vkStorageImageViews[frame];
+                tonemapImageDescriptors[0].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+                tonemapImageDescriptors[1].imageView = vkTonemapOutputImageViews[tonemapIntoSwapChain ? imageIndex : frame];
+                tonemapImageDescriptors[1].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+                std::array< VkWriteDescriptorSet, 2 > tonemapWrites{};
+                for (uint32_t binding = 0; binding < tonemapWrites.size(); binding++) {
+                    tonemapWrites[binding].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                    tonemapWrites[binding].dstSet = vkTonemapDescriptorSet;
+                    tonemapWrites[binding].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                    tonemapWrites[binding].dstBinding = binding;
+                    tonemapWrites[binding].pImageInfo = &tonemapImageDescriptors[binding];
+                    tonemapWrites[binding].descriptorCount = 1;
+                }
+                vkUpdateDescriptorSets(vkDevice, static_cast<uint32_t>(tonemapWrites.size()), tonemapWrites.data(), 0, VK_NULL_HANDLE);
+            }
+        }
+
+        // Allocate denoiser sets, they differ only by the radiance image as well.
+        vkDenoiserDescriptorSets.assign(denoiserSetCount, VK_NULL_HANDLE);
+        if (denoiserSetCount == 0) {
+            return;
+        }
+        std::vector< VkDescriptorSetLayout > vkDenoiserDescriptorSetLayouts(denoiserSetCount, vkDenoiserDescriptorSetLayout);
+        VkDescriptorSetAllocateInfo denoiserDescriptorSetAllocateInfo {};
+        denoiserDescriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+        denoiserDescriptorSetAllocateInfo.descriptorPool = vkDescriptorPool;
+        denoiserDescriptorSetAllocateInfo.pSetLayouts = vkDenoiserDescriptorSetLayouts.data();
+        denoiserDescriptorSetAllocateInfo.descriptorSetCount = denoiserSetCount;
+        if (vkAllocateDescriptorSets(vkDevice, &denoiserDescriptorSetAllocateInfo, vkDenoiserDescriptorSets.data()) != VK_SUCCESS) {
+            std::cerr << "Failed to allocate denoiser descriptor sets!" << std::endl;
+            abort();
+        }
 
-    // Top level acceleration structure.
-    VkWriteDescriptorSetAccelerationStructureNV descriptorAccelerationStructureInfo{};
-    descriptorAccelerationStructureInfo.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET_ACCELERATION_STRUCTURE_NV;
-    descriptorAccelerationStructureInfo.accelerationStructureCount = 1;
-    descriptorAccelerationStructureInfo.pAccelerationStructures = &vkTopLevelAccelerationStructure;
-    VkWriteDescriptorSet accelerationStructureWrite{};
-    accelerationStructureWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    accelerationStructureWrite.pNext = &descriptorAccelerationStructureInfo;
-    accelerationStructureWrite.dstSet = vkDescriptorSet;
-    accelerationStructureWrite.dstBinding = 0;
-    accelerationStructureWrite.descriptorCount = 1;
-    accelerationStructureWrite.descriptorType = VK_DESCRIPTOR_TYPE_ACCELERATION_STRUCTURE_NV;
-
-    // Storage image.
-    VkDescriptorImageInfo storageImageDescriptor{};
-    storageImageDescriptor.imageView = vkStorageImageView;
-    storageImageDescriptor.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
-    VkWriteDescriptorSet storageImageWrite {};
-    storageImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    storageImageWrite.dstSet = vkDescriptorSet;
-    storageImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-    storageImageWrite.dstBinding = 1;
-    storageImageWrite.pImageInfo = &storageImageDescriptor;
-    storageImageWrite.descriptorCount = 1;
-
-    // Uniform buffer providing view and projection matrices.
-    VkDescriptorBufferInfo uniformBufferInfo{};
-    uniformBufferInfo.buffer = vkUniformBuffer;
-    uniformBufferInfo.offset = 0;
-    uniformBufferInfo.range = vkUniformBufferSize;
-    VkWriteDescriptorSet uniformBufferWrite {};
-    uniformBufferWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
-    uniformBufferWrite.dstSet = vkDescriptorSet;
-    uniformBufferWrite.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-    uniformBufferWrite.dstBinding = 2;
-    uniformBufferWrite.pBufferInfo = &uniformBufferInfo;
-    uniformBufferWrite.descriptorCount = 1;
-
-    // Write descriptor sets.
-    std::vector<VkWriteDescriptorSet> writeDescriptorSets = {
-        accelerationStructureWrite,
-        storageImageWrite,
-        uniformBufferWrite
-    };
-    vkUpdateDescriptorSets(vkDevice, static_cast<uint32_t>(writeDescriptorSets.size()), writeDescriptorSets.data(), 0, VK_NULL_HANDLE);
+        // Images of each binding go one after another, the traced image is the first one.
+        std::vector< VkDescriptorImageInfo > denoiserImageDescriptors(1 + DENOISER_IMAGE_COUNT);
+        for (size_t j = 0; j < denoiserImageDescriptors.size(); j++) {
+            denoiserImageDescriptors[j].imageView = (j == 0) ? VK_NULL_HANDLE : vkDenoiserImageViews[j - 1];
+            denoiserImageDescriptors[j].imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+        }
+        for (uint32_t i = 0; i < denoiserSetCount; i++) {
+            denoiserImageDescriptors[0].imageView = vkOutputImageViews[i];
+            std::vector< VkWriteDescriptorSet > denoiserWrites;
+            uint32_t firstImage = 0;
+            for (uint32_t binding = 0; binding < denoiserImageCounts.size(); binding++) {
+                VkWriteDescriptorSet denoiserImageWrite {};
+                denoiserImageWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+                denoiserImageWrite.dstSet = vkDenoiserDescriptorSets[i];
+                denoiserImageWrite.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+                denoiserImageWrite.dstBinding = binding;
+                denoiserImageWrite.pImageInfo = denoiserImageDescriptors.data() + firstImage;
+                denoiserImageWrite.descriptorCount = denoiserImageCounts[binding];
+                denoiserWrites.push_back(denoiserImageWrite);
+                firstImage += denoiserImageCounts[binding];
+            }
+            vkUpdateDescriptorSets(vkDevice, static_cast<uint32_t>(denoiserWrites.size()), denoiserWrites.data(), 0, VK_NULL_HANDLE);
+        }
+    };
+    createDescriptorSets();
 
     // ==========================================================================
     //                    STEP 28: Create command buffers
     // ==========================================================================
     // Command buffers describe a set of rendering commands submitted to Vulkan.
-    // We need to have one buffer per each image in the swap chain.
-    // Command buffers are taken from the command pool.
+    // The scene changes every frame, so commands are recorded every frame.
+    // Recording is split into jobs executed by worker threads. Each job writes
+    // a secondary command buffer, and the frame's primary command buffer
+    // executes them in order.
+    // Command pools are not thread safe, so each worker has its own pool per
+    // frame in flight. When a frame starts, we reset all its pools at once
+    // instead of freeing command buffers one by one.
     // ==========================================================================
 
-    // Describe a command pool.
+    // -------------------------
+    // 1: Start worker threads
+    // -------------------------
+
+    // Use as many threads as the CPU has, but not more than we can use.
+    const uint32_t recordingThreadCount = std::max(1u, std::min(std::thread::hardware_concurrency(), MAX_RECORDING_THREADS));
+    JobSystem jobSystem;
+    jobSystem.start(recordingThreadCount);
+
+    // -------------------------
+    // 2: Create command pools
+    // -------------------------
+
+    // Command pool of one worker thread for one frame in flight.
+    // Secondary command buffers are allocated on demand and reused after
+    // the pool reset, usedCount tells how many of them are taken in the current frame.
+    struct ThreadCommandPool
+    {
+        VkCommandPool pool;
+        std::vector< VkCommandBuffer > buffers;
+        size_t usedCount;
+    };
+
+    // Command buffers live only for one frame, so pools are transient.
     VkCommandPoolCreateInfo vkPoolInfo{};
     vkPoolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
     vkPoolInfo.queueFamilyIndex = queueFamilyIndices.graphicsFamily.value();
-    vkPoolInfo.flags = 0;
+    vkPoolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+    // Create worker pools for each frame in flight.
+    std::array< std::vector< ThreadCommandPool >, MAX_FRAMES_IN_FLIGHT > threadCommandPools;
+    for (auto& framePools : threadCommandPools) {
+        framePools.resize(recordingThreadCount);
+        for (auto& threadPool : framePools) {
+            if (vkCreateCommandPool(vkDevice, &vkPoolInfo, nullptr, &threadPool.pool) != VK_SUCCESS) {
+                std::cerr << "Failed to create a command pool!" << std::endl;
+                abort();
+            }
+            threadPool.usedCount = 0;
+        }
+    }
 
-    // Create a command pool.
-    VkCommandPool vkCommandPool;
-    if (vkCreateCommandPool(vkDevice, &vkPoolInfo, nullptr, &vkCommandPool) != VK_SUCCESS) {
-        std::cerr << "Failed to create a command pool!" << std::endl;
-        abort();
+    // The main thread records primary command buffers from its own pools.
+    // Each queue submission of a frame has its own primary command buffer,
+    // they are allocated on demand when tiles are split into several submissions.
+    std::array< VkCommandPool, MAX_FRAMES_IN_FLIGHT > vkFrameCommandPools;
+    std::array< std::vector< VkCommandBuffer >, MAX_FRAMES_IN_FLIGHT > vkFrameCommandBuffers;
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        // Create a command pool.
+        if (vkCreateCommandPool(vkDevice, &vkPoolInfo, nullptr, &vkFrameCommandPools[i]) != VK_SUCCESS) {
+            std::cerr << "Failed to create a command pool!" << std::endl;
+            abort();
+        }
+    }
+
+    // Get a primary command buffer for the given submission of the frame.
+    auto getFrameCommandBuffer = [&](size_t frame, size_t submitIndex) {
+        while (vkFrameCommandBuffers[frame].size() <= submitIndex) {
+            VkCommandBufferAllocateInfo vkAllocInfo{};
+            vkAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            vkAllocInfo.commandPool = vkFrameCommandPools[frame];
+            vkAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+            vkAllocInfo.commandBufferCount = 1;
+            VkCommandBuffer vkNewCmdBuffer;
+            if (vkAllocateCommandBuffers(vkDevice, &vkAllocInfo, &vkNewCmdBuffer) != VK_SUCCESS) {
+                std::cerr << "Failed to create command buffers" << std::endl;
+                abort();
+            }
+            vkFrameCommandBuffers[frame].push_back(vkNewCmdBuffer);
+        }
+        return vkFrameCommandBuffers[frame][submitIndex];
+    };
+
+    // Reset all command pools of the frame. The GPU should not use them anymore.
+    auto resetFrameCommandPools = [&](size_t frame) {
+        for (auto& threadPool : threadCommandPools[frame]) {
+            vkResetCommandPool(vkDevice, threadPool.pool, 0);
+            threadPool.usedCount = 0;
+        }
+        vkResetCommandPool(vkDevice, vkFrameCommandPools[frame], 0);
+    };
+
+    // Take a secondary command buffer from the pool of the worker and start recording.
+    // Should be called only by the worker thread itself.
+    auto beginSecondaryCommandBuffer = [&](size_t frame, uint32_t workerIndex) {
+        ThreadCommandPool& threadPool = threadCommandPools[frame][workerIndex];
+        if (threadPool.usedCount == threadPool.buffers.size()) {
+            VkCommandBufferAllocateInfo vkAllocInfo{};
+            vkAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+            vkAllocInfo.commandPool = threadPool.pool;
+            vkAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+            vkAllocInfo.commandBufferCount = 1;
+            VkCommandBuffer vkNewCmdBuffer;
+            if (vkAllocateCommandBuffers(vkDevice, &vkAllocInfo, &vkNewCmdBuffer) != VK_SUCCESS) {
+                std::cerr << "Failed to create command buffers" << std::endl;
+                abort();
+            }
+            threadPool.buffers.push_back(vkNewCmdBuffer);
+        }
+        VkCommandBuffer vkCmdBuffer = threadPool.buffers[threadPool.usedCount++];
+
+        // Secondary command buffers are executed outside of render passes,
+        // so they do not inherit anything from the primary one.
+        VkCommandBufferInheritanceInfo vkInheritanceInfo{};
+        vkInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+        vkInheritanceInfo.renderPass = VK_NULL_HANDLE;
+        vkInheritanceInfo.framebuffer = VK_NULL_HANDLE;
+        VkCommandBufferBeginInfo vkBeginInfo{};
+        vkBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+        vkBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+        vkBeginInfo.pInheritanceInfo = &vkInheritanceInfo;
+        if (vkBeginCommandBuffer(vkCmdBuffer, &vkBeginInfo) != VK_SUCCESS) {
+            std::cerr << "Failed to start command buffer recording" << std::endl;
+            abort();
+        }
+        return vkCmdBuffer;
+    };
+
+    // Finish recording of a command buffer.
+    auto endCommandBuffer = [&](VkCommandBuffer vkCmdBuffer) {
+        if (vkEndCommandBuffer(vkCmdBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to finish command buffer recording" << std::endl;
+            abort();
+        }
+    };
+
+    // ------------------------------
+    // 3: Create timestamp queries
+    // ------------------------------
+
+    // GPU profiler measures phases of each frame with timestamps:
+    // the TLAS update, ray tracing and copying the image into the swap chain.
+    // Each frame in flight has its own query pool, so results are read once
+    // the frame fence is signaled and reading never stalls the GPU.
+    constexpr const uint32_t FRAME_TIMESTAMP_BEGIN = 0;
+    constexpr const uint32_t FRAME_TIMESTAMP_UPDATE_END = 1;
+    constexpr const uint32_t FRAME_TIMESTAMP_TRACE_END = 2;
+    constexpr const uint32_t FRAME_TIMESTAMP_COPY_END = 3;
+    constexpr const uint32_t NUM_FRAME_TIMESTAMPS = 4;
+
+    // The profiler works only if the graphics queue supports timestamps.
+    const uint32_t frameTimestampValidBits = vkDeviceQueueFamilies[queueFamilyIndices.graphicsFamily.value()].timestampValidBits;
+    const bool profilerEnabled = frameTimestampValidBits > 0;
+    if (!profilerEnabled) {
+        std::cout << "Graphics queue does not support timestamps, GPU profiler is disabled" << std::endl;
+    }
+
+    // Create query pools.
+    std::array< VkQueryPool, MAX_FRAMES_IN_FLIGHT > vkFrameTimestampPools{};
+    std::array< bool, MAX_FRAMES_IN_FLIGHT > frameSlotUsed{};
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && profilerEnabled; i++) {
+        VkQueryPoolCreateInfo vkTimestampPoolInfo{};
+        vkTimestampPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+        vkTimestampPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+        vkTimestampPoolInfo.queryCount = NUM_FRAME_TIMESTAMPS;
+        if (vkCreateQueryPool(vkDevice, &vkTimestampPoolInfo, nullptr, &vkFrameTimestampPools[i]) != VK_SUCCESS) {
+            std::cerr << "Failed to create a query pool!" << std::endl;
+            abort();
+        }
+    }
+
+    // Write a timestamp of the frame once all previous commands finish the given stage.
+    // In multi-GPU mode frame timestamps are written by the presenting GPU only.
+    // Commands recorded afterwards run on all GPUs again.
+    auto writeFrameTimestamp = [&](VkCommandBuffer vkCmdBuffer, VkPipelineStageFlagBits stage, size_t frame, uint32_t query) {
+        if (!profilerEnabled) {
+            return;
+        }
+        if (multiGpu) {
+            vkCmdSetDeviceMask(vkCmdBuffer, 1);
+        }
+        vkCmdWriteTimestamp(vkCmdBuffer, stage, vkFrameTimestampPools[frame], query);
+        if (multiGpu) {
+            vkCmdSetDeviceMask(vkCmdBuffer, deviceGroupMask);
+        }
+    };
+
+    // In multi-GPU mode every GPU measures how long it traces its band with its own pair of queries
+    // and copies the results into a host buffer. Host memory is shared by all GPUs of the group,
+    // so the CPU sees times of every GPU there and rebalances bands by them.
+    std::array< VkQueryPool, MAX_FRAMES_IN_FLIGHT > vkBandTimestampPools{};
+    VkBuffer vkBandTimestampBuffer = VK_NULL_HANDLE;
+    MemoryAllocation vkBandTimestampBufferMemory{};
+    if (multiGpu && profilerEnabled) {
+        for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+            VkQueryPoolCreateInfo vkTimestampPoolInfo{};
+            vkTimestampPoolInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+            vkTimestampPoolInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+            vkTimestampPoolInfo.queryCount = MAX_DEVICE_GROUP_SIZE * 2;
+            if (vkCreateQueryPool(vkDevice, &vkTimestampPoolInfo, nullptr, &vkBandTimestampPools[i]) != VK_SUCCESS) {
+                std::cerr << "Failed to create a query pool!" << std::endl;
+                abort();
+            }
+        }
+
+        // Results of every frame in flight and every GPU: the band begin and the band end.
+        VkBufferCreateInfo vkBandTimestampBufferInfo{};
+        vkBandTimestampBufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+        vkBandTimestampBufferInfo.size = MAX_FRAMES_IN_FLIGHT * MAX_DEVICE_GROUP_SIZE * 2 * sizeof(uint64_t);
+        vkBandTimestampBufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+        vkBandTimestampBufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        if (vkCreateBuffer(vkDevice, &vkBandTimestampBufferInfo, nullptr, &vkBandTimestampBuffer) != VK_SUCCESS) {
+            std::cerr << "Failed to create a band timestamp buffer!" << std::endl;
+            abort();
+        }
+        VkMemoryRequirements vkBandTimestampBufferMemRequirements;
+        vkGetBufferMemoryRequirements(vkDevice, vkBandTimestampBuffer, &vkBandTimestampBufferMemRequirements);
+        vkBandTimestampBufferMemory = memoryArena.allocate(vkBandTimestampBufferMemRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, false);
+        vkBindBufferMemory(vkDevice, vkBandTimestampBuffer, vkBandTimestampBufferMemory.memory, vkBandTimestampBufferMemory.offset);
+        memset(vkBandTimestampBufferMemory.mappedData, 0, static_cast< size_t >(vkBandTimestampBufferInfo.size));
+    }
+
+    // Open a CSV file for per-frame timings if requested.
+    std::ofstream profileCsvFile;
+    if (!profileCsvPath.empty()) {
+        profileCsvFile.open(profileCsvPath, std::ios::trunc);
+        if (!profileCsvFile.is_open()) {
+            std::cerr << "Failed to open " << profileCsvPath << "!" << std::endl;
+            abort();
+        }
+        profileCsvFile << "frame,update_ms,trace_ms,copy_ms,gpu_total_ms,cpu_frame_ms,latency_ms,mrays_per_second" << std::endl;
     }
 
-    // Create a vector for all command buffers.
-    std::vector< VkCommandBuffer > vkCommandBuffers;
-    vkCommandBuffers.resize(vkSwapChainImageViews.size());
+    // Timings accumulated since the last report.
+    struct ProfilerTotals
+    {
+        double updateMs;
+        double traceMs;
+        double copyMs;
+        double gpuMs;
+        double cpuMs;
+        double latencyMs;
+        uint32_t frameCount;
+    };
+    ProfilerTotals profilerTotals{};
+    uint64_t profiledFrameIndex = 0;
+    // Frame times measured in headless mode after the warm up.
+    // CPU frame interval is always available, GPU timings only with timestamps.
+    uint64_t collectedFrameCount = 0;
+    std::vector< double > benchmarkCpuFrameMs;
+    std::vector< double > benchmarkGpuFrameMs;
+    std::vector< double > benchmarkTraceMs;
+    auto lastProfilerReportTime = std::chrono::steady_clock::now();
+    auto lastFrameTime = std::chrono::steady_clock::now();
+    // Input-to-present latency of each frame.
+    // It is measured from the moment camera input is sampled to the moment the CPU sees
+    // the frame fence signaled, after that only presentation is left. In low latency mode
+    // the fence is waited for right away, otherwise it is noticed when the frame slot is reused,
+    // so the value is an upper bound.
+    std::array< std::chrono::steady_clock::time_point, MAX_FRAMES_IN_FLIGHT > frameInputTimes{};
+    std::array< std::chrono::steady_clock::time_point, MAX_FRAMES_IN_FLIGHT > frameCompletionTimes{};
+    std::array< bool, MAX_FRAMES_IN_FLIGHT > frameCompletionObserved{};
+    auto observeFrameCompletion = [&](size_t frame) {
+        if (!frameCompletionObserved[frame]) {
+            frameCompletionTimes[frame] = std::chrono::steady_clock::now();
+            frameCompletionObserved[frame] = true;
+        }
+    };
+
+    // Time of the last collected frame used by dynamic resolution.
+    // GPU frame time if timestamps are supported, CPU frame interval otherwise, zero if nothing was collected.
+    double lastMeasuredFrameMs = 0.0;
+
+    // Read timestamps of the previous use of the frame slot and report them.
+    // Should be called after the frame fence is signaled. CPU frame time is
+    // measured between calls, the difference to the GPU time shows
+    // how much we wait for the presentation.
+    auto collectFrameTimings = [&](size_t frame) {
+        const auto now = std::chrono::steady_clock::now();
+        const double cpuMs = std::chrono::duration< double, std::milli >(now - lastFrameTime).count();
+        lastFrameTime = now;
+        lastMeasuredFrameMs = 0.0;
+        if (!frameSlotUsed[frame]) {
+            return;
+        }
+        lastMeasuredFrameMs = cpuMs;
+        const bool recordBenchmarkSample = headless && collectedFrameCount >= BENCHMARK_WARMUP_FRAMES;
+        collectedFrameCount++;
+        if (recordBenchmarkSample) {
+            benchmarkCpuFrameMs.push_back(cpuMs);
+        }
+        if (!profilerEnabled) {
+            return;
+        }
+        std::array< uint64_t, NUM_FRAME_TIMESTAMPS > timestamps{};
+        if (vkGetQueryPoolResults(vkDevice, vkFrameTimestampPools[frame], 0, NUM_FRAME_TIMESTAMPS, sizeof(timestamps), timestamps.data(), sizeof(uint64_t), VK_QUERY_RESULT_64_BIT) != VK_SUCCESS) {
+            return;
+        }
+        const double updateMs = timestampsToMs(timestamps[FRAME_TIMESTAMP_BEGIN], timestamps[FRAME_TIMESTAMP_UPDATE_END], frameTimestampValidBits);
+        const double traceMs = timestampsToMs(timestamps[FRAME_TIMESTAMP_UPDATE_END], timestamps[FRAME_TIMESTAMP_TRACE_END], frameTimestampValidBits);
+        const double copyMs = timestampsToMs(timestamps[FRAME_TIMESTAMP_TRACE_END], timestamps[FRAME_TIMESTAMP_COPY_END], frameTimestampValidBits);
+        const double gpuMs = timestampsToMs(timestamps[FRAME_TIMESTAMP_BEGIN], timestamps[FRAME_TIMESTAMP_COPY_END], frameTimestampValidBits);
+        lastMeasuredFrameMs = gpuMs;
+        // Headless mode has no input, so there is no latency either.
+        const double latencyMs = headless || !frameCompletionObserved[frame] ? 0.0 :
+                                 std::chrono::duration< double, std::milli >(frameCompletionTimes[frame] - frameInputTimes[frame]).count();
+        // Each pixel of the internal resolution launches one primary ray per sample.
+        const double raysPerFrame = static_cast< double >(vkRenderExtent.width) * vkRenderExtent.height * samplesPerPixel;
+        if (profileCsvFile.is_open()) {
+            profileCsvFile << profiledFrameIndex << "," << updateMs << "," << traceMs << "," << copyMs << "," << gpuMs << "," << cpuMs << "," << latencyMs << ","
+                           << (traceMs > 0.0 ? raysPerFrame / (traceMs * 1e3) : 0.0) << "\n";
+        }
+        profiledFrameIndex++;
+        if (recordBenchmarkSample) {
+            benchmarkGpuFrameMs.push_back(gpuMs);
+            benchmarkTraceMs.push_back(traceMs);
+        }
+        profilerTotals.updateMs += updateMs;
+        profilerTotals.traceMs += traceMs;
+        profilerTotals.copyMs += copyMs;
+        profilerTotals.gpuMs += gpuMs;
+        profilerTotals.cpuMs += cpuMs;
+        profilerTotals.latencyMs += latencyMs;
+        profilerTotals.frameCount++;
+
+        // Print averages periodically.
+        if (std::chrono::duration< double >(now - lastProfilerReportTime).count() >= PROFILER_REPORT_INTERVAL) {
+            const double n = profilerTotals.frameCount;
+            std::cout << "GPU update " << profilerTotals.updateMs / n << " ms"
+                      << ", trace " << profilerTotals.traceMs / n << " ms"
+                      << ", copy " << profilerTotals.copyMs / n << " ms"
+                      << ", total " << profilerTotals.gpuMs / n << " ms"
+                      << ", CPU frame " << profilerTotals.cpuMs / n << " ms"
+                      << ", latency " << profilerTotals.latencyMs / n << " ms"
+                      << ", " << (profilerTotals.traceMs > 0.0 ? raysPerFrame * n / (profilerTotals.traceMs * 1e3) : 0.0) << " Mrays/s" << std::endl;
+            profilerTotals = ProfilerTotals{};
+            lastProfilerReportTime = now;
+        }
+    };
+
+    // Bands of GPUs of a device group.
+    // Each GPU traces a horizontal band of the image, bands take shares of the image height
+    // and follow each other from the top. A single GPU has one band covering the whole image.
+    std::array< double, MAX_DEVICE_GROUP_SIZE > deviceBandShares{};
+    deviceBandShares.fill(1.0 / deviceGroupSize);
+    using BandStarts = std::array< uint32_t, MAX_DEVICE_GROUP_SIZE + 1 >;
+    // Rows bands start at for the given shares, bands past the last GPU are empty.
+    auto computeBandStarts = [&](const std::array< double, MAX_DEVICE_GROUP_SIZE >& shares, uint32_t height) {
+        BandStarts starts{};
+        starts.fill(height);
+        double position = 0.0;
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            starts[device] = std::min(height, static_cast< uint32_t >(std::lround(position * height)));
+            position += shares[device];
+        }
+        return starts;
+    };
+    BandStarts traceBandStarts{};
+
+    // Band starts every frame slot was traced with, band times are measured for those bands.
+    std::array< BandStarts, MAX_FRAMES_IN_FLIGHT > frameBandStarts{};
+    // Smoothed time it takes every GPU to trace one row of the image.
+    std::array< double, MAX_DEVICE_GROUP_SIZE > deviceRowCostMs{};
+
+    // Move band borders so that all GPUs of the group finish tracing at the same time.
+    // Row costs of GPUs are smoothed over frames, and bands are moved only if a border
+    // moves far enough, so bands do not jitter between frames and accumulation is not reset
+    // by noise. Should be called after the frame fence is signaled.
+    auto balanceDeviceBands = [&](size_t frame) {
+        if (!frameSlotUsed[frame] || !profilerEnabled) {
+            return;
+        }
+        const uint64_t* bandTimestamps = static_cast< const uint64_t* >(vkBandTimestampBufferMemory.mappedData) + frame * MAX_DEVICE_GROUP_SIZE * 2;
+        const BandStarts& bandStarts = frameBandStarts[frame];
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            const uint32_t rows = bandStarts[device + 1] - bandStarts[device];
+            const double bandMs = timestampsToMs(bandTimestamps[device * 2], bandTimestamps[device * 2 + 1], frameTimestampValidBits);
+            if (rows == 0 || bandMs <= 0.0) {
+                continue;
+            }
+            const double rowCostMs = bandMs / rows;
+            deviceRowCostMs[device] = deviceRowCostMs[device] == 0.0 ? rowCostMs :
+                                      deviceRowCostMs[device] + (rowCostMs - deviceRowCostMs[device]) * DEVICE_BAND_COST_SMOOTHING;
+        }
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            if (deviceRowCostMs[device] == 0.0) {
+                return;
+            }
+        }
+
+        // A GPU gets a share inverse to its row cost, but never less than the minimal share,
+        // so a GPU that was slow once still traces enough rows to be measured.
+        std::array< double, MAX_DEVICE_GROUP_SIZE > shares{};
+        double shareSum = 0.0;
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            shares[device] = 1.0 / deviceRowCostMs[device];
+            shareSum += shares[device];
+        }
+        double clampedSum = 0.0;
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            shares[device] = std::max(shares[device] / shareSum, DEVICE_BAND_MIN_SHARE);
+            clampedSum += shares[device];
+        }
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            shares[device] /= clampedSum;
+        }
+
+        const BandStarts newStarts = computeBandStarts(shares, vkRenderExtent.height);
+        const BandStarts currentStarts = computeBandStarts(deviceBandShares, vkRenderExtent.height);
+        bool moved = false;
+        for (uint32_t device = 1; device < deviceGroupSize; device++) {
+            const uint32_t distance = newStarts[device] > currentStarts[device] ? newStarts[device] - currentStarts[device] : currentStarts[device] - newStarts[device];
+            moved = moved || distance >= DEVICE_BAND_MIN_ROW_CHANGE;
+        }
+        if (moved) {
+            deviceBandShares = shares;
+            // Every GPU accumulates only its own pixels, so samples of moved rows are lost.
+            accumulatedFrameCount = 0;
+        }
+    };
+
+    // ---------------------------
+    // 4: Describe recording jobs
+    // ---------------------------
+
+    // Record a TLAS update from the instance buffer of the given frame.
+    // Update refits the existing TLAS in place, which is much cheaper than a full rebuild.
+    auto recordTlasUpdate = [&](VkCommandBuffer vkCmdBuffer, size_t frame) {
+        // Mark the beginning of the frame.
+        writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, frame, FRAME_TIMESTAMP_BEGIN);
+
+        // Wait until the previous frame stops tracing rays against the TLAS
+        // and the previous update stops using the scratch buffer.
+        VkMemoryBarrier vkBeforeUpdateBarrier{};
+        vkBeforeUpdateBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        vkBeforeUpdateBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV;
+        vkBeforeUpdateBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV | VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV;
+        vkCmdPipelineBarrier(
+            vkCmdBuffer,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV,
+            0,
+            1, &vkBeforeUpdateBarrier,
+            0, nullptr,
+            0, nullptr);
+
+        // Update the TLAS. Source and destination are the same structure.
+        if (useKhrRayTracing) {
+            const VkAccelerationStructureGeometryKHR updateGeometry = getTlasGeometryKhr(vkInstanceBuffers[frame]);
+            VkAccelerationStructureBuildGeometryInfoKHR updateInfo = getTlasBuildInfoKhr(updateGeometry, VK_BUILD_ACCELERATION_STRUCTURE_MODE_UPDATE_KHR);
+            updateInfo.srcAccelerationStructure = vkTopLevelAccelerationStructure.khr;
+            updateInfo.dstAccelerationStructure = vkTopLevelAccelerationStructure.khr;
+            updateInfo.scratchData.deviceAddress = vkUpdateScratchBufferAddress;
+            VkAccelerationStructureBuildRangeInfoKHR updateRange{};
+            updateRange.primitiveCount = instanceCount;
+            const VkAccelerationStructureBuildRangeInfoKHR* updateRanges = &updateRange;
+            vkCmdBuildAccelerationStructuresKHR(vkCmdBuffer, 1, &updateInfo, &updateRanges);
+        } else {
+            VkAccelerationStructureInfoNV updateInfo{};
+            updateInfo.sType = VK_STRUCTURE_TYPE_ACCELERATION_STRUCTURE_INFO_NV;
+            updateInfo.type = VK_ACCELERATION_STRUCTURE_TYPE_TOP_LEVEL_NV;
+            updateInfo.flags = tlasInfo.flags;
+            updateInfo.instanceCount = instanceCount;
+            vkCmdBuildAccelerationStructureNV(
+                        vkCmdBuffer,
+                        &updateInfo,
+                        vkInstanceBuffers[frame],
+                        0,
+                        VK_TRUE,
+                        vkTopLevelAccelerationStructure.nv,
+                        vkTopLevelAccelerationStructure.nv,
+                        vkUpdateScratchBufferHandle,
+                        0);
+        }
+        writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV, frame, FRAME_TIMESTAMP_UPDATE_END);
+
+        // Ray tracing shaders should see the updated TLAS.
+        VkMemoryBarrier vkAfterUpdateBarrier{};
+        vkAfterUpdateBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        vkAfterUpdateBarrier.srcAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_WRITE_BIT_NV;
+        vkAfterUpdateBarrier.dstAccessMask = VK_ACCESS_ACCELERATION_STRUCTURE_READ_BIT_NV;
+        vkCmdPipelineBarrier(
+            vkCmdBuffer,
+            VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+            0,
+            1, &vkAfterUpdateBarrier,
+            0, nullptr,
+            0, nullptr);
+    };
 
-    // Describe a command buffer allocate info.
-    VkCommandBufferAllocateInfo vkAllocInfo{};
-    vkAllocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-    vkAllocInfo.commandPool = vkCommandPool;
-    vkAllocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    vkAllocInfo.commandBufferCount = static_cast< uint32_t >(vkCommandBuffers.size());
+    // Tiles the image is traced in.
+    // One huge trace call may run longer than the OS allows a GPU task to run
+    // and blocks other applications using the GPU until it finishes. Several
+    // smaller trace calls, optionally submitted separately, give the GPU points
+    // to switch in between. Tiles are sorted in Morton order, so consecutive
+    // tiles trace neighbouring rays that tend to visit the same nodes of the BVH.
+    std::vector< TraceTile > traceTiles;
+    VkExtent2D traceTilesExtent{ 0, 0 };
+
+    auto updateTraceTiles = [&]() {
+        // Tiles change only together with the internal resolution or bands.
+        const BandStarts bandStarts = computeBandStarts(deviceBandShares, vkRenderExtent.height);
+        if (traceTilesExtent.width == vkRenderExtent.width && traceTilesExtent.height == vkRenderExtent.height && traceBandStarts == bandStarts) {
+            return;
+        }
+        traceTilesExtent = vkRenderExtent;
+        traceBandStarts = bandStarts;
+        traceTiles.clear();
+
+        // Zero tile size means the whole band is traced at once.
+        // Tiles do not cross bands, so every tile is traced by one GPU.
+        const uint32_t tileWidth = traceTileSize == 0 ? vkRenderExtent.width : traceTileSize;
+        const uint32_t tileHeight = traceTileSize == 0 ? vkRenderExtent.height : traceTileSize;
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            const uint32_t bandEnd = traceBandStarts[device + 1];
+            for (uint32_t y = traceBandStarts[device]; y < bandEnd; y += tileHeight) {
+                for (uint32_t x = 0; x < vkRenderExtent.width; x += tileWidth) {
+                    TraceTile tile{};
+                    tile.offset = { static_cast< int32_t >(x), static_cast< int32_t >(y) };
+                    tile.extent = { std::min(tileWidth, vkRenderExtent.width - x), std::min(tileHeight, bandEnd - y) };
+                    tile.mortonCode = mortonCode(static_cast< uint16_t >(x / tileWidth), static_cast< uint16_t >(y / tileHeight));
+                    tile.deviceIndex = device;
+                    traceTiles.push_back(tile);
+                }
+            }
+        }
+        std::sort(traceTiles.begin(), traceTiles.end(), [](const TraceTile& a, const TraceTile& b) {
+            return a.deviceIndex != b.deviceIndex ? a.deviceIndex < b.deviceIndex : a.mortonCode < b.mortonCode;
+        });
+    };
 
-    // Allocate command buffers.
-    if (vkAllocateCommandBuffers(vkDevice, &vkAllocInfo, vkCommandBuffers.data()) != VK_SUCCESS) {
-        std::cerr << "Failed to create command buffers" << std::endl;
-        abort();
-    }
+    // Record denoising of the traced image of the frame.
+    // The temporal pass blends the traced color into the history reprojected with motion vectors,
+    // then a-trous iterations blur the history with growing steps, stopping at edges of the G-buffer.
+    // The last iteration writes the result back into the traced image.
+    auto recordDenoise = [&](VkCommandBuffer vkCmdBuffer, size_t frame) {
+        const VkDescriptorSet vkDenoiserDescriptorSet = vkDenoiserDescriptorSets[frame];
+        vkCmdBindDescriptorSets(vkCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkDenoiserPipelineLayout, 0, 1, &vkDenoiserDescriptorSet, 0, nullptr);
+        const uint32_t groupCountX = (vkRenderExtent.width + DENOISER_WORKGROUP_SIZE - 1) / DENOISER_WORKGROUP_SIZE;
+        const uint32_t groupCountY = (vkRenderExtent.height + DENOISER_WORKGROUP_SIZE - 1) / DENOISER_WORKGROUP_SIZE;
+
+        // Every pass reads what the previous one wrote. The first one also reads
+        // the history written by the previous frame, which is in the same queue.
+        VkMemoryBarrier vkPassBarrier{};
+        vkPassBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        vkPassBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkPassBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+
+        DenoiserPushConstants pushConstants{};
+        pushConstants.renderWidth = vkRenderExtent.width;
+        pushConstants.renderHeight = vkRenderExtent.height;
+        pushConstants.current = denoiserCurrentIndices[frame];
+        pushConstants.historyValid = denoiserHistoryValid[frame] ? 1 : 0;
+
+        // Temporal pass.
+        vkCmdPipelineBarrier(
+            vkCmdBuffer,
+            VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0,
+            1, &vkPassBarrier,
+            0, nullptr,
+            0, nullptr);
+        vkCmdBindPipeline(vkCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkDenoiserPipelines[DENOISER_PASS_TEMPORAL]);
+        vkCmdPushConstants(vkCmdBuffer, vkDenoiserPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+        vkCmdDispatch(vkCmdBuffer, groupCountX, groupCountY, 1);
+
+        // A-trous iterations. The first one reads the history, the others ping-pong
+        // between two images, and the last one writes the traced image.
+        vkCmdBindPipeline(vkCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkDenoiserPipelines[DENOISER_PASS_ATROUS]);
+        for (uint32_t iteration = 0; iteration < DENOISER_ATROUS_ITERATIONS; iteration++) {
+            pushConstants.stepSize = 1u << iteration;
+            pushConstants.source = iteration == 0 ? 0 : 1 + (iteration - 1) % 2;
+            pushConstants.target = iteration + 1 == DENOISER_ATROUS_ITERATIONS ? 2 : iteration % 2;
+            vkCmdPipelineBarrier(
+                vkCmdBuffer,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                0,
+                1, &vkPassBarrier,
+                0, nullptr,
+                0, nullptr);
+            vkCmdPushConstants(vkCmdBuffer, vkDenoiserPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(pushConstants), &pushConstants);
+            vkCmdDispatch(vkCmdBuffer, groupCountX, groupCountY, 1);
+        }
+    };
 
-    // Describe a rendering sequence for each command buffer.
-    for (size_t i = 0; i < vkCommandBuffers.size(); i++) {
-        // Start adding commands into the buffer.
-        VkCommandBufferBeginInfo vkBeginInfo{};
-        vkBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-        vkBeginInfo.flags = 0;
-        vkBeginInfo.pInheritanceInfo = nullptr;
-        if (vkBeginCommandBuffer(vkCommandBuffers[i], &vkBeginInfo) != VK_SUCCESS) {
-            std::cerr << "Failed to start command buffer recording" << std::endl;
-            abort();
+    // Record everything after ray tracing: denoising, tone mapping into the swap chain image
+    // or into the display image which is then copied into the swap chain image, and the readback.
+    auto recordOutput = [&](VkCommandBuffer vkCmdBuffer, uint32_t imageIndex, size_t frame) {
+        // Denoise the traced image before it is presented, the final image is written by compute shaders then.
+        if (denoise) {
+            recordDenoise(vkCmdBuffer, frame);
+        }
+        const VkPipelineStageFlags vkOutputWriteStage = denoise ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV;
+
+        // Tone map radiance into the swap chain image or into the display image of the frame.
+        // The pass reads everything ray generation or denoiser shaders wrote into the radiance image.
+        // The swap chain image should be in the general layout, its previous content is not needed.
+        // The submit waits for the image to be acquired at the compute stage and this barrier
+        // continues that dependency. The display image is always in the general layout,
+        // and the copy of the previous use of it is finished since the frame fence is signaled.
+        VkMemoryBarrier vkRadianceBarrier{};
+        vkRadianceBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+        vkRadianceBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkRadianceBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+        VkImageMemoryBarrier vkToGeneralBarrier{};
+        vkToGeneralBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+        vkToGeneralBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkToGeneralBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkToGeneralBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+        vkToGeneralBarrier.image = tonemapIntoSwapChain ? vkSwapChainImages[imageIndex] : VK_NULL_HANDLE;
+        vkToGeneralBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+        vkToGeneralBarrier.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        vkToGeneralBarrier.srcAccessMask = 0;
+        vkToGeneralBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        vkCmdPipelineBarrier(
+            vkCmdBuffer,
+            vkOutputWriteStage | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+            0,
+            1, &vkRadianceBarrier,
+            0, nullptr,
+            tonemapIntoSwapChain ? 1 : 0, &vkToGeneralBarrier);
+
+        // One invocation per output pixel. Dynamic resolution traced only a part of the radiance image,
+        // the pass scales it up to the whole output image with bilinear filtering.
+        const VkDescriptorSet vkTonemapDescriptorSet = vkTonemapDescriptorSets[getTonemapDescriptorSetIndex(imageIndex, frame)];
+        vkCmdBindPipeline(vkCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkTonemapPipeline);
+        vkCmdBindDescriptorSets(vkCmdBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, vkTonemapPipelineLayout, 0, 1, &vkTonemapDescriptorSet, 0, nullptr);
+        TonemapPushConstants tonemapPushConstants{};
+        tonemapPushConstants.renderWidth = vkRenderExtent.width;
+        tonemapPushConstants.renderHeight = vkRenderExtent.height;
+        tonemapPushConstants.outputWidth = vkSelectedExtent.width;
+        tonemapPushConstants.outputHeight = vkSelectedExtent.height;
+        tonemapPushConstants.exposure = TONEMAP_EXPOSURE;
+        // The display image is UNORM, but the blit into an sRGB swap chain encodes it.
+        tonemapPushConstants.encodeSrgb = swapChainSrgb ? 0 : 1;
+        vkCmdPushConstants(vkCmdBuffer, vkTonemapPipelineLayout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(tonemapPushConstants), &tonemapPushConstants);
+        vkCmdDispatch(vkCmdBuffer,
+            (vkSelectedExtent.width + TONEMAP_WORKGROUP_SIZE - 1) / TONEMAP_WORKGROUP_SIZE,
+            (vkSelectedExtent.height + TONEMAP_WORKGROUP_SIZE - 1) / TONEMAP_WORKGROUP_SIZE,
+            1);
+
+        // Headless mode without readback keeps the result in the display image.
+        // The image is not used again until the frame fence is signaled,
+        // so the next frame may start tracing without waiting for this one.
+        if (headless && !readback) {
+            writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, FRAME_TIMESTAMP_COPY_END);
+            return;
         }
 
-        // Bind the ray tracing pipeline.
-        vkCmdBindPipeline(vkCommandBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, vkPipeline);
+        // Tone mapping into the swap chain image leaves nothing to copy,
+        // just hand the image over to the presentation engine.
+        // Readback needs the display image, so it never takes this path.
+        if (tonemapIntoSwapChain) {
+            VkImageMemoryBarrier vkToPresentBarrier{};
+            vkToPresentBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            vkToPresentBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            vkToPresentBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            vkToPresentBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            vkToPresentBarrier.image = vkSwapChainImages[imageIndex];
+            vkToPresentBarrier.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+            vkToPresentBarrier.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            vkToPresentBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            vkToPresentBarrier.dstAccessMask = 0;
+            vkCmdPipelineBarrier(
+                vkCmdBuffer,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                0,
+                0, nullptr,
+                0, nullptr,
+                1, &vkToPresentBarrier);
+            writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, FRAME_TIMESTAMP_COPY_END);
+            return;
+        }
 
-        // Bind descriptor sets.
-        vkCmdBindDescriptorSets(vkCommandBuffers[i], VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, vkPipelineLayout, 0, 1, &vkDescriptorSet, 0, 0);
-
-        // Calculate shader binding offsets, which is pretty straight forward in our example.
-        VkDeviceSize bindingOffsetRayGenShader = rayTracingProperties.shaderGroupBaseAlignment * INDEX_RAYGEN;
-        VkDeviceSize bindingOffsetMissShader = rayTracingProperties.shaderGroupBaseAlignment * INDEX_MISS;
-        VkDeviceSize bindingOffsetHitShader = rayTracingProperties.shaderGroupBaseAlignment * INDEX_CLOSEST_HIT;
-        VkDeviceSize bindingStride = rayTracingProperties.shaderGroupBaseAlignment;
-
-        // Trace rays.
-        vkCmdTraceRaysNV(vkCommandBuffers[i],
-            vkShaderBindingTable, bindingOffsetRayGenShader,
-            vkShaderBindingTable, bindingOffsetMissShader, bindingStride,
-            vkShaderBindingTable, bindingOffsetHitShader, bindingStride,
-            VK_NULL_HANDLE, 0, 0,
-            vkSelectedExtent.width, vkSelectedExtent.height, 1);
+        // Otherwise blit the display image into the swap chain image and copy it into the readback buffer.
+        // Barriers wait only for stages that actually touch the images,
+        // so they do not drain the whole pipeline.
+        const VkImage vkDisplayImage = vkDisplayImages[frame];
+        std::vector< VkImageMemoryBarrier > vkBeforeCopyBarriers;
 
-        // Prepare current swapchain image as transfer destination.
-        VkImageMemoryBarrier imageMemoryBarrier1 {};
+        // Prepare the display image as transfer source.
+        // Copies should see everything the tone mapping shader wrote.
+        VkImageMemoryBarrier imageMemoryBarrier1{};
         imageMemoryBarrier1.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier1.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageMemoryBarrier1.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageMemoryBarrier1.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-        imageMemoryBarrier1.image = vkSwapChainImages[i];
-        imageMemoryBarrier1.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-        imageMemoryBarrier1.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageMemoryBarrier1.srcAccessMask = 0;
-        imageMemoryBarrier1.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-        vkCmdPipelineBarrier(
-            vkCommandBuffers[i],
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &imageMemoryBarrier1);
-
-        // Prepare ray tracing output image as transfer source.
-        VkImageMemoryBarrier imageMemoryBarrier2 {};
-        imageMemoryBarrier2.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageMemoryBarrier2.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier2.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier2.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-        imageMemoryBarrier2.image = vkStorageImage;
-        imageMemoryBarrier2.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier2.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        imageMemoryBarrier2.srcAccessMask = 0;
-        imageMemoryBarrier2.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        imageMemoryBarrier1.image = vkDisplayImage;
+        imageMemoryBarrier1.oldLayout = VK_IMAGE_LAYOUT_GENERAL;
+        imageMemoryBarrier1.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        imageMemoryBarrier1.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+        imageMemoryBarrier1.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+        vkBeforeCopyBarriers.push_back(imageMemoryBarrier1);
+
+        // Prepare current swapchain image as transfer destination.
+        // The submit waits for the image to be acquired at the transfer stage.
+        if (!headless) {
+            VkImageMemoryBarrier imageMemoryBarrier2{};
+            imageMemoryBarrier2.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            imageMemoryBarrier2.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier2.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier2.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            imageMemoryBarrier2.image = vkSwapChainImages[imageIndex];
+            imageMemoryBarrier2.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+            imageMemoryBarrier2.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            imageMemoryBarrier2.srcAccessMask = 0;
+            imageMemoryBarrier2.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkBeforeCopyBarriers.push_back(imageMemoryBarrier2);
+        }
         vkCmdPipelineBarrier(
-            vkCommandBuffers[i],
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            vkCmdBuffer,
+            VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
             0,
             0, nullptr,
             0, nullptr,
-            1, &imageMemoryBarrier2);
+            static_cast< uint32_t >(vkBeforeCopyBarriers.size()), vkBeforeCopyBarriers.data());
+
+        // Blit the display image into the swap chain image.
+        // Both have the same size, scaling has been done by the tone mapping pass,
+        // but formats may differ, so a copy cannot be used: the blit converts channels.
+        if (!headless) {
+            VkImageBlit blitRegion{};
+            blitRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            blitRegion.srcOffsets[0] = { 0, 0, 0 };
+            blitRegion.srcOffsets[1] = { static_cast< int32_t >(vkSelectedExtent.width), static_cast< int32_t >(vkSelectedExtent.height), 1 };
+            blitRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            blitRegion.dstOffsets[0] = { 0, 0, 0 };
+            blitRegion.dstOffsets[1] = blitRegion.srcOffsets[1];
+            vkCmdBlitImage(vkCmdBuffer, vkDisplayImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vkSwapChainImages[imageIndex], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &blitRegion, VK_FILTER_NEAREST);
+        }
 
-        // Copy the storage image into the swap chain image.
-        VkImageCopy copyRegion{};
-        copyRegion.srcSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-        copyRegion.srcOffset = { 0, 0, 0 };
-        copyRegion.dstSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
-        copyRegion.dstOffset = { 0, 0, 0 };
-        copyRegion.extent = { vkSelectedExtent.width, vkSelectedExtent.height, 1 };
-        vkCmdCopyImage(vkCommandBuffers[i], vkStorageImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vkSwapChainImages[i], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copyRegion);
+        // Copy the display image into the readback buffer of the frame as tightly packed rows.
+        // The encoder has released the buffer before the frame was recorded.
+        if (readback) {
+            VkBufferImageCopy readbackRegion{};
+            readbackRegion.bufferOffset = 0;
+            readbackRegion.bufferRowLength = 0;
+            readbackRegion.bufferImageHeight = 0;
+            readbackRegion.imageSubresource = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 0, 1 };
+            readbackRegion.imageOffset = { 0, 0, 0 };
+            readbackRegion.imageExtent = { vkSelectedExtent.width, vkSelectedExtent.height, 1 };
+            vkCmdCopyImageToBuffer(vkCmdBuffer, vkDisplayImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, vkReadbackBuffers[frame], 1, &readbackRegion);
+        }
 
-        // Transition swap chain image back for presentation.
-        VkImageMemoryBarrier imageMemoryBarrier3 {};
+        std::vector< VkImageMemoryBarrier > vkAfterCopyBarriers;
+
+        // Transition the display image back to general layout.
+        // The image is written again only after the frame fence is signaled,
+        // so tone mapping of the next frame does not wait for the copy.
+        VkImageMemoryBarrier imageMemoryBarrier3{};
         imageMemoryBarrier3.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
         imageMemoryBarrier3.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageMemoryBarrier3.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
         imageMemoryBarrier3.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-        imageMemoryBarrier3.image = vkSwapChainImages[i];
-        imageMemoryBarrier3.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageMemoryBarrier3.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
-        imageMemoryBarrier3.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        imageMemoryBarrier3.image = vkDisplayImage;
+        imageMemoryBarrier3.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        imageMemoryBarrier3.newLayout = VK_IMAGE_LAYOUT_GENERAL;
+        imageMemoryBarrier3.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
         imageMemoryBarrier3.dstAccessMask = 0;
+        vkAfterCopyBarriers.push_back(imageMemoryBarrier3);
+
+        // Transition swap chain image back for presentation.
+        // Presentation is synchronized by the semaphore, so nothing waits for the barrier.
+        if (!headless) {
+            VkImageMemoryBarrier imageMemoryBarrier4{};
+            imageMemoryBarrier4.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+            imageMemoryBarrier4.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier4.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+            imageMemoryBarrier4.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+            imageMemoryBarrier4.image = vkSwapChainImages[imageIndex];
+            imageMemoryBarrier4.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+            imageMemoryBarrier4.newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+            imageMemoryBarrier4.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            imageMemoryBarrier4.dstAccessMask = 0;
+            vkAfterCopyBarriers.push_back(imageMemoryBarrier4);
+        }
+
+        // A fence alone does not make device writes visible to the host,
+        // so the readback copy is made visible to host reads explicitly.
+        VkBufferMemoryBarrier vkReadbackBarrier{};
+        vkReadbackBarrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+        vkReadbackBarrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkReadbackBarrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+        vkReadbackBarrier.buffer = vkReadbackBuffers[frame];
+        vkReadbackBarrier.offset = 0;
+        vkReadbackBarrier.size = VK_WHOLE_SIZE;
+        vkReadbackBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+        vkReadbackBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
         vkCmdPipelineBarrier(
-            vkCommandBuffers[i],
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            0,
-            0, nullptr,
-            0, nullptr,
-            1, &imageMemoryBarrier3);
-
-        // Transition ray tracing output image back to general layout.
-        VkImageMemoryBarrier imageMemoryBarrier4 {};
-        imageMemoryBarrier4.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-        imageMemoryBarrier4.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier4.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-        imageMemoryBarrier4.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
-        imageMemoryBarrier4.image = vkStorageImage;
-        imageMemoryBarrier4.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        imageMemoryBarrier4.newLayout = VK_IMAGE_LAYOUT_GENERAL;
-        imageMemoryBarrier4.srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
-        imageMemoryBarrier4.dstAccessMask = 0;
-        vkCmdPipelineBarrier(
-            vkCommandBuffers[i],
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
-            VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+            vkCmdBuffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT,
+            VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT | (readback ? VK_PIPELINE_STAGE_HOST_BIT : 0),
             0,
             0, nullptr,
-            0, nullptr,
-            1, &imageMemoryBarrier4);
+            readback ? 1 : 0, &vkReadbackBarrier,
+            static_cast< uint32_t >(vkAfterCopyBarriers.size()), vkAfterCopyBarriers.data());
 
-        // Fihish adding commands into the buffer.
-        if (vkEndCommandBuffer(vkCommandBuffers[i]) != VK_SUCCESS) {
-            std::cerr << "Failed to finish command buffer recording" << std::endl;
-            abort();
+        // Mark the end of the frame.
+        writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, frame, FRAME_TIMESTAMP_COPY_END);
+    };
+
+    // Finish bands of the frame in multi-GPU mode.
+    // Every GPU stops its band timer, and every GPU except the presenting one copies its band
+    // into the peer alias of the radiance image, which writes straight into the memory of the
+    // presenting GPU. Output commands are recorded separately and run on the presenting GPU only.
+    auto recordBandComposite = [&](VkCommandBuffer vkCmdBuffer, size_t frame) {
+        for (uint32_t device = 0; device < deviceGroupSize; device++) {
+            vkCmdSetDeviceMask(vkCmdBuffer, 1u << device);
+            if (profilerEnabled) {
+                vkCmdWriteTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, vkBandTimestampPools[frame], device * 2 + 1);
+            }
+            const uint32_t bandBegin = traceBandStarts[device];
+            const uint32_t bandEnd = traceBandStarts[device + 1];
+            if (device != 0 && bandEnd > bandBegin) {
+                // The copy reads what ray generation shaders of this GPU wrote.
+                VkMemoryBarrier vkBandBarrier{};
+                vkBandBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                vkBandBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+                vkBandBarrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+                vkCmdPipelineBarrier(
+                    vkCmdBuffer,
+                    VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+                    VK_PIPELINE_STAGE_TRANSFER_BIT,
+                    0,
+                    1, &vkBandBarrier,
+                    0, nullptr,
+                    0, nullptr);
+
+                // Both images are in the general layout, the alias shares the layout of the radiance image.
+                VkImageCopy vkBandCopy{};
+                vkBandCopy.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+                vkBandCopy.srcSubresource.layerCount = 1;
+                vkBandCopy.srcOffset = { 0, static_cast< int32_t >(bandBegin), 0 };
+                vkBandCopy.dstSubresource = vkBandCopy.srcSubresource;
+                vkBandCopy.dstOffset = vkBandCopy.srcOffset;
+                vkBandCopy.extent = { vkRenderExtent.width, bandEnd - bandBegin, 1 };
+                vkCmdCopyImage(
+                    vkCmdBuffer,
+                    vkStorageImages[frame], VK_IMAGE_LAYOUT_GENERAL,
+                    vkPeerStorageImages[frame], VK_IMAGE_LAYOUT_GENERAL,
+                    1, &vkBandCopy);
+            }
+            if (profilerEnabled) {
+                const VkDeviceSize offset = (frame * MAX_DEVICE_GROUP_SIZE + device) * 2 * sizeof(uint64_t);
+                vkCmdCopyQueryPoolResults(vkCmdBuffer, vkBandTimestampPools[frame], device * 2, 2, vkBandTimestampBuffer, offset,
+                    sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT);
+            }
         }
-    }
+        vkCmdSetDeviceMask(vkCmdBuffer, deviceGroupMask);
+
+        // Band times are read by the CPU after the frame fence is signaled.
+        if (profilerEnabled) {
+            VkMemoryBarrier vkBandTimestampBarrier{};
+            vkBandTimestampBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            vkBandTimestampBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+            vkBandTimestampBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+            vkCmdPipelineBarrier(
+                vkCmdBuffer,
+                VK_PIPELINE_STAGE_TRANSFER_BIT,
+                VK_PIPELINE_STAGE_HOST_BIT,
+                0,
+                1, &vkBandTimestampBarrier,
+                0, nullptr,
+                0, nullptr);
+        }
+    };
+
+    // Record ray tracing of tiles [firstTile, firstTile + tileCount) into the radiance image of the frame.
+    // Output commands are recorded together with the last tiles. In multi-GPU mode every tile
+    // is traced by the GPU of its band, and output commands are recorded separately.
+    auto recordTrace = [&](VkCommandBuffer vkCmdBuffer, uint32_t imageIndex, size_t frame, size_t firstTile, size_t tileCount) {
+        const bool firstTiles = firstTile == 0;
+        const bool lastTiles = firstTile + tileCount == traceTiles.size();
+
+        // Bind the ray tracing pipeline.
+        vkCmdBindPipeline(vkCmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, vkPipeline);
+
+        // Bind descriptor sets.
+        // The dynamic offset selects uniforms of the frame,
+        // and the set of the frame selects its radiance image.
+        const uint32_t uniformBufferOffset = static_cast< uint32_t >(vkUniformBufferSlotSize * frame);
+        const VkDescriptorSet vkFrameDescriptorSet = vkDescriptorSets[frame];
+        vkCmdBindDescriptorSets(vkCmdBuffer, VK_PIPELINE_BIND_POINT_RAY_TRACING_NV, vkPipelineLayout, 0, 1, &vkFrameDescriptorSet, 1, &uniformBufferOffset);
+
+        // Tiles of one frame write different pixels, so tile groups need no barriers between them.
+        // Barriers recorded with the first tiles cover all later commands in submission order,
+        // the following submissions included, so later groups do not wait for earlier ones.
+
+        // The shader reads the average written by the previous frame, so that write
+        // should be finished. Frames are submitted to one queue, so the barrier
+        // orders this trace after the trace of the previous frame.
+        if (accumulate && firstTiles) {
+            VkMemoryBarrier vkAccumulationBarrier{};
+            vkAccumulationBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            vkAccumulationBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            vkAccumulationBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(
+                vkCmdBuffer,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+                0,
+                1, &vkAccumulationBarrier,
+                0, nullptr,
+                0, nullptr);
+        }
+
+        // The trace overwrites the G-buffer and motion vectors the denoiser
+        // of the previous frames read, so those reads should be finished.
+        if (denoise && firstTiles) {
+            VkMemoryBarrier vkDenoiserInputBarrier{};
+            vkDenoiserInputBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+            vkDenoiserInputBarrier.srcAccessMask = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+            vkDenoiserInputBarrier.dstAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+            vkCmdPipelineBarrier(
+                vkCmdBuffer,
+                VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+                0,
+                1, &vkDenoiserInputBarrier,
+                0, nullptr,
+                0, nullptr);
+        }
+
+        // Every GPU starts the band timer before its first tile.
+        // The timestamp is written at the ray tracing stage, which waits for the TLAS update
+        // by the barrier recorded after it, so band times measure tracing only.
+        if (multiGpu && profilerEnabled && firstTiles) {
+            for (uint32_t device = 0; device < deviceGroupSize; device++) {
+                vkCmdSetDeviceMask(vkCmdBuffer, 1u << device);
+                vkCmdWriteTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, vkBandTimestampPools[frame], device * 2);
+            }
+            vkCmdSetDeviceMask(vkCmdBuffer, deviceGroupMask);
+        }
+
+        // Trace rays tile by tile.
+        // One invocation per pixel, each of them traces all samples of its pixel.
+        for (size_t i = firstTile; i < firstTile + tileCount; i++) {
+            const TraceTile& tile = traceTiles[i];
+            if (multiGpu) {
+                vkCmdSetDeviceMask(vkCmdBuffer, 1u << tile.deviceIndex);
+            }
+            TracePushConstants pushConstants{};
+            pushConstants.tileOffsetX = static_cast< uint32_t >(tile.offset.x);
+            pushConstants.tileOffsetY = static_cast< uint32_t >(tile.offset.y);
+            pushConstants.renderWidth = vkRenderExtent.width;
+            pushConstants.renderHeight = vkRenderExtent.height;
+            vkCmdPushConstants(vkCmdBuffer, vkPipelineLayout, VK_SHADER_STAGE_RAYGEN_BIT_NV, 0, sizeof(pushConstants), &pushConstants);
+            if (useKhrRayTracing) {
+                // The KHR backend describes each table region by its device address, stride and size.
+                // The ray generation region has exactly one record.
+                const VkStridedDeviceAddressRegionKHR raygenRegion{ vkShaderBindingTableAddress + sbtRaygenOffset, sbtRaygenStride, sbtRaygenStride };
+                const VkStridedDeviceAddressRegionKHR missRegion{ vkShaderBindingTableAddress + sbtMissOffset, sbtMissStride, sbtMissRegionSize };
+                const VkStridedDeviceAddressRegionKHR hitRegion{ vkShaderBindingTableAddress + sbtHitOffset, sbtHitStride, sbtHitRegionSize };
+                const VkStridedDeviceAddressRegionKHR callableRegion{};
+                vkCmdTraceRaysKHR(vkCmdBuffer,
+                    &raygenRegion, &missRegion, &hitRegion, &callableRegion,
+                    tile.extent.width, tile.extent.height, 1);
+                continue;
+            }
+            vkCmdTraceRaysNV(vkCmdBuffer,
+                vkShaderBindingTable, sbtRaygenOffset,
+                vkShaderBindingTable, sbtMissOffset, sbtMissStride,
+                vkShaderBindingTable, sbtHitOffset, sbtHitStride,
+                VK_NULL_HANDLE, 0, 0,
+                tile.extent.width, tile.extent.height, 1);
+        }
+        if (multiGpu) {
+            vkCmdSetDeviceMask(vkCmdBuffer, deviceGroupMask);
+        }
+        if (!lastTiles) {
+            return;
+        }
+        writeFrameTimestamp(vkCmdBuffer, VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV, frame, FRAME_TIMESTAMP_TRACE_END);
+
+        if (multiGpu) {
+            recordBandComposite(vkCmdBuffer, frame);
+            return;
+        }
+        recordOutput(vkCmdBuffer, imageIndex, frame);
+    };
 
     // ==========================================================================
     //                   STEP 29: Synchronization primitives
@@ -2145,6 +7032,18 @@ int main()
         }
     }
 
+    // In multi-GPU mode every GPU except the presenting one signals that its band is copied
+    // into the radiance image of the presenting GPU, and the output submission waits for all bands.
+    std::array< std::array< VkSemaphore, MAX_DEVICE_GROUP_SIZE >, MAX_FRAMES_IN_FLIGHT > vkBandSemaphores{};
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT && multiGpu; i++) {
+        for (uint32_t device = 1; device < deviceGroupSize; device++) {
+            if (vkCreateSemaphore(vkDevice, &vkSemaphoreInfo, nullptr, &vkBandSemaphores[i][device]) != VK_SUCCESS) {
+                std::cerr << "Failed to create a semaphore!" << std::endl;
+                abort();
+            }
+        }
+    }
+
     // In order to not overflow the swap chain we need to wait on CPU side if there are too many images
     // produced by GPU. This CPU-GPU synchronization is performed by fences.
 
@@ -2178,54 +7077,664 @@ int main()
     VkQueue vkPresentQueue;
     vkGetDeviceQueue(vkDevice, queueFamilyIndices.presentFamily.value(), 0, &vkPresentQueue);
 
+    // Print how much memory we use after all resources are created.
+    memoryArena.printStatistics();
+
+    // Frame readback.
+    // A frame is handed over to the encoder thread as soon as its fence is signaled, the main loop
+    // checks fences of all frames in flight without blocking. The encoder writes raw pixels into the file
+    // and has to release a buffer before its frame slot comes around again, otherwise the main loop waits.
+    std::ofstream readbackFile;
+    ReadbackEncoder readbackEncoder;
+    // Written by the encoder thread, read only after it is stopped.
+    uint64_t readbackFrameCount = 0;
+    // Frames in flight whose copies are submitted but not handed over to the encoder yet.
+    std::array< bool, MAX_FRAMES_IN_FLIGHT > readbackRecorded{};
+    std::array< ReadbackFrame, MAX_FRAMES_IN_FLIGHT > recordedReadbacks{};
+    if (readback) {
+        readbackFile.open(readbackPath, std::ios::binary | std::ios::trunc);
+        if (!readbackFile.is_open()) {
+            std::cerr << "Failed to open " << readbackPath << "!" << std::endl;
+            abort();
+        }
+        std::cout << "Reading back frames into " << readbackPath << " as raw images of 4 bytes per pixel" << std::endl;
+        readbackEncoder.start([&](const ReadbackFrame& frame) {
+            readbackFile.write(reinterpret_cast< const char* >(frame.pixels), static_cast< std::streamsize >(frame.width) * frame.height * 4);
+            readbackFrameCount++;
+        });
+    }
+
+    // Push finished readbacks to the encoder in the order frames were submitted.
+    // Slots are taken from the oldest submitted frame, and collection stops at the first frame
+    // that is not finished yet, so a later frame is never written into the file before an earlier one.
+    // Non-coherent memory is invalidated, so the encoder sees what the GPU wrote.
+    auto collectReadbacks = [&]() {
+        while (true) {
+            std::optional< size_t > oldest;
+            for (size_t i = 0; i < framesInFlight; i++) {
+                if (readbackRecorded[i] && (!oldest.has_value() || recordedReadbacks[i].frameIndex < recordedReadbacks[oldest.value()].frameIndex)) {
+                    oldest = i;
+                }
+            }
+            if (!oldest.has_value() || vkGetFenceStatus(vkDevice, vkInFlightFences[oldest.value()]) != VK_SUCCESS) {
+                break;
+            }
+            const size_t i = oldest.value();
+            if (!readbackMemoryCoherent) {
+                VkMappedMemoryRange vkReadbackRange{};
+                vkReadbackRange.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+                vkReadbackRange.memory = vkReadbackBufferMemories[i].memory;
+                vkReadbackRange.offset = vkReadbackBufferMemories[i].offset;
+                vkReadbackRange.size = vkReadbackBufferMemories[i].size;
+                vkInvalidateMappedMemoryRanges(vkDevice, 1, &vkReadbackRange);
+            }
+            readbackEncoder.push(recordedReadbacks[i]);
+            readbackRecorded[i] = false;
+        }
+    };
+
     // Index of a framce processed in the current loop.
-    // We go through MAX_FRAMES_IN_FLIGHT indices.
+    // We go through framesInFlight indices. Less frames in flight reduce latency,
+    // more frames let the CPU run further ahead of the GPU.
     size_t currentFrame = 0;
 
+    // Whether the next frame is the first one presented by the application.
+    bool isFirstFrame = true;
+
+    // Amount of frames submitted so far, drives the animation in headless mode.
+    uint64_t submittedFrameCount = 0;
+
+    // Size of the window the swap chain was created for.
+    int swapChainFramebufferWidth = 0;
+    int swapChainFramebufferHeight = 0;
+    if (!headless) {
+        glfwGetFramebufferSize(glfwWindow, &swapChainFramebufferWidth, &swapChainFramebufferHeight);
+    }
+
+    // Recreate the swap chain and everything that depends on its resolution.
+    // Acceleration structures, pipelines and command pools are kept, command buffers
+    // are recorded every frame anyway, so they pick up the new resolution automatically.
+    auto recreateSwapChain = [&]() {
+        // A minimized window has zero size, wait until it is restored.
+        glfwGetFramebufferSize(glfwWindow, &swapChainFramebufferWidth, &swapChainFramebufferHeight);
+        while ((swapChainFramebufferWidth == 0 || swapChainFramebufferHeight == 0) && !glfwWindowShouldClose(glfwWindow)) {
+            glfwWaitEvents();
+            glfwGetFramebufferSize(glfwWindow, &swapChainFramebufferWidth, &swapChainFramebufferHeight);
+        }
+        // The window has been closed while minimized, there is nothing to recreate.
+        if (swapChainFramebufferWidth == 0 || swapChainFramebufferHeight == 0) {
+            return;
+        }
+
+        // Resources should not be in use by the GPU.
+        vkDeviceWaitIdle(vkDevice);
+
+        // Readback buffers should not be in use by the encoder either.
+        if (readback) {
+            collectReadbacks();
+            readbackEncoder.waitIdle();
+
+            // Raw frames carry no size, so consumers of the stream would read garbage after a size change.
+            // The window is not resizable, but the window system may still change its size.
+            const VkExtent2D readbackExtent = vkSelectedExtent;
+            selectExtent();
+            if (vkSelectedExtent.width != readbackExtent.width || vkSelectedExtent.height != readbackExtent.height) {
+                std::cerr << "Window size changed from " << readbackExtent.width << "x" << readbackExtent.height << " to "
+                          << vkSelectedExtent.width << "x" << vkSelectedExtent.height << " during frame readback!" << std::endl;
+                abort();
+            }
+        }
+
+        // Destroy resources of the old resolution.
+        // The old swap chain itself is destroyed after the new one is created.
+        vkDestroyDescriptorPool(vkDevice, vkDescriptorPool, nullptr);
+        destroyDenoiserImages();
+        destroyAccumulationImage();
+        destroyStorageImages();
+        destroySwapChainImageViews();
+
+        // Create them again for the new resolution.
+        selectExtent();
+        updateRenderExtent();
+        createSwapChain();
+        createSwapChainImageViews();
+        createStorageImages();
+        createAccumulationImage();
+        createDenoiserImages();
+        initializeStorageImageLayouts();
+        createDescriptorSets();
+
+        // Image count may change together with the swap chain.
+        vkImagesInFlight.assign(vkSwapChainImages.size(), VK_NULL_HANDLE);
+
+        // The accumulation image and denoiser images have been recreated and contain no samples.
+        accumulatedFrameCount = 0;
+        denoisedFrameCount = 0;
+    };
+
+    // Dynamic resolution controller.
+    // The internal resolution goes down when the average frame time exceeds the budget
+    // and goes up again once there is enough headroom. Frame times are averaged
+    // over several frames, so a single slow frame does not change the resolution.
+    double dynamicResolutionFrameMsSum = 0.0;
+    uint32_t dynamicResolutionFrameCount = 0;
+    auto updateDynamicResolution = [&](double frameMs) {
+        if (frameMs <= 0.0) {
+            return;
+        }
+        dynamicResolutionFrameMsSum += frameMs;
+        dynamicResolutionFrameCount++;
+        if (dynamicResolutionFrameCount < DYNAMIC_RESOLUTION_ADJUST_FRAMES) {
+            return;
+        }
+        const double averageFrameMs = dynamicResolutionFrameMsSum / dynamicResolutionFrameCount;
+        dynamicResolutionFrameMsSum = 0.0;
+        dynamicResolutionFrameCount = 0;
+
+        float newScale = renderScale;
+        if (averageFrameMs > frameTimeBudgetMs) {
+            newScale -= DYNAMIC_RESOLUTION_SCALE_STEP;
+        } else if (averageFrameMs < frameTimeBudgetMs * DYNAMIC_RESOLUTION_HEADROOM) {
+            newScale += DYNAMIC_RESOLUTION_SCALE_STEP;
+        }
+        // Keep the scale on the grid of steps, so it comes back to exactly 1.
+        newScale = std::round(newScale / DYNAMIC_RESOLUTION_SCALE_STEP) * DYNAMIC_RESOLUTION_SCALE_STEP;
+        newScale = std::max(DYNAMIC_RESOLUTION_MIN_SCALE, std::min(1.0f, newScale));
+        if (newScale != renderScale) {
+            renderScale = newScale;
+            updateRenderExtent();
+            // Samples of another resolution cannot be mixed.
+            accumulatedFrameCount = 0;
+            denoisedFrameCount = 0;
+            std::cout << "Internal resolution " << vkRenderExtent.width << "x" << vkRenderExtent.height
+                      << " (average frame time " << averageFrameMs << " ms)" << std::endl;
+        }
+    };
+
+    // Hot shader reload.
+    // Sources of ray tracing shaders are watched by their modification times. Once one of them
+    // changes, a background thread compiles all of them with glslc and creates a new pipeline
+    // through the pipeline cache, while the main loop keeps rendering with the old pipeline.
+    // The new pipeline and its shader binding table replace the old ones between frames,
+    // the old ones are destroyed when no frame in flight uses them anymore.
+    // Sources of pipeline stages in the order of shaderStages, all hit stages use the last one.
+    const std::array< const char*, 4 > hotReloadStageSources = { "main.rgen", "main.rmiss", "shadow.rmiss", "main.rchit" };
+    // Files a change of which triggers a reload, the included header is among them.
+    const std::array< const char*, 5 > hotReloadWatchedFiles = { "main.rgen", "main.rmiss", "shadow.rmiss", "main.rchit", "raytracing.glsl" };
+
+    // Modification times of watched files, zero for a file that cannot be found.
+    auto getShaderSourceTimes = [&]() {
+        std::vector< int64_t > times;
+        for (const char* fileName : hotReloadWatchedFiles) {
+            struct stat fileStat;
+            const std::string path = std::string(SHADER_SOURCE_DIR) + "/" + fileName;
+            times.push_back(stat(path.c_str(), &fileStat) == 0 ? static_cast< int64_t >(fileStat.st_mtime) : 0);
+        }
+        return times;
+    };
+    std::vector< int64_t > shaderSourceTimes;
+    if (hotReload) {
+        shaderSourceTimes = getShaderSourceTimes();
+        std::cout << "Watching shader sources in " << SHADER_SOURCE_DIR << std::endl;
+    }
+    auto lastShaderSourcePoll = std::chrono::steady_clock::now();
+
+    // Background reload and its result.
+    // The thread writes the pipeline, its shader binding table and the error, the main loop reads them only
+    // after it sees the finished flag. The table buffer is created by the main loop before the thread starts,
+    // since the memory arena is used by the main thread only, and is kept for the next reload if this one fails.
+    std::thread hotReloadThread;
+    std::atomic< bool > hotReloadFinished(false);
+    VkPipeline hotReloadPipeline = VK_NULL_HANDLE;
+    VkBuffer hotReloadShaderBindingTable = VK_NULL_HANDLE;
+    MemoryAllocation hotReloadShaderBindingTableMemory;
+    VkDeviceAddress hotReloadShaderBindingTableAddress = 0;
+    // Host-visible table of a swapped pipeline that the next frame copies into the device-local table,
+    // so traces do not read the table over the bus for the rest of the run.
+    VkBuffer pendingShaderBindingTableCopy = VK_NULL_HANDLE;
+    std::string hotReloadError;
+    // Sources changed while a reload was running, so another one is needed after it.
+    bool hotReloadPending = false;
+
+    // Compile shaders and create a pipeline, runs on the background thread.
+    // Stages keep specialization constants of the startup pipeline, only modules are replaced.
+    auto reloadShaders = [&]() {
+        std::array< VkShaderModule, 4 > modules{};
+        for (size_t i = 0; i < hotReloadStageSources.size() && hotReloadError.empty(); i++) {
+            // Compile the source for the current backend like CMake does.
+            // The binary gets its own name, so a failed compilation does not touch shaders loaded at startup.
+            const std::string sourcePath = std::string(SHADER_SOURCE_DIR) + "/" + hotReloadStageSources[i];
+            const std::string binaryPath = hotReloadStageSources[i] + shaderFileSuffix + ".reload";
+            std::string command = std::string("\"") + SHADER_COMPILER + "\" " +
+                                  (useKhrRayTracing ? "--target-env=vulkan1.2 -DRAY_TRACING_KHR " : "") +
+                                  "\"" + sourcePath + "\" -o \"" + binaryPath + "\"";
+#ifdef _WIN32
+            // cmd.exe strips the first and the last quote of a command having several quoted parts.
+            command = "\"" + command + "\"";
+#endif
+            if (std::system(command.c_str()) != 0) {
+                hotReloadError = std::string("Failed to compile ") + hotReloadStageSources[i];
+                break;
+            }
+
+            // Map shader code.
+            MappedFile shaderFile;
+            if (!shaderFile.open(binaryPath)) {
+                hotReloadError = "Compiled shader " + binaryPath + " not found";
+                break;
+            }
+
+            // Create a shader module.
+            VkShaderModuleCreateInfo vkShaderCreateInfo{};
+            vkShaderCreateInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+            vkShaderCreateInfo.codeSize = shaderFile.size;
+            vkShaderCreateInfo.pCode = reinterpret_cast< const uint32_t* >(shaderFile.data);
+            if (vkCreateShaderModule(vkDevice, &vkShaderCreateInfo, nullptr, &modules[i]) != VK_SUCCESS) {
+                hotReloadError = std::string("Failed to create a shader ") + hotReloadStageSources[i];
+            }
+        }
+
+        // Create a pipeline from the new modules.
+        if (hotReloadError.empty()) {
+            std::vector< VkPipelineShaderStageCreateInfo > stages = shaderStages;
+            for (size_t stage = 0; stage < stages.size(); stage++) {
+                stages[stage].module = modules[std::min(stage, modules.size() - 1)];
+            }
+            hotReloadPipeline = createRayTracingPipeline(stages);
+            if (hotReloadPipeline == VK_NULL_HANDLE) {
+                hotReloadError = "Failed to create a pipeline";
+            }
+        }
+
+        // Fill the shader binding table of the new pipeline, so the main loop only swaps handles.
+        if (hotReloadPipeline != VK_NULL_HANDLE &&
+            !writeShaderBindingTable(hotReloadPipeline, static_cast< uint8_t* >(hotReloadShaderBindingTableMemory.mappedData))) {
+            hotReloadError = "Failed to get shader group handles";
+            vkDestroyPipeline(vkDevice, hotReloadPipeline, nullptr);
+            hotReloadPipeline = VK_NULL_HANDLE;
+        }
+
+        // Modules are not needed once the pipeline is created.
+        for (VkShaderModule module : modules) {
+            if (module != VK_NULL_HANDLE) {
+                vkDestroyShaderModule(vkDevice, module, nullptr);
+            }
+        }
+        hotReloadFinished = true;
+    };
+
+    // Pipelines replaced by reloads together with their shader binding tables.
+    // They are destroyed once all frames submitted before the replacement are finished.
+    // Host-visible tables copied into device-local ones are retired without a pipeline.
+    struct RetiredPipeline
+    {
+        VkPipeline pipeline;
+        VkBuffer shaderBindingTable;
+        MemoryAllocation shaderBindingTableMemory;
+        // Amount of submitted frames when the pipeline was replaced.
+        uint64_t retireFrame;
+    };
+    std::vector< RetiredPipeline > retiredPipelines;
+    auto destroyRetiredPipeline = [&](const RetiredPipeline& retired) {
+        if (retired.pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(vkDevice, retired.pipeline, nullptr);
+        }
+        memoryArena.free(retired.shaderBindingTableMemory);
+        vkDestroyBuffer(vkDevice, retired.shaderBindingTable, nullptr);
+    };
+
+    // Called at a frame boundary: swap in a finished pipeline, release retired ones
+    // and start a new reload if sources have changed.
+    auto updateHotReload = [&]() {
+        // The fence of the current frame has been waited, so every frame submitted
+        // framesInFlight frames ago or earlier is finished.
+        for (auto retired = retiredPipelines.begin(); retired != retiredPipelines.end();) {
+            if (submittedFrameCount >= retired->retireFrame + framesInFlight) {
+                destroyRetiredPipeline(*retired);
+                retired = retiredPipelines.erase(retired);
+            } else {
+                ++retired;
+            }
+        }
+
+        // Take the result of a finished reload.
+        // Frames in flight keep the old table, the new one has been written into a host-visible buffer by the thread.
+        // The next frame copies it into a new device-local table before tracing, the copy is recorded
+        // into the frame instead of waiting for an upload here, and the host-visible buffer is retired after that frame.
+        if (hotReloadThread.joinable() && hotReloadFinished) {
+            hotReloadThread.join();
+            hotReloadFinished = false;
+            if (hotReloadPipeline != VK_NULL_HANDLE) {
+                retiredPipelines.push_back({ vkPipeline, vkShaderBindingTable, vkShaderBindingTableMemory, submittedFrameCount });
+                vkPipeline = hotReloadPipeline;
+                createShaderBindingTableBuffer(false, vkShaderBindingTable, vkShaderBindingTableMemory, vkShaderBindingTableAddress);
+                pendingShaderBindingTableCopy = hotReloadShaderBindingTable;
+                retiredPipelines.push_back({ VK_NULL_HANDLE, hotReloadShaderBindingTable, hotReloadShaderBindingTableMemory, submittedFrameCount });
+                hotReloadPipeline = VK_NULL_HANDLE;
+                hotReloadShaderBindingTable = VK_NULL_HANDLE;
+                // Samples of old shaders should not be mixed with new ones.
+                accumulatedFrameCount = 0;
+                denoisedFrameCount = 0;
+                std::cout << "Shaders reloaded" << std::endl;
+            } else {
+                std::cerr << hotReloadError << ", the old pipeline is kept" << std::endl;
+            }
+        }
+
+        // Check sources for changes.
+        const auto now = std::chrono::steady_clock::now();
+        if (now - lastShaderSourcePoll >= std::chrono::milliseconds(HOT_RELOAD_POLL_INTERVAL_MS)) {
+            lastShaderSourcePoll = now;
+            std::vector< int64_t > times = getShaderSourceTimes();
+            if (times != shaderSourceTimes) {
+                shaderSourceTimes = std::move(times);
+                hotReloadPending = true;
+            }
+        }
+
+        // Only one reload runs at a time.
+        if (hotReloadPending && !hotReloadThread.joinable()) {
+            hotReloadPending = false;
+            hotReloadError.clear();
+            if (hotReloadShaderBindingTable == VK_NULL_HANDLE) {
+                createShaderBindingTableBuffer(true, hotReloadShaderBindingTable, hotReloadShaderBindingTableMemory, hotReloadShaderBindingTableAddress);
+            }
+            hotReloadThread = std::thread(reloadShaders);
+        }
+    };
+
     // Main loop.
-    while(!glfwWindowShouldClose(glfwWindow)) {
+    // Headless mode runs until enough frames are measured.
+    while(headless ? benchmarkCpuFrameMs.size() < benchmarkFrameCount : !glfwWindowShouldClose(glfwWindow)) {
         // Poll GLFW events.
-        glfwPollEvents();
+        if (!headless) {
+            glfwPollEvents();
+        }
+
+        // Recreate the swap chain if the window has been resized.
+        // Not every platform reports this via vkAcquireNextImageKHR(), so check the size explicitly.
+        if (!headless) {
+            int framebufferWidth, framebufferHeight;
+            glfwGetFramebufferSize(glfwWindow, &framebufferWidth, &framebufferHeight);
+            if (framebufferWidth != swapChainFramebufferWidth || framebufferHeight != swapChainFramebufferHeight) {
+                recreateSwapChain();
+            }
+        }
+
+        // Release temporary resources of acceleration structure builds once they are finished.
+        if (!buildResourcesReleased && vkGetFenceStatus(vkDevice, vkBuildASFence) == VK_SUCCESS) {
+            releaseBuildResources();
+        }
 
         // Wait for the current frame.
         vkWaitForFences(vkDevice, 1, &vkInFlightFences[currentFrame], VK_TRUE, UINT64_MAX);
+        observeFrameCompletion(currentFrame);
+
+        // Hand finished readbacks over to the encoder, the current frame is among them.
+        // Its buffer is written again by this frame, so the encoder should release it first.
+        if (readback) {
+            collectReadbacks();
+            readbackEncoder.waitForSlot(currentFrame);
+        }
 
         // Aquire a next image from a swap chain to process.
-        uint32_t imageIndex;
-        vkAcquireNextImageKHR(vkDevice, vkSwapChain, UINT64_MAX, vkImageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
-
-        // If the image is locked - wait for it.
-        if (vkImagesInFlight[imageIndex] != VK_NULL_HANDLE) {
-            vkWaitForFences(vkDevice, 1, &vkImagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
-        }
-
-        // Put a free fence to imagesInFlight array.
-        vkImagesInFlight[imageIndex] = vkInFlightFences[currentFrame];
-
-        // Describe a submit to the graphics queue.
-        VkSubmitInfo vkSubmitInfo{};
-        vkSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-        // Specify semaphores the GPU should wait before executing the submit.
-        std::array< VkSemaphore, 1 > vkWaitSemaphores{ vkImageAvailableSemaphores[currentFrame] };
-        // Pipeline stages corresponding to each semaphore.
-        std::array< VkPipelineStageFlags, 1 > vkWaitStages{ VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
-        vkSubmitInfo.waitSemaphoreCount = vkWaitSemaphores.size();
-        vkSubmitInfo.pWaitSemaphores = vkWaitSemaphores.data();
-        vkSubmitInfo.pWaitDstStageMask = vkWaitStages.data();
-        vkSubmitInfo.commandBufferCount = 1;
-        vkSubmitInfo.pCommandBuffers = &vkCommandBuffers[imageIndex];
-        // Specify semaphores the GPU should unlock after executing the submit.
-        std::array< VkSemaphore, 1 > vkSignalSemaphores{ vkRenderFinishedSemaphores[currentFrame] };
-        vkSubmitInfo.signalSemaphoreCount = vkSignalSemaphores.size();
-        vkSubmitInfo.pSignalSemaphores = vkSignalSemaphores.data();
+        // Headless mode has no swap chain and does not use the index.
+        uint32_t imageIndex = 0;
+        bool swapChainSuboptimal = false;
+        if (!headless) {
+            const VkResult acquireResult = vkAcquireNextImageKHR(vkDevice, vkSwapChain, UINT64_MAX, vkImageAvailableSemaphores[currentFrame], VK_NULL_HANDLE, &imageIndex);
+
+            // The swap chain does not match the surface anymore and cannot be used.
+            // The semaphore is not signaled in this case, so we can simply start the frame again.
+            if (acquireResult == VK_ERROR_OUT_OF_DATE_KHR) {
+                recreateSwapChain();
+                continue;
+            }
+            if (acquireResult != VK_SUCCESS && acquireResult != VK_SUBOPTIMAL_KHR) {
+                std::cerr << "Failed to acquire a swap chain image!" << std::endl;
+                abort();
+            }
+            // A suboptimal swap chain still works, it is recreated after the image is presented.
+            swapChainSuboptimal = acquireResult == VK_SUBOPTIMAL_KHR;
+
+            // If the image is locked - wait for it.
+            if (vkImagesInFlight[imageIndex] != VK_NULL_HANDLE) {
+                vkWaitForFences(vkDevice, 1, &vkImagesInFlight[imageIndex], VK_TRUE, UINT64_MAX);
+            }
+
+            // Put a free fence to imagesInFlight array.
+            vkImagesInFlight[imageIndex] = vkInFlightFences[currentFrame];
+        }
+
+        // The GPU does not use resources of the current frame anymore,
+        // so we can read its timestamps and reuse its command pools and its uniform slot.
+        collectFrameTimings(currentFrame);
+        if (multiGpu) {
+            balanceDeviceBands(currentFrame);
+        }
+        if (dynamicResolution) {
+            updateDynamicResolution(lastMeasuredFrameMs);
+        }
+        resetFrameCommandPools(currentFrame);
+
+        // Frames are recorded only after this point, so they all see the same pipeline.
+        if (hotReload) {
+            updateHotReload();
+        }
+
+        // Low latency mode waits until the GPU finishes the previous frame and only then
+        // samples input. The frame is rendered right away instead of waiting in the queue
+        // behind other frames, so it shows the freshest input.
+        if (lowLatency && !headless) {
+            const size_t previousFrame = (currentFrame + framesInFlight - 1) % framesInFlight;
+            if (frameSlotUsed[previousFrame]) {
+                vkWaitForFences(vkDevice, 1, &vkInFlightFences[previousFrame], VK_TRUE, UINT64_MAX);
+                observeFrameCompletion(previousFrame);
+            }
+            glfwPollEvents();
+        }
+        frameInputTimes[currentFrame] = std::chrono::steady_clock::now();
+        // Accumulation restarts when the camera moves.
+        if (updateCamera()) {
+            accumulatedFrameCount = 0;
+        }
+        writeUniforms(currentFrame);
+
+        // Record the frame on worker threads.
+        // The first job moves instances and updates the TLAS, other jobs trace groups of tiles.
+        // Each group of tiles goes into its own queue submission.
+        // Headless mode uses a fixed time step, so all runs render the same frames.
+        // Accumulation needs a static scene, so instances do not move.
+        const float frameTime = accumulate ? 0.0f : static_cast< float >(headless ? submittedFrameCount * BENCHMARK_FRAME_TIME_STEP : glfwGetTime());
+        updateTraceTiles();
+        const size_t tilesPerGroup = tilesPerSubmit == 0 ? traceTiles.size() : std::min< size_t >(tilesPerSubmit, traceTiles.size());
+        const size_t traceGroupCount = (traceTiles.size() + tilesPerGroup - 1) / tilesPerGroup;
+        VkCommandBuffer vkUpdateCmdBuffer = VK_NULL_HANDLE;
+        VkCommandBuffer vkOutputCmdBuffer = VK_NULL_HANDLE;
+        std::vector< VkCommandBuffer > vkTraceCmdBuffers(traceGroupCount, VK_NULL_HANDLE);
+        frameBandStarts[currentFrame] = traceBandStarts;
+        jobSystem.submit([&](uint32_t workerIndex) {
+            writeInstances(static_cast< VkAccelerationStructureInstanceKHR* >(vkInstanceBufferMemories[currentFrame].mappedData), frameTime);
+            vkUpdateCmdBuffer = beginSecondaryCommandBuffer(currentFrame, workerIndex);
+            recordTlasUpdate(vkUpdateCmdBuffer, currentFrame);
+            endCommandBuffer(vkUpdateCmdBuffer);
+        });
+        for (size_t group = 0; group < traceGroupCount; group++) {
+            jobSystem.submit([&, group](uint32_t workerIndex) {
+                const size_t firstTile = group * tilesPerGroup;
+                const size_t tileCount = std::min(tilesPerGroup, traceTiles.size() - firstTile);
+                vkTraceCmdBuffers[group] = beginSecondaryCommandBuffer(currentFrame, workerIndex);
+                recordTrace(vkTraceCmdBuffers[group], imageIndex, currentFrame, firstTile, tileCount);
+                endCommandBuffer(vkTraceCmdBuffers[group]);
+            });
+        }
+        // In multi-GPU mode output commands go into their own submission,
+        // which runs on the presenting GPU once all bands are copied into its radiance image.
+        if (multiGpu) {
+            jobSystem.submit([&](uint32_t workerIndex) {
+                vkOutputCmdBuffer = beginSecondaryCommandBuffer(currentFrame, workerIndex);
+                recordOutput(vkOutputCmdBuffer, imageIndex, currentFrame);
+                endCommandBuffer(vkOutputCmdBuffer);
+            });
+        }
+        jobSystem.wait();
+
+        frameSlotUsed[currentFrame] = true;
+        frameCompletionObserved[currentFrame] = false;
 
-        // Reset the fence.
+        // Reset the fence, it is signaled by the last submission of the frame.
         vkResetFences(vkDevice, 1, &vkInFlightFences[currentFrame]);
 
-        // Submit to the queue.
-        if (vkQueueSubmit(vkGraphicsQueue, 1, &vkSubmitInfo, vkInFlightFences[currentFrame]) != VK_SUCCESS) {
-            std::cerr << "Failed to submit" << std::endl;
-            abort();
+        // Semaphores the last submission unlocks after execution.
+        // Nobody presents the frame in headless mode, so signal nothing.
+        std::array< VkSemaphore, 1 > vkSignalSemaphores{ vkRenderFinishedSemaphores[currentFrame] };
+
+        // Multi-GPU mode adds the output submission after trace submissions.
+        const size_t submitCount = traceGroupCount + (multiGpu ? 1 : 0);
+        for (size_t group = 0; group < submitCount; group++) {
+            const bool firstSubmit = group == 0;
+            const bool lastSubmit = group + 1 == submitCount;
+            const bool lastTraceSubmit = group + 1 == traceGroupCount;
+            const bool outputSubmit = group == traceGroupCount;
+
+            // Execute secondary command buffers in order from the primary one.
+            // The first submission also updates the TLAS.
+            VkCommandBuffer vkFrameCmdBuffer = getFrameCommandBuffer(currentFrame, group);
+            VkCommandBufferBeginInfo vkFrameBeginInfo{};
+            vkFrameBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+            vkFrameBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+            if (vkBeginCommandBuffer(vkFrameCmdBuffer, &vkFrameBeginInfo) != VK_SUCCESS) {
+                std::cerr << "Failed to start command buffer recording" << std::endl;
+                abort();
+            }
+            std::vector< VkCommandBuffer > vkSecondaryCmdBuffers;
+            if (firstSubmit) {
+                // Queries should be reset before secondary command buffers write them again.
+                if (profilerEnabled) {
+                    vkCmdResetQueryPool(vkFrameCmdBuffer, vkFrameTimestampPools[currentFrame], 0, NUM_FRAME_TIMESTAMPS);
+                }
+                if (multiGpu && profilerEnabled) {
+                    vkCmdResetQueryPool(vkFrameCmdBuffer, vkBandTimestampPools[currentFrame], 0, MAX_DEVICE_GROUP_SIZE * 2);
+                }
+                // A reloaded pipeline has just been swapped in, copy its table into device-local memory
+                // before any trace of the frame reads it.
+                if (pendingShaderBindingTableCopy != VK_NULL_HANDLE) {
+                    VkBufferCopy vkSbtCopyRegion{};
+                    vkSbtCopyRegion.size = shaderBindingTableSize;
+                    vkCmdCopyBuffer(vkFrameCmdBuffer, pendingShaderBindingTableCopy, vkShaderBindingTable, 1, &vkSbtCopyRegion);
+                    VkMemoryBarrier vkSbtCopyBarrier{};
+                    vkSbtCopyBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+                    vkSbtCopyBarrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+                    vkSbtCopyBarrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+                    vkCmdPipelineBarrier(
+                        vkFrameCmdBuffer,
+                        VK_PIPELINE_STAGE_TRANSFER_BIT,
+                        VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV,
+                        0,
+                        1, &vkSbtCopyBarrier,
+                        0, nullptr,
+                        0, nullptr);
+                    pendingShaderBindingTableCopy = VK_NULL_HANDLE;
+                }
+                vkSecondaryCmdBuffers.push_back(vkUpdateCmdBuffer);
+            }
+            vkSecondaryCmdBuffers.push_back(outputSubmit ? vkOutputCmdBuffer : vkTraceCmdBuffers[group]);
+            vkCmdExecuteCommands(vkFrameCmdBuffer, static_cast< uint32_t >(vkSecondaryCmdBuffers.size()), vkSecondaryCmdBuffers.data());
+            endCommandBuffer(vkFrameCmdBuffer);
+
+            // Describe a submit to the graphics queue.
+            VkSubmitInfo vkSubmitInfo{};
+            vkSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+            // Specify semaphores the GPU should wait before executing the submit.
+            std::vector< VkSemaphore > vkWaitSemaphores;
+            // Pipeline stages corresponding to each semaphore.
+            std::vector< VkPipelineStageFlags > vkWaitStages;
+            // Semaphores the submit signals.
+            std::vector< VkSemaphore > vkSubmitSignalSemaphores;
+            // In multi-GPU mode, GPUs each semaphore is waited or signaled by.
+            std::vector< uint32_t > vkWaitDeviceIndices;
+            std::vector< uint32_t > vkSignalDeviceIndices;
+            // The output submission waits for bands of other GPUs copied into the radiance image.
+            if (outputSubmit) {
+                for (uint32_t device = 1; device < deviceGroupSize; device++) {
+                    vkWaitSemaphores.push_back(vkBandSemaphores[currentFrame][device]);
+                    vkWaitStages.push_back(VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT);
+                }
+            }
+            // Wait for the swap chain image. Headless mode has nothing to wait for.
+            // The image is first touched either by the tone mapping shader or by the copy, both in the last
+            // submission, so ray tracing and everything before it may run before the image is acquired.
+            if (!headless && lastSubmit) {
+                vkWaitSemaphores.push_back(vkImageAvailableSemaphores[currentFrame]);
+                vkWaitStages.push_back(tonemapIntoSwapChain ? VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT : VK_PIPELINE_STAGE_TRANSFER_BIT);
+            }
+            // The first frame should not touch acceleration structures until the compute queue builds them.
+            if (waitForBuildASSemaphore) {
+                vkWaitSemaphores.push_back(vkBuildASSemaphore);
+                vkWaitStages.push_back(VK_PIPELINE_STAGE_ACCELERATION_STRUCTURE_BUILD_BIT_NV | VK_PIPELINE_STAGE_RAY_TRACING_SHADER_BIT_NV);
+                waitForBuildASSemaphore = false;
+            }
+            // The last submission finishes the frame.
+            if (!headless && lastSubmit) {
+                vkSubmitSignalSemaphores.assign(vkSignalSemaphores.begin(), vkSignalSemaphores.end());
+            }
+            vkWaitDeviceIndices.resize(vkWaitSemaphores.size(), 0);
+            vkSignalDeviceIndices.resize(vkSubmitSignalSemaphores.size(), 0);
+            // The last trace submission signals that every GPU copied its band.
+            if (multiGpu && lastTraceSubmit) {
+                for (uint32_t device = 1; device < deviceGroupSize; device++) {
+                    vkSubmitSignalSemaphores.push_back(vkBandSemaphores[currentFrame][device]);
+                    vkSignalDeviceIndices.push_back(device);
+                }
+            }
+            vkSubmitInfo.waitSemaphoreCount = static_cast< uint32_t >(vkWaitSemaphores.size());
+            vkSubmitInfo.pWaitSemaphores = vkWaitSemaphores.data();
+            vkSubmitInfo.pWaitDstStageMask = vkWaitStages.data();
+            vkSubmitInfo.commandBufferCount = 1;
+            vkSubmitInfo.pCommandBuffers = &vkFrameCmdBuffer;
+            vkSubmitInfo.signalSemaphoreCount = static_cast< uint32_t >(vkSubmitSignalSemaphores.size());
+            vkSubmitInfo.pSignalSemaphores = vkSubmitSignalSemaphores.data();
+
+            // In multi-GPU mode trace submissions run on all GPUs, and the output submission
+            // runs only on the presenting GPU. Semaphores of the presenting GPU have index 0.
+            VkDeviceGroupSubmitInfo vkDeviceGroupSubmitInfo{};
+            const uint32_t vkSubmitDeviceMask = outputSubmit ? 1 : deviceGroupMask;
+            if (multiGpu) {
+                vkDeviceGroupSubmitInfo.sType = VK_STRUCTURE_TYPE_DEVICE_GROUP_SUBMIT_INFO;
+                vkDeviceGroupSubmitInfo.waitSemaphoreCount = static_cast< uint32_t >(vkWaitDeviceIndices.size());
+                vkDeviceGroupSubmitInfo.pWaitSemaphoreDeviceIndices = vkWaitDeviceIndices.data();
+                vkDeviceGroupSubmitInfo.commandBufferCount = 1;
+                vkDeviceGroupSubmitInfo.pCommandBufferDeviceMasks = &vkSubmitDeviceMask;
+                vkDeviceGroupSubmitInfo.signalSemaphoreCount = static_cast< uint32_t >(vkSignalDeviceIndices.size());
+                vkDeviceGroupSubmitInfo.pSignalSemaphoreDeviceIndices = vkSignalDeviceIndices.data();
+                vkSubmitInfo.pNext = &vkDeviceGroupSubmitInfo;
+            }
+
+            // Submit to the queue.
+            if (vkQueueSubmit(vkGraphicsQueue, 1, &vkSubmitInfo, lastSubmit ? vkInFlightFences[currentFrame] : VK_NULL_HANDLE) != VK_SUCCESS) {
+                std::cerr << "Failed to submit" << std::endl;
+                abort();
+            }
+        }
+
+        // The readback copy is finished together with the frame.
+        if (readback) {
+            recordedReadbacks[currentFrame] = { currentFrame, submittedFrameCount, vkSelectedExtent.width, vkSelectedExtent.height,
+                                                static_cast< const uint8_t* >(vkReadbackBufferMemories[currentFrame].mappedData) };
+            readbackRecorded[currentFrame] = true;
+        }
+        submittedFrameCount++;
+
+        // Report how long it took to submit the first frame.
+        // There is nothing to present in headless mode.
+        if (headless) {
+            if (isFirstFrame) {
+                const auto startupTime = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - applicationStartTime).count();
+                std::cout << "First frame submitted " << startupTime << " ms after the start" << std::endl;
+                isFirstFrame = false;
+            }
+            currentFrame = (currentFrame + 1) % framesInFlight;
+            continue;
         }
 
         // Prepare an image for presentation.
@@ -2241,10 +7750,53 @@ int main()
         vkPresentInfo.pResults = nullptr;
 
         // Submit and image for presentaion.
-        vkQueuePresentKHR(vkPresentQueue, &vkPresentInfo);
+        const VkResult presentResult = vkQueuePresentKHR(vkPresentQueue, &vkPresentInfo);
+        if (presentResult == VK_ERROR_OUT_OF_DATE_KHR || presentResult == VK_SUBOPTIMAL_KHR || swapChainSuboptimal) {
+            recreateSwapChain();
+        } else if (presentResult != VK_SUCCESS) {
+            std::cerr << "Failed to present a swap chain image!" << std::endl;
+            abort();
+        }
+
+        // Report how long it took to show the first frame.
+        if (isFirstFrame) {
+            const auto startupTime = std::chrono::duration< double, std::milli >(std::chrono::steady_clock::now() - applicationStartTime).count();
+            std::cout << "First frame presented " << startupTime << " ms after the start" << std::endl;
+            isFirstFrame = false;
+        }
 
         // Switch to the next frame in the loop.
-        currentFrame = (currentFrame + 1) % MAX_FRAMES_IN_FLIGHT;
+        currentFrame = (currentFrame + 1) % framesInFlight;
+    }
+
+    // Print statistics of the headless run.
+    // GPU time is the best measure of driver and shader performance,
+    // CPU frame interval is used for ray throughput when timestamps are not supported.
+    if (headless) {
+        auto printFrameTimeStatistics = [](const char* name, std::vector< double > samples) {
+            if (samples.empty()) {
+                return 0.0;
+            }
+            std::sort(samples.begin(), samples.end());
+            double sum = 0.0;
+            for (double sample : samples) {
+                sum += sample;
+            }
+            const double average = sum / samples.size();
+            const size_t p99Index = static_cast< size_t >(std::ceil(samples.size() * 0.99)) - 1;
+            std::cout << name << ": min " << samples.front() << " ms"
+                      << ", avg " << average << " ms"
+                      << ", p99 " << samples[p99Index] << " ms" << std::endl;
+            return average;
+        };
+        std::cout << "Benchmark of " << benchmarkCpuFrameMs.size() << " frames at " << vkSelectedExtent.width << "x" << vkSelectedExtent.height
+                  << ", " << samplesPerPixel << " samples per pixel" << std::endl;
+        const double averageCpuFrameMs = printFrameTimeStatistics("CPU frame interval", benchmarkCpuFrameMs);
+        printFrameTimeStatistics("GPU frame time", benchmarkGpuFrameMs);
+        const double averageTraceMs = printFrameTimeStatistics("GPU trace time", benchmarkTraceMs);
+        const double averageRayMs = averageTraceMs > 0.0 ? averageTraceMs : averageCpuFrameMs;
+        const double raysPerFrame = static_cast< double >(vkSelectedExtent.width) * vkSelectedExtent.height * samplesPerPixel;
+        std::cout << "Ray throughput: " << (averageRayMs > 0.0 ? raysPerFrame / (averageRayMs * 1e3) : 0.0) << " Mrays/s" << std::endl;
     }
 
     // ==========================================================================
@@ -2256,12 +7808,48 @@ int main()
     // Wait until all pending render operations are finished.
     vkDeviceWaitIdle(vkDevice);
 
+    // Let the encoder consume the last frames and stop it.
+    if (readback) {
+        collectReadbacks();
+        readbackEncoder.stop();
+        readbackFile.close();
+        std::cout << "Read back " << readbackFrameCount << " frames into " << readbackPath << std::endl;
+    }
+
+    // Wait for a running shader reload and destroy pipelines replaced by reloads.
+    if (hotReloadThread.joinable()) {
+        hotReloadThread.join();
+    }
+    if (hotReloadPipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(vkDevice, hotReloadPipeline, nullptr);
+    }
+    if (hotReloadShaderBindingTable != VK_NULL_HANDLE) {
+        memoryArena.free(hotReloadShaderBindingTableMemory);
+        vkDestroyBuffer(vkDevice, hotReloadShaderBindingTable, nullptr);
+    }
+    for (const RetiredPipeline& retired : retiredPipelines) {
+        destroyRetiredPipeline(retired);
+    }
+
+    // Release build resources if the main loop did not do that.
+    if (!buildResourcesReleased) {
+        releaseBuildResources();
+    }
+    vkDestroySemaphore(vkDevice, vkBuildASSemaphore, nullptr);
+
     // Destroy fences.
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroyFence(vkDevice, vkInFlightFences[i], nullptr);
     }
 
     // Destroy semaphores.
+    for (const auto& frameSemaphores : vkBandSemaphores) {
+        for (VkSemaphore semaphore : frameSemaphores) {
+            if (semaphore != VK_NULL_HANDLE) {
+                vkDestroySemaphore(vkDevice, semaphore, nullptr);
+            }
+        }
+    }
     for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
         vkDestroySemaphore(vkDevice, vkRenderFinishedSemaphores[i], nullptr);
     }
@@ -2269,60 +7857,132 @@ int main()
         vkDestroySemaphore(vkDevice, vkImageAvailableSemaphores[i], nullptr);
     }
 
-    // Destory command pool
-    vkDestroyCommandPool(vkDevice, vkCommandPool, nullptr);
+    // Stop worker threads.
+    jobSystem.stop();
+
+    // Destory command pools.
+    // This also frees all command buffers allocated from them.
+    for (auto& framePools : threadCommandPools) {
+        for (auto& threadPool : framePools) {
+            vkDestroyCommandPool(vkDevice, threadPool.pool, nullptr);
+        }
+    }
+    for (auto pool : vkFrameCommandPools) {
+        vkDestroyCommandPool(vkDevice, pool, nullptr);
+    }
+
+    // Destroy timestamp query pools and the buffer of band times.
+    for (auto pool : vkFrameTimestampPools) {
+        if (pool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(vkDevice, pool, nullptr);
+        }
+    }
+    for (auto pool : vkBandTimestampPools) {
+        if (pool != VK_NULL_HANDLE) {
+            vkDestroyQueryPool(vkDevice, pool, nullptr);
+        }
+    }
+    if (vkBandTimestampBuffer != VK_NULL_HANDLE) {
+        memoryArena.free(vkBandTimestampBufferMemory);
+        vkDestroyBuffer(vkDevice, vkBandTimestampBuffer, nullptr);
+    }
 
     // Destroy descriptor pool.
     vkDestroyDescriptorPool(vkDevice, vkDescriptorPool, nullptr);
 
     // Destroy uniform buffer.
-    vkFreeMemory(vkDevice, vkUniformBufferMemory, nullptr);
+    memoryArena.free(vkUniformBufferMemory);
     vkDestroyBuffer(vkDevice, vkUniformBuffer, nullptr);
 
+    // Destroy the staging ring.
+    for (auto fence : vkStagingRingFences) {
+        vkDestroyFence(vkDevice, fence, nullptr);
+    }
+    vkFreeCommandBuffers(vkDevice, vkStagingRingCommandPool, static_cast< uint32_t >(vkStagingRingCmdBuffers.size()), vkStagingRingCmdBuffers.data());
+    vkDestroyCommandPool(vkDevice, vkStagingRingCommandPool, nullptr);
+    memoryArena.free(vkStagingRingBufferMemory);
+    vkDestroyBuffer(vkDevice, vkStagingRingBuffer, nullptr);
+
     // Destroy shader binding table.
-    vkFreeMemory(vkDevice, vkShaderBindingTableMemory, nullptr);
+    memoryArena.free(vkShaderBindingTableMemory);
     vkDestroyBuffer(vkDevice, vkShaderBindingTable, nullptr);
 
-    // Destroy pipeline.
+    // Store the pipeline cache for the next run and destroy it.
+    savePipelineCache();
+    vkDestroyPipelineCache(vkDevice, vkPipelineCache, nullptr);
+
+    // Destroy pipelines.
+    for (VkPipeline pipeline : vkDenoiserPipelines) {
+        if (pipeline != VK_NULL_HANDLE) {
+            vkDestroyPipeline(vkDevice, pipeline, nullptr);
+        }
+    }
+    vkDestroyPipelineLayout(vkDevice, vkDenoiserPipelineLayout, nullptr);
+    vkDestroyPipeline(vkDevice, vkTonemapPipeline, nullptr);
+    vkDestroyPipelineLayout(vkDevice, vkTonemapPipelineLayout, nullptr);
     vkDestroyPipeline(vkDevice, vkPipeline, nullptr);
     vkDestroyPipelineLayout(vkDevice, vkPipelineLayout, nullptr);
 
-    // Destroy descriptor set layout.
+    // Destroy descriptor set layouts.
+    vkDestroyDescriptorSetLayout(vkDevice, vkDenoiserDescriptorSetLayout, nullptr);
+    vkDestroyDescriptorSetLayout(vkDevice, vkTonemapDescriptorSetLayout, nullptr);
     vkDestroyDescriptorSetLayout(vkDevice, vkDescriptorSetLayout, nullptr);
 
     // Destroy shaders.
+    if (vkDenoiseShaderModule != VK_NULL_HANDLE) {
+        vkDestroyShaderModule(vkDevice, vkDenoiseShaderModule, nullptr);
+    }
+    vkDestroyShaderModule(vkDevice, vkTonemapShaderModule, nullptr);
     vkDestroyShaderModule(vkDevice, vkRayhitShaderModule, nullptr);
+    vkDestroyShaderModule(vkDevice, vkShadowMissShaderModule, nullptr);
     vkDestroyShaderModule(vkDevice, vkRaymissShaderModule, nullptr);
     vkDestroyShaderModule(vkDevice, vkRaygenShaderModule, nullptr);
 
-    // Destroy storage image.
-    vkDestroyImageView(vkDevice, vkStorageImageView, nullptr);
-    vkFreeMemory(vkDevice, vkStorageImageMemory, nullptr);
-    vkDestroyImage(vkDevice, vkStorageImage, nullptr);
+    // Destroy storage and display images, the accumulation image and denoiser images.
+    destroyDenoiserImages();
+    destroyAccumulationImage();
+    destroyStorageImages();
 
     // Destroy TLAS.
-    vkFreeMemory(vkDevice, vkTlasMemory, nullptr);
-    vkDestroyAccelerationStructureNV(vkDevice, vkTopLevelAccelerationStructure, nullptr);
+    destroyAccelerationStructure(vkTopLevelAccelerationStructure);
 
-    // Destroy instance buffer.
-    vkFreeMemory(vkDevice, vkInstanceBufferMemory, nullptr);
-    vkDestroyBuffer(vkDevice, vkInstanceBufferHandle, nullptr);
+    // Destroy the update scratch buffer.
+    memoryArena.free(vkUpdateScratchBufferMemory);
+    vkDestroyBuffer(vkDevice, vkUpdateScratchBufferHandle, nullptr);
 
-    // Destroy BLAS.
-    vkFreeMemory(vkDevice, vkBlasMemory, nullptr);
-    vkDestroyAccelerationStructureNV(vkDevice, vkBottomLevelAccelerationStructure, nullptr);
+    // Destroy instance buffers.
+    for (size_t i = 0; i < MAX_FRAMES_IN_FLIGHT; i++) {
+        memoryArena.free(vkInstanceBufferMemories[i]);
+        vkDestroyBuffer(vkDevice, vkInstanceBuffers[i], nullptr);
+    }
 
-    // Destroy vertex buffer.
-    vkFreeMemory(vkDevice, vkVertexBufferMemory, nullptr);
-    vkDestroyBuffer(vkDevice, vkVertexBuffer, nullptr);
+    // Destroy the mesh info buffer.
+    memoryArena.free(vkMeshInfoBufferMemory);
+    vkDestroyBuffer(vkDevice, vkMeshInfoBuffer, nullptr);
 
-    // Destory swap chain image views.
-    for (auto imageView : vkSwapChainImageViews) {
-        vkDestroyImageView(vkDevice, imageView, nullptr);
+    // Destroy BLASes, attribute, index and vertex buffers of all meshes.
+    for (Mesh& mesh : meshes) {
+        destroyAccelerationStructure(mesh.blas);
+        if (mesh.attributeBuffer != VK_NULL_HANDLE) {
+            memoryArena.free(mesh.attributeBufferMemory);
+            vkDestroyBuffer(vkDevice, mesh.attributeBuffer, nullptr);
+        }
+        memoryArena.free(mesh.indexBufferMemory);
+        vkDestroyBuffer(vkDevice, mesh.indexBuffer, nullptr);
+        memoryArena.free(mesh.vertexBufferMemory);
+        vkDestroyBuffer(vkDevice, mesh.vertexBuffer, nullptr);
     }
 
+    // Destory swap chain image views.
+    destroySwapChainImageViews();
+
     // Destroy swap chain.
-    vkDestroySwapchainKHR(vkDevice, vkSwapChain, nullptr);
+    if (vkSwapChain != VK_NULL_HANDLE) {
+        vkDestroySwapchainKHR(vkDevice, vkSwapChain, nullptr);
+    }
+
+    // Give all memory blocks back to the driver.
+    memoryArena.destroy();
 
     // Destory logical device.
     vkDestroyDevice(vkDevice, nullptr);
@@ -2342,16 +8002,19 @@ int main()
 #endif
 
     // Destory surface.
-    vkDestroySurfaceKHR(vkInstance, vkSurface, nullptr);
+    if (vkSurface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(vkInstance, vkSurface, nullptr);
+    }
 
     // Destroy Vulkan instance.
     vkDestroyInstance(vkInstance, nullptr);
 
-    // Destroy window.
-    glfwDestroyWindow(glfwWindow);
-
-    // Deinitialize GLFW library.
-    glfwTerminate();
+    // Destroy window and deinitialize GLFW library.
+    // Headless mode never initialized GLFW.
+    if (!headless) {
+        glfwDestroyWindow(glfwWindow);
+        glfwTerminate();
+    }
 
     return 0;
 }
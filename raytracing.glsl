@@ -0,0 +1,61 @@
+// Ray tracing shaders are compiled for both ray tracing backends.
+// VK_NV_ray_tracing runs shaders written against GL_NV_ray_tracing,
+// while the KHR extensions run ones written against GL_EXT_ray_tracing.
+// Both GLSL extensions differ mostly in names, so shaders use the names
+// below and RAY_TRACING_KHR selects the variant for the KHR backend.
+
+#ifdef RAY_TRACING_KHR
+
+#extension GL_EXT_ray_tracing : require
+
+#define accelerationStructureRT accelerationStructureEXT
+#define rayPayloadRT rayPayloadEXT
+#define rayPayloadInRT rayPayloadInEXT
+#define hitAttributeRT hitAttributeEXT
+#define shaderRecordRT shaderRecordEXT
+#define traceRayRT traceRayEXT
+#define LAUNCH_ID gl_LaunchIDEXT
+#define LAUNCH_SIZE gl_LaunchSizeEXT
+#define RAY_FLAGS_OPAQUE gl_RayFlagsOpaqueEXT
+#define RAY_FLAGS_TERMINATE_ON_FIRST_HIT gl_RayFlagsTerminateOnFirstHitEXT
+#define RAY_FLAGS_SKIP_CLOSEST_HIT_SHADER gl_RayFlagsSkipClosestHitShaderEXT
+#define HIT_T gl_HitTEXT
+#define INSTANCE_CUSTOM_INDEX gl_InstanceCustomIndexEXT
+#define WORLD_TO_OBJECT gl_WorldToObjectEXT
+#define WORLD_RAY_DIRECTION gl_WorldRayDirectionEXT
+#define WORLD_RAY_ORIGIN gl_WorldRayOriginEXT
+
+#else
+
+#extension GL_NV_ray_tracing : require
+
+#define accelerationStructureRT accelerationStructureNV
+#define rayPayloadRT rayPayloadNV
+#define rayPayloadInRT rayPayloadInNV
+#define hitAttributeRT hitAttributeNV
+#define shaderRecordRT shaderRecordNV
+#define traceRayRT traceNV
+#define LAUNCH_ID gl_LaunchIDNV
+#define LAUNCH_SIZE gl_LaunchSizeNV
+#define RAY_FLAGS_OPAQUE gl_RayFlagsOpaqueNV
+#define RAY_FLAGS_TERMINATE_ON_FIRST_HIT gl_RayFlagsTerminateOnFirstHitNV
+#define RAY_FLAGS_SKIP_CLOSEST_HIT_SHADER gl_RayFlagsSkipClosestHitShaderNV
+#define HIT_T gl_HitTNV
+#define INSTANCE_CUSTOM_INDEX gl_InstanceCustomIndexNV
+#define WORLD_TO_OBJECT gl_WorldToObjectNV
+#define WORLD_RAY_DIRECTION gl_WorldRayDirectionNV
+#define WORLD_RAY_ORIGIN gl_WorldRayOriginNV
+
+#endif
+
+// Payload of primary rays, shared by ray generation, miss and closest hit shaders.
+// Besides the color it carries the surface seen by the ray, which the denoiser needs.
+struct hit_payload
+{
+    // Color of the hit surface or of the background.
+    vec3 color;
+    // Distance along the ray to the hit, negative for rays that hit nothing.
+    float distance;
+    // World space normal of the hit surface facing the ray.
+    vec3 normal;
+};